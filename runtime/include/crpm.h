@@ -27,6 +27,12 @@
 #define DEFAULT_FIXED_BASE_ADDRESS      (0x10000000000ull)
 #define crpm_annotate(addr, length)    AnnotateCheckpointRegion((addr), (length))
 
+#define CRPM_FLUSH_MODE_NO_ACTION       (0)
+#define CRPM_FLUSH_MODE_FLUSH_BLOCKS    (1)
+#define CRPM_FLUSH_MODE_WBINVD          (2)
+#define CRPM_FLUSH_MODE_NT_RECOPY       (3)
+#define CRPM_STATS_HISTORY_CAPACITY     (64)
+
 #ifdef __cplusplus
 namespace crpm {
     struct MemoryPoolOption {
@@ -36,18 +42,151 @@ namespace crpm {
         bool truncate;
         bool verbose_output;
         size_t capacity;
+        // Share of main segments backed by a back segment when the pool is
+        // created, and the floor of the elastic back pool of the default
+        // engine, see MemoryPool::set_shadow_capacity_factor()
         double shadow_capacity_factor;
         uintptr_t fixed_base_address;
         std::string allocator_name;
         std::string engine_name;
+        std::string persist_mode;
+        // Threads of the runtime-owned checkpoint pool. When non-zero, a
+        // single caller runs checkpoint() and nr_threads is ignored; other
+        // application threads must not store to the pool meanwhile.
+        size_t checkpoint_threads;
+        // A pool created with max_capacity above capacity grows on demand
+        // up to max_capacity, the file only holds the space in use
+        size_t max_capacity;
+        // Back segment to rebind when the back pool is full: default
+        // (round-robin), clock, lru-k or frequency
+        std::string replacement_policy;
+        // Threads that restore the segments when an existing pool is
+        // opened, bound to the NUMA node of the pool. 0 takes the CPUs of
+        // that node, up to 8.
+        size_t recovery_threads;
+        // Open an existing pool without restoring it first. The segments
+        // are restored on first access and by a background thread.
+        bool lazy_recovery;
+        // Snapshots of the last committed epochs kept by the default engine
+        // in "<path>.history", 0 keeps none. An existing history is kept
+        // up to date whatever the value. history_capacity bounds the
+        // pre-images of the snapshots, 0 takes a quarter of the capacity.
+        size_t retained_snapshots;
+        size_t history_capacity;
+        // Rolls an existing pool back to this retained epoch when it is
+        // opened, see MemoryPool::get_snapshots(). 0 keeps the latest one.
+        uint64_t restore_epoch;
+        // The write-back of the default engine compares main and back per
+        // cache line and only streams the lines that differ. It saves
+        // write bandwidth of the back segments at the cost of reading them.
+        bool write_elimination;
+        // The default engine tracks the dirty 64-byte lines of each block
+        // and only flushes and writes back those. It costs a bit per line
+        // and a wider store filter key.
+        bool track_dirty_lines;
+        // Block and segment size of a pool of the default engine, powers of
+        // two out of CRPM_FOR_EACH_GEOMETRY. 0 takes the default. Ignored
+        // when an existing pool is opened. Only the instrumented NVM engine
+        // picks it, through Open and OpenForMPI alike. The hybrid engine
+        // of libcrpm_mpi and the other engines only take the build default.
+        size_t block_size;
+        size_t segment_size;
     };
 
     const static uintptr_t kDefaultFixedBaseAddress = DEFAULT_FIXED_BASE_ADDRESS;
 
+    // Statistics of one checkpoint. Time is measured with the calibrated TSC.
+    // The background fields are filled in once the write-back of the epoch
+    // has been completed by the cleaner.
+    struct CheckpointStats {
+        uint64_t epoch;                     // sequence number, starting from 1
+        uint64_t dirty_blocks;              // saturates when the engine falls back to wbinvd
+        uint64_t dirty_segments;
+        int flush_mode;                     // CRPM_FLUSH_MODE_*
+        uint64_t bytes_copied;              // foreground main-to-back copy
+        uint64_t fences;
+        double flush_ms;                    // until the checkpoint is durable
+        double write_back_ms;               // foreground write-back and final commit
+        double total_ms;
+        uint64_t back_segment_evictions;    // since the last write-back, including copy-on-write
+        uint64_t full_segment_copies;       // back segments filled by copying a whole main segment
+        uint64_t background_bytes_copied;   // copied by the cleaner and copy-on-write
+        double cleaner_lag_ms;              // from durable to the end of background write-back
+        bool background_completed;
+        uint64_t back_segments;             // usable back segments once the checkpoint is done
+        uint64_t deferred_segments;         // left in main for lack of a free back segment
+        uint64_t hooked_stores;             // instrumented stores of the epoch, all pools
+        uint64_t store_filter_hits;         // of which the per-thread store filter returned early
+        uint64_t eliminated_lines;          // cache lines the write-back found unchanged in back
+        uint64_t bytes_flushed;             // main pool bytes flushed or re-copied to persist the epoch
+        bool skipped;                       // nothing committed, the dirty blocks wait for the next checkpoint
+    };
+
     class Allocator;
 
     class Engine;
 
+    // Completion of an asynchronous checkpoint
+    class CheckpointHandle {
+    public:
+        CheckpointHandle() : engine(nullptr), ticket(0) {}
+
+        CheckpointHandle(Engine *engine_, uint64_t ticket_) :
+                engine(engine_),
+                ticket(ticket_) {}
+
+        bool is_durable() const;
+
+        void wait() const;
+
+        uint64_t get_ticket() const { return ticket; }
+
+    private:
+        Engine *engine;
+        uint64_t ticket;
+    };
+
+    // Read-only copy of the pool at the last committed checkpoint. It keeps
+    // that content while the pool is changed and checkpointed, until it is
+    // closed. Only the threads of the process that opened it can read it.
+    class SnapshotView {
+    public:
+        SnapshotView() : engine(nullptr), address(nullptr), pool_address(nullptr), size(0), epoch(0) {}
+
+        SnapshotView(Engine *engine_, const void *address_, const void *pool_address_,
+                     size_t size_, uint64_t epoch_) :
+                engine(engine_),
+                address(address_),
+                pool_address(pool_address_),
+                size(size_),
+                epoch(epoch_) {}
+
+        bool is_open() const { return address != nullptr; }
+
+        // Where the view holds the object at ptr of the pool
+        template<typename T>
+        const T *translate(const T *ptr) const {
+            return reinterpret_cast<const T *>((const uint8_t *) address +
+                                               ((const uint8_t *) ptr - (const uint8_t *) pool_address));
+        }
+
+        const void *get_address() const { return address; }
+
+        size_t get_size() const { return size; }
+
+        // Committed epoch of the pool when the view was opened
+        uint64_t get_epoch() const { return epoch; }
+
+        void close();
+
+    private:
+        Engine *engine;
+        const void *address;
+        const void *pool_address;
+        size_t size;
+        uint64_t epoch;
+    };
+
     class MemoryPool {
     public:
         static MemoryPool *Open(const char *path, const MemoryPoolOption &option);
@@ -115,10 +254,34 @@ namespace crpm {
 
         void pfree(void *pointer);
 
-        void checkpoint(uint64_t nr_threads = 1);
+        // Returns false if the engine skipped the checkpoint: the last
+        // committed epoch stays in place and the next checkpoint takes the
+        // stores of this one
+        bool checkpoint(uint64_t nr_threads = 1);
+
+        // Return once the dirty blocks are captured, the checkpoint becomes
+        // durable in the background
+        CheckpointHandle checkpoint_async(uint64_t nr_threads = 1);
 
         void wait_for_background_task();
 
+        // Copy the statistics of the most recent checkpoints, newest first
+        size_t get_stats(CheckpointStats *records, size_t max_records) const;
+
+        void reset_stats();
+
+        // Epochs of the retained snapshots, newest first
+        size_t get_snapshots(uint64_t *epochs, size_t max_epochs) const;
+
+        // The view is not opened while a checkpoint is in progress, an engine
+        // without views returns one that is not open
+        SnapshotView open_snapshot_view();
+
+        // Back segments kept for at least factor of the main segments. The
+        // engine sizes the back pool between this floor and the working set
+        // of the recent epochs, returns false if it has no elastic back pool.
+        bool set_shadow_capacity_factor(double factor);
+
         void set_default_pool();
 
         Engine *get_engine() { return engine; }
@@ -186,8 +349,45 @@ typedef struct crpm_option {
     uintptr_t fixed_base_address;
     char allocator_name[MAX_NAME_LENGTH];
     char engine_name[MAX_NAME_LENGTH];
+    char persist_mode[MAX_NAME_LENGTH];
+    unsigned int checkpoint_threads;
+    size_t max_capacity;
+    char replacement_policy[MAX_NAME_LENGTH];
+    unsigned int recovery_threads;
+    unsigned int lazy_recovery;
+    unsigned int retained_snapshots;
+    size_t history_capacity;
+    uint64_t restore_epoch;
+    unsigned int write_elimination;
+    unsigned int track_dirty_lines;
+    size_t block_size;
+    size_t segment_size;
 } crpm_option_t;
 
+typedef struct crpm_stats {
+    uint64_t epoch;
+    uint64_t dirty_blocks;
+    uint64_t dirty_segments;
+    int flush_mode;
+    uint64_t bytes_copied;
+    uint64_t fences;
+    double flush_ms;
+    double write_back_ms;
+    double total_ms;
+    uint64_t back_segment_evictions;
+    uint64_t full_segment_copies;
+    uint64_t background_bytes_copied;
+    double cleaner_lag_ms;
+    unsigned int background_completed;
+    uint64_t back_segments;
+    uint64_t deferred_segments;
+    uint64_t hooked_stores;
+    uint64_t store_filter_hits;
+    uint64_t eliminated_lines;
+    uint64_t bytes_flushed;
+    unsigned int skipped;
+} crpm_stats_t;
+
 typedef void *crpm_t;
 
 void crpm_init_option(crpm_option_t *option);
@@ -208,10 +408,29 @@ void *crpm_default_malloc(size_t size);
 
 void crpm_default_free(void *ptr);
 
-void crpm_checkpoint(crpm_t pool, unsigned int nr_threads);
+// Returns -1 if the checkpoint was skipped, see MemoryPool::checkpoint
+int crpm_checkpoint(crpm_t pool, unsigned int nr_threads);
+
+uint64_t crpm_checkpoint_async(crpm_t pool, unsigned int nr_threads);
+
+int crpm_checkpoint_is_durable(crpm_t pool, uint64_t ticket);
+
+void crpm_checkpoint_wait(crpm_t pool, uint64_t ticket);
 
 void crpm_wait_for_background_task(crpm_t pool);
 
+unsigned int crpm_get_stats(crpm_t pool, crpm_stats_t *records, unsigned int max_records);
+
+void crpm_reset_stats(crpm_t pool);
+
+unsigned int crpm_get_snapshots(crpm_t pool, uint64_t *epochs, unsigned int max_epochs);
+
+const void *crpm_open_snapshot_view(crpm_t pool, uint64_t *epoch);
+
+void crpm_close_snapshot_view(crpm_t pool, const void *view);
+
+int crpm_set_shadow_capacity_factor(crpm_t pool, double factor);
+
 void crpm_set_default_pool(crpm_t pool);
 
 __attribute__((noinline)) void AnnotateCheckpointRegion(void *addr, size_t length);
@@ -30,7 +30,8 @@ crpm_mpi_t *crpm_mpi_open(const char *path, crpm_option_t *option, MPI_Comm comm
 
 void crpm_mpi_close(crpm_mpi_t *pool);
 
-void crpm_mpi_checkpoint(crpm_mpi_t *pool, unsigned int nr_threads);
+// Returns -1 if every rank skipped the checkpoint
+int crpm_mpi_checkpoint(crpm_mpi_t *pool, unsigned int nr_threads);
 
 void crpm_protect(crpm_mpi_t *pool, unsigned int index, void *ptr, size_t length);
 
@@ -0,0 +1,141 @@
+//
+// Lock-free lookup of the pool that covers an address
+//
+
+#ifndef LIBCRPM_ADDRESS_TABLE_H
+#define LIBCRPM_ADDRESS_TABLE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include "internal/common.h"
+
+namespace crpm {
+    // Two-level radix table over the user address space with one entry per
+    // kMinContainerSize granule. A pool is at least that large, so at most
+    // two pools overlap a granule: one that covers its first byte and one
+    // that starts inside it. A lookup takes two dependent loads and two
+    // range checks. Updates are serialized by the caller. The entries of a
+    // pool are cleared in place when it is closed and the leaves are only
+    // freed with the table, so a lookup never reads freed memory. A slot
+    // reused by another pool may change under a lookup, which loads the
+    // pool again after its bound and only returns it if it is unchanged.
+    template<typename T>
+    class AddressTable {
+    public:
+        AddressTable() {
+            for (auto &leaf : leaves) {
+                leaf.store(nullptr, std::memory_order_relaxed);
+            }
+        }
+
+        ~AddressTable() {
+            for (auto &leaf : leaves) {
+                free(leaf.load(std::memory_order_relaxed));
+            }
+        }
+
+        // Registers [start, end), which must not overlap a registered range
+        void insert(uintptr_t start, uintptr_t end, T *value) {
+            if (start >= end || ((end - 1) >> kAddressBits)) {
+                fprintf(stderr, "address range %lx-%lx is not supported\n", start, end);
+                exit(EXIT_FAILURE);
+            }
+            for (uintptr_t granule = start >> kGranuleShift;
+                 granule <= (end - 1) >> kGranuleShift; ++granule) {
+                Entry &entry = get_entry(granule, true);
+                if ((granule << kGranuleShift) >= start) {
+                    insert_slot(entry.lower, entry.lower_end, end, value);
+                } else {
+                    insert_slot(entry.upper, entry.upper_start, start, value);
+                }
+            }
+        }
+
+        void erase(uintptr_t start, uintptr_t end, T *value) {
+            for (uintptr_t granule = start >> kGranuleShift;
+                 start < end && granule <= (end - 1) >> kGranuleShift; ++granule) {
+                Entry &entry = get_entry(granule, false);
+                if (entry.lower.load(std::memory_order_relaxed) == value) {
+                    entry.lower.store(nullptr, std::memory_order_release);
+                }
+                if (entry.upper.load(std::memory_order_relaxed) == value) {
+                    entry.upper.store(nullptr, std::memory_order_release);
+                }
+            }
+        }
+
+        inline T *find(uintptr_t addr) const {
+            if (unlikely(addr >> kAddressBits)) {
+                return nullptr;
+            }
+            const Entry *leaf = leaves[addr >> kLeafShift].load(std::memory_order_acquire);
+            if (unlikely(!leaf)) {
+                return nullptr;
+            }
+            const Entry &entry = leaf[(addr >> kGranuleShift) & (kLeafEntries - 1)];
+            T *value = entry.lower.load(std::memory_order_acquire);
+            if (likely(value && addr < entry.lower_end.load(std::memory_order_acquire) &&
+                       entry.lower.load(std::memory_order_relaxed) == value)) {
+                return value;
+            }
+            value = entry.upper.load(std::memory_order_acquire);
+            if (value && addr >= entry.upper_start.load(std::memory_order_acquire) &&
+                entry.upper.load(std::memory_order_relaxed) == value) {
+                return value;
+            }
+            return nullptr;
+        }
+
+    private:
+        // The bound of a slot is written before the slot is published, with
+        // release: a lookup that reads the bound of a reused slot then sees
+        // the slot cleared or holding the new pool
+        struct Entry {
+            std::atomic<T *> lower;
+            std::atomic<uintptr_t> lower_end;
+            std::atomic<T *> upper;
+            std::atomic<uintptr_t> upper_start;
+        };
+
+        const static uint64_t kAddressBits = 47;
+        const static uint64_t kGranuleShift = 24;
+        const static uint64_t kLeafShift = 36;
+        const static uint64_t kLeafEntries = 1ull << (kLeafShift - kGranuleShift);
+        const static uint64_t kNrLeaves = 1ull << (kAddressBits - kLeafShift);
+        static_assert((1ull << kGranuleShift) <= kMinContainerSize,
+                      "a granule may not overlap more than two pools");
+
+        Entry &get_entry(uintptr_t granule, bool create) {
+            auto &slot = leaves[granule >> (kLeafShift - kGranuleShift)];
+            Entry *leaf = slot.load(std::memory_order_acquire);
+            if (!leaf) {
+                assert(create);
+                leaf = (Entry *) calloc(kLeafEntries, sizeof(Entry));
+                if (!leaf) {
+                    perror("calloc");
+                    exit(EXIT_FAILURE);
+                }
+                slot.store(leaf, std::memory_order_release);
+            }
+            return leaf[granule & (kLeafEntries - 1)];
+        }
+
+        static void insert_slot(std::atomic<T *> &slot, std::atomic<uintptr_t> &bound, uintptr_t value_bound,
+                                T *value) {
+            if (slot.load(std::memory_order_relaxed)) {
+                fprintf(stderr, "address range of a pool overlaps another one\n");
+                exit(EXIT_FAILURE);
+            }
+            bound.store(value_bound, std::memory_order_release);
+            slot.store(value, std::memory_order_release);
+        }
+
+    private:
+        std::atomic<Entry *> leaves[kNrLeaves];
+    };
+}
+
+#endif //LIBCRPM_ADDRESS_TABLE_H
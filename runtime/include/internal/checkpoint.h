@@ -8,6 +8,7 @@
 #include <cstdint>
 #include <cstddef>
 #include <functional>
+#include <vector>
 
 #include "internal/pptr.h"
 #include "internal/common.h"
@@ -17,24 +18,71 @@
 #endif
 
 namespace crpm {
-    class CheckpointImage {
+    // The layout of the header does not depend on the geometry, an image
+    // records the one it was created with
+    template<size_t BlockShift, size_t SegmentShift>
+    class BasicCheckpointImage {
     public:
+        static const size_t kBlockShift = BlockShift;
+        static const size_t kBlockSize = 1ull << kBlockShift;
+        static const size_t kSegmentShift = SegmentShift;
+        static const size_t kSegmentSize = 1ull << kSegmentShift;
+        static const size_t kBlocksPerSegment = kSegmentSize / kBlockSize;
+
         static const uint8_t SS_Initial = 0x0;
         static const uint8_t SS_Main = 0x1;
         static const uint8_t SS_Back = 0x2;
         static const uint8_t SS_Identical = 0x3;
 
+        static const size_t kMaxExtents = 64;
+        static const size_t kMissingWordsPerSegment = kBlocksPerSegment / 64;
+        static const size_t kMaxRecoveryThreads = 8;
+
     public:
-        static CheckpointImage *Open(void *addr, size_t nr_main_segments,
-                                     size_t nr_back_segments, bool initialize);
+        // An image created with more max_*_segments than nr_*_segments is
+        // growable: its segments are chained extents of the file, mapped
+        // into address space reserved for the maximum size
+        static BasicCheckpointImage *Open(void *addr, size_t nr_main_segments,
+                                          size_t nr_back_segments, bool initialize,
+                                          size_t max_main_segments = 0,
+                                          size_t max_back_segments = 0);
 
         static size_t CalculateHeaderSize(size_t nr_main_segments, size_t nr_back_segments);
 
         static size_t CalculateFileSize(size_t nr_main_segments, size_t nr_back_segments);
 
-        ~CheckpointImage();
+        static size_t CalculateGrowableHeaderSize(size_t max_main_segments, size_t max_back_segments);
+
+        static size_t CalculateReservedSize(size_t max_main_segments, size_t max_back_segments);
+
+        static size_t CalculateExtentSize(size_t nr_main_segments, size_t nr_back_segments);
+
+        // Inspects the first kCacheLineSize bytes of an image, returns false
+        // if it is not growable
+        static bool GetGrowableLayout(const void *prefix, size_t &header_size, size_t &reserved_size);
+
+        // Inspects the first kCacheLineSize bytes of an image, returns false
+        // if it is not an image. Images that predate the geometry in the
+        // header have the default one.
+        static bool GetGeometry(const void *prefix, size_t &block_shift, size_t &segment_shift);
 
-        void recovery(uint8_t to_state);
+        ~BasicCheckpointImage();
+
+        // Restores the main segments of the committed epoch and moves them
+        // to to_state. The threads are bound to the NUMA node of the pool,
+        // 0 takes one per CPU of that node up to kMaxRecoveryThreads.
+        // Returns the number of bytes copied.
+        uint64_t recovery(uint8_t to_state, size_t nr_threads = 1);
+
+        // Lazy recovery restores the bound main segments one at a time and
+        // keeps their state. A segment in SS_Back is inconsistent until it
+        // is restored, one in SS_Main only needs its back segment reset.
+        bool is_recovery_needed(uint64_t main_segment_id);
+
+        // The main segment is written through main_view if it is not null.
+        // The caller clears the divergence marker once the main segment is
+        // persistent. Returns the number of bytes copied.
+        uint64_t recover_main_segment(uint64_t main_segment_id, uint8_t *main_view = nullptr);
 
         void set_segment_state_atomic(uint64_t segment_id, uint8_t state);
 
@@ -60,8 +108,53 @@ namespace crpm {
 
         void bind_back_segment(uint64_t main_segment_id, uint64_t back_segment_id);
 
+        // The main segment left without a back segment must hold its
+        // committed data, i.e. be in SS_Main or SS_Initial
+        void unbind_back_segment(uint64_t back_segment_id);
+
+        // The back segment holds a copy of the block from now on. The
+        // caller persists it with a fence before the block may be changed.
+        void mark_back_block_present(uint64_t back_segment_id, uint64_t block_index);
+
+        // Persisted before the first store of an epoch to the main segment
+        void set_segment_diverged(uint64_t segment_id);
+
+        // The main segment equals the present blocks of its back segment
+        // again, persisted by the next fence
+        void clear_segment_diverged(uint64_t segment_id);
+
+        // Where the back segment is stored in the file
+        uint64_t get_back_file_offset(uint64_t back_segment_id);
+
         void reset_committed_epoch(uint64_t epoch);
 
+        // Calls map(offset, file_offset, length) for the main and the back
+        // part of every extent, offset is relative to get_start_address()
+        bool map_extents(const std::function<bool(size_t, size_t, size_t)> &map);
+
+        // Appends nr_main_segments and nr_back_segments stored at file_offset,
+        // which must be mapped already. The extent table is the commit point.
+        bool append_extent(uint64_t file_offset, uint64_t nr_main_segments, uint64_t nr_back_segments);
+
+        // End of the last extent in the file
+        uint64_t get_file_size();
+
+        inline bool is_growable() {
+            return extent_table != nullptr;
+        }
+
+        // Back segments of kMetadataV4Magic images and later are filled
+        // block by block
+        inline bool is_block_granular() {
+            return back_missing != nullptr;
+        }
+
+        // Blocks [64 * index, 64 * index + 64) of the back segment that
+        // have no copy, their committed data is in the main segment
+        inline uint64_t get_missing_blocks(uint64_t back_segment_id, uint64_t index) {
+            return back_missing[back_segment_id * kMissingWordsPerSegment + index];
+        }
+
         inline uint64_t get_committed_epoch() {
             return header->committed_epoch;
         }
@@ -90,11 +183,31 @@ namespace crpm {
             return header->nr_back_segments;
         }
 
+        inline uint64_t get_max_main_segments() {
+            return max_main_segments;
+        }
+
+        inline uint64_t get_max_back_segments() {
+            return max_back_segments;
+        }
+
+        // Main segments that have a back segment bound
+        inline uint64_t get_nr_bound_segments() {
+            return nr_bound_segments;
+        }
+
+        inline uint64_t get_nr_extents() {
+            return extent_table ? extent_table->nr_extents : 1;
+        }
+
         inline uint8_t *get_start_address() {
             return (uint8_t *) header;
         }
 
         inline uint8_t *get_end_address() {
+            if (extent_table) {
+                return back_memory + max_back_segments * kSegmentSize;
+            }
             return (uint8_t *) header +
                 CalculateFileSize(header->nr_main_segments, header->nr_back_segments);
         }
@@ -104,10 +217,21 @@ namespace crpm {
         }
 
     private:
-        CheckpointImage() : has_initialized(false) {}
+        BasicCheckpointImage() : has_initialized(false), extent_table(nullptr), back_missing(nullptr),
+                                 segment_diverged(nullptr), nr_bound_segments(0) {}
+
+        void setup_layout(void *addr, uint32_t magic);
+
+        void mark_back_segment_missing(uint64_t back_segment_id);
+
+        uint64_t recover_segment(uint64_t main_segment_id, uint64_t back_segment_id, uint8_t state,
+                                 uint8_t *main_view = nullptr);
 
     private:
 
+        // Growable images (kMetadataV3Magic and later) size the arrays by
+        // the max_* fields, nr_main_segments and nr_back_segments are
+        // derived from the committed extents
         struct Header {
             uint32_t magic;
             uint32_t attributes;
@@ -115,17 +239,51 @@ namespace crpm {
             uint64_t nr_back_segments;
             uint64_t committed_epoch;
             uint64_t media_error;
+            uint64_t max_main_segments;
+            uint64_t max_back_segments;
+            // Zero in images that predate them
+            uint32_t block_shift;
+            uint32_t segment_shift;
             // alignas(64) uint8_t segment_state_0[nr_main_segments];
             // alignas(64) uint8_t segment_state_1[nr_main_segments];
             // alignas(64) uint64_t back_to_main[nr_back_segments];
+            // alignas(64) ExtentTable extent_table; (growable only)
+            // alignas(64) uint64_t back_missing[max_back_segments][kMissingWordsPerSegment]; (V4 on)
+            // alignas(64) uint8_t segment_diverged[max_main_segments]; (V5 on)
+        };
+
+        struct Extent {
+            uint64_t file_offset;
+            uint64_t nr_main_segments;
+            uint64_t nr_back_segments;
+        };
+
+        struct ExtentTable {
+            uint64_t nr_extents;
+            uint64_t reserved[7];
+            Extent extents[kMaxExtents];
         };
 
+        static size_t CalculateHeaderSize(size_t nr_main_segments, size_t nr_back_segments,
+                                          uint32_t magic);
+
     private:
         bool has_initialized;
         Header *header;
+        ExtentTable *extent_table;
+        // A set bit marks a block of the back segment that has not been
+        // copied, recovery takes it from the main segment. Back segments
+        // start with every block missing when they are bound.
+        uint64_t *back_missing;
+        // A main segment that may have been changed since it was written
+        // back, recovery skips the SS_Back segments that are not marked
+        uint8_t *segment_diverged;
+        uint64_t max_main_segments;
+        uint64_t max_back_segments;
         uint8_t *segment_state[2];
         uint64_t *back_to_main;
         uint64_t *main_to_back; // In DRAM
+        uint64_t nr_bound_segments;
         uint8_t *header_shadow;
         size_t header_size;
 
@@ -134,7 +292,12 @@ namespace crpm {
         uint8_t *parity_memory;
         int pkey[4];
         bool *segment_state_dirty;
+        // Cache lines of segment_state marked in segment_state_dirty, so
+        // that a commit visits only the lines it changed
+        std::vector<uint64_t> dirty_state_lines;
     };
+
+    typedef BasicCheckpointImage<kBlockShift, kSegmentShift> CheckpointImage;
 }
 
 #endif //LIBCRPM_CHECKPOINT_H
@@ -14,6 +14,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <cstdio>
+#include <string>
 
 // #define SFENCE_STAT
 
@@ -37,8 +38,22 @@
 #define SEGMENT_SHIFT 21
 #endif // SEGMENT_SHIFT
 
+// Geometries (block shift, segment shift) the default engine and the
+// checkpoint image are instantiated for, a pool picks one when it is
+// created. BLOCK_SHIFT and SEGMENT_SHIFT give the geometry of the pools
+// that do not pick one and of the other engines.
+#define CRPM_FOR_EACH_LISTED_GEOMETRY(F) \
+    F(6, 21) F(8, 21) F(10, 21) F(12, 21) \
+    F(6, 25) F(8, 25) F(10, 25) F(12, 25)
+
+#if (BLOCK_SHIFT == 6 || BLOCK_SHIFT == 8 || BLOCK_SHIFT == 10 || BLOCK_SHIFT == 12) && \
+    (SEGMENT_SHIFT == 21 || SEGMENT_SHIFT == 25)
+#define CRPM_FOR_EACH_GEOMETRY(F) CRPM_FOR_EACH_LISTED_GEOMETRY(F)
+#else
+#define CRPM_FOR_EACH_GEOMETRY(F) CRPM_FOR_EACH_LISTED_GEOMETRY(F) F(BLOCK_SHIFT, SEGMENT_SHIFT)
+#endif
+
 #define USE_CLWB
-#define USE_AVX512
 // #define USE_IDENTICAL_DATA
 // #define USE_ENHANCED_ADR
 // #define USE_PARITY_CHECK
@@ -56,7 +71,7 @@ namespace crpm {
     const static size_t kHugePageSize = 1ull << kHugePageShift;
     const static size_t kHugePageMask = kHugePageSize - 1;
 
-    // For default engine only
+    // For default engine only, which takes them as the default geometry
     const static size_t kBlockShift = BLOCK_SHIFT;
     const static size_t kBlockSize = 1ull << kBlockShift;
     const static size_t kBlockMask = kBlockSize - 1;
@@ -67,7 +82,8 @@ namespace crpm {
 
     const static size_t kParitySize = 16ull << 10;
 
-    const static size_t kMaxFlushBlocks = (32ull << 20ull) >> kBlockShift;
+    const static size_t kMaxFlushBytes = 32ull << 20ull;
+    const static size_t kMaxFlushBlocks = kMaxFlushBytes >> kBlockShift;
     const static size_t kBlocksPerSegment = kSegmentSize / kBlockSize;
 
     // For mprotect()-based engine only.
@@ -82,6 +98,11 @@ namespace crpm {
     const static uint32_t kMetadataHeaderMagic = 0xc3c3c3c3;
     const static uint32_t kMetadataV1Magic = 0x6f6f0101;
     const static uint32_t kMetadataV2Magic = 0x6f6f0202;
+    const static uint32_t kMetadataV3Magic = 0x6f6f0303;
+    const static uint32_t kMetadataV4Magic = 0x6f6f0404;
+    const static uint32_t kMetadataV5Magic = 0x6f6f0505;
+    const static uint32_t kSnapshotHistoryMagic = 0x6f6f4801;
+    const static uint32_t kSegmentStashMagic = 0x6f6f5301;
     const static size_t kDescriptorSize = kCacheLineSize;
     const static size_t kMaxRoots = 1024;
     const static size_t kMaxThreads = 256;
@@ -94,7 +115,85 @@ namespace crpm {
 
     extern uint64_t sfence_cnt;
 
+    // Persistence domain backing the memory pool files.
+    //  PERSIST_DAX:      Optane in FSDAX mode, mapped with MAP_SYNC (default)
+    //  PERSIST_MSYNC:    plain file mapped MAP_SHARED, the flushed and
+    //                    non-temporally stored ranges are msync()ed at each
+    //                    store fence, whole files in place of wbinvd
+    //  PERSIST_EMULATED: DRAM/tmpfs, flush and wbinvd events are counted
+    //                    instead of being issued
+    enum PersistMode {
+        PERSIST_DAX, PERSIST_MSYNC, PERSIST_EMULATED
+    };
+
+    struct PersistCounters {
+        uint64_t nr_flushes;
+        uint64_t nr_fences;
+        uint64_t nr_wbinvds;
+    };
+
+    extern PersistMode g_persist_mode;
+    extern std::atomic<uint64_t> g_persist_flushes, g_persist_fences, g_persist_wbinvds;
+
+    // Fences issued by the calling thread, sampled by the engines to report
+    // the fences of each checkpoint
+    extern thread_local uint64_t tl_nr_fences;
+
+    // The mode is shared by all pools of the process, it can only change
+    // while no pool is open
+    bool SetPersistMode(const std::string &name);
+
+    PersistCounters GetPersistCounters();
+
+    void ResetPersistCounters();
+
+    // Implemented in filesystem.cpp, msync() all mapped memory pool files
+    void SyncMappedFiles();
+
+    // Implemented in filesystem.cpp, whether any memory pool file is mapped
+    bool HasMappedFiles();
+
+    // Crash simulation, on top of PERSIST_EMULATED. Every mapped pool file gets
+    // a shadow "media" image. Flushed lines and non-temporal stores reach the
+    // media only when the issuing thread executes a store fence, wbinvd copies
+    // the whole mapping. When the armed crash point is reached for the
+    // countdown-th time, the media image is dumped to "<pool path>.crash" and
+    // the process exits with kCrashExitCode. Implemented in filesystem.cpp.
+    const static int kCrashExitCode = 86;
+
+    extern bool g_crash_simulation;
+
+    // Set in PERSIST_MSYNC and in crash simulation. Flushed lines and
+    // non-temporal stores are then recorded per thread and made durable
+    // at the next store fence of the thread.
+    extern bool g_track_persist_ranges;
+
+    bool EnableCrashSimulation(const char *crash_point, uint64_t countdown);
+
+    void TrackPersistRange(const void *addr, size_t len);
+
+    void TrackPersistFence();
+
+    void TrackWriteBackAndInvalidate();
+
+    void TriggerCrashPoint(const char *name);
+
+    static inline void CrashPoint(const char *name) {
+        if (unlikely(g_crash_simulation)) {
+            TriggerCrashPoint(name);
+        }
+    }
+
     static inline void Flush(const void *addr) {
+        if (unlikely(g_persist_mode != PERSIST_DAX)) {
+            if (g_persist_mode == PERSIST_EMULATED) {
+                g_persist_flushes.fetch_add(1, std::memory_order_relaxed);
+            }
+            if (g_track_persist_ranges) {
+                TrackPersistRange(addr, kCacheLineSize);
+            }
+            return;
+        }
 #ifndef USE_ENHANCED_ADR
 #ifdef USE_CLWB
         asm volatile(".byte 0x66; xsaveopt %0" : "+m" (*(volatile char *) (addr)));
@@ -105,7 +204,18 @@ namespace crpm {
     }
 
     static inline void StoreFence() {
+        // sfence is kept in emulated mode as well: it still orders the
+        // non-temporal stores with respect to other threads.
         asm volatile("sfence" : : : "memory");
+        tl_nr_fences++;
+        if (unlikely(g_persist_mode != PERSIST_DAX)) {
+            if (g_persist_mode == PERSIST_EMULATED) {
+                g_persist_fences.fetch_add(1, std::memory_order_relaxed);
+            }
+            if (g_track_persist_ranges) {
+                TrackPersistFence();
+            }
+        }
 #ifdef SFENCE_STAT
         sfence_cnt++;
 #endif
@@ -133,94 +243,69 @@ namespace crpm {
     }
 
     static inline void NTStore(const void *addr, uint64_t value) {
+        if (unlikely(g_track_persist_ranges)) {
+            TrackPersistRange(addr, sizeof(uint64_t));
+        }
         _mm_stream_si64((long long int *) addr, (long long int) value);
     }
 
     static inline void NTStore32(const void *addr, uint32_t value) {
+        if (unlikely(g_track_persist_ranges)) {
+            TrackPersistRange(addr, sizeof(uint32_t));
+        }
         _mm_stream_si32((int *) addr, (int) value);
     }
 
+    // Non-temporal copy kernels of one instruction set. dst, src and len
+    // are cache line aligned, len of copy256 is a multiple of 256 bytes.
+    // copy_with_write_elimination skips the lines that dst holds already
+    // and returns how many it skipped.
+    struct CopyKernels {
+        const char *name;
+        void (*copy64)(void *dst, const void *src, size_t len);
+        void (*copy256)(void *dst, const void *src, size_t len);
+        size_t (*copy_with_write_elimination)(void *dst, const void *src, size_t len);
+    };
+
+    // The fastest kernels supported by the CPU, picked at startup.
+    // Implemented in copy_kernels.cpp.
+    extern const CopyKernels *g_copy_kernels;
+
+    // Kernels supported by the CPU, fastest first
+    size_t GetSupportedCopyKernels(const CopyKernels **kernels, size_t max_kernels);
+
+    // Forces the kernels of an instruction set (avx512, avx2, sse4.1, scalar)
+    bool SetCopyKernels(const std::string &name);
+
     static inline void NonTemporalCopy64(void *dst, void *src, const size_t len) {
         assert(!(((uint64_t) dst) & kCacheLineMask));
         assert(!(((uint64_t) src) & kCacheLineMask));
         assert(!(len & kCacheLineMask));
-        uintptr_t dst_addr = (uintptr_t) dst;
-        uintptr_t src_addr = (uintptr_t) src;
-#ifdef USE_AVX512
-#pragma unroll
-        for (int i = 0; i < len; i += 64) {
-            __m512i reg = _mm512_stream_load_si512((__m512i *) src_addr);
-            _mm512_stream_si512((__m512i *) dst_addr, reg);
-            src_addr += 64;
-            dst_addr += 64;
-        }
-#else
-#pragma unroll
-        for (int i = 0; i < len; i += 32) {
-            __m256i reg = _mm256_stream_load_si256((__m256i *) src_addr);
-            _mm256_stream_si256((__m256i *) dst_addr, reg);
-            src_addr += 32;
-            dst_addr += 32;
+        if (unlikely(g_track_persist_ranges)) {
+            TrackPersistRange(dst, len);
         }
-#endif
+        g_copy_kernels->copy64(dst, src, len);
     }
 
-    static inline void NonTemporalCopyWithWriteElimination(void *dst, void *src, const size_t len) {
+    // Returns the number of lines that were left alone
+    static inline size_t NonTemporalCopyWithWriteElimination(void *dst, void *src, const size_t len) {
         assert(!(((uint64_t) dst) & kCacheLineMask));
         assert(!(((uint64_t) src) & kCacheLineMask));
         assert(!(len & kCacheLineMask));
-        uintptr_t dst_addr = (uintptr_t) dst;
-        uintptr_t src_addr = (uintptr_t) src;
-#ifdef USE_AVX512
-#pragma unroll
-        for (int i = 0; i < len; i += 64) {
-            __m512i reg = _mm512_stream_load_si512((__m512i *) src_addr);
-            __m512i cmp_reg = _mm512_stream_load_si512((__m512i *) dst_addr);
-            if (_mm512_cmpeq_epi64_mask(reg, cmp_reg) != UINT8_MAX) {
-                _mm512_stream_si512((__m512i *) dst_addr, reg);
-            }
-            src_addr += 64;
-            dst_addr += 64;
-        }
-#else
-#pragma unroll
-        for (int i = 0; i < len; i += 32) {
-            __m256i reg = _mm256_stream_load_si256((__m256i *) src_addr);
-            __m256i cmp_reg = _mm256_stream_load_si256((__m256i *) dst_addr);
-            if (_mm256_cmpeq_epi64_mask(reg, cmp_reg) != 15) {
-                _mm256_stream_si256((__m256i *) dst_addr, reg);
-            }
-            src_addr += 32;
-            dst_addr += 32;
+        if (unlikely(g_track_persist_ranges)) {
+            TrackPersistRange(dst, len);
         }
-#endif
+        return g_copy_kernels->copy_with_write_elimination(dst, src, len);
     }
 
     static inline void NonTemporalCopy256(void *dst, void *src, const size_t len) {
         assert(!(((uint64_t) dst) & kCacheLineMask));
         assert(!(((uint64_t) src) & kCacheLineMask));
         assert(len % 256 == 0);
-
-#ifdef USE_AVX512
-        uintptr_t dst_addr = (uintptr_t) dst;
-        uintptr_t src_addr = (uintptr_t) src;
-#pragma unroll
-        for (int i = 0; i < len; i += 256) {
-            __m512i regs[4];
-            regs[0] = _mm512_stream_load_si512((__m512i *) src_addr);
-            regs[1] = _mm512_stream_load_si512((__m512i *) (src_addr + 64));
-            regs[2] = _mm512_stream_load_si512((__m512i *) (src_addr + 128));
-            regs[3] = _mm512_stream_load_si512((__m512i *) (src_addr + 192));
-            _mm512_stream_si512((__m512i *) dst_addr, regs[0]);
-            _mm512_stream_si512((__m512i *) (dst_addr + 64), regs[1]);
-            _mm512_stream_si512((__m512i *) (dst_addr + 128), regs[2]);
-            _mm512_stream_si512((__m512i *) (dst_addr + 192), regs[3]);
-            src_addr += 256;
-            dst_addr += 256;
+        if (unlikely(g_track_persist_ranges)) {
+            TrackPersistRange(dst, len);
         }
-#else
-        NonTemporalCopy64(dst, src, len);
-#endif
+        g_copy_kernels->copy256(dst, src, len);
     }
 
     class ThreadInfo {
@@ -237,28 +322,51 @@ namespace crpm {
 
     extern thread_local ThreadInfo tl_thread_info;
 
+    // Bit i of summary word j is set when word 64 * j + i may have a bit
+    // set, so that scans of a large set only visit its non-zero words. A
+    // word cleared by clear() or clear_all() stays in the summary until
+    // clear_region() covers it as a whole, which must not race with set()
+    // on that word.
     class AtomicBitSet {
     public:
         const static uint64_t kBitShift = 6;
         const static uint64_t kBitWidth = 64;
         const static uint64_t kBitMask = 63;
+        // Bits covered by a summary word
+        const static uint64_t kGroupShift = 2 * kBitShift;
+        const static uint64_t kGroupBits = 1ull << kGroupShift;
 
-        AtomicBitSet() : is_allocated(false) {}
+        AtomicBitSet() : is_allocated(false), nr_bits(0) {}
 
         ~AtomicBitSet() {
             if (is_allocated) {
                 free(buf);
+                free(summary);
                 is_allocated = false;
             }
         }
 
-        void allocate(uint64_t nr_bits_);
+        // Room for max_bits_ is reserved up front, so that resize() never
+        // moves the set while other threads are using it
+        void allocate(uint64_t nr_bits_, uint64_t max_bits_ = 0);
+
+        // Published with release, the scans of other threads load the
+        // size with acquire
+        inline void resize(uint64_t nr_bits_) {
+            assert(is_allocated && nr_bits_ >= get_nr_bits() && nr_bits_ <= max_bits);
+            nr_bits.store(nr_bits_, std::memory_order_release);
+        }
+
+        inline uint64_t get_nr_bits() const {
+            return nr_bits.load(std::memory_order_acquire);
+        }
 
         inline void set(uint64_t idx, std::memory_order m = std::memory_order_relaxed) {
-            assert(idx < nr_bits && is_allocated && buf);
+            assert(idx < get_nr_bits() && is_allocated && buf);
             uint64_t idx_off = idx >> kBitShift;
             uint64_t idx_bit = 1ull << (idx & kBitMask);
             buf[idx_off].fetch_or(idx_bit, m);
+            mark_summary(idx_off);
         }
 
         inline bool test(uint64_t idx, std::memory_order m = std::memory_order_relaxed) {
@@ -278,32 +386,90 @@ namespace crpm {
             return buf[idx_off].load(std::memory_order_relaxed);
         }
 
+        inline void store_all(uint64_t idx, uint64_t value) {
+            uint64_t idx_off = idx >> kBitShift;
+            buf[idx_off].store(value, std::memory_order_relaxed);
+            if (value) {
+                mark_summary(idx_off);
+            }
+        }
+
         inline void clear_all(uint64_t idx) {
             uint64_t idx_off = idx >> kBitShift;
             buf[idx_off].store(0, std::memory_order_relaxed);
         }
 
-        inline void clear_region(uint64_t start_idx, uint64_t end_idx) {
-            uint64_t start_idx_off = start_idx >> kBitShift;
-            uint64_t end_idx_off = end_idx >> kBitShift;
-            for (uint64_t idx_off = start_idx_off; idx_off < end_idx_off; idx_off++) {
-                buf[idx_off].store(0, std::memory_order_relaxed);
+        // Words partially covered by [start_idx, end_idx) are masked, only
+        // the non-zero ones of those covered as a whole are visited
+        void clear_region(uint64_t start_idx, uint64_t end_idx);
+
+        // First set bit in [idx, end_idx), end_idx if there is none
+        uint64_t find_next(uint64_t idx, uint64_t end_idx);
+
+        // Calls visit(idx, word) for the non-zero words of the set, idx is
+        // the first bit of the word
+        template<typename Visitor>
+        inline void for_each_word(Visitor visit) {
+            uint64_t nr_groups = (get_nr_bits() + kGroupBits - 1) >> kGroupShift;
+            for (uint64_t group = 0; group < nr_groups; ++group) {
+                uint64_t words = summary[group].load(std::memory_order_relaxed);
+                while (words != 0) {
+                    uint64_t idx_off = (group << kBitShift) + __builtin_ctzll(words);
+                    words &= words - 1;
+                    uint64_t word = buf[idx_off].load(std::memory_order_relaxed);
+                    if (word != 0) {
+                        visit(idx_off << kBitShift, word);
+                    }
+                }
             }
         }
 
+        // Calls visit(idx) for the set bits in ascending order
+        template<typename Visitor>
+        inline void for_each(Visitor visit) {
+            for_each_word([&visit](uint64_t idx, uint64_t word) {
+                while (word != 0) {
+                    visit(idx + __builtin_ctzll(word));
+                    word &= word - 1;
+                }
+            });
+        }
+
+        inline uint64_t count() {
+            uint64_t result = 0;
+            for_each_word([&result](uint64_t idx, uint64_t word) {
+                result += __builtin_popcountll(word);
+            });
+            return result;
+        }
+
         inline void prefetch() {
-            uint64_t nr_bytes = nr_bits / kBitWidth * sizeof(uint64_t);
-            if (nr_bits % kBitWidth) {
+            uint64_t bits = get_nr_bits();
+            uint64_t nr_bytes = bits / kBitWidth * sizeof(uint64_t);
+            if (bits % kBitWidth) {
                 nr_bytes += sizeof(uint64_t);
             }
             PrefetchT0(this, sizeof(*this));
             PrefetchT0(buf, nr_bytes);
         }
 
+    private:
+        inline void mark_summary(uint64_t idx_off) {
+            uint64_t group_bit = 1ull << (idx_off & kBitMask);
+            auto &word = summary[idx_off >> kBitShift];
+            if (!(word.load(std::memory_order_relaxed) & group_bit)) {
+                word.fetch_or(group_bit, std::memory_order_relaxed);
+            }
+        }
+
+        uint64_t find_next_group(uint64_t group, uint64_t end_group);
+
     private:
         bool is_allocated;
-        uint64_t nr_bits;
+        std::atomic<uint64_t> nr_bits;
+        uint64_t max_bits;
         std::atomic<uint64_t> *buf;
+        std::atomic<uint64_t> *summary;
     };
 
     struct Barrier {
@@ -382,6 +548,13 @@ namespace crpm {
         return (rdx << 32ull) + rax;
     }
 
+    // TSC ticks per millisecond, measured against CLOCK_MONOTONIC once
+    double GetTSCFrequency();
+
+    static inline double CyclesToMilliseconds(uint64_t cycles) {
+        return cycles / GetTSCFrequency();
+    }
+
     static inline uint64_t RoundUp(uint64_t a, uint64_t b) {
         uint64_t mod = a % b;
         if (mod) {
@@ -391,12 +564,30 @@ namespace crpm {
     }
 
     static inline bool WriteBackAndInvalidate() {
+        if (g_persist_mode == PERSIST_EMULATED) {
+            g_persist_wbinvds.fetch_add(1, std::memory_order_relaxed);
+            if (unlikely(g_crash_simulation)) {
+                TrackWriteBackAndInvalidate();
+            }
+            return true;
+        } else if (g_persist_mode == PERSIST_MSYNC) {
+            SyncMappedFiles();
+            return true;
+        }
 #ifndef USE_ENHANCED_ADR
         GlobalFlush::Get().flush();
 #endif // USE_ENHANCED_ADR
         return true;
     }
 
+    // Makes everything written so far durable, called at checkpoint boundaries.
+    // Only needed when the persistence domain is not byte-addressable.
+    static inline void PersistBarrier() {
+        if (g_persist_mode == PERSIST_MSYNC) {
+            SyncMappedFiles();
+        }
+    }
+
     static inline void AcquireLock(std::atomic_flag &lock) {
         std::atomic_thread_fence(std::memory_order_acquire);
         while (lock.test_and_set(std::memory_order_relaxed)) {}
@@ -415,6 +606,12 @@ namespace crpm {
 
     void BindSingleSocket(int socket = 0);
 
+    // NUMA node with CPUs that is closest to the memory at addr
+    int FindLocalSocket(const void *addr);
+
+    // Number of CPUs of the NUMA node, of the machine without NUMA support
+    int GetSocketCpuCount(int socket);
+
     uint32_t CalculateCRC32(const void *buf, int len, unsigned int init);
 }
 
@@ -25,6 +25,18 @@ namespace crpm {
 
         virtual void checkpoint(uint64_t nr_threads) = 0;
 
+        // Whether the last checkpoint committed nothing, its dirty blocks
+        // are kept for the next one. Read by the threads that took part.
+        virtual bool checkpoint_skipped() { return false; }
+
+        // Returns a ticket for is_durable() and wait_for_durable(). Engines
+        // without a background flush checkpoint synchronously.
+        virtual uint64_t checkpoint_async(uint64_t nr_threads);
+
+        virtual bool is_durable(uint64_t ticket) { return true; }
+
+        virtual void wait_for_durable(uint64_t ticket) {}
+
         virtual bool exist_snapshot() = 0;
 
         void *get_address() { return get_address(0); }
@@ -33,8 +45,28 @@ namespace crpm {
 
         virtual size_t get_capacity() = 0;
 
+        // Capacity the pool may grow to, the allocator sizes its metadata by it
+        virtual size_t get_max_capacity() { return get_capacity(); }
+
+        // Grows the pool to at least min_capacity bytes, returns false if
+        // the engine cannot grow that far
+        virtual bool grow(size_t min_capacity) { return min_capacity <= get_capacity(); }
+
         virtual void wait_for_background_task() {}
 
+        virtual size_t get_stats(CheckpointStats *records, size_t max_records) { return 0; }
+
+        virtual void reset_stats() {}
+
+        virtual size_t get_snapshots(uint64_t *epochs, size_t max_epochs) { return 0; }
+
+        virtual SnapshotView open_snapshot_view() { return SnapshotView(); }
+
+        virtual void close_snapshot_view(const void *address) {}
+
+        // Engines with a fixed back pool ignore it
+        virtual bool set_shadow_capacity_factor(double factor) { return false; }
+
 #ifdef USE_MPI_EXTENSION
 
         static Engine *OpenForMPI(const char *path, const MemoryPoolOption &option, MPI_Comm comm);
@@ -16,6 +16,10 @@
 #include "internal/filesystem.h"
 #include "internal/checkpoint.h"
 #include "internal/engine.h"
+#include "internal/address_table.h"
+#include "internal/flush_blocks.h"
+#include "internal/stats.h"
+#include "internal/replacement_policy.h"
 
 namespace crpm {
     class HybridInstEngine : public Engine {
@@ -51,6 +55,8 @@ namespace crpm {
         private:
             std::mutex mutex;
             std::set<HybridInstEngine *> engines;
+            // Looked up by the store hooks without taking the mutex
+            AddressTable<HybridInstEngine> table;
             HybridInstEngine *default_engine;
         };
 
@@ -64,6 +70,8 @@ namespace crpm {
 
         virtual void checkpoint(uint64_t nr_threads);
 
+        virtual bool checkpoint_skipped() { return skipped; }
+
         virtual bool exist_snapshot();
 
         virtual void *get_address(uint64_t offset);
@@ -72,6 +80,10 @@ namespace crpm {
 
         virtual void wait_for_background_task();
 
+        virtual size_t get_stats(CheckpointStats *records, size_t max_records);
+
+        virtual void reset_stats();
+
         void hook_routine(const void *addr, size_t len);
 
         void hook_routine(const void *addr);
@@ -101,10 +113,14 @@ namespace crpm {
 
         void allocate_back_segment(uint64_t segment_id);
 
+        void record_back_segment_accesses(AtomicBitSet &dirty_segments);
+
         uint64_t find_back_block(uint64_t block_id, bool &created);
 
         uint64_t find_back_segment(uint64_t segment_id, bool &created);
 
+        bool reserve_back_segments();
+
         void prepare_working_memory();
 
         void determine_flush_mode();
@@ -116,11 +132,6 @@ namespace crpm {
 
         static void WriteBackThreadRoutine(HybridInstEngine *engine);
 
-        inline void advance_next_back_segment() {
-            const size_t kNumBackSegments = image->get_nr_back_segments();
-            next_back_segment = (next_back_segment + 1) % kNumBackSegments;
-        }
-
     private:
         bool has_init;
         bool has_snapshot;
@@ -149,17 +160,33 @@ namespace crpm {
         std::atomic<uint64_t> flush_latency;
         std::atomic<uint64_t> write_back_latency;
 
+        CheckpointStatsHistory stats_history;
+        std::atomic<uint64_t> checkpoint_fences;
+        std::atomic<uint64_t> nr_evictions;
+        // Back segments filled with a copy of the whole segment
+        std::atomic<uint64_t> nr_full_copies;
+        // Background write-back of the last wbinvd checkpoint
+        uint64_t write_back_epoch;
+        uint64_t write_back_start_clock;
+        uint64_t write_back_start_traffic;
+
+        // Null until the thread first dirties a block of the pool
         volatile uint64_t *flush_blocks[kMaxThreads];
         volatile uint64_t flush_blocks_count[kMaxThreads];
+        FlushBlockArena flush_arena;
 
         enum FlushMode {
             FMODE_NO_ACTION, FMODE_USE_FLUSH_BLOCKS, FMODE_WBINVD
         };
         FlushMode flush_mode, prev_flush_mode;
+        // Set by the leader when the back pool cannot take the working set
+        // of the epoch, before the other threads are released
+        bool skipped;
 
         std::pair<uintptr_t, uintptr_t> address_range;
 
-        uint64_t next_back_segment;
+        // Picks the back segment to bind, guarded by back_memory_lock
+        ReplacementPolicy *replacement_policy;
         std::atomic_flag back_memory_lock;
         uint64_t epoch;
     };
@@ -14,6 +14,8 @@
 #include "internal/common.h"
 #include "internal/filesystem.h"
 #include "internal/engine.h"
+#include "internal/address_table.h"
+#include "internal/flush_blocks.h"
 
 namespace crpm {
     class LmcEngine : public Engine {
@@ -49,6 +51,8 @@ namespace crpm {
         private:
             std::mutex mutex;
             std::set<LmcEngine *> engines;
+            // Looked up by the store hooks without taking the mutex
+            AddressTable<LmcEngine> table;
             LmcEngine *default_engine;
         };
 
@@ -117,8 +121,10 @@ namespace crpm {
         HeapHeader *header;
         std::atomic_flag *segment_locks;
 
+        // Null until the thread first dirties a block of the pool
         volatile uint64_t *flush_blocks[kMaxThreads];
         volatile uint64_t flush_blocks_count[kMaxThreads];
+        FlushBlockArena flush_arena;
 
         FlushMode flush_mode;
         std::pair<uintptr_t, uintptr_t> address_range;
@@ -65,7 +65,7 @@ namespace crpm {
 
         virtual size_t get_capacity();
 
-        virtual void wait_for_background_task() {
+        virtual void reset_stats() {
             checkpoint_traffic = 0;
             flush_latency = 0;
             write_back_latency = 0;
@@ -17,8 +17,18 @@
 #include "internal/filesystem.h"
 #include "internal/checkpoint.h"
 #include "internal/engine.h"
+#include "internal/address_table.h"
+#include "internal/flush_blocks.h"
+#include "internal/stats.h"
+#include "internal/worker_pool.h"
+#include "internal/flush_cost_model.h"
+#include "internal/replacement_policy.h"
+#include "internal/snapshot_history.h"
+#include "internal/segment_stash.h"
 
 namespace crpm {
+    // Pools of the instrumented engine as the registry and the store hooks
+    // see them. The engine itself is NvmInstEngineImpl.
     class NvmInstEngine : public Engine {
     public:
         class Registry {
@@ -44,6 +54,12 @@ namespace crpm {
 
             NvmInstEngine *get_unique_engine() const;
 
+            NvmInstEngine *find(const void *addr);
+
+            // Installs the handler that restores the segments of a lazy
+            // recovery on first access, other faults go to the previous one
+            void enable_segfault_handler();
+
         private:
             Registry();
 
@@ -51,49 +67,141 @@ namespace crpm {
 
             Registry &operator=(const Registry &);
 
-            NvmInstEngine *find(const void *addr);
+            void update_hook_dispatch();
 
-            NvmInstEngine *find_address_space(const void *addr);
+            static void SegfaultHandlerProc(int sig, siginfo_t *info, void *ucontext);
 
         private:
             std::mutex mutex;
             std::set<NvmInstEngine *> engines;
+            // Looked up by the store hooks without taking the mutex
+            AddressTable<NvmInstEngine> table;
             NvmInstEngine *default_engine;
+            std::once_flag segfault_handler_flag;
+            struct sigaction prev_segfault_action;
+        };
+
+        // Store hooks with the tracking shift and the geometry of a pool as
+        // constants, taken by the instrumented stores while every registered
+        // pool has the same ones
+        struct StoreHooks {
+            void (*store)(void *addr);
+            void (*range_store)(void *addr, size_t length);
         };
 
     public:
+        // Picks the geometry the pool was created with, or the one of the
+        // options if it is created
         static NvmInstEngine *Open(const char *path,
                                    const MemoryPoolOption &option);
 
-        NvmInstEngine();
+#ifdef USE_MPI_EXTENSION
+
+        static NvmInstEngine *OpenForMPI(const char *path,
+                                         const MemoryPoolOption &option,
+                                         MPI_Comm comm);
+
+#endif // USE_MPI_EXTENSION
+
+        virtual void hook_routine(const void *addr, size_t len) = 0;
+
+        virtual void hook_routine(const void *addr) = 0;
+
+        virtual void hook_copy_on_write_routine(const void *addr, size_t len) = 0;
+
+        virtual void hook_copy_on_write_routine(const void *addr) = 0;
+
+        // Drains the addresses buffered by the store hooks, the ones outside
+        // the pool are skipped
+        virtual void hook_routine_batch(const volatile uint64_t *addrs, uint64_t count) = 0;
 
-        virtual ~NvmInstEngine();
+        const StoreHooks &get_store_hooks() const { return store_hooks; }
+
+    protected:
+        NvmInstEngine() : tracking_shift(kBlockShift), store_hooks{nullptr, nullptr} {}
+
+        virtual bool restore_faulting_segment(const void *addr) = 0;
+
+    protected:
+        std::pair<uintptr_t, uintptr_t> address_range;
+        // Block or cache line shift of the dirty tracking, the store hooks
+        // filter at the finest one of the registered pools
+        size_t tracking_shift;
+        StoreHooks store_hooks;
+    };
+
+    // Instantiated for the geometries of CRPM_FOR_EACH_GEOMETRY, the
+    // constants below shadow the defaults of common.h
+    template<size_t BlockShift, size_t SegmentShift>
+    class NvmInstEngineImpl : public NvmInstEngine {
+        typedef BasicCheckpointImage<BlockShift, SegmentShift> CheckpointImage;
+
+        const static size_t kBlockShift = BlockShift;
+        const static size_t kBlockSize = 1ull << kBlockShift;
+        const static size_t kBlockMask = kBlockSize - 1;
+        const static size_t kSegmentShift = SegmentShift;
+        const static size_t kSegmentSize = 1ull << kSegmentShift;
+        const static size_t kSegmentMask = kSegmentSize - 1;
+        const static size_t kBlocksPerSegment = kSegmentSize / kBlockSize;
+        const static size_t kMaxFlushBlocks = kMaxFlushBytes >> kBlockShift;
+
+    public:
+        static NvmInstEngineImpl *Open(const char *path,
+                                       const MemoryPoolOption &option);
+
+        NvmInstEngineImpl();
+
+        virtual ~NvmInstEngineImpl();
 
         virtual void checkpoint(uint64_t nr_threads);
 
+        virtual uint64_t checkpoint_async(uint64_t nr_threads);
+
+        virtual bool is_durable(uint64_t ticket);
+
+        virtual void wait_for_durable(uint64_t ticket);
+
         virtual bool exist_snapshot();
 
         virtual void *get_address(uint64_t offset);
 
         virtual size_t get_capacity();
 
+        virtual size_t get_max_capacity();
+
+        virtual bool grow(size_t min_capacity);
+
         virtual void wait_for_background_task();
 
+        virtual size_t get_stats(CheckpointStats *records, size_t max_records);
+
+        virtual void reset_stats();
+
+        virtual bool set_shadow_capacity_factor(double factor);
+
+        virtual size_t get_snapshots(uint64_t *epochs, size_t max_epochs);
+
+        virtual SnapshotView open_snapshot_view();
+
+        virtual void close_snapshot_view(const void *address);
+
         bool has_background_task();
 
-        void hook_routine(const void *addr, size_t len);
+        virtual void hook_routine(const void *addr, size_t len);
 
-        void hook_routine(const void *addr);
+        virtual void hook_routine(const void *addr);
 
-        void hook_copy_on_write_routine(const void *addr, size_t len);
+        virtual void hook_copy_on_write_routine(const void *addr, size_t len);
 
-        void hook_copy_on_write_routine(const void *addr);
+        virtual void hook_copy_on_write_routine(const void *addr);
+
+        virtual void hook_routine_batch(const volatile uint64_t *addrs, uint64_t count);
 
 #ifdef USE_MPI_EXTENSION
 
-        static NvmInstEngine *OpenForMPI(const char *path,
-                                         const MemoryPoolOption &option,
-                                         MPI_Comm comm);
+        static NvmInstEngineImpl *OpenForMPI(const char *path,
+                                             const MemoryPoolOption &option,
+                                             MPI_Comm comm);
 
         virtual void checkpoint_for_mpi(uint64_t nr_threads, MPI_Comm comm);
 
@@ -102,6 +210,8 @@ namespace crpm {
 #endif // USE_MPI_EXTENSION
 
     private:
+        void init_dirty_tracking();
+
         uint64_t write_back_parallel(int tid, int nr_threads);
 
         void clear_dirty_bits();
@@ -113,25 +223,287 @@ namespace crpm {
 
         bool open_checkpoint_image(const char *path, void *hint_addr, int flags);
 
+        // Undoes the opening of the image on a failure of Open
+        void close_checkpoint_image();
+
+        bool map_checkpoint_image();
+
+        bool prepare_lazy_recovery();
+
+        void start_lazy_recovery();
+
+        bool open_snapshot_history(const char *path, const MemoryPoolOption &option, bool create);
+
+        void begin_snapshot(uint64_t max_blocks);
+
+        uint64_t count_dirty_blocks();
+
+        // The back segment holds the committed data of every dirty block,
+        // copied there by the first store of the epoch at the latest, or the
+        // stash if none could be bound. A segment never committed has no
+        // copy, its blocks were zero.
+        inline void record_pre_image(uint64_t block_id) {
+            uint64_t segment_id = block_id / kBlocksPerSegment;
+            if (image->get_segment_state(segment_id) == CheckpointImage::SS_Initial) {
+                history->record(block_id, nullptr);
+                return;
+            }
+            uint64_t back_id = image->get_main_to_back(segment_id);
+            if (back_id != kNullSegmentIndex) {
+                if (!block_missing.test(block_id)) {
+                    history->record(block_id, image->get_back_block(
+                            back_id * kBlocksPerSegment + block_id % kBlocksPerSegment));
+                }
+            } else if (unlikely(stash != nullptr)) {
+                const uint8_t *segment = stash->find(image->get_committed_epoch(), segment_id);
+                if (segment) {
+                    history->record(block_id, (void *) (segment + ((block_id % kBlocksPerSegment) << kBlockShift)));
+                }
+            }
+        }
+
+        void record_dirty_segment(uint64_t segment_id);
+
+        bool restore_snapshot(uint64_t epoch);
+
+        struct View;
+
+        void map_view_segment(View *view, uint64_t segment_id, uint8_t source);
+
+        void fill_missing_blocks(uint64_t segment_id, uint64_t back_id);
+
+        void pin_viewed_segment(uint64_t segment_id);
+
+        void unpin_segment(uint64_t segment_id);
+
+        inline bool is_pinned(uint64_t segment_id) {
+            return unlikely(nr_views.load(std::memory_order_relaxed) != 0) &&
+                   segment_pinned.test(segment_id, std::memory_order_acquire);
+        }
+
+        inline bool is_unrestored(uint64_t segment_id) {
+            return unlikely(nr_unrestored.load(std::memory_order_acquire) != 0) &&
+                   segment_unrestored.test(segment_id, std::memory_order_acquire);
+        }
+
+        void restore_segment(uint64_t segment_id);
+
+        void restore_segment_locked(uint64_t segment_id);
+
+        virtual bool restore_faulting_segment(const void *addr);
+
+        static void RestoreThreadRoutine(NvmInstEngineImpl *engine);
+
+        void allocate_dirty_bits();
+
+        void load_missing_blocks();
+
+        void reset_missing_blocks(uint64_t main_id, bool missing);
+
+        inline void mark_block_present(uint64_t block_id, uint64_t back_id) {
+            if (unlikely(block_missing.test(block_id))) {
+                image->mark_back_block_present(back_id, block_id % kBlocksPerSegment);
+                block_missing.clear(block_id);
+            }
+        }
+
+        void copy_missing_block(uint64_t block_id);
+
+        void mark_segment_dirty(uint64_t segment_id);
+
+        bool init_back_segment_pool(const MemoryPoolOption &option);
+
         void determine_flush_mode();
 
+        void calibrate_flush_cost();
+
+        // Lines of the block stored to in the epoch, bit i is line i
+        inline uint64_t get_dirty_lines(uint64_t block_id) {
+            uint64_t line_id = block_id << kLineShift;
+            uint64_t lines = line_dirty.test_all(line_id) >> (line_id & AtomicBitSet::kBitMask);
+            return lines & kAllLines;
+        }
+
+        // Lines of a dirty block the flush and the write-back have to cover.
+        // A block missing in back is copied as a whole.
+        inline uint64_t get_lines_to_persist(uint64_t block_id, bool missing = false) {
+            if (!track_lines || missing) {
+                return kAllLines;
+            }
+            uint64_t lines = get_dirty_lines(block_id);
+            return lines ? lines : kAllLines;
+        }
+
+        // Blocks under 256 bytes take the 64-byte kernel
+        inline void copy_block(void *dst, void *src) {
+            if (kBlockSize & 255) {
+                NonTemporalCopy64(dst, src, kBlockSize);
+            } else {
+                NonTemporalCopy256(dst, src, kBlockSize);
+            }
+        }
+
+        // Returns the bytes persisted
+        inline uint64_t persist_block(uint8_t *base_address, uint64_t block_id) {
+            uint8_t *addr = base_address + (block_id << kBlockShift);
+            uint64_t lines = get_lines_to_persist(block_id);
+            if (lines == kAllLines) {
+                if (flush_by_recopy) {
+                    copy_block(addr, addr);
+                } else {
+                    FlushRegion(addr, kBlockSize);
+                }
+                return kBlockSize;
+            }
+            uint64_t bytes = 0;
+            while (lines != 0) {
+                uint8_t *line = addr + (__builtin_ctzll(lines) << kCacheLineShift);
+                lines &= lines - 1;
+                if (flush_by_recopy) {
+                    NonTemporalCopy64(line, line, kCacheLineSize);
+                } else {
+                    Flush(line);
+                }
+                bytes += kCacheLineSize;
+            }
+            return bytes;
+        }
+
+        void begin_stats(CheckpointStats &stats);
+
+        void begin_checkpoint();
+
+        bool prepare_checkpoint();
+
+        void commit_main_state();
+
+        void finish_checkpoint();
+
+        void checkpoint_by_workers();
+
         uint64_t flush_parallel(int tid, int nr_threads);
 
+        void partition_flush_blocks();
+
+        template<typename Visitor>
+        void for_each_flush_chunk(std::atomic<uint64_t> &cursor, Visitor visit);
+
+        uint64_t claim_dirty_segments(std::atomic<uint64_t> &cursor);
+
         bool lazy_write_back(uint64_t segment_id, bool on_demand = false);
 
-        void allocate_back_segment(uint64_t main_id);
+        bool allocate_back_segment(uint64_t main_id);
 
-        uint64_t find_back_block(uint64_t block_id, bool &created);
+        void bind_back_segment(uint64_t main_id, uint64_t back_id, uint64_t old_main_id);
+
+        void record_back_segment_accesses(AtomicBitSet &dirty_segments);
+
+        // Called with cleaner_mutex held, before the cleaner is started
+        inline void mark_write_back_pending(AtomicBitSet &segments) {
+            segments.for_each_word([this](uint64_t seg_id, uint64_t bitset) {
+                write_back_pending.store_all(seg_id, write_back_pending.test_all(seg_id) | bitset);
+            });
+        }
+
+        inline void mark_write_back_complete() {
+            idle_start_evictions.store(nr_evictions.load(std::memory_order_relaxed),
+                                       std::memory_order_relaxed);
+            idle_start_full_copies.store(nr_full_copies.load(std::memory_order_relaxed),
+                                         std::memory_order_relaxed);
+            idle_start_eliminated_lines.store(nr_eliminated_lines.load(std::memory_order_relaxed),
+                                              std::memory_order_relaxed);
+        }
+
+        // Copies main to back for the write-back, returns the lines that
+        // were skipped because back holds them already
+        inline uint64_t write_back_copy(void *back_addr, void *main_addr, size_t len) {
+            if (write_elimination) {
+                return NonTemporalCopyWithWriteElimination(back_addr, main_addr, len);
+            }
+            if (len & 255) {
+                NonTemporalCopy64(back_addr, main_addr, len);
+            } else {
+                NonTemporalCopy256(back_addr, main_addr, len);
+            }
+            return 0;
+        }
+
+        // Copies the given lines of a block to back, returns the bytes copied
+        inline uint64_t write_back_lines(uint8_t *back_addr, uint8_t *main_addr, uint64_t lines,
+                                         uint64_t &eliminated_lines) {
+            if (lines == kAllLines) {
+                eliminated_lines += write_back_copy(back_addr, main_addr, kBlockSize);
+                return kBlockSize;
+            }
+            uint64_t bytes = 0;
+            while (lines != 0) {
+                uint64_t offset = __builtin_ctzll(lines) << kCacheLineShift;
+                lines &= lines - 1;
+                eliminated_lines += write_back_copy(back_addr + offset, main_addr + offset, kCacheLineSize);
+                bytes += kCacheLineSize;
+            }
+            return bytes;
+        }
+
+        // Blocks from block_id on that form a run with it, stop_block_id if
+        // block_id is. A run is a single block unless its blocks are copied
+        // as a whole, lines is set to the lines of the first block.
+        inline uint64_t find_run_stop(uint64_t block_id, uint64_t stop_block_id, uint64_t &lines) {
+            if (block_id >= stop_block_id) {
+                return stop_block_id;
+            }
+            lines = get_lines_to_persist(block_id, block_missing.test(block_id));
+            if (lines != kAllLines) {
+                return block_id + 1;
+            }
+            for (++block_id; block_id < stop_block_id && block_dirty.test(block_id); ++block_id) {
+                if (get_lines_to_persist(block_id, block_missing.test(block_id)) != kAllLines) {
+                    break;
+                }
+            }
+            return block_id;
+        }
+
+        uint64_t write_back_segment(uint64_t main_id, uint64_t back_id, uint64_t &eliminated_lines);
 
         uint64_t find_back_segment(uint64_t segment_id, bool &created);
 
-        static void WriteBackThreadRoutine(NvmInstEngine *engine);
+        void defer_write_back(uint64_t segment_id);
+
+        bool reclaim_back_segment();
+
+        bool make_room_for_back_segment();
+
+        bool stash_segment(uint64_t segment_id);
+
+        bool open_segment_stash(const char *path, bool create);
+
+        uint64_t recover_stashed_segments();
 
-        inline void advance_next_back_segment() {
-            const size_t kNumBackSegments = image->get_nr_back_segments();
-            next_back_id = (next_back_id + 1) % kNumBackSegments;
+        inline uint64_t get_nr_usable_back_segments() const {
+            return nr_back_segments - nr_released_back_segments;
         }
 
+        bool grow_back_segments(uint64_t min_usable);
+
+        void shrink_back_segments(uint64_t max_usable);
+
+        void resize_back_segments(uint64_t dirty_segments, bool can_shrink);
+
+        void complete_cleaner_epoch();
+
+        void restart_cleaner(uint64_t epoch, uint64_t start_clock);
+
+        static void WriteBackThreadRoutine(NvmInstEngineImpl *engine);
+
+        static void CheckpointWorkerRoutine(NvmInstEngineImpl *engine);
+
+        void persist_async_checkpoint();
+
+        void wait_for_async_checkpoint();
+
+        void wait_for_in_flight_segment(uint64_t segment_id);
+
     private:
         bool has_init;
         bool has_snapshot;
@@ -139,20 +511,84 @@ namespace crpm {
         FileSystem fs;
         CheckpointImage *image;
 
-        uint64_t nr_blocks;
-        uint64_t nr_segments, nr_back_segments;
-        uint64_t capacity;
+        // Published by grow() after the bitsets are resized, the
+        // checkpoints, the cleaner and the hooks read them without a lock
+        std::atomic<uint64_t> nr_blocks;
+        std::atomic<uint64_t> nr_segments, nr_back_segments;
+        std::atomic<uint64_t> capacity;
+        // Growable pools reserve address space and DRAM state for max_capacity
+        uint64_t max_capacity;
+        std::mutex grow_mutex;
         bool skip_copy_on_write;
         AtomicBitSet segment_dirty;
         AtomicBitSet block_dirty;
+        // Cache lines stored to in the epoch, see
+        // MemoryPoolOption::track_dirty_lines. Set and cleared along with
+        // block_dirty, allocated only if the lines are tracked.
+        bool track_lines;
+        AtomicBitSet line_dirty;
+        // Blocks of bound main segments that have no copy in their back
+        // segment yet, mirrors the bitmaps of a block granular image. The
+        // first store to such a block copies it to the back segment.
+        AtomicBitSet block_missing;
+        // Lazy recovery: bound main segments of the opened image that are
+        // restored on first access or by the restorer thread. Those in
+        // SS_Back are inaccessible until then and restored through
+        // main_alias, stores to the others wait in the hooks.
+        AtomicBitSet segment_unrestored;
+        std::atomic<uint64_t> nr_unrestored;
+        uint64_t nr_lazy_segments;
+        uint8_t *main_alias;
+        std::thread restorer;
+        volatile bool restorer_running;
+        std::atomic<uint64_t> recovery_traffic;
+        // Retained snapshots, nullptr if the pool keeps none. The checkpoint
+        // of a rollback records no snapshot.
+        SnapshotHistory *history;
+        bool restoring_snapshot;
+        std::atomic<uint64_t> history_cursor;
+        // Snapshot views map the main segment of the committed epoch until
+        // it is first stored to, then its back segment, and a private copy
+        // once the back segment is about to be written back. Segments are
+        // switched under their lock and view_mutex.
+        enum ViewSource : uint8_t {
+            VS_Pending, VS_Zero, VS_Main, VS_Back, VS_Private
+        };
+        struct View {
+            uint8_t *alias;
+            uint8_t *address;
+            uint64_t nr_segments;
+            std::vector<uint8_t> source;
+        };
+        std::vector<View *> views;
+        std::mutex view_mutex;
+        std::atomic<uint64_t> nr_views;
+        // Segments that a view reads from the main or the back segment
+        AtomicBitSet segment_viewed;
+        AtomicBitSet segment_pinned;
         std::atomic<uint64_t> next_thread_id;
         Barrier barrier, latch;
+        WorkerPool workers;
+        std::mutex checkpoint_mutex;
+
+        // Owned by the leader of the running checkpoint
+        uint64_t checkpoint_start_clock;
+        uint64_t checkpoint_persist_clock;
+        uint64_t checkpoint_start_fences;
+        // Totals of the store hooks of all pools when the last checkpoint began
+        uint64_t last_hooked_stores;
+        uint64_t last_store_filter_hits;
+        bool cleaner_busy;
+        CheckpointStats checkpoint_stats;
         std::atomic_flag *segment_locks;
 
         enum CleanerState {
             WB_STARTED, WB_RUNNING, WB_IDLE
         };
         std::atomic<CleanerState> cleaner_state;
+        // Segments committed in SS_Main that the cleaner has yet to write
+        // back, guarded by cleaner_mutex
+        AtomicBitSet write_back_pending;
 
         std::thread cleaner;
         volatile bool cleaner_running;
@@ -160,22 +596,111 @@ namespace crpm {
         std::atomic<bool> checkpoint_in_progress;
         std::condition_variable cleaner_condvar;
 
+        // Asynchronous checkpoint: the blocks captured by checkpoint_async()
+        // are flushed and committed by checkpoint_worker. Until the epoch is
+        // durable, the first store to a segment it covers has to wait.
+        std::thread checkpoint_worker;
+        volatile bool checkpoint_worker_running;
+        std::mutex async_mutex;
+        std::condition_variable async_condvar;
+        bool async_pending;
+        std::atomic<bool> async_in_flight;
+        std::atomic<uint64_t> async_issued;
+        std::atomic<uint64_t> async_durable;
+        std::vector<uint64_t> async_blocks;
+        AtomicBitSet segment_in_flight;
+        CheckpointStats async_stats;
+        uint64_t async_start_clock;
+        uint64_t async_ticket;
+
         std::atomic<uint64_t> checkpoint_traffic;
+        // Bytes persisted by the flush of FMODE_USE_FLUSH_BLOCKS checkpoints
+        std::atomic<uint64_t> flush_traffic;
         std::atomic<uint64_t> flush_latency;
         std::atomic<uint64_t> write_back_latency;
 
+        CheckpointStatsHistory stats_history;
+        std::atomic<uint64_t> checkpoint_fences;
+        std::atomic<uint64_t> background_traffic;
+        std::atomic<uint64_t> nr_evictions;
+        // Back segments filled with a copy of the whole main segment
+        std::atomic<uint64_t> nr_full_copies;
+        // Lines the write-back left alone, see MemoryPoolOption::write_elimination
+        bool write_elimination;
+        std::atomic<uint64_t> nr_eliminated_lines;
+        // Background write-back of the last wbinvd checkpoint, guarded by cleaner_mutex
+        uint64_t cleaner_epoch;
+        uint64_t cleaner_start_clock;
+        uint64_t cleaner_start_traffic;
+        uint64_t cleaner_start_evictions;
+        uint64_t cleaner_start_full_copies;
+        uint64_t cleaner_start_eliminated_lines;
+        // Counters when the last write-back completed, the copy-on-write
+        // that follows is accounted to the next checkpoint
+        std::atomic<uint64_t> idle_start_evictions;
+        std::atomic<uint64_t> idle_start_full_copies;
+        std::atomic<uint64_t> idle_start_eliminated_lines;
+
+        // Null until the thread first dirties a block of the pool
         volatile uint64_t *flush_blocks[kMaxThreads];
         volatile uint64_t flush_blocks_count[kMaxThreads];
+        FlushBlockArena flush_arena;
+
+        // The flush_blocks lists are handed out to the checkpoint threads in
+        // chunks, so that a thread that dirtied most blocks does not make
+        // one checkpoint thread do most of the work
+        const static uint64_t kFlushChunkBlocks = 512;
+
+        const static uint64_t kLineShift = kBlockShift - kCacheLineShift;
+        const static uint64_t kLinesPerBlock = 1ull << kLineShift;
+        const static uint64_t kAllLines = ~0ull >> (AtomicBitSet::kBitWidth - kLinesPerBlock);
+        static_assert(kLinesPerBlock <= AtomicBitSet::kBitWidth, "a block must fit in a word of line_dirty");
+        const static uint64_t kWriteBackChunkSegments = 4;
+        // Bytes of the next run prefetched while a run is written back
+        const static uint64_t kWriteBackPrefetchBytes = 2048;
+        // Indexed by the position of the thread in flush_arena
+        uint64_t flush_blocks_offset[kMaxThreads + 1];
+        uint64_t nr_flush_threads;
+        std::atomic<uint64_t> flush_cursor;
+        std::atomic<uint64_t> write_back_cursor;
 
         enum FlushMode {
             FMODE_NO_ACTION, FMODE_USE_FLUSH_BLOCKS, FMODE_WBINVD
         };
         FlushMode flush_mode;
-
-        std::pair<uintptr_t, uintptr_t> address_range;
-
-        uint64_t next_back_id;
+        // Dirty blocks are rewritten in place with non-temporal stores instead
+        // of being flushed, only meaningful in FMODE_USE_FLUSH_BLOCKS
+        bool flush_by_recopy;
+        FlushCostModel flush_cost_model;
+        FlushCostModel::Method last_flush_method;
+
+        // Picks the back segment to bind, guarded by back_memory_lock
+        ReplacementPolicy *replacement_policy;
         std::atomic_flag back_memory_lock;
+
+        // Elastic back pool: slots in back_released are unbound and their
+        // storage is returned to the file system, so the pool holds
+        // nr_back_segments - nr_released_back_segments usable slots. It is
+        // sized between shadow_factor * nr_segments and the largest working
+        // set of the recent epochs, and grows on demand when every usable
+        // slot is held by a dirty segment. Changes hold grow_mutex.
+        const static uint64_t kWorkingSetWindow = 16;
+        std::atomic<double> shadow_factor;
+        AtomicBitSet back_released;
+        std::atomic<uint64_t> nr_released_back_segments;
+        uint64_t working_set[kWorkingSetWindow];
+        uint64_t working_set_cursor;
+
+        // Segments of the running checkpoint that found no back segment
+        // stay committed in SS_Main, guarded by back_memory_lock
+        AtomicBitSet write_back_deferred;
+        uint64_t nr_deferred_segments;
+        // Committed segments written in place because the back pool was
+        // full, created by the first copy-on-write that needs it
+        SegmentStash *stash;
+        std::string stash_path;
+        std::mutex stash_mutex;
+        std::atomic<uint64_t> nr_stashed_segments;
     };
 }
 
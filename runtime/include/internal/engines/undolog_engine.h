@@ -14,6 +14,8 @@
 #include "internal/common.h"
 #include "internal/filesystem.h"
 #include "internal/engine.h"
+#include "internal/address_table.h"
+#include "internal/flush_blocks.h"
 
 namespace crpm {
     class UndoLogEngine : public Engine {
@@ -49,6 +51,8 @@ namespace crpm {
         private:
             std::mutex mutex;
             std::set<UndoLogEngine *> engines;
+            // Looked up by the store hooks without taking the mutex
+            AddressTable<UndoLogEngine> table;
             UndoLogEngine *default_engine;
         };
 
@@ -122,8 +126,10 @@ namespace crpm {
         std::atomic_flag *segment_locks;
         std::atomic<uint64_t> log_head;
 
+        // Null until the thread first dirties a block of the pool
         volatile uint64_t *flush_blocks[kMaxThreads];
         volatile uint64_t flush_blocks_count[kMaxThreads];
+        FlushBlockArena flush_arena;
 
         enum FlushMode {
             FMODE_NO_ACTION, FMODE_USE_FLUSH_BLOCKS, FMODE_WBINVD
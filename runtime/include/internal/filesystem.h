@@ -7,6 +7,7 @@
 
 #include <cstdint>
 #include <string>
+#include <vector>
 
 namespace crpm {
     class FileSystem {
@@ -15,17 +16,47 @@ namespace crpm {
 
         static bool Remove(const char *path);
 
+        static bool ReadHeader(const char *path, void *buf, size_t len);
+
     public:
-        FileSystem() : has_init(false) {}
+        FileSystem() : has_init(false), reserved_size(0) {}
 
         ~FileSystem() { if (has_init) close(); }
 
-        bool create(const char *path, size_t size, int flags = 0, void *hint_addr = nullptr);
+        // With a non-zero reserve_size, only that much address space is
+        // reserved and the ranges of the file are mapped by map_range()
+        bool create(const char *path, size_t size, int flags = 0, void *hint_addr = nullptr,
+                    size_t reserve_size = 0);
+
+        bool open(const char *path, int flags = 0, void *hint_addr = nullptr,
+                  size_t reserve_size = 0);
+
+        bool map_range(size_t offset, size_t file_offset, size_t length);
+
+        // Maps the ranges mapped so far once more at another address, with
+        // the same layout. Stores through the alias are not tracked by the
+        // crash simulation.
+        void *map_alias(bool read_only = false);
+
+        // Maps length bytes of the file at file_offset over offset of a
+        // read-only alias
+        bool map_alias_range(void *alias, size_t offset, size_t file_offset, size_t length);
+
+        void unmap_alias(void *alias);
+
+        // Allocates the file up to new_size, the new part reads as zero
+        bool extend(size_t new_size);
+
+        // Gives the storage of [offset, offset + length) back to the file
+        // system, the range reads as zero until it is allocated again
+        void release(size_t offset, size_t length);
 
-        bool open(const char *path, int flags = 0, void *hint_addr = nullptr);
+        bool allocate(size_t offset, size_t length);
 
         void clear_poison(size_t offset, size_t length);
 
+        void sync();
+
         inline void *rel_to_abs(uintptr_t rel) const { return (char *) addr + rel; }
 
         inline uintptr_t abs_to_rel(void *abs) const { return (uintptr_t) abs - (uintptr_t) addr; }
@@ -36,11 +67,28 @@ namespace crpm {
 
         void close();
 
+    private:
+        struct MappedRange {
+            size_t offset;
+            size_t file_offset;
+            size_t length;
+        };
+
+        int get_map_flags() const;
+
+        bool map_file(int tmp_fd, size_t reserve_size, int flags, void *hint_addr);
+
+        void register_mapping(const MappedRange &range);
+
+        void unregister_mapping();
+
     private:
         bool has_init;
         int fd;
         void *addr;
         size_t size;
+        size_t reserved_size;
+        std::vector<MappedRange> ranges;
         std::string file_path;
     };
 }
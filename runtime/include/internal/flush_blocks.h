@@ -0,0 +1,50 @@
+//
+// Per-thread lists of the blocks dirtied in an epoch.
+//
+
+#ifndef LIBCRPM_FLUSH_BLOCKS_H
+#define LIBCRPM_FLUSH_BLOCKS_H
+
+#include <mutex>
+#include <atomic>
+#include <vector>
+
+#include "internal/common.h"
+
+namespace crpm {
+    // Hands out the flush_blocks lists of an engine. A thread gets its list
+    // on its first store to the pool, the lists are carved from chunks that
+    // are allocated as threads show up. The checkpoint phases only visit
+    // the threads that have a list.
+    class FlushBlockArena {
+    public:
+        explicit FlushBlockArena(uint64_t list_capacity = kMaxFlushBlocks);
+
+        ~FlushBlockArena();
+
+        // Binds a list of list_capacity entries to lists[tid], which
+        // stays bound once the thread exits and its id is reused
+        volatile uint64_t *attach(unsigned int tid, volatile uint64_t **lists);
+
+        inline uint64_t get_nr_threads() const {
+            return nr_threads.load(std::memory_order_acquire);
+        }
+
+        // Thread ids in the order they were attached
+        inline unsigned int get_thread(uint64_t index) const {
+            return threads[index];
+        }
+
+    private:
+        const static uint64_t kListsPerChunk = 4;
+
+        const uint64_t list_capacity;
+        std::mutex mutex;
+        std::atomic<uint64_t> nr_threads;
+        unsigned int threads[kMaxThreads];
+        std::vector<uint64_t *> chunks;
+        uint64_t chunk_used;
+    };
+}
+
+#endif //LIBCRPM_FLUSH_BLOCKS_H
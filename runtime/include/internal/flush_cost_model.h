@@ -0,0 +1,52 @@
+//
+// Cost model that picks how the dirty blocks of a checkpoint are persisted.
+//
+
+#ifndef LIBCRPM_FLUSH_COST_MODEL_H
+#define LIBCRPM_FLUSH_COST_MODEL_H
+
+#include <cstdint>
+#include <cstddef>
+
+namespace crpm {
+    class FlushCostModel {
+    public:
+        enum Method {
+            METHOD_FLUSH_BLOCKS, METHOD_NT_RECOPY, METHOD_WBINVD
+        };
+
+        struct Estimate {
+            double flush_blocks_ms;
+            double nt_recopy_ms;
+            double wbinvd_ms;
+        };
+
+        // Costs are per block of 1 << block_shift bytes
+        explicit FlushCostModel(size_t block_shift);
+
+        // Measure the flush primitives on [sample, sample + len), which is
+        // rewritten with its own content. Must not race with other writers.
+        void calibrate(void *sample, size_t len);
+
+        Method choose(uint64_t dirty_blocks, uint64_t dirty_segments, Estimate &estimate) const;
+
+        void print() const;
+
+        static const char *GetMethodName(Method method);
+
+    private:
+        // Per-line clflushopt/clwb, per-block in-place non-temporal copy, one
+        // wbinvd, and the serialized state update the cleaner later pays for
+        // each segment left dirty by wbinvd, all in TSC cycles
+        double line_cycles;
+        double block_cycles;
+        double wbinvd_cycles;
+        double segment_cycles;
+        size_t block_size;
+        size_t lines_per_block;
+        bool calibrated;
+        bool has_wbinvd;
+    };
+}
+
+#endif //LIBCRPM_FLUSH_COST_MODEL_H
@@ -0,0 +1,144 @@
+//
+// Policies that pick the back segment to bind when the back pool is full.
+//
+
+#ifndef LIBCRPM_REPLACEMENT_POLICY_H
+#define LIBCRPM_REPLACEMENT_POLICY_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <functional>
+
+namespace crpm {
+    // The history is indexed by back segment and follows its binding: it is
+    // reset when the back segment is bound to another main segment. Callers
+    // serialize all calls, e.g. with the back memory lock of the engine.
+    class ReplacementPolicy {
+    public:
+        // Whether the back segment may be bound to a new main segment
+        typedef std::function<bool(uint64_t back_id)> Filter;
+
+        // Returns nullptr if the policy name is unknown. Recognized names
+        // are default (round-robin), clock, lru-k and frequency.
+        static ReplacementPolicy *Create(const std::string &name, uint64_t max_back_segments);
+
+        ReplacementPolicy() : clock(1), cursor(0) {}
+
+        virtual ~ReplacementPolicy() {}
+
+        virtual const char *get_name() const = 0;
+
+        // Starts a new epoch, called once per checkpoint
+        void tick() { clock++; }
+
+        // The main segment bound to back_id has been dirtied in this epoch
+        virtual void access(uint64_t back_id) = 0;
+
+        // back_id has been bound to a new main segment dirtied in this epoch
+        virtual void bind(uint64_t back_id) = 0;
+
+        // back_id has been unbound, it is the coldest candidate from now on
+        virtual void release(uint64_t back_id) = 0;
+
+        // Returns the next back segment in [0, nr_back_segments) accepted by
+        // evictable, or kNullSegmentIndex if there is none
+        virtual uint64_t select(uint64_t nr_back_segments, const Filter &evictable) = 0;
+
+    protected:
+        // Samples up to kSampleSize candidates from the cursor on and
+        // returns the one with the lowest score
+        uint64_t select_sampled(uint64_t nr_back_segments, const Filter &evictable,
+                                const std::function<uint64_t(uint64_t back_id)> &score);
+
+        const static uint64_t kSampleSize = 16;
+
+        uint64_t clock;
+        uint64_t cursor;
+    };
+
+    // Takes the first evictable back segment after the last one taken
+    class RoundRobinPolicy : public ReplacementPolicy {
+    public:
+        RoundRobinPolicy() {}
+
+        virtual const char *get_name() const { return "default"; }
+
+        virtual void access(uint64_t back_id) {}
+
+        virtual void bind(uint64_t back_id) {}
+
+        virtual void release(uint64_t back_id) {}
+
+        virtual uint64_t select(uint64_t nr_back_segments, const Filter &evictable);
+    };
+
+    // Second chance: a back segment whose main segment has been dirtied
+    // since the hand last passed it is skipped once
+    class ClockPolicy : public ReplacementPolicy {
+    public:
+        explicit ClockPolicy(uint64_t max_back_segments);
+
+        virtual const char *get_name() const { return "clock"; }
+
+        virtual void access(uint64_t back_id) { referenced[back_id] = true; }
+
+        virtual void bind(uint64_t back_id) { referenced[back_id] = true; }
+
+        virtual void release(uint64_t back_id) { referenced[back_id] = false; }
+
+        virtual uint64_t select(uint64_t nr_back_segments, const Filter &evictable);
+
+    private:
+        std::vector<bool> referenced;
+    };
+
+    // LRU-2: evicts the back segment whose second most recent access is the
+    // oldest, so a segment dirtied once does not displace recurring ones
+    class LruKPolicy : public ReplacementPolicy {
+    public:
+        explicit LruKPolicy(uint64_t max_back_segments);
+
+        virtual const char *get_name() const { return "lru-k"; }
+
+        virtual void access(uint64_t back_id);
+
+        virtual void bind(uint64_t back_id);
+
+        virtual void release(uint64_t back_id);
+
+        virtual uint64_t select(uint64_t nr_back_segments, const Filter &evictable);
+
+    private:
+        // Epochs of the last two accesses, 0 for none
+        std::vector<uint64_t> last_access;
+        std::vector<uint64_t> prev_access;
+    };
+
+    // Evicts the back segment dirtied in the fewest epochs, the count is
+    // halved every kHalfLife epochs so that old hot spots fade out
+    class FrequencyPolicy : public ReplacementPolicy {
+    public:
+        explicit FrequencyPolicy(uint64_t max_back_segments);
+
+        virtual const char *get_name() const { return "frequency"; }
+
+        virtual void access(uint64_t back_id);
+
+        virtual void bind(uint64_t back_id);
+
+        virtual void release(uint64_t back_id);
+
+        virtual uint64_t select(uint64_t nr_back_segments, const Filter &evictable);
+
+    private:
+        const static uint64_t kHalfLife = 8;
+
+        uint64_t decayed_count(uint64_t back_id) const;
+
+        std::vector<uint64_t> count;
+        std::vector<uint64_t> last_access;
+    };
+}
+
+#endif //LIBCRPM_REPLACEMENT_POLICY_H
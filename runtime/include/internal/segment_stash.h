@@ -0,0 +1,84 @@
+//
+// Copies of committed segments that are written in place because the
+// back pool had no room for them.
+//
+
+#ifndef LIBCRPM_SEGMENT_STASH_H
+#define LIBCRPM_SEGMENT_STASH_H
+
+#include <mutex>
+#include <string>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+
+#include "internal/common.h"
+#include "internal/filesystem.h"
+
+namespace crpm {
+    // A segment is stashed by its first store of the epoch when no back
+    // segment can be bound to it. The stash is tagged with the committed
+    // epoch of the image: the recovery of that epoch copies the segments
+    // back to the main segments, and the next checkpoint, which persists
+    // them in place, makes the stash stale. The segments are kept in a file
+    // next to the pool, which is only created once one is needed.
+    class SegmentStash {
+    public:
+        static std::string GetPath(const char *pool_path) {
+            return std::string(pool_path) + ".stash";
+        }
+
+        // Holds up to max_segments segments of 1 << segment_shift bytes
+        static SegmentStash *Create(const char *path, size_t max_segments, size_t segment_shift);
+
+        static SegmentStash *Open(const char *path, size_t segment_shift);
+
+        ~SegmentStash() {}
+
+        // Calls restore(segment_id, data) for the segments stashed in
+        // committed_epoch and drops them. Called before the recovery of the
+        // image.
+        void recover(uint64_t committed_epoch,
+                     const std::function<void(uint64_t, const uint8_t *)> &restore);
+
+        // Persists a copy of the segment, restored if the image recovers
+        // epoch. May be called by several threads. Returns false if the
+        // file cannot grow.
+        bool stash(uint64_t epoch, uint64_t segment_id, const void *data);
+
+        // The copy of the segment stashed in epoch, nullptr if there is none
+        const uint8_t *find(uint64_t epoch, uint64_t segment_id);
+
+    private:
+        SegmentStash() : header(nullptr), segment_ids(nullptr), segments(nullptr),
+                         segment_size(0), nr_mapped(0) {}
+
+        struct Header {
+            uint32_t magic;
+            uint32_t segment_shift;
+            uint64_t nr_slots;
+            uint64_t epoch;
+            uint64_t nr_entries;
+        };
+
+        static size_t CalculateDataOffset(size_t nr_slots);
+
+        void setup_layout();
+
+        bool map_slot(uint64_t slot);
+
+    private:
+        FileSystem fs;
+        Header *header;
+        uint64_t *segment_ids;
+        uint8_t *segments;
+        size_t segment_size;
+        // Slots of the file mapped so far, the file grows by a slot
+        uint64_t nr_mapped;
+        std::mutex mutex;
+        // Slots of the segments stashed in header->epoch
+        std::unordered_map<uint64_t, uint64_t> slots;
+    };
+}
+
+#endif //LIBCRPM_SEGMENT_STASH_H
@@ -0,0 +1,151 @@
+//
+// Pre-images of the blocks changed by the recent checkpoints, so that a
+// pool can be rolled back to one of its last committed epochs.
+//
+
+#ifndef LIBCRPM_SNAPSHOT_HISTORY_H
+#define LIBCRPM_SNAPSHOT_HISTORY_H
+
+#include <string>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+
+#include "internal/common.h"
+#include "internal/filesystem.h"
+
+namespace crpm {
+    // A snapshot is named after the committed epoch of the image it restores
+    // and holds the blocks that the next checkpoint changed, as they were
+    // before. The snapshots thus form a chain from the current image back to
+    // the oldest one, and every checkpoint has to record its snapshot. The
+    // pre-images are kept in a ring of blocks in a file next to the pool,
+    // the oldest snapshots are dropped to make room for a new one.
+    class SnapshotHistory {
+    public:
+        static const size_t kMaxSnapshots = 64;
+
+        static std::string GetPath(const char *pool_path) {
+            return std::string(pool_path) + ".history";
+        }
+
+        // Pre-images are blocks of 1 << block_shift bytes, those of an
+        // opened history have to be of the same size
+        static SnapshotHistory *Create(const char *path, size_t nr_snapshots, size_t capacity,
+                                       size_t block_shift);
+
+        static SnapshotHistory *Open(const char *path, size_t block_shift);
+
+        ~SnapshotHistory() {}
+
+        // Drops the snapshot of a checkpoint that has not been committed and
+        // the snapshots consumed by a committed rollback. Called before the
+        // recovery of the image, which commits an epoch of its own.
+        void recover(uint64_t committed_epoch);
+
+        // Starts the snapshot of epoch, filled with at most max_blocks
+        // pre-images by the checkpoint that commits epoch + 1. If they do
+        // not fit, every snapshot is dropped and false is returned.
+        bool begin_snapshot(uint64_t epoch, uint64_t max_blocks);
+
+        inline bool is_recording() const {
+            return recording;
+        }
+
+        // May be called by several threads, each fences before the snapshot
+        // is committed. A null pre_image records a block of zeros.
+        void record(uint64_t block_id, void *pre_image);
+
+        // Persisted before the image commits epoch + 1, the snapshot is
+        // retained once it has
+        void commit_snapshot();
+
+        // Epochs of the retained snapshots, newest first
+        size_t get_snapshots(uint64_t *epochs, size_t max_epochs);
+
+        bool has_snapshot(uint64_t epoch);
+
+        // Calls restore(block_id, pre_image) for the snapshots from the
+        // newest one down to the one of epoch, so the last pre-image of each
+        // block is the oldest one. pre_image is null for a block of zeros.
+        void for_each_pre_image(uint64_t epoch,
+                                const std::function<void(uint64_t, const uint8_t *)> &restore);
+
+        // The snapshots from epoch on are dropped once the image commits
+        // commit_epoch, see recover()
+        void begin_rollback(uint64_t epoch, uint64_t commit_epoch);
+
+        inline uint64_t get_nr_snapshots() const {
+            return get_count(header->window);
+        }
+
+    private:
+        // Set in the block id of a pre-image of zeros, whose entry is left
+        // unwritten
+        const static uint64_t kZeroPreImage = 1ull << 63;
+
+        SnapshotHistory() : header(nullptr), block_ids(nullptr), blocks(nullptr), block_size(0),
+                            recording(false), pending_start(0), pending_epoch(0),
+                            reserved_blocks(0), recorded_blocks(0) {}
+
+        struct Snapshot {
+            uint64_t epoch;
+            uint64_t commit_epoch;
+            uint64_t start;
+            uint64_t nr_blocks;
+        };
+
+        struct Header {
+            uint32_t magic;
+            // Zero in histories that predate it, which have default blocks
+            uint32_t block_shift;
+            uint64_t nr_slots;
+            uint64_t nr_entries;
+            // The oldest slot in the low half, the number of snapshots in
+            // the high half, so that both change with one store
+            uint64_t window;
+            uint64_t rollback_epoch;
+            uint64_t rollback_commit_epoch;
+            uint64_t padding[2];
+            Snapshot slots[kMaxSnapshots];
+        };
+
+        static size_t CalculateFileSize(size_t nr_entries, size_t block_size);
+
+        static inline uint64_t get_first(uint64_t window) {
+            return window & UINT32_MAX;
+        }
+
+        static inline uint64_t get_count(uint64_t window) {
+            return window >> 32;
+        }
+
+        static inline uint64_t make_window(uint64_t first, uint64_t count) {
+            return first | (count << 32);
+        }
+
+        void setup_layout();
+
+        inline Snapshot &get_slot(uint64_t window, uint64_t index) {
+            return header->slots[(get_first(window) + index) % header->nr_slots];
+        }
+
+        void set_window(uint64_t window);
+
+    private:
+        FileSystem fs;
+        Header *header;
+        uint64_t *block_ids;
+        uint8_t *blocks;
+        size_t block_size;
+
+        // The snapshot being recorded, in DRAM until it is committed
+        bool recording;
+        uint64_t pending_start;
+        uint64_t pending_epoch;
+        uint64_t reserved_blocks;
+        std::atomic<uint64_t> recorded_blocks;
+    };
+}
+
+#endif //LIBCRPM_SNAPSHOT_HISTORY_H
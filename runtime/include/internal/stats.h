@@ -0,0 +1,79 @@
+//
+// Ring buffer of per-checkpoint statistics, shared by the engines.
+//
+
+#ifndef LIBCRPM_STATS_H
+#define LIBCRPM_STATS_H
+
+#include <mutex>
+#include <algorithm>
+
+#include "crpm.h"
+
+namespace crpm {
+    class CheckpointStatsHistory {
+    public:
+        const static size_t kCapacity = CRPM_STATS_HISTORY_CAPACITY;
+
+        CheckpointStatsHistory() : next_epoch(1), nr_records(0) {}
+
+        // Assign the epoch of the record and append it, returns the epoch
+        uint64_t append(const CheckpointStats &stats) {
+            std::lock_guard<std::mutex> guard(mutex);
+            CheckpointStats &slot = records[nr_records % kCapacity];
+            slot = stats;
+            slot.epoch = next_epoch++;
+            nr_records++;
+            return slot.epoch;
+        }
+
+        // Called once the background write-back of the epoch has completed.
+        // Records that have been dropped from the ring are left alone.
+        void complete_background(uint64_t epoch, uint64_t bytes_copied, uint64_t evictions,
+                                 uint64_t full_copies, uint64_t eliminated_lines, double lag_ms) {
+            std::lock_guard<std::mutex> guard(mutex);
+            size_t count = std::min(nr_records, (uint64_t) kCapacity);
+            for (size_t i = 0; i < count; ++i) {
+                CheckpointStats &slot = records[(nr_records - 1 - i) % kCapacity];
+                if (slot.epoch == epoch) {
+                    slot.background_bytes_copied += bytes_copied;
+                    slot.back_segment_evictions += evictions;
+                    slot.full_segment_copies += full_copies;
+                    slot.eliminated_lines += eliminated_lines;
+                    slot.cleaner_lag_ms = lag_ms;
+                    slot.background_completed = true;
+                    return;
+                }
+            }
+        }
+
+        size_t get(CheckpointStats *output, size_t max_records) {
+            std::lock_guard<std::mutex> guard(mutex);
+            size_t count = std::min(std::min(nr_records, (uint64_t) kCapacity), (uint64_t) max_records);
+            for (size_t i = 0; i < count; ++i) {
+                output[i] = records[(nr_records - 1 - i) % kCapacity];
+            }
+            return count;
+        }
+
+        // Checkpoints appended since the last reset
+        uint64_t get_nr_records() {
+            std::lock_guard<std::mutex> guard(mutex);
+            return nr_records;
+        }
+
+        // Epochs keep increasing across resets
+        void reset() {
+            std::lock_guard<std::mutex> guard(mutex);
+            nr_records = 0;
+        }
+
+    private:
+        std::mutex mutex;
+        uint64_t next_epoch;
+        uint64_t nr_records;
+        CheckpointStats records[kCapacity];
+    };
+}
+
+#endif //LIBCRPM_STATS_H
@@ -0,0 +1,49 @@
+//
+// Runtime-owned threads for the parallel phases of a checkpoint.
+//
+
+#ifndef LIBCRPM_WORKER_POOL_H
+#define LIBCRPM_WORKER_POOL_H
+
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+namespace crpm {
+    class WorkerPool {
+    public:
+        typedef std::function<void(int tid, int nr_threads)> Task;
+
+        WorkerPool();
+
+        ~WorkerPool();
+
+        // Start nr_threads - 1 workers bound to the NUMA node closest to
+        // local_addr, the caller of run() acts as thread 0
+        bool start(int nr_threads, const void *local_addr);
+
+        int get_nr_threads() const { return nr_threads; }
+
+        // Run task(tid, nr_threads) on all threads and wait for completion
+        void run(const Task &task);
+
+    private:
+        static void WorkerRoutine(WorkerPool *pool, int tid, int socket);
+
+    private:
+        int nr_threads;
+        std::vector<std::thread> workers;
+        std::mutex run_mutex;
+        std::mutex mutex;
+        std::condition_variable start_condvar;
+        std::condition_variable done_condvar;
+        const Task *current_task;
+        uint64_t generation;
+        int nr_running;
+        bool running;
+    };
+}
+
+#endif //LIBCRPM_WORKER_POOL_H
@@ -31,7 +31,7 @@ namespace crpm {
     }
 
     void HookLRMallocAllocator::setup_metadata() {
-        uint64_t nr_superblocks = engine->get_capacity() / kSuperBlockSize;
+        uint64_t nr_superblocks = engine->get_max_capacity() / kSuperBlockSize;
         uint64_t offset = RoundUp(sizeof(Metadata), kPageSize);
 
         metadata = (Metadata *) engine->get_address();
@@ -54,7 +54,10 @@ namespace crpm {
         metadata->first_sb = (char *) engine->get_address(offset);
 
         void *new_sb = nullptr;
-        int res = bulk_allocate(&new_sb, kPageSize, kMinAllocateSuperBlockSize);
+        int res;
+        do {
+            res = bulk_allocate(&new_sb, kPageSize, kMinAllocateSuperBlockSize);
+        } while (res == -EAGAIN);
         if (res) {
             fprintf(stderr, "allocate superblock failed!\n");
             exit(EXIT_FAILURE);
@@ -424,8 +427,11 @@ namespace crpm {
         uint64_t address_limit = (uint64_t) engine->get_address() +
                                  engine->get_capacity();
 
-        if ((uint64_t) new_bulk_tail > address_limit)
-            return -ENOMEM;
+        if ((uint64_t) new_bulk_tail > address_limit) {
+            // A growable pool is extended and the caller retries
+            uint64_t min_capacity = (uint64_t) new_bulk_tail - (uint64_t) engine->get_address();
+            return engine->grow(min_capacity) ? -EAGAIN : -ENOMEM;
+        }
 
         if (metadata->bulk_tail.compare_exchange_strong(old_bulk_tail, new_bulk_tail)) {
             *mem_ptr = res;
@@ -3,99 +3,236 @@
 //
 
 #include <sys/mman.h>
-#include <thread>
+#include <atomic>
+#include <algorithm>
 #include "internal/checkpoint.h"
+#include "internal/worker_pool.h"
 
 namespace crpm {
     thread_local bool segment_state_update = false;
 
-    size_t CheckpointImage::CalculateHeaderSize(size_t nr_main_segments, size_t nr_back_segments) {
+    template<size_t BlockShift, size_t SegmentShift>
+    size_t BasicCheckpointImage<BlockShift, SegmentShift>::CalculateHeaderSize(
+            size_t nr_main_segments, size_t nr_back_segments, uint32_t magic) {
         size_t header_size =
                 RoundUp(sizeof(Header), kCacheLineSize) +
                 RoundUp(sizeof(uint8_t) * nr_main_segments, kCacheLineSize) * 2 +
                 RoundUp(sizeof(uint64_t) * nr_back_segments, kCacheLineSize);
+        if (magic != kMetadataV2Magic) {
+            header_size += RoundUp(sizeof(ExtentTable), kCacheLineSize);
+        }
+        if (magic >= kMetadataV4Magic) {
+            header_size += sizeof(uint64_t) * kMissingWordsPerSegment * nr_back_segments;
+        }
+        if (magic >= kMetadataV5Magic) {
+            header_size += RoundUp(sizeof(uint8_t) * nr_main_segments, kCacheLineSize);
+        }
         return RoundUp(header_size, kHugePageSize) * 2;
     }
 
-    size_t CheckpointImage::CalculateFileSize(size_t nr_main_segments, size_t nr_back_segments) {
+    template<size_t BlockShift, size_t SegmentShift>
+    size_t BasicCheckpointImage<BlockShift, SegmentShift>::CalculateHeaderSize(size_t nr_main_segments,
+                                                                               size_t nr_back_segments) {
+        return CalculateHeaderSize(nr_main_segments, nr_back_segments, kMetadataV2Magic);
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    size_t BasicCheckpointImage<BlockShift, SegmentShift>::CalculateFileSize(size_t nr_main_segments,
+                                                                             size_t nr_back_segments) {
         return CalculateHeaderSize(nr_main_segments, nr_back_segments) +
                (nr_main_segments + nr_back_segments) * kSegmentSize +
                (nr_main_segments + nr_back_segments) * kParitySize;
     }
 
-    CheckpointImage *CheckpointImage::Open(void *addr, size_t nr_main_segments,
-                                           size_t nr_back_segments, bool initialize) {
+    template<size_t BlockShift, size_t SegmentShift>
+    size_t BasicCheckpointImage<BlockShift, SegmentShift>::CalculateGrowableHeaderSize(size_t max_main_segments,
+                                                                                       size_t max_back_segments) {
+        return CalculateHeaderSize(max_main_segments, max_back_segments, kMetadataV5Magic);
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    size_t BasicCheckpointImage<BlockShift, SegmentShift>::CalculateReservedSize(size_t max_main_segments,
+                                                                                 size_t max_back_segments) {
+        return CalculateGrowableHeaderSize(max_main_segments, max_back_segments) +
+               (max_main_segments + max_back_segments) * kSegmentSize;
+    }
+
+    // Extents start at huge page boundaries of the file, so that each part
+    // can be mapped on its own
+    template<size_t BlockShift, size_t SegmentShift>
+    size_t BasicCheckpointImage<BlockShift, SegmentShift>::CalculateExtentSize(size_t nr_main_segments,
+                                                                               size_t nr_back_segments) {
+        return RoundUp((nr_main_segments + nr_back_segments) * (kSegmentSize + kParitySize),
+                       kHugePageSize);
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    bool BasicCheckpointImage<BlockShift, SegmentShift>::GetGrowableLayout(const void *prefix, size_t &header_size,
+                                                                           size_t &reserved_size) {
+        const Header *header = (const Header *) prefix;
+        if (header->magic < kMetadataV3Magic || header->magic > kMetadataV5Magic) {
+            return false;
+        }
+        header_size = CalculateHeaderSize(header->max_main_segments, header->max_back_segments,
+                                          header->magic);
+        reserved_size = header_size +
+                        (header->max_main_segments + header->max_back_segments) * kSegmentSize;
+        return true;
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    bool BasicCheckpointImage<BlockShift, SegmentShift>::GetGeometry(const void *prefix, size_t &block_shift,
+                                                                     size_t &segment_shift) {
+        static_assert(sizeof(Header) <= kCacheLineSize, "header exceeds the inspected prefix");
+        const Header *header = (const Header *) prefix;
+        if (header->magic < kMetadataV2Magic || header->magic > kMetadataV5Magic) {
+            return false;
+        }
+        block_shift = header->block_shift ? header->block_shift : crpm::kBlockShift;
+        segment_shift = header->segment_shift ? header->segment_shift : crpm::kSegmentShift;
+        return true;
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void BasicCheckpointImage<BlockShift, SegmentShift>::setup_layout(void *addr, uint32_t magic) {
+        uint64_t offset = RoundUp(sizeof(Header), kCacheLineSize);
+        segment_state[0] = (uint8_t *) addr + offset;
+        offset += RoundUp(sizeof(uint8_t) * max_main_segments, kCacheLineSize);
+        segment_state[1] = (uint8_t *) addr + offset;
+        offset += RoundUp(sizeof(uint8_t) * max_main_segments, kCacheLineSize);
+        back_to_main = (uint64_t *) ((uintptr_t) addr + offset);
+        offset += RoundUp(sizeof(uint64_t) * max_back_segments, kCacheLineSize);
+        if (magic != kMetadataV2Magic) {
+            extent_table = (ExtentTable *) ((uintptr_t) addr + offset);
+            offset += RoundUp(sizeof(ExtentTable), kCacheLineSize);
+        }
+        if (magic >= kMetadataV4Magic) {
+            back_missing = (uint64_t *) ((uintptr_t) addr + offset);
+            offset += sizeof(uint64_t) * kMissingWordsPerSegment * max_back_segments;
+        }
+        if (magic >= kMetadataV5Magic) {
+            segment_diverged = (uint8_t *) addr + offset;
+            offset += RoundUp(sizeof(uint8_t) * max_main_segments, kCacheLineSize);
+        }
+        offset = RoundUp(offset, kHugePageSize);
+        header_size = offset;
+        header_shadow = (uint8_t *) addr + offset;
+        offset *= 2;
+        main_memory = (uint8_t *) addr + offset;
+        offset += max_main_segments * kSegmentSize;
+        back_memory = (uint8_t *) addr + offset;
+        offset += max_back_segments * kSegmentSize;
+        parity_memory = (uint8_t *) addr + offset;
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    BasicCheckpointImage<BlockShift, SegmentShift> *BasicCheckpointImage<BlockShift, SegmentShift>::Open(
+            void *addr, size_t nr_main_segments, size_t nr_back_segments, bool initialize, size_t max_main_segments,
+            size_t max_back_segments) {
         Header *header = (Header *) addr;
         if (!header) {
             fprintf(stderr, "addr is nullptr\n");
             return nullptr;
         }
 
-        CheckpointImage *obj = new CheckpointImage();
+        BasicCheckpointImage *obj = new BasicCheckpointImage();
+        obj->header = header;
+        size_t block_shift, segment_shift;
 
         if (initialize) {
-            uint64_t offset = RoundUp(sizeof(Header), kCacheLineSize);
+            bool growable = (max_main_segments > nr_main_segments ||
+                             max_back_segments > nr_back_segments);
+            if (!growable) {
+                max_main_segments = nr_main_segments;
+                max_back_segments = nr_back_segments;
+            }
 
+            uint32_t magic = growable ? kMetadataV5Magic : kMetadataV2Magic;
             memset(header, 0, sizeof(Header));
-            header->magic = kMetadataV2Magic;
+            header->magic = magic;
             header->nr_main_segments = nr_main_segments;
             header->nr_back_segments = nr_back_segments;
+            if (growable) {
+                header->max_main_segments = max_main_segments;
+                header->max_back_segments = max_back_segments;
+            }
+            header->block_shift = kBlockShift;
+            header->segment_shift = kSegmentShift;
+
+            obj->max_main_segments = max_main_segments;
+            obj->max_back_segments = max_back_segments;
+            obj->setup_layout(addr, magic);
 
-            obj->header = header;
-            obj->segment_state[0] = (uint8_t *) addr + offset;
-            offset += RoundUp(sizeof(uint8_t) * nr_main_segments, kCacheLineSize);
-            obj->segment_state[1] = (uint8_t *) addr + offset;
-            offset += RoundUp(sizeof(uint8_t) * nr_main_segments, kCacheLineSize);
-            obj->back_to_main = (uint64_t *) ((uintptr_t) addr + offset);
-            offset += RoundUp(sizeof(uint64_t) * nr_back_segments, kCacheLineSize);
-            offset = RoundUp(offset, kHugePageSize);
-            obj->header_size = offset;
-            obj->header_shadow = (uint8_t *) addr + offset;
-            offset *= 2;
-            obj->main_memory = (uint8_t *) addr + offset;
-            offset += nr_main_segments * kSegmentSize;
-            obj->back_memory = (uint8_t *) addr + offset;
-            offset += nr_back_segments * kSegmentSize;
-            obj->parity_memory = (uint8_t *) addr + offset;
-
-            memset(obj->segment_state[0], SS_Initial, nr_main_segments);
-            memset(obj->segment_state[1], SS_Initial, nr_main_segments);
+            memset(obj->segment_state[0], SS_Initial, max_main_segments);
+            memset(obj->segment_state[1], SS_Initial, max_main_segments);
             // memset(obj->back_to_main, UINT8_MAX, nr_back_segments * sizeof(uint64_t));
             for (int i = 0; i < nr_back_segments; ++i) {
                 obj->back_to_main[i] = i;
             }
-            FlushRegion(header, CalculateHeaderSize(nr_main_segments, nr_back_segments));
+            if (growable) {
+                for (uint64_t i = nr_back_segments; i < max_back_segments; ++i) {
+                    obj->back_to_main[i] = kNullSegmentIndex;
+                }
+                memset(obj->extent_table, 0, sizeof(ExtentTable));
+                obj->extent_table->extents[0].file_offset = obj->header_size * 2;
+                obj->extent_table->extents[0].nr_main_segments = nr_main_segments;
+                obj->extent_table->extents[0].nr_back_segments = nr_back_segments;
+                obj->extent_table->nr_extents = 1;
+                // The back segments bound at creation hold zeros like their
+                // main segments, every block is present
+                memset(obj->back_missing, 0,
+                       sizeof(uint64_t) * kMissingWordsPerSegment * max_back_segments);
+                memset(obj->segment_diverged, 0, max_main_segments);
+            }
+            FlushRegion(header, CalculateHeaderSize(max_main_segments, max_back_segments, magic));
             StoreFence();
-        } else {
-            if (header->magic != kMetadataV2Magic) {
-                fprintf(stderr, "magic number mismatch\n");
+        } else if (GetGeometry(header, block_shift, segment_shift) &&
+                   (block_shift != kBlockShift || segment_shift != kSegmentShift)) {
+            fprintf(stderr, "geometry mismatch\n");
+            delete obj;
+            return nullptr;
+        } else if (header->magic == kMetadataV2Magic) {
+            obj->max_main_segments = header->nr_main_segments;
+            obj->max_back_segments = header->nr_back_segments;
+            obj->setup_layout(addr, kMetadataV2Magic);
+        } else if (header->magic >= kMetadataV3Magic && header->magic <= kMetadataV5Magic) {
+            obj->max_main_segments = header->max_main_segments;
+            obj->max_back_segments = header->max_back_segments;
+            obj->setup_layout(addr, header->magic);
+
+            // A growth may have been interrupted after its extent was
+            // committed, so the sizes are derived from the extent table
+            ExtentTable *extent_table = obj->extent_table;
+            if (extent_table->nr_extents == 0 || extent_table->nr_extents > kMaxExtents) {
+                fprintf(stderr, "extent table corrupted\n");
+                delete obj;
+                return nullptr;
+            }
+            nr_main_segments = nr_back_segments = 0;
+            for (uint64_t i = 0; i < extent_table->nr_extents; ++i) {
+                nr_main_segments += extent_table->extents[i].nr_main_segments;
+                nr_back_segments += extent_table->extents[i].nr_back_segments;
+            }
+            if (nr_main_segments > obj->max_main_segments || nr_back_segments > obj->max_back_segments) {
+                fprintf(stderr, "extent table corrupted\n");
+                delete obj;
                 return nullptr;
             }
+            if (header->nr_main_segments != nr_main_segments ||
+                header->nr_back_segments != nr_back_segments) {
+                NTStore(&header->nr_main_segments, nr_main_segments);
+                NTStore(&header->nr_back_segments, nr_back_segments);
+                StoreFence();
+            }
+        } else {
+            fprintf(stderr, "magic number mismatch\n");
+            delete obj;
+            return nullptr;
+        }
 
-            nr_main_segments = header->nr_main_segments;
-            nr_back_segments = header->nr_back_segments;
-            uint64_t offset = RoundUp(sizeof(Header), kCacheLineSize);
-            obj->header = header;
-            obj->segment_state[0] = (uint8_t *) addr + offset;
-            offset += RoundUp(sizeof(uint8_t) * nr_main_segments, kCacheLineSize);
-            obj->segment_state[1] = (uint8_t *) addr + offset;
-            offset += RoundUp(sizeof(uint8_t) * nr_main_segments, kCacheLineSize);
-            obj->back_to_main = (uint64_t *) ((uintptr_t) addr + offset);
-            offset += RoundUp(sizeof(uint64_t) * nr_back_segments, kCacheLineSize);
-            offset = RoundUp(offset, kHugePageSize);
-            obj->header_size = offset;
-            obj->header_shadow = (uint8_t *) addr + offset;
-            offset *= 2;
-            obj->main_memory = (uint8_t *) addr + offset;
-            offset += nr_main_segments * kSegmentSize;
-            obj->back_memory = (uint8_t *) addr + offset;
-            offset += nr_back_segments * kSegmentSize;
-            obj->parity_memory = (uint8_t *) addr + offset;
-        }
-
-        obj->segment_state_dirty = (bool *) malloc(nr_main_segments);
-        obj->main_to_back = (uint64_t *) malloc(nr_main_segments * sizeof(uint64_t));
-        for (uint64_t i = 0; i < header->nr_main_segments; ++i) {
+        obj->segment_state_dirty = (bool *) malloc(obj->max_main_segments);
+        obj->main_to_back = (uint64_t *) malloc(obj->max_main_segments * sizeof(uint64_t));
+        for (uint64_t i = 0; i < obj->max_main_segments; ++i) {
             obj->segment_state_dirty[i] = false;
             obj->main_to_back[i] = kNullSegmentIndex;
         }
@@ -103,6 +240,7 @@ namespace crpm {
         for (uint64_t i = 0; i < header->nr_back_segments; ++i) {
             if (obj->back_to_main[i] != kNullSegmentIndex) {
                 obj->main_to_back[obj->back_to_main[i]] = i;
+                obj->nr_bound_segments++;
             }
         }
 
@@ -110,7 +248,8 @@ namespace crpm {
         return obj;
     }
 
-    CheckpointImage::~CheckpointImage() {
+    template<size_t BlockShift, size_t SegmentShift>
+    BasicCheckpointImage<BlockShift, SegmentShift>::~BasicCheckpointImage() {
         if (has_initialized) {
             free(segment_state_dirty);
             free(main_to_back);
@@ -118,33 +257,58 @@ namespace crpm {
         }
     }
 
-    void CheckpointImage::recovery(uint8_t to_state) {
-#ifdef USE_MULTI_THREADS_RECOVERY
-        const static size_t kThreads = 8;
-        std::thread threads[kThreads];
-        for (int tid = 0; tid < kThreads; tid++) {
-            threads[tid] = std::thread([=]{
-                uint8_t bi_epoch = header->committed_epoch & 1;
-                uint8_t *state = segment_state[bi_epoch];
-                for (uint64_t back_id = tid; back_id < header->nr_back_segments; back_id += kThreads) {
+    template<size_t BlockShift, size_t SegmentShift>
+    uint64_t BasicCheckpointImage<BlockShift, SegmentShift>::recovery(uint8_t to_state, size_t nr_threads) {
+        const static uint64_t kChunkSegments = 16;
+        uint8_t bi_epoch = header->committed_epoch & 1;
+        uint8_t *state = segment_state[bi_epoch];
+        uint64_t nr_back_segments = header->nr_back_segments;
+        if (nr_threads == 0) {
+            int socket = FindLocalSocket(get_main_segment(0));
+            nr_threads = std::max(1, std::min(GetSocketCpuCount(socket), (int) kMaxRecoveryThreads));
+        }
+        nr_threads = std::min<uint64_t>(nr_threads, (nr_back_segments + kChunkSegments - 1) / kChunkSegments);
+
+        // A segment written back since its last store is equal to the
+        // present blocks of its back segment, there is nothing to restore
+        auto need_restore = [&](uint64_t main_id) {
+            return state[main_id] != SS_Back || !segment_diverged || segment_diverged[main_id];
+        };
+
+        std::atomic<uint64_t> cursor(0), traffic(0);
+        auto task = [&](int tid, int nr_workers) {
+            uint64_t local_traffic = 0;
+            for (;;) {
+                uint64_t start = cursor.fetch_add(kChunkSegments, std::memory_order_relaxed);
+                if (start >= nr_back_segments) {
+                    break;
+                }
+                uint64_t stop = std::min(start + kChunkSegments, nr_back_segments);
+                for (uint64_t back_id = start; back_id < stop; ++back_id) {
                     uint64_t main_id = get_back_to_main(back_id);
-                    if (main_id == kNullSegmentIndex || state[main_id] == SS_Initial) {
+                    if (main_id == kNullSegmentIndex || state[main_id] == SS_Initial || !need_restore(main_id)) {
                         continue;
                     }
-                    uint8_t *main_segment = get_main_segment(main_id);
-                    uint8_t *back_segment = get_back_segment(back_id);
-                    if (state[main_id] == SS_Main) {
-                        NonTemporalCopyWithWriteElimination(back_segment, main_segment, kSegmentSize);
-                    } else if (state[main_id] == SS_Back) {
-                        NonTemporalCopyWithWriteElimination(main_segment, back_segment, kSegmentSize);
-                    }
+                    local_traffic += recover_segment(main_id, back_id, state[main_id]);
                 }
-            });
+            }
+            StoreFence();
+            traffic.fetch_add(local_traffic, std::memory_order_relaxed);
+        };
+        if (nr_threads > 1) {
+            // The threads are bound to the NUMA node of the main segments
+            WorkerPool workers;
+            if (workers.start((int) nr_threads, get_main_segment(0))) {
+                workers.run(task);
+            } else {
+                task(0, 1);
+            }
+        } else {
+            task(0, 1);
         }
+
         begin_segment_state_update();
-        uint8_t bi_epoch = header->committed_epoch & 1;
-        uint8_t *state = segment_state[bi_epoch];
-        for (uint64_t back_id = 0; back_id < header->nr_back_segments; ++back_id) {
+        for (uint64_t back_id = 0; back_id < nr_back_segments; ++back_id) {
             uint64_t main_id = get_back_to_main(back_id);
             if (main_id == kNullSegmentIndex || state[main_id] == SS_Initial) {
                 continue;
@@ -153,38 +317,90 @@ namespace crpm {
                 set_segment_state(main_id, to_state);
             }
         }
-        for (int i = 0; i < kThreads; i++) {
-            threads[i].join();
-        }
         commit_segment_state_update();
-#else
+        if (segment_diverged) {
+            for (uint64_t back_id = 0; back_id < nr_back_segments; ++back_id) {
+                uint64_t main_id = get_back_to_main(back_id);
+                if (main_id != kNullSegmentIndex) {
+                    clear_segment_diverged(main_id);
+                }
+            }
+            StoreFence();
+        }
+        return traffic.load(std::memory_order_relaxed);
+    }
+
+    // Returns the number of bytes copied
+    template<size_t BlockShift, size_t SegmentShift>
+    uint64_t BasicCheckpointImage<BlockShift, SegmentShift>::recover_segment(uint64_t main_segment_id,
+                                                                             uint64_t back_segment_id, uint8_t state,
+                                                                             uint8_t *main_view) {
+        const static size_t kWordBytes = 64 * kBlockSize;
+        uint8_t *main_segment = main_view ? main_view : get_main_segment(main_segment_id);
+        uint8_t *back_segment = get_back_segment(back_segment_id);
+        if (state == SS_Main) {
+            if (back_missing) {
+                // The main segment holds the committed data, the back
+                // segment is filled again by copy-on-write
+                mark_back_segment_missing(back_segment_id);
+                return 0;
+            }
+            NonTemporalCopyWithWriteElimination(back_segment, main_segment, kSegmentSize);
+            return kSegmentSize;
+        }
+        if (state != SS_Back) {
+            return 0;
+        }
+        if (!back_missing) {
+            NonTemporalCopyWithWriteElimination(main_segment, back_segment, kSegmentSize);
+            return kSegmentSize;
+        }
         uint64_t traffic = 0;
-        begin_segment_state_update();
-        uint8_t bi_epoch = header->committed_epoch & 1;
-        uint8_t *state = segment_state[bi_epoch];
-        for (uint64_t back_id = 0; back_id < header->nr_back_segments; ++back_id) {
-            uint64_t main_id = get_back_to_main(back_id);
-            if (main_id == kNullSegmentIndex || state[main_id] == SS_Initial) {
+        for (uint64_t i = 0; i < kMissingWordsPerSegment; ++i) {
+            uint64_t present = ~get_missing_blocks(back_segment_id, i);
+            uint8_t *main_base = main_segment + i * kWordBytes;
+            uint8_t *back_base = back_segment + i * kWordBytes;
+            if (present == UINT64_MAX) {
+                NonTemporalCopyWithWriteElimination(main_base, back_base, kWordBytes);
+                traffic += kWordBytes;
                 continue;
             }
-            uint8_t *main_segment = get_main_segment(main_id);
-            uint8_t *back_segment = get_back_segment(back_id);
-            if (state[main_id] == SS_Main) {
-                NonTemporalCopyWithWriteElimination(back_segment, main_segment, kSegmentSize);
-                traffic += kSegmentSize;
-            } else if (state[main_id] == SS_Back) {
-                NonTemporalCopyWithWriteElimination(main_segment, back_segment, kSegmentSize);
-                traffic += kSegmentSize;
-            }
-            if (to_state != state[main_id]) {
-                set_segment_state(main_id, to_state);
+            while (present != 0) {
+                uint64_t t = present & -present;
+                int j = __builtin_ctzll(present); // j == first set index
+                present ^= t;
+                NonTemporalCopyWithWriteElimination(main_base + (j << kBlockShift),
+                                                    back_base + (j << kBlockShift), kBlockSize);
+                traffic += kBlockSize;
             }
         }
-        commit_segment_state_update();
-#endif
+        return traffic;
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    bool BasicCheckpointImage<BlockShift, SegmentShift>::is_recovery_needed(uint64_t main_segment_id) {
+        if (get_main_to_back(main_segment_id) == kNullSegmentIndex) {
+            return false;
+        }
+        uint8_t state = get_segment_state(main_segment_id);
+        if (state == SS_Main) {
+            return true;
+        }
+        return state == SS_Back && (!segment_diverged || segment_diverged[main_segment_id]);
     }
 
-    void CheckpointImage::set_segment_state_atomic(uint64_t segment_id, uint8_t state) {
+    template<size_t BlockShift, size_t SegmentShift>
+    uint64_t BasicCheckpointImage<BlockShift, SegmentShift>::recover_main_segment(uint64_t main_segment_id,
+                                                                                  uint8_t *main_view) {
+        uint64_t back_segment_id = get_main_to_back(main_segment_id);
+        uint8_t state = get_segment_state(main_segment_id);
+        uint64_t traffic = recover_segment(main_segment_id, back_segment_id, state, main_view);
+        StoreFence();
+        return traffic;
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void BasicCheckpointImage<BlockShift, SegmentShift>::set_segment_state_atomic(uint64_t segment_id, uint8_t state) {
         uint32_t bi_epoch = header->committed_epoch & 1;
         uint8_t *slot = &segment_state[bi_epoch][segment_id];
         *slot = state;
@@ -195,17 +411,20 @@ namespace crpm {
         Flush(slot);
     }
 
-    uint8_t CheckpointImage::get_segment_state(uint64_t segment_id) {
+    template<size_t BlockShift, size_t SegmentShift>
+    uint8_t BasicCheckpointImage<BlockShift, SegmentShift>::get_segment_state(uint64_t segment_id) {
         uint32_t bi_epoch = header->committed_epoch & 1;
         uint8_t *slot = &segment_state[bi_epoch][segment_id];
         return *slot;
     }
 
-    void CheckpointImage::begin_segment_state_update() {
+    template<size_t BlockShift, size_t SegmentShift>
+    void BasicCheckpointImage<BlockShift, SegmentShift>::begin_segment_state_update() {
         segment_state_update = true;
     }
 
-    void CheckpointImage::set_segment_state(uint64_t segment_id, uint8_t state) {
+    template<size_t BlockShift, size_t SegmentShift>
+    void BasicCheckpointImage<BlockShift, SegmentShift>::set_segment_state(uint64_t segment_id, uint8_t state) {
         if (!segment_state_update) {
             fprintf(stderr, "illegal instruction\n");
             exit(EXIT_FAILURE);
@@ -215,88 +434,267 @@ namespace crpm {
         uint8_t *slot = &segment_state[1 - bi_epoch][segment_id];
         if (*slot != state) {
             *slot = state;
-            segment_state_dirty[segment_id / kRecordsPerCacheLine] = true;
+            uint64_t line = segment_id / kRecordsPerCacheLine;
+            if (!segment_state_dirty[line]) {
+                segment_state_dirty[line] = true;
+                dirty_state_lines.push_back(line);
+            }
         }
     }
 
-    void CheckpointImage::commit_segment_state_update() {
+    template<size_t BlockShift, size_t SegmentShift>
+    void BasicCheckpointImage<BlockShift, SegmentShift>::commit_segment_state_update() {
         uint32_t next_epoch = header->committed_epoch + 1;
         uint8_t bi_epoch = next_epoch & 1;
         const static size_t kRecordsPerCacheLine = kCacheLineSize / sizeof(uint8_t);
-        for (uint64_t i = 0; i < header->nr_main_segments; i += kRecordsPerCacheLine) {
-            if (segment_state_dirty[i / kRecordsPerCacheLine]) {
-                Flush(&segment_state[bi_epoch][i]);
-            }
+        for (auto line : dirty_state_lines) {
+            Flush(&segment_state[bi_epoch][line * kRecordsPerCacheLine]);
         }
         StoreFence();
+        CrashPoint("commit.state_flushed");
         NTStore(&header->committed_epoch, next_epoch);
         StoreFence();
-        for (uint64_t i = 0; i < header->nr_main_segments; i += kRecordsPerCacheLine) {
-            if (segment_state_dirty[i / kRecordsPerCacheLine]) {
-                NonTemporalCopy64(&segment_state[1 - bi_epoch][i],
-                                  &segment_state[bi_epoch][i],
-                                  kCacheLineSize);
-                segment_state_dirty[i / kRecordsPerCacheLine] = false;
-            }
+        CrashPoint("commit.epoch_committed");
+        for (auto line : dirty_state_lines) {
+            uint64_t i = line * kRecordsPerCacheLine;
+            NonTemporalCopy64(&segment_state[1 - bi_epoch][i],
+                              &segment_state[bi_epoch][i],
+                              kCacheLineSize);
+            segment_state_dirty[line] = false;
         }
+        dirty_state_lines.clear();
         segment_state_update = false;
     }
 
 #ifdef USE_MPI_EXTENSION
-    void CheckpointImage::commit_segment_state_update_for_mpi(MPI_Comm comm) {
+    template<size_t BlockShift, size_t SegmentShift>
+    void BasicCheckpointImage<BlockShift, SegmentShift>::commit_segment_state_update_for_mpi(MPI_Comm comm) {
         uint32_t next_epoch = header->committed_epoch + 1;
         uint8_t bi_epoch = next_epoch & 1;
         const static size_t kRecordsPerCacheLine = kCacheLineSize / sizeof(uint8_t);
-        for (uint64_t i = 0; i < header->nr_main_segments; i += kRecordsPerCacheLine) {
-            if (segment_state_dirty[i / kRecordsPerCacheLine]) {
-                Flush(&segment_state[bi_epoch][i]);
-            }
+        for (auto line : dirty_state_lines) {
+            Flush(&segment_state[bi_epoch][line * kRecordsPerCacheLine]);
         }
         StoreFence();
         NTStore(&header->committed_epoch, next_epoch);
         StoreFence();
         MPI_Barrier(comm); // Inter-process synchronization
-        for (uint64_t i = 0; i < header->nr_main_segments; i += kRecordsPerCacheLine) {
-            if (segment_state_dirty[i / kRecordsPerCacheLine]) {
-                NonTemporalCopy64(&segment_state[1 - bi_epoch][i],
-                                  &segment_state[bi_epoch][i],
-                                  kCacheLineSize);
-                segment_state_dirty[i / kRecordsPerCacheLine] = false;
-            }
+        for (auto line : dirty_state_lines) {
+            uint64_t i = line * kRecordsPerCacheLine;
+            NonTemporalCopy64(&segment_state[1 - bi_epoch][i],
+                              &segment_state[bi_epoch][i],
+                              kCacheLineSize);
+            segment_state_dirty[line] = false;
         }
+        dirty_state_lines.clear();
         segment_state_update = false;
     }
 #endif //USE_MPI_EXTENSION
 
-    uint32_t CheckpointImage::get_attributes() {
+    template<size_t BlockShift, size_t SegmentShift>
+    uint32_t BasicCheckpointImage<BlockShift, SegmentShift>::get_attributes() {
         return header->attributes;
     }
 
-    void CheckpointImage::set_attributes(uint32_t value) {
+    template<size_t BlockShift, size_t SegmentShift>
+    void BasicCheckpointImage<BlockShift, SegmentShift>::set_attributes(uint32_t value) {
         NTStore32(&header->attributes, value);
         StoreFence();
     }
 
-    void CheckpointImage::reset_committed_epoch(uint64_t epoch) {
+    template<size_t BlockShift, size_t SegmentShift>
+    void BasicCheckpointImage<BlockShift, SegmentShift>::reset_committed_epoch(uint64_t epoch) {
         NTStore(&header->committed_epoch, epoch);
         StoreFence();
     }
 
-    uint64_t CheckpointImage::get_back_to_main(uint64_t back_segment_id) {
+    template<size_t BlockShift, size_t SegmentShift>
+    bool BasicCheckpointImage<BlockShift, SegmentShift>::map_extents(
+            const std::function<bool(size_t, size_t, size_t)> &map) {
+        if (!extent_table) {
+            return true; // the file is mapped as a whole
+        }
+        uint64_t main_id = 0, back_id = 0;
+        for (uint64_t i = 0; i < extent_table->nr_extents; ++i) {
+            Extent &extent = extent_table->extents[i];
+            size_t main_length = extent.nr_main_segments * kSegmentSize;
+            size_t back_length = extent.nr_back_segments * kSegmentSize;
+            if (main_length && !map(get_main_segment(main_id) - get_start_address(),
+                                    extent.file_offset, main_length)) {
+                return false;
+            }
+            if (back_length && !map(get_back_segment(back_id) - get_start_address(),
+                                    extent.file_offset + main_length, back_length)) {
+                return false;
+            }
+            main_id += extent.nr_main_segments;
+            back_id += extent.nr_back_segments;
+        }
+        return true;
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    bool BasicCheckpointImage<BlockShift, SegmentShift>::append_extent(uint64_t file_offset, uint64_t nr_main_segments,
+                                                                       uint64_t nr_back_segments) {
+        if (!extent_table || extent_table->nr_extents == kMaxExtents) {
+            return false;
+        }
+        const uint64_t main_start = header->nr_main_segments;
+        const uint64_t back_start = header->nr_back_segments;
+        if (main_start + nr_main_segments > max_main_segments ||
+            back_start + nr_back_segments > max_back_segments) {
+            return false;
+        }
+
+        // The slots may hold leftovers of a growth that was not committed.
+        // Like at creation, the new back segments are bound to the new main
+        // segments one by one.
+        memset(&segment_state[0][main_start], SS_Initial, nr_main_segments);
+        memset(&segment_state[1][main_start], SS_Initial, nr_main_segments);
+        FlushRegion(&segment_state[0][main_start], nr_main_segments);
+        FlushRegion(&segment_state[1][main_start], nr_main_segments);
+        if (segment_diverged) {
+            memset(&segment_diverged[main_start], 0, nr_main_segments);
+            FlushRegion(&segment_diverged[main_start], nr_main_segments);
+        }
+        for (uint64_t i = 0; i < nr_back_segments; ++i) {
+            back_to_main[back_start + i] = (i < nr_main_segments) ? main_start + i : kNullSegmentIndex;
+        }
+        FlushRegion(&back_to_main[back_start], nr_back_segments * sizeof(uint64_t));
+        if (back_missing) {
+            uint64_t *missing = &back_missing[back_start * kMissingWordsPerSegment];
+            size_t missing_size = nr_back_segments * kMissingWordsPerSegment * sizeof(uint64_t);
+            memset(missing, 0, missing_size);
+            FlushRegion(missing, missing_size);
+        }
+
+        uint64_t nr_extents = extent_table->nr_extents;
+        Extent &extent = extent_table->extents[nr_extents];
+        extent.file_offset = file_offset;
+        extent.nr_main_segments = nr_main_segments;
+        extent.nr_back_segments = nr_back_segments;
+        FlushRegion(&extent, sizeof(Extent));
+        StoreFence();
+        CrashPoint("grow.extent_written");
+        NTStore(&extent_table->nr_extents, nr_extents + 1);
+        StoreFence();
+        CrashPoint("grow.extent_committed");
+
+        for (uint64_t i = 0; i < nr_back_segments && i < nr_main_segments; ++i) {
+            main_to_back[main_start + i] = back_start + i;
+            nr_bound_segments++;
+        }
+        NTStore(&header->nr_back_segments, back_start + nr_back_segments);
+        NTStore(&header->nr_main_segments, main_start + nr_main_segments);
+        StoreFence();
+        return true;
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    uint64_t BasicCheckpointImage<BlockShift, SegmentShift>::get_file_size() {
+        if (!extent_table) {
+            return CalculateFileSize(header->nr_main_segments, header->nr_back_segments);
+        }
+        Extent &extent = extent_table->extents[extent_table->nr_extents - 1];
+        return extent.file_offset + CalculateExtentSize(extent.nr_main_segments, extent.nr_back_segments);
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    uint64_t BasicCheckpointImage<BlockShift, SegmentShift>::get_back_to_main(uint64_t back_segment_id) {
         return back_to_main[back_segment_id];
     }
 
-    uint64_t CheckpointImage::get_main_to_back(uint64_t main_segment_id) {
+    template<size_t BlockShift, size_t SegmentShift>
+    uint64_t BasicCheckpointImage<BlockShift, SegmentShift>::get_main_to_back(uint64_t main_segment_id) {
         return main_to_back[main_segment_id];
     }
 
-    void CheckpointImage::bind_back_segment(uint64_t main_segment_id, uint64_t back_segment_id) {
+    template<size_t BlockShift, size_t SegmentShift>
+    void BasicCheckpointImage<BlockShift, SegmentShift>::mark_back_segment_missing(uint64_t back_segment_id) {
+        uint64_t *missing = &back_missing[back_segment_id * kMissingWordsPerSegment];
+        memset(missing, 0xff, kMissingWordsPerSegment * sizeof(uint64_t));
+        FlushRegion(missing, kMissingWordsPerSegment * sizeof(uint64_t));
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void BasicCheckpointImage<BlockShift, SegmentShift>::mark_back_block_present(uint64_t back_segment_id,
+                                                                                 uint64_t block_index) {
+        uint64_t *word = &back_missing[back_segment_id * kMissingWordsPerSegment + block_index / 64];
+        uint64_t bit = 1ull << (block_index % 64);
+        if (__atomic_fetch_and(word, ~bit, __ATOMIC_RELAXED) & bit) {
+            Flush(word);
+        }
+    }
+
+    // The old main segment must hold its committed data. The back segment
+    // of a block granular image is emptied before the binding is persisted,
+    // instead of copying the new main segment into it.
+    template<size_t BlockShift, size_t SegmentShift>
+    void BasicCheckpointImage<BlockShift, SegmentShift>::set_segment_diverged(uint64_t segment_id) {
+        if (!segment_diverged || segment_diverged[segment_id]) {
+            return;
+        }
+        segment_diverged[segment_id] = 1;
+        Flush(&segment_diverged[segment_id]);
+        StoreFence();
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void BasicCheckpointImage<BlockShift, SegmentShift>::clear_segment_diverged(uint64_t segment_id) {
+        if (!segment_diverged || !segment_diverged[segment_id]) {
+            return;
+        }
+        segment_diverged[segment_id] = 0;
+        Flush(&segment_diverged[segment_id]);
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void BasicCheckpointImage<BlockShift, SegmentShift>::bind_back_segment(uint64_t main_segment_id,
+                                                                           uint64_t back_segment_id) {
+        if (back_missing) {
+            mark_back_segment_missing(back_segment_id);
+            StoreFence();
+        }
         uint64_t old_main_segment_id = back_to_main[back_segment_id];
         if (old_main_segment_id != kNullSegmentIndex) {
             main_to_back[old_main_segment_id] = kNullSegmentIndex;
+            nr_bound_segments--;
         }
         NTStore(&back_to_main[back_segment_id], main_segment_id);
         main_to_back[main_segment_id] = back_segment_id;
+        nr_bound_segments++;
+        StoreFence();
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void BasicCheckpointImage<BlockShift, SegmentShift>::unbind_back_segment(uint64_t back_segment_id) {
+        uint64_t old_main_segment_id = back_to_main[back_segment_id];
+        if (old_main_segment_id == kNullSegmentIndex) {
+            return;
+        }
+        NTStore(&back_to_main[back_segment_id], kNullSegmentIndex);
         StoreFence();
+        main_to_back[old_main_segment_id] = kNullSegmentIndex;
+        nr_bound_segments--;
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    uint64_t BasicCheckpointImage<BlockShift, SegmentShift>::get_back_file_offset(uint64_t back_segment_id) {
+        if (!extent_table) {
+            return get_back_segment(back_segment_id) - get_start_address();
+        }
+        for (uint64_t i = 0; i < extent_table->nr_extents; ++i) {
+            Extent &extent = extent_table->extents[i];
+            if (back_segment_id < extent.nr_back_segments) {
+                return extent.file_offset + (extent.nr_main_segments + back_segment_id) * kSegmentSize;
+            }
+            back_segment_id -= extent.nr_back_segments;
+        }
+        return UINT64_MAX;
     }
-}
\ No newline at end of file
+
+#define CRPM_INSTANTIATE_IMAGE(block_shift, segment_shift) \
+    template class BasicCheckpointImage<block_shift, segment_shift>;
+
+    CRPM_FOR_EACH_GEOMETRY(CRPM_INSTANTIATE_IMAGE)
+}
@@ -2,16 +2,85 @@
 // Created by Feng Ren on 2021/1/23.
 //
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <ctime>
+#include <thread>
 #include <pthread.h>
 #include <numa.h>
+#include <numaif.h>
 #include "internal/common.h"
 
 namespace crpm {
     volatile bool g_bitmap[kMaxThreads] = {false};
     thread_local ThreadInfo tl_thread_info;
 
+    PersistMode g_persist_mode = PERSIST_DAX;
+    std::atomic<uint64_t> g_persist_flushes(0), g_persist_fences(0), g_persist_wbinvds(0);
+    static bool g_persist_mode_assigned = false;
+    thread_local uint64_t tl_nr_fences = 0;
+
+    bool SetPersistMode(const std::string &name) {
+        PersistMode mode;
+        if (name == "default" || name == "dax") {
+            mode = PERSIST_DAX;
+        } else if (name == "msync") {
+            mode = PERSIST_MSYNC;
+        } else if (name == "emulated") {
+            mode = PERSIST_EMULATED;
+        } else {
+            fprintf(stderr, "unsupported persist mode %s\n", name.c_str());
+            return false;
+        }
+        if (g_crash_simulation && mode != PERSIST_EMULATED) {
+            fprintf(stderr, "crash simulation requires emulated persist mode\n");
+            return false;
+        }
+        if (g_persist_mode_assigned && g_persist_mode != mode && HasMappedFiles()) {
+            fprintf(stderr, "persist mode %s differs from the mode of the open pools\n", name.c_str());
+            return false;
+        }
+        g_persist_mode = mode;
+        g_persist_mode_assigned = true;
+        g_track_persist_ranges = g_crash_simulation || mode == PERSIST_MSYNC;
+        return true;
+    }
+
+    PersistCounters GetPersistCounters() {
+        PersistCounters counters;
+        counters.nr_flushes = g_persist_flushes.load(std::memory_order_relaxed);
+        counters.nr_fences = g_persist_fences.load(std::memory_order_relaxed);
+        counters.nr_wbinvds = g_persist_wbinvds.load(std::memory_order_relaxed);
+        return counters;
+    }
+
+    void ResetPersistCounters() {
+        g_persist_flushes.store(0, std::memory_order_relaxed);
+        g_persist_fences.store(0, std::memory_order_relaxed);
+        g_persist_wbinvds.store(0, std::memory_order_relaxed);
+    }
+
+    static double CalibrateTSCFrequency() {
+        const static uint64_t kCalibrateNanoseconds = 10000000;
+        struct timespec start_ts, now_ts;
+        clock_gettime(CLOCK_MONOTONIC, &start_ts);
+        uint64_t start_clock = ReadTSC();
+        uint64_t elapsed;
+        do {
+            clock_gettime(CLOCK_MONOTONIC, &now_ts);
+            elapsed = (now_ts.tv_sec - start_ts.tv_sec) * 1000000000ull
+                      + now_ts.tv_nsec - start_ts.tv_nsec;
+        } while (elapsed < kCalibrateNanoseconds);
+        uint64_t stop_clock = ReadTSC();
+        return (stop_clock - start_clock) * 1000000.0 / elapsed;
+    }
+
+    double GetTSCFrequency() {
+        static double frequency = CalibrateTSCFrequency();
+        return frequency;
+    }
+
     ThreadInfo::ThreadInfo() noexcept {
         for (int i = 0; i < kMaxThreads; i++) {
             if (!g_bitmap[i]) {
@@ -30,22 +99,120 @@ namespace crpm {
         g_bitmap[id] = false;
     }
 
-    void AtomicBitSet::allocate(uint64_t nr_bits_) {
+    void AtomicBitSet::allocate(uint64_t nr_bits_, uint64_t max_bits_) {
         assert(!is_allocated);
-        nr_bits = nr_bits_;
-        uint64_t nr_bytes = nr_bits_ / kBitWidth * sizeof(uint64_t);
-        if (nr_bits_ % kBitWidth) {
+        nr_bits.store(nr_bits_, std::memory_order_relaxed);
+        max_bits = std::max(nr_bits_, max_bits_);
+        uint64_t nr_bytes = max_bits / kBitWidth * sizeof(uint64_t);
+        if (max_bits % kBitWidth) {
             nr_bytes += sizeof(uint64_t);
         }
-        buf = (std::atomic<uint64_t> *) malloc(nr_bytes);
-        if (!buf) {
-            perror("malloc");
+        // Pages of the reserved part stay untouched until the set grows
+        buf = (std::atomic<uint64_t> *) calloc(nr_bytes, 1);
+        // Padded for the vector loads of find_next_group()
+        uint64_t nr_groups = RoundUp((max_bits + kGroupBits - 1) >> kGroupShift, 8);
+        summary = (std::atomic<uint64_t> *) calloc(nr_groups, sizeof(uint64_t));
+        if (!buf || !summary) {
+            perror("calloc");
             exit(EXIT_FAILURE);
         }
-        memset(buf, 0, nr_bytes);
         is_allocated = true;
     }
 
+    void AtomicBitSet::clear_region(uint64_t start_idx, uint64_t end_idx) {
+        if (start_idx >= end_idx) {
+            return;
+        }
+        uint64_t start_idx_off = start_idx >> kBitShift;
+        uint64_t last_idx_off = (end_idx - 1) >> kBitShift;
+        uint64_t start_mask = ~0ull << (start_idx & kBitMask);
+        uint64_t last_mask = ~0ull >> (kBitMask - ((end_idx - 1) & kBitMask));
+        if (start_idx_off == last_idx_off) {
+            start_mask &= last_mask;
+            last_mask = ~0ull;
+        }
+        uint64_t full_start_off = start_idx_off, full_stop_off = last_idx_off + 1;
+        if (start_mask != ~0ull) {
+            buf[start_idx_off].fetch_and(~start_mask, std::memory_order_relaxed);
+            full_start_off++;
+        }
+        if (last_mask != ~0ull) {
+            buf[last_idx_off].fetch_and(~last_mask, std::memory_order_relaxed);
+            full_stop_off--;
+        }
+
+        for (uint64_t idx_off = full_start_off; idx_off < full_stop_off;) {
+            uint64_t group = idx_off >> kBitShift;
+            uint64_t group_stop_off = std::min(full_stop_off, (group + 1) << kBitShift);
+            uint64_t mask = ~0ull << (idx_off & kBitMask);
+            if (group_stop_off & kBitMask) {
+                mask &= ~(~0ull << (group_stop_off & kBitMask));
+            }
+            uint64_t words = summary[group].load(std::memory_order_relaxed) & mask;
+            while (words != 0) {
+                buf[(group << kBitShift) + __builtin_ctzll(words)].store(0, std::memory_order_relaxed);
+                words &= words - 1;
+            }
+            summary[group].fetch_and(~mask, std::memory_order_relaxed);
+            idx_off = group_stop_off;
+        }
+    }
+
+    uint64_t AtomicBitSet::find_next_group(uint64_t group, uint64_t end_group) {
+        const void *base = (const void *) summary;
+        // Follows the compile target, the scan is too short to dispatch
+#if defined(__AVX512F__)
+        for (; group + 8 <= end_group; group += 8) {
+            __m512i words = _mm512_loadu_si512((const void *) ((const uint64_t *) base + group));
+            if (_mm512_test_epi64_mask(words, words)) {
+                break;
+            }
+        }
+#elif defined(__AVX2__)
+        for (; group + 4 <= end_group; group += 4) {
+            __m256i words = _mm256_loadu_si256((const __m256i *) ((const uint64_t *) base + group));
+            if (!_mm256_testz_si256(words, words)) {
+                break;
+            }
+        }
+#endif
+        while (group < end_group && !summary[group].load(std::memory_order_relaxed)) {
+            group++;
+        }
+        return group;
+    }
+
+    uint64_t AtomicBitSet::find_next(uint64_t idx, uint64_t end_idx) {
+        if (idx >= end_idx) {
+            return end_idx;
+        }
+        uint64_t idx_off = idx >> kBitShift;
+        uint64_t word = buf[idx_off].load(std::memory_order_relaxed) & (~0ull << (idx & kBitMask));
+        if (word != 0) {
+            return std::min(end_idx, (idx_off << kBitShift) + __builtin_ctzll(word));
+        }
+        const uint64_t stop_off = (end_idx + kBitMask) >> kBitShift;
+        const uint64_t stop_group = (stop_off + kBitMask) >> kBitShift;
+        idx_off++;
+        while (idx_off < stop_off) {
+            uint64_t group = idx_off >> kBitShift;
+            uint64_t words = summary[group].load(std::memory_order_relaxed) & (~0ull << (idx_off & kBitMask));
+            while (words != 0) {
+                uint64_t off = (group << kBitShift) + __builtin_ctzll(words);
+                if (off >= stop_off) {
+                    return end_idx;
+                }
+                word = buf[off].load(std::memory_order_relaxed);
+                if (word != 0) {
+                    return std::min(end_idx, (off << kBitShift) + __builtin_ctzll(word));
+                }
+                words &= words - 1;
+            }
+            idx_off = find_next_group(group + 1, stop_group) << kBitShift;
+        }
+        return end_idx;
+    }
+
     void GetStackAddressSpace(uint64_t &addr_begin, uint64_t &addr_end) {
         FILE *fp = fopen("/proc/self/maps", "r");
         if (!fp) {
@@ -83,6 +250,44 @@ namespace crpm {
         pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
     }
 
+    int FindLocalSocket(const void *addr) {
+        int node = 0;
+        if (numa_available() != 0) {
+            return 0;
+        }
+        if (get_mempolicy(&node, nullptr, 0, (void *) addr, MPOL_F_NODE | MPOL_F_ADDR) != 0) {
+            return 0;
+        }
+        // Memory-only nodes (e.g. persistent memory in system-ram mode) have
+        // no CPUs, take the nearest node that has
+        bitmask *mask = numa_allocate_cpumask();
+        int best_node = node, best_distance = -1;
+        for (int i = 0; i <= numa_max_node(); i++) {
+            if (numa_node_to_cpus(i, mask) != 0 || numa_bitmask_weight(mask) == 0) {
+                continue;
+            }
+            int distance = numa_distance(node, i);
+            if (best_distance < 0 || distance < best_distance) {
+                best_node = i;
+                best_distance = distance;
+            }
+        }
+        numa_free_cpumask(mask);
+        return best_node;
+    }
+
+    int GetSocketCpuCount(int socket) {
+        if (numa_available() != 0) {
+            return (int) std::thread::hardware_concurrency();
+        }
+        bitmask *mask = numa_allocate_cpumask();
+        int nr_cpus = 0;
+        if (numa_node_to_cpus(socket, mask) == 0) {
+            nr_cpus = numa_bitmask_weight(mask);
+        }
+        numa_free_cpumask(mask);
+        return nr_cpus;
+    }
 
     static const uint32_t crc32_table[] = {
             0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9,
@@ -0,0 +1,225 @@
+//
+// Non-temporal copy kernels, dispatched on the instruction sets of the CPU.
+//
+
+#include <immintrin.h>
+#include "internal/common.h"
+
+#define TARGET(isa) __attribute__((target(isa)))
+
+namespace crpm {
+    TARGET("avx512f")
+    static void Copy64Avx512(void *dst, const void *src, size_t len) {
+        uintptr_t dst_addr = (uintptr_t) dst;
+        uintptr_t src_addr = (uintptr_t) src;
+        for (size_t i = 0; i < len; i += 64) {
+            __m512i reg = _mm512_stream_load_si512((void *) src_addr);
+            _mm512_stream_si512((__m512i *) dst_addr, reg);
+            src_addr += 64;
+            dst_addr += 64;
+        }
+    }
+
+    TARGET("avx512f")
+    static void Copy256Avx512(void *dst, const void *src, size_t len) {
+        uintptr_t dst_addr = (uintptr_t) dst;
+        uintptr_t src_addr = (uintptr_t) src;
+        for (size_t i = 0; i < len; i += 256) {
+            __m512i regs[4];
+            regs[0] = _mm512_stream_load_si512((void *) src_addr);
+            regs[1] = _mm512_stream_load_si512((void *) (src_addr + 64));
+            regs[2] = _mm512_stream_load_si512((void *) (src_addr + 128));
+            regs[3] = _mm512_stream_load_si512((void *) (src_addr + 192));
+            _mm512_stream_si512((__m512i *) dst_addr, regs[0]);
+            _mm512_stream_si512((__m512i *) (dst_addr + 64), regs[1]);
+            _mm512_stream_si512((__m512i *) (dst_addr + 128), regs[2]);
+            _mm512_stream_si512((__m512i *) (dst_addr + 192), regs[3]);
+            src_addr += 256;
+            dst_addr += 256;
+        }
+    }
+
+    TARGET("avx512f")
+    static size_t CopyWithWriteEliminationAvx512(void *dst, const void *src, size_t len) {
+        size_t skipped = 0;
+        uintptr_t dst_addr = (uintptr_t) dst;
+        uintptr_t src_addr = (uintptr_t) src;
+        for (size_t i = 0; i < len; i += 64) {
+            __m512i reg = _mm512_stream_load_si512((void *) src_addr);
+            __m512i cmp_reg = _mm512_stream_load_si512((void *) dst_addr);
+            if (_mm512_cmpeq_epi64_mask(reg, cmp_reg) != UINT8_MAX) {
+                _mm512_stream_si512((__m512i *) dst_addr, reg);
+            } else {
+                skipped++;
+            }
+            src_addr += 64;
+            dst_addr += 64;
+        }
+        return skipped;
+    }
+
+    TARGET("avx2")
+    static void Copy64Avx2(void *dst, const void *src, size_t len) {
+        uintptr_t dst_addr = (uintptr_t) dst;
+        uintptr_t src_addr = (uintptr_t) src;
+        for (size_t i = 0; i < len; i += 64) {
+            __m256i reg0 = _mm256_stream_load_si256((__m256i *) src_addr);
+            __m256i reg1 = _mm256_stream_load_si256((__m256i *) (src_addr + 32));
+            _mm256_stream_si256((__m256i *) dst_addr, reg0);
+            _mm256_stream_si256((__m256i *) (dst_addr + 32), reg1);
+            src_addr += 64;
+            dst_addr += 64;
+        }
+    }
+
+    // A line is written when any of its words differs, as the AVX-512
+    // kernel does
+    TARGET("avx2")
+    static size_t CopyWithWriteEliminationAvx2(void *dst, const void *src, size_t len) {
+        size_t skipped = 0;
+        uintptr_t dst_addr = (uintptr_t) dst;
+        uintptr_t src_addr = (uintptr_t) src;
+        for (size_t i = 0; i < len; i += 64) {
+            __m256i reg0 = _mm256_stream_load_si256((__m256i *) src_addr);
+            __m256i reg1 = _mm256_stream_load_si256((__m256i *) (src_addr + 32));
+            __m256i cmp0 = _mm256_cmpeq_epi64(reg0, _mm256_stream_load_si256((__m256i *) dst_addr));
+            __m256i cmp1 = _mm256_cmpeq_epi64(reg1, _mm256_stream_load_si256((__m256i *) (dst_addr + 32)));
+            if (_mm256_movemask_epi8(_mm256_and_si256(cmp0, cmp1)) != -1) {
+                _mm256_stream_si256((__m256i *) dst_addr, reg0);
+                _mm256_stream_si256((__m256i *) (dst_addr + 32), reg1);
+            } else {
+                skipped++;
+            }
+            src_addr += 64;
+            dst_addr += 64;
+        }
+        return skipped;
+    }
+
+    TARGET("sse4.1")
+    static void Copy64Sse41(void *dst, const void *src, size_t len) {
+        uintptr_t dst_addr = (uintptr_t) dst;
+        uintptr_t src_addr = (uintptr_t) src;
+        for (size_t i = 0; i < len; i += 64) {
+            __m128i regs[4];
+            regs[0] = _mm_stream_load_si128((__m128i *) src_addr);
+            regs[1] = _mm_stream_load_si128((__m128i *) (src_addr + 16));
+            regs[2] = _mm_stream_load_si128((__m128i *) (src_addr + 32));
+            regs[3] = _mm_stream_load_si128((__m128i *) (src_addr + 48));
+            _mm_stream_si128((__m128i *) dst_addr, regs[0]);
+            _mm_stream_si128((__m128i *) (dst_addr + 16), regs[1]);
+            _mm_stream_si128((__m128i *) (dst_addr + 32), regs[2]);
+            _mm_stream_si128((__m128i *) (dst_addr + 48), regs[3]);
+            src_addr += 64;
+            dst_addr += 64;
+        }
+    }
+
+    TARGET("sse4.1")
+    static size_t CopyWithWriteEliminationSse41(void *dst, const void *src, size_t len) {
+        size_t skipped = 0;
+        uintptr_t dst_addr = (uintptr_t) dst;
+        uintptr_t src_addr = (uintptr_t) src;
+        for (size_t i = 0; i < len; i += 64) {
+            __m128i regs[4];
+            __m128i cmp = _mm_set1_epi64x(-1);
+            for (int j = 0; j < 4; ++j) {
+                regs[j] = _mm_stream_load_si128((__m128i *) (src_addr + 16 * j));
+                __m128i cmp_reg = _mm_stream_load_si128((__m128i *) (dst_addr + 16 * j));
+                cmp = _mm_and_si128(cmp, _mm_cmpeq_epi64(regs[j], cmp_reg));
+            }
+            if (_mm_movemask_epi8(cmp) != 0xffff) {
+                for (int j = 0; j < 4; ++j) {
+                    _mm_stream_si128((__m128i *) (dst_addr + 16 * j), regs[j]);
+                }
+            } else {
+                skipped++;
+            }
+            src_addr += 64;
+            dst_addr += 64;
+        }
+        return skipped;
+    }
+
+    static void Copy64Scalar(void *dst, const void *src, size_t len) {
+        long long int *dst_words = (long long int *) dst;
+        const long long int *src_words = (const long long int *) src;
+        for (size_t i = 0; i < len / sizeof(uint64_t); ++i) {
+            _mm_stream_si64(dst_words + i, src_words[i]);
+        }
+    }
+
+    static size_t CopyWithWriteEliminationScalar(void *dst, const void *src, size_t len) {
+        size_t skipped = 0;
+        const size_t kWordsPerLine = kCacheLineSize / sizeof(uint64_t);
+        long long int *dst_words = (long long int *) dst;
+        const long long int *src_words = (const long long int *) src;
+        for (size_t i = 0; i < len / sizeof(uint64_t); i += kWordsPerLine) {
+            if (memcmp(dst_words + i, src_words + i, kCacheLineSize) != 0) {
+                for (size_t j = i; j < i + kWordsPerLine; ++j) {
+                    _mm_stream_si64(dst_words + j, src_words[j]);
+                }
+            } else {
+                skipped++;
+            }
+        }
+        return skipped;
+    }
+
+    // Fastest first. Without AVX-512 the 256-byte kernel is the 64-byte one.
+    static const CopyKernels kCopyKernels[] = {
+            {"avx512", Copy64Avx512, Copy256Avx512, CopyWithWriteEliminationAvx512},
+            {"avx2",   Copy64Avx2,   Copy64Avx2,    CopyWithWriteEliminationAvx2},
+            {"sse4.1", Copy64Sse41,  Copy64Sse41,   CopyWithWriteEliminationSse41},
+            {"scalar", Copy64Scalar, Copy64Scalar,  CopyWithWriteEliminationScalar},
+    };
+    const static size_t kNrCopyKernels = sizeof(kCopyKernels) / sizeof(kCopyKernels[0]);
+
+    static bool IsSupported(const CopyKernels &kernels) {
+        __builtin_cpu_init();
+        if (!strcmp(kernels.name, "avx512")) {
+            return __builtin_cpu_supports("avx512f");
+        } else if (!strcmp(kernels.name, "avx2")) {
+            return __builtin_cpu_supports("avx2");
+        } else if (!strcmp(kernels.name, "sse4.1")) {
+            return __builtin_cpu_supports("sse4.1");
+        }
+        return true;
+    }
+
+    // Constant-initialized, so that copies issued by static constructors
+    // of other units work before the dispatch below runs
+    const CopyKernels *g_copy_kernels = &kCopyKernels[kNrCopyKernels - 1];
+
+    __attribute__((constructor))
+    static void SelectCopyKernels() {
+        const CopyKernels *kernels;
+        GetSupportedCopyKernels(&kernels, 1);
+        g_copy_kernels = kernels;
+    }
+
+    size_t GetSupportedCopyKernels(const CopyKernels **kernels, size_t max_kernels) {
+        size_t count = 0;
+        for (size_t i = 0; i < kNrCopyKernels && count < max_kernels; ++i) {
+            if (IsSupported(kCopyKernels[i])) {
+                kernels[count++] = &kCopyKernels[i];
+            }
+        }
+        return count;
+    }
+
+    bool SetCopyKernels(const std::string &name) {
+        for (size_t i = 0; i < kNrCopyKernels; ++i) {
+            if (name == kCopyKernels[i].name) {
+                if (!IsSupported(kCopyKernels[i])) {
+                    fprintf(stderr, "copy kernels %s are not supported by the CPU\n", name.c_str());
+                    return false;
+                }
+                g_copy_kernels = &kCopyKernels[i];
+                return true;
+            }
+        }
+        fprintf(stderr, "unsupported copy kernels %s\n", name.c_str());
+        return false;
+    }
+}
@@ -5,6 +5,7 @@
 #include <cstdlib>
 #include <cassert>
 #include <cstring>
+#include <algorithm>
 
 #include "crpm.h"
 #include "internal/allocator.h"
@@ -22,7 +23,20 @@ namespace crpm {
             shadow_capacity_factor(crpm::kShadowMemoryCapacityFactor),
             fixed_base_address(0),
             allocator_name("default"),
-            engine_name("default") {}
+            engine_name("default"),
+            persist_mode("default"),
+            checkpoint_threads(0),
+            max_capacity(0),
+            replacement_policy("default"),
+            recovery_threads(0),
+            lazy_recovery(false),
+            retained_snapshots(0),
+            history_capacity(0),
+            restore_epoch(0),
+            write_elimination(false),
+            track_dirty_lines(false),
+            block_size(0),
+            segment_size(0) {}
 
     MemoryPool *MemoryPool::Open(const char *path, const MemoryPoolOption &option) {
         auto engine = Engine::Open(path, option);
@@ -70,11 +84,37 @@ namespace crpm {
         return allocator->get_root(index);
     }
 
-    void MemoryPool::checkpoint(uint64_t nr_threads) {
+    bool MemoryPool::checkpoint(uint64_t nr_threads) {
         assert(has_init && engine);
         StoreFence();
         engine->checkpoint(nr_threads);
         StoreFence();
+        PersistBarrier();
+        return !engine->checkpoint_skipped();
+    }
+
+    CheckpointHandle MemoryPool::checkpoint_async(uint64_t nr_threads) {
+        assert(has_init && engine);
+        StoreFence();
+        uint64_t ticket = engine->checkpoint_async(nr_threads);
+        return CheckpointHandle(engine, ticket);
+    }
+
+    bool CheckpointHandle::is_durable() const {
+        return !engine || engine->is_durable(ticket);
+    }
+
+    void CheckpointHandle::wait() const {
+        if (engine) {
+            engine->wait_for_durable(ticket);
+        }
+    }
+
+    void SnapshotView::close() {
+        if (engine && address) {
+            engine->close_snapshot_view(address);
+        }
+        address = nullptr;
     }
 
     void MemoryPool::wait_for_background_task() {
@@ -82,6 +122,31 @@ namespace crpm {
         engine->wait_for_background_task();
     }
 
+    size_t MemoryPool::get_stats(CheckpointStats *records, size_t max_records) const {
+        assert(has_init && engine);
+        return engine->get_stats(records, max_records);
+    }
+
+    void MemoryPool::reset_stats() {
+        assert(has_init && engine);
+        engine->reset_stats();
+    }
+
+    size_t MemoryPool::get_snapshots(uint64_t *epochs, size_t max_epochs) const {
+        assert(has_init && engine);
+        return engine->get_snapshots(epochs, max_epochs);
+    }
+
+    SnapshotView MemoryPool::open_snapshot_view() {
+        assert(has_init && engine);
+        return engine->open_snapshot_view();
+    }
+
+    bool MemoryPool::set_shadow_capacity_factor(double factor) {
+        assert(has_init && engine);
+        return engine->set_shadow_capacity_factor(factor);
+    }
+
     void MemoryPool::set_default_pool() {
         if (__crpm_global_pool) {
             fprintf(stderr, "default pool has been assigned, force to reassign\n");
@@ -98,6 +163,8 @@ void crpm_init_option(crpm_option_t *option) {
     memset(option, 0, sizeof(crpm_option_t));
     strcpy(option->allocator_name, "default");
     strcpy(option->engine_name, "default");
+    strcpy(option->persist_mode, "default");
+    strcpy(option->replacement_policy, "default");
     option->shadow_capacity_factor = crpm::kShadowMemoryCapacityFactor;
 }
 
@@ -112,6 +179,19 @@ crpm_t crpm_open(const char *path, crpm_option_t *option) {
     opt.truncate = option->truncate;
     opt.engine_name = option->engine_name;
     opt.allocator_name = option->allocator_name;
+    opt.persist_mode = option->persist_mode;
+    opt.checkpoint_threads = option->checkpoint_threads;
+    opt.max_capacity = option->max_capacity;
+    opt.replacement_policy = option->replacement_policy;
+    opt.recovery_threads = option->recovery_threads;
+    opt.lazy_recovery = option->lazy_recovery;
+    opt.retained_snapshots = option->retained_snapshots;
+    opt.history_capacity = option->history_capacity;
+    opt.restore_epoch = option->restore_epoch;
+    opt.write_elimination = option->write_elimination;
+    opt.track_dirty_lines = option->track_dirty_lines;
+    opt.block_size = option->block_size;
+    opt.segment_size = option->segment_size;
     opt.verbose_output = option->verbose_output;
     opt.fixed_base_address = option->fixed_base_address;
     opt.shadow_capacity_factor = option->shadow_capacity_factor;
@@ -169,12 +249,36 @@ void crpm_default_free(void *ptr) {
     crpm::__crpm_global_pool->pfree(ptr);
 }
 
-void crpm_checkpoint(crpm_t pool, unsigned int nr_threads) {
+int crpm_checkpoint(crpm_t pool, unsigned int nr_threads) {
+    auto target = pool ? (crpm::MemoryPool *) pool : crpm::__crpm_global_pool;
+    if (!target) {
+        return -1;
+    }
+    return target->checkpoint(nr_threads) ? 0 : -1;
+}
+
+uint64_t crpm_checkpoint_async(crpm_t pool, unsigned int nr_threads) {
+    auto target = pool ? (crpm::MemoryPool *) pool : crpm::__crpm_global_pool;
+    if (!target) {
+        return 0;
+    }
+    return target->checkpoint_async(nr_threads).get_ticket();
+}
+
+int crpm_checkpoint_is_durable(crpm_t pool, uint64_t ticket) {
+    auto target = pool ? (crpm::MemoryPool *) pool : crpm::__crpm_global_pool;
+    if (!target) {
+        return 1;
+    }
+    return target->get_engine()->is_durable(ticket) ? 1 : 0;
+}
+
+void crpm_checkpoint_wait(crpm_t pool, uint64_t ticket) {
     auto target = pool ? (crpm::MemoryPool *) pool : crpm::__crpm_global_pool;
     if (!target) {
         return;
     }
-    target->checkpoint(nr_threads);
+    target->get_engine()->wait_for_durable(ticket);
 }
 
 void crpm_wait_for_background_task(crpm_t pool) {
@@ -185,6 +289,83 @@ void crpm_wait_for_background_task(crpm_t pool) {
     target->wait_for_background_task();
 }
 
+unsigned int crpm_get_stats(crpm_t pool, crpm_stats_t *records, unsigned int max_records) {
+    auto target = pool ? (crpm::MemoryPool *) pool : crpm::__crpm_global_pool;
+    if (!target || !records) {
+        return 0;
+    }
+    crpm::CheckpointStats stats[CRPM_STATS_HISTORY_CAPACITY];
+    size_t count = target->get_stats(stats, std::min(max_records, (unsigned int) CRPM_STATS_HISTORY_CAPACITY));
+    for (size_t i = 0; i < count; ++i) {
+        records[i].epoch = stats[i].epoch;
+        records[i].dirty_blocks = stats[i].dirty_blocks;
+        records[i].dirty_segments = stats[i].dirty_segments;
+        records[i].flush_mode = stats[i].flush_mode;
+        records[i].bytes_copied = stats[i].bytes_copied;
+        records[i].fences = stats[i].fences;
+        records[i].flush_ms = stats[i].flush_ms;
+        records[i].write_back_ms = stats[i].write_back_ms;
+        records[i].total_ms = stats[i].total_ms;
+        records[i].back_segment_evictions = stats[i].back_segment_evictions;
+        records[i].full_segment_copies = stats[i].full_segment_copies;
+        records[i].background_bytes_copied = stats[i].background_bytes_copied;
+        records[i].cleaner_lag_ms = stats[i].cleaner_lag_ms;
+        records[i].background_completed = stats[i].background_completed;
+        records[i].back_segments = stats[i].back_segments;
+        records[i].deferred_segments = stats[i].deferred_segments;
+        records[i].hooked_stores = stats[i].hooked_stores;
+        records[i].store_filter_hits = stats[i].store_filter_hits;
+        records[i].eliminated_lines = stats[i].eliminated_lines;
+        records[i].bytes_flushed = stats[i].bytes_flushed;
+        records[i].skipped = stats[i].skipped;
+    }
+    return count;
+}
+
+void crpm_reset_stats(crpm_t pool) {
+    auto target = pool ? (crpm::MemoryPool *) pool : crpm::__crpm_global_pool;
+    if (!target) {
+        return;
+    }
+    target->reset_stats();
+}
+
+unsigned int crpm_get_snapshots(crpm_t pool, uint64_t *epochs, unsigned int max_epochs) {
+    auto target = pool ? (crpm::MemoryPool *) pool : crpm::__crpm_global_pool;
+    if (!target || !epochs) {
+        return 0;
+    }
+    return target->get_snapshots(epochs, max_epochs);
+}
+
+const void *crpm_open_snapshot_view(crpm_t pool, uint64_t *epoch) {
+    auto target = pool ? (crpm::MemoryPool *) pool : crpm::__crpm_global_pool;
+    if (!target) {
+        return nullptr;
+    }
+    crpm::SnapshotView view = target->open_snapshot_view();
+    if (epoch) {
+        *epoch = view.get_epoch();
+    }
+    return view.get_address();
+}
+
+void crpm_close_snapshot_view(crpm_t pool, const void *view) {
+    auto target = pool ? (crpm::MemoryPool *) pool : crpm::__crpm_global_pool;
+    if (!target || !view) {
+        return;
+    }
+    target->get_engine()->close_snapshot_view(view);
+}
+
+int crpm_set_shadow_capacity_factor(crpm_t pool, double factor) {
+    auto target = pool ? (crpm::MemoryPool *) pool : crpm::__crpm_global_pool;
+    if (!target) {
+        return 0;
+    }
+    return target->set_shadow_capacity_factor(factor) ? 1 : 0;
+}
+
 void crpm_set_default_pool(crpm_t pool) {
     crpm::__crpm_global_pool = (crpm::MemoryPool *) pool;
 }
\ No newline at end of file
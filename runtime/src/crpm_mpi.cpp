@@ -18,9 +18,21 @@ crpm_mpi_t *crpm_mpi_open(const char *path, crpm_option_t *option, MPI_Comm comm
     native_option.truncate = option->truncate;
     native_option.engine_name = option->engine_name;
     native_option.allocator_name = option->allocator_name;
+    native_option.persist_mode = option->persist_mode;
+    native_option.checkpoint_threads = option->checkpoint_threads;
     native_option.verbose_output = option->verbose_output;
     native_option.shadow_capacity_factor = option->shadow_capacity_factor;
     native_option.fixed_base_address = option->fixed_base_address;
+    native_option.replacement_policy = option->replacement_policy;
+    native_option.recovery_threads = option->recovery_threads;
+    native_option.lazy_recovery = option->lazy_recovery;
+    native_option.retained_snapshots = option->retained_snapshots;
+    native_option.history_capacity = option->history_capacity;
+    native_option.restore_epoch = option->restore_epoch;
+    native_option.write_elimination = option->write_elimination;
+    native_option.track_dirty_lines = option->track_dirty_lines;
+    native_option.block_size = option->block_size;
+    native_option.segment_size = option->segment_size;
 
     auto engine = Engine::OpenForMPI(path, native_option, comm);
     if (!engine) {
@@ -64,7 +76,7 @@ static void crpm_mpi_safe_memcpy(void *dst, const void *src, size_t length) {
     }
 }
 
-void crpm_mpi_checkpoint(crpm_mpi_t *pool, unsigned int nr_threads) {
+int crpm_mpi_checkpoint(crpm_mpi_t *pool, unsigned int nr_threads) {
     auto native_pool = (MemoryPool *) pool->pool;
     auto desc = pool->desc_list;
     while (desc) {
@@ -74,6 +86,8 @@ void crpm_mpi_checkpoint(crpm_mpi_t *pool, unsigned int nr_threads) {
     StoreFence();
     native_pool->get_engine()->checkpoint_for_mpi(nr_threads, pool->comm);
     StoreFence();
+    PersistBarrier();
+    return native_pool->get_engine()->checkpoint_skipped() ? -1 : 0;
 }
 
 void crpm_protect(crpm_mpi_t *pool, unsigned int index, void *ptr, size_t length) {
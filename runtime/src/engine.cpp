@@ -15,7 +15,35 @@
 namespace crpm {
     bool process_instrumented = false;
 
+    uint64_t Engine::checkpoint_async(uint64_t nr_threads) {
+        checkpoint(nr_threads);
+        StoreFence();
+        PersistBarrier();
+        return 0;
+    }
+
+    // Only the default engine of libcrpm picks the geometry per pool, the
+    // other engines are built for kBlockSize and kSegmentSize
+    static bool CheckGeometry(const MemoryPoolOption &option) {
+#ifdef USE_NVM_INST_ENGINE
+        if (process_instrumented && option.engine_name == "default") {
+            return true;
+        }
+#endif
+        if ((option.block_size && option.block_size != kBlockSize) ||
+            (option.segment_size && option.segment_size != kSegmentSize)) {
+            fprintf(stderr, "engine %s only supports block size %zu and segment size %zu\n",
+                    option.engine_name.c_str(), kBlockSize, kSegmentSize);
+            return false;
+        }
+        return true;
+    }
+
     Engine *Engine::Open(const char *path, const MemoryPoolOption &option) {
+        if (!SetPersistMode(option.persist_mode) || !CheckGeometry(option)) {
+            return nullptr;
+        }
+
         if (process_instrumented) {
             // Instrumentation is enabled
 #ifdef USE_NVM_INST_ENGINE
@@ -69,6 +97,10 @@ namespace crpm {
 
 #ifdef USE_MPI_EXTENSION
     Engine *Engine::OpenForMPI(const char *path, const MemoryPoolOption &option, MPI_Comm comm) {
+        if (!SetPersistMode(option.persist_mode) || !CheckGeometry(option)) {
+            return nullptr;
+        }
+
         if (process_instrumented) {
             // Instrumentation is enabled
 #ifdef USE_NVM_INST_ENGINE
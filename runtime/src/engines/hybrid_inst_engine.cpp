@@ -21,6 +21,7 @@ namespace crpm {
     void HybridInstEngine::Registry::do_register(HybridInstEngine *engine) {
         std::lock_guard<std::mutex> guard(mutex);
         engines.insert(engine);
+        table.insert(engine->address_range.first, engine->address_range.second, engine);
         if (!default_engine) {
             default_engine = engine;
         }
@@ -29,29 +30,14 @@ namespace crpm {
     void HybridInstEngine::Registry::do_unregister(HybridInstEngine *engine) {
         std::lock_guard<std::mutex> guard(mutex);
         engines.erase(engine);
+        table.erase(engine->address_range.first, engine->address_range.second, engine);
         if (engine == default_engine) {
             default_engine = nullptr;
         }
     }
 
     HybridInstEngine *HybridInstEngine::Registry::find(const void *addr) {
-        uintptr_t u_addr = (uintptr_t) addr;
-        if (likely(default_engine != nullptr)) {
-            auto &range = default_engine->address_range;
-            if (likely(u_addr >= range.first && u_addr < range.second)) {
-                return default_engine;
-            }
-        }
-        if (engines.size() == 1) {
-            return nullptr;
-        }
-        for (auto engine : engines) {
-            auto &range = engine->address_range;
-            if (u_addr >= range.first && u_addr < range.second) {
-                return engine;
-            }
-        }
-        return nullptr;
+        return table.find((uintptr_t) addr);
     }
 
     void HybridInstEngine::Registry::hook_routine(const void *addr) {
@@ -145,6 +131,13 @@ namespace crpm {
             }
         }
 
+        impl->replacement_policy = ReplacementPolicy::Create(option.replacement_policy,
+                                                             impl->image->get_nr_back_segments());
+        if (!impl->replacement_policy) {
+            delete impl;
+            return nullptr;
+        }
+
         impl->segment_dirty[0].allocate(impl->nr_segments);
         impl->segment_dirty[1].allocate(impl->nr_segments);
         impl->block_dirty[0].allocate(impl->nr_blocks);
@@ -162,11 +155,11 @@ namespace crpm {
 
         if (!create) {
             uint64_t a = ReadTSC();
-            impl->image->recovery(CheckpointImage::SS_Main);
+            impl->image->recovery(CheckpointImage::SS_Main, option.recovery_threads);
             impl->prepare_working_memory();
             impl->has_snapshot = impl->exist_snapshot();
             uint64_t b = ReadTSC();
-            printf("%.3lf ms\n", (b - a) / 2400000.0);
+            printf("%.3lf ms\n", CyclesToMilliseconds(b - a));
         }
 
         impl->address_range.first = (uintptr_t) impl->get_address(0);
@@ -187,17 +180,23 @@ namespace crpm {
             checkpoint_traffic(0),
             flush_latency(0),
             write_back_latency(0),
+            checkpoint_fences(0),
+            nr_evictions(0),
+            nr_full_copies(0),
+            write_back_epoch(0),
+            write_back_start_clock(0),
+            write_back_start_traffic(0),
             write_back_thread_running(true),
             checkpoint_in_progress(false),
             write_back_state(WB_IDLE),
-            next_back_segment(0),
+            replacement_policy(nullptr),
             epoch(1),
             verbose(false) {
         for (uint64_t i = 0; i < kMaxThreads; ++i) {
-            flush_blocks[i] = (volatile uint64_t *)
-                    malloc(sizeof(uint64_t) * kMaxFlushBlocks);
+            flush_blocks[i] = nullptr;
             flush_blocks_count[i] = 0;
         }
+        skipped = false;
         write_back_thread_lock.clear(std::memory_order_relaxed);
         back_memory_lock.clear(std::memory_order_relaxed);
     }
@@ -208,9 +207,6 @@ namespace crpm {
             write_back_thread_running = false;
             write_back_thread.join();
 #endif //USE_SYNCHRONOUS_CHECKPOINT
-            for (uint64_t i = 0; i < kMaxThreads; ++i) {
-                free((void *) flush_blocks[i]);
-            }
             delete image;
             munmap(working_memory, capacity);
             fs.close();
@@ -219,11 +215,14 @@ namespace crpm {
                 printf("checkpoint_traffic: %.3lf MiB\n",
                        checkpoint_traffic / 1000000.0);
                 printf("flush_latency: %.3lf ms\n",
-                       flush_latency / 2400000.0);
+                       CyclesToMilliseconds(flush_latency));
                 printf("write_back_latency: %.3lf ms\n",
-                       write_back_latency / 2400000.0);
+                       CyclesToMilliseconds(write_back_latency));
+                printf("replacement policy %s: evictions %ld full segment copies %ld\n",
+                       replacement_policy->get_name(), nr_evictions.load(), nr_full_copies.load());
             }
         }
+        delete replacement_policy;
     }
 
     void HybridInstEngine::prepare_working_memory() {
@@ -268,7 +267,8 @@ namespace crpm {
         prev_flush_mode = flush_mode;
         uint64_t total_blocks = 0;
         bool all_empty = true, has_full = false;
-        for (size_t i = 0; i < kMaxThreads; ++i) {
+        for (uint64_t k = 0; k < flush_arena.get_nr_threads(); ++k) {
+            size_t i = flush_arena.get_thread(k);
             size_t size = flush_blocks_count[i];
             if (size != 0) {
                 all_empty = false;
@@ -290,8 +290,10 @@ namespace crpm {
 
     void HybridInstEngine::checkpoint(uint64_t nr_threads) {
         uint64_t start_clock, persist_clock;
+        uint64_t start_fences = tl_nr_fences;
         int tid = next_thread_id.fetch_add(1, std::memory_order_relaxed);
         bool is_leader = (tid == 0);
+        CheckpointStats stats;
 
         barrier.barrier(nr_threads, tid);
         if (is_leader) {
@@ -304,17 +306,41 @@ namespace crpm {
         if (is_leader) {
             std::atomic_thread_fence(std::memory_order_acquire);
             determine_flush_mode();
+            // Nothing is written, the blocks stay dirty and the last
+            // checkpoint remains the committed one
+            skipped = (flush_mode != FMODE_NO_ACTION && !reserve_back_segments());
+            if (skipped) {
+                fprintf(stderr, "checkpoint skipped: the working set of the epoch exceeds the back pool\n");
+                flush_mode = FMODE_NO_ACTION;
+            }
+            memset(&stats, 0, sizeof(stats));
+            stats.flush_mode = flush_mode;
+            stats.skipped = skipped;
+            for (uint64_t k = 0; k < flush_arena.get_nr_threads(); ++k) {
+                size_t i = flush_arena.get_thread(k);
+                stats.dirty_blocks += flush_blocks_count[i];
+            }
+            stats.dirty_segments = segment_dirty[epoch].count();
             if (flush_mode == FMODE_NO_ACTION) {
                 next_thread_id.store(0, std::memory_order_relaxed);
             } else {
                 checkpoint_in_progress.store(true, std::memory_order_relaxed);
                 AcquireLock(write_back_thread_lock);
+                stats.bytes_copied = checkpoint_traffic.load(std::memory_order_relaxed);
+                stats.back_segment_evictions = nr_evictions.load(std::memory_order_relaxed);
+                stats.full_segment_copies = nr_full_copies.load(std::memory_order_relaxed);
             }
             latch.latch_add(tid);
         }
         latch.latch_wait(tid);
 
         if (flush_mode == FMODE_NO_ACTION) {
+            if (is_leader) {
+                stats.fences = tl_nr_fences - start_fences;
+                stats.total_ms = CyclesToMilliseconds(ReadTSC() - start_clock);
+                stats.background_completed = true;
+                stats_history.append(stats);
+            }
             return;
         }
 
@@ -328,23 +354,40 @@ namespace crpm {
         } else {
             apply_dram_to_main_parallel(tid, nr_threads);
         }
+        if (!is_leader && flush_mode == FMODE_WBINVD) {
+            checkpoint_fences.fetch_add(tl_nr_fences - start_fences, std::memory_order_relaxed);
+        }
         barrier.barrier(nr_threads, tid);
 
         if (flush_mode == FMODE_WBINVD) {
             if (is_leader) {
                 uint8_t state = epoch ? CheckpointImage::SS_Back : CheckpointImage::SS_Main;
                 commit_layout_state(state);
+                record_back_segment_accesses(segment_dirty[epoch]);
                 clear_dirty_bits_last_epoch();
                 persist_clock = ReadTSC();
                 next_thread_id.store(0, std::memory_order_relaxed);
                 flush_latency.fetch_add(persist_clock - start_clock,
                                         std::memory_order_relaxed);
+                stats.bytes_copied = checkpoint_traffic.load(std::memory_order_relaxed) - stats.bytes_copied;
+                stats.back_segment_evictions = nr_evictions.load(std::memory_order_relaxed)
+                                               - stats.back_segment_evictions;
+                stats.full_segment_copies = nr_full_copies.load(std::memory_order_relaxed)
+                                            - stats.full_segment_copies;
+                stats.fences = checkpoint_fences.exchange(0, std::memory_order_relaxed)
+                               + tl_nr_fences - start_fences;
+                stats.flush_ms = CyclesToMilliseconds(persist_clock - start_clock);
+                stats.total_ms = stats.flush_ms;
+                write_back_epoch = stats_history.append(stats);
+                write_back_start_clock = persist_clock;
+                write_back_start_traffic = checkpoint_traffic.load(std::memory_order_relaxed);
                 if (unlikely(!has_snapshot)) {
                     image->set_attributes(kAttributeHasSnapshot);
                     has_snapshot = true;
                 }
                 write_back_state.store(WB_STARTING, std::memory_order_relaxed);
-                for (uint64_t i = 0; i < kMaxThreads; ++i) {
+                for (uint64_t k = 0; k < flush_arena.get_nr_threads(); ++k) {
+                    uint64_t i = flush_arena.get_thread(k);
                     flush_blocks_count[i] = 0;
                 }
                 checkpoint_in_progress.store(false, std::memory_order_relaxed);
@@ -366,18 +409,34 @@ namespace crpm {
             } else {
                 apply_dram_to_back_parallel(tid, nr_threads);
             }
+            if (!is_leader) {
+                checkpoint_fences.fetch_add(tl_nr_fences - start_fences, std::memory_order_relaxed);
+            }
             barrier.barrier(nr_threads, tid);
             if (is_leader) {
+                record_back_segment_accesses(segment_dirty[epoch]);
                 clear_dirty_bits_last_epoch();
                 persist_clock = ReadTSC();
                 next_thread_id.store(0, std::memory_order_relaxed);
                 flush_latency.fetch_add(persist_clock - start_clock,
                                         std::memory_order_relaxed);
+                stats.bytes_copied = checkpoint_traffic.load(std::memory_order_relaxed) - stats.bytes_copied;
+                stats.back_segment_evictions = nr_evictions.load(std::memory_order_relaxed)
+                                               - stats.back_segment_evictions;
+                stats.full_segment_copies = nr_full_copies.load(std::memory_order_relaxed)
+                                            - stats.full_segment_copies;
+                stats.fences = checkpoint_fences.exchange(0, std::memory_order_relaxed)
+                               + tl_nr_fences - start_fences;
+                stats.flush_ms = CyclesToMilliseconds(persist_clock - start_clock);
+                stats.total_ms = stats.flush_ms;
+                stats.background_completed = true;
+                stats_history.append(stats);
                 if (unlikely(!has_snapshot)) {
                     image->set_attributes(kAttributeHasSnapshot);
                     has_snapshot = true;
                 }
-                for (uint64_t i = 0; i < kMaxThreads; ++i) {
+                for (uint64_t k = 0; k < flush_arena.get_nr_threads(); ++k) {
+                    uint64_t i = flush_arena.get_thread(k);
                     flush_blocks_count[i] = 0;
                 }
                 checkpoint_in_progress.store(false, std::memory_order_relaxed);
@@ -407,7 +466,8 @@ namespace crpm {
             image->commit_segment_state_update();
         } else {
             image->begin_segment_state_update();
-            for (size_t id = 0; id < kMaxThreads; ++id) {
+            for (uint64_t k = 0; k < flush_arena.get_nr_threads(); ++k) {
+                size_t id = flush_arena.get_thread(k);
                 auto &bucket = flush_blocks[id];
                 uint64_t bucket_size = flush_blocks_count[id];
                 for (uint64_t i = 0; i != bucket_size; ++i) {
@@ -453,9 +513,17 @@ namespace crpm {
             _mm_pause();
         }
 #endif //USE_SYNCHRONOUS_CHECKPOINT
+    }
+
+    size_t HybridInstEngine::get_stats(CheckpointStats *records, size_t max_records) {
+        return stats_history.get(records, max_records);
+    }
+
+    void HybridInstEngine::reset_stats() {
         checkpoint_traffic = 0;
         flush_latency = 0;
         write_back_latency = 0;
+        stats_history.reset();
     }
 
     void HybridInstEngine::apply_nvm_to_nvm_parallel(int tid, int nr_threads) {
@@ -544,6 +612,7 @@ namespace crpm {
                 uint8_t *back_base = image->get_back_segment(back_id);
                 if (created && image->get_segment_state(main_id) != CheckpointImage::SS_Initial) {
                     NonTemporalCopy256(back_base, work_base, kSegmentSize);
+                    nr_full_copies.fetch_add(1, std::memory_order_relaxed);
                     traffic += kSegmentSize;
                 } else {
                     for (uint64_t block_id = start_block_id;
@@ -569,9 +638,10 @@ namespace crpm {
         } else {
             if (tid == 0) {
                 size_t id = 0;
-                while (id < kMaxThreads) {
-                    auto &bucket = flush_blocks[id];
-                    uint64_t bucket_size = flush_blocks_count[id];
+                while (id < flush_arena.get_nr_threads()) {
+                    unsigned int thread_id = flush_arena.get_thread(id);
+                    auto &bucket = flush_blocks[thread_id];
+                    uint64_t bucket_size = flush_blocks_count[thread_id];
                     for (uint64_t i = 0; i != bucket_size; ++i) {
                         uint64_t block_id = bucket[i];
                         bool created;
@@ -583,6 +653,7 @@ namespace crpm {
                             uint8_t *back_addr = image->get_back_segment(
                                     back_block_id / kBlocksPerSegment);
                             NonTemporalCopy256(back_addr, work_addr, kSegmentSize);
+                            nr_full_copies.fetch_add(1, std::memory_order_relaxed);
                             traffic += kSegmentSize;
                         } else {
                             uint8_t *work_addr =
@@ -619,6 +690,7 @@ namespace crpm {
                         uint8_t *main_base = image->get_main_segment(main_id);
                         uint8_t *back_base = image->get_back_segment(back_id);
                         NonTemporalCopy256(main_base, back_base, kSegmentSize);
+                        nr_full_copies.fetch_add(1, std::memory_order_relaxed);
                         traffic += kSegmentSize;
                         image->set_segment_state_atomic(main_id, CheckpointImage::SS_Back);
                     }
@@ -652,9 +724,10 @@ namespace crpm {
             }
         } else {
             size_t id = tid;
-            while (id < kMaxThreads) {
-                auto &bucket = flush_blocks[id];
-                uint64_t bucket_size = flush_blocks_count[id];
+            while (id < flush_arena.get_nr_threads()) {
+                unsigned int thread_id = flush_arena.get_thread(id);
+                auto &bucket = flush_blocks[thread_id];
+                uint64_t bucket_size = flush_blocks_count[thread_id];
                 for (uint64_t i = 0; i != bucket_size; ++i) {
                     uint64_t block_id = bucket[i];
                     uint64_t main_id = (block_id / kBlocksPerSegment);
@@ -665,6 +738,7 @@ namespace crpm {
                             uint8_t *main_base = image->get_main_segment(main_id);
                             uint8_t *back_base = image->get_back_segment(back_id);
                             NonTemporalCopy256(main_base, back_base, kSegmentSize);
+                            nr_full_copies.fetch_add(1, std::memory_order_relaxed);
                             traffic += kSegmentSize;
                             image->set_segment_state_atomic(main_id, CheckpointImage::SS_Back);
                         }
@@ -688,14 +762,41 @@ namespace crpm {
         if (created) {
             allocate_back_segment(segment_id);
             back_seg_id = image->get_main_to_back(segment_id);
-            if (back_seg_id == kNullSegmentIndex) {
-                fprintf(stderr, "no free back segments\n");
+            if (unlikely(back_seg_id == kNullSegmentIndex)) {
+                // reserve_back_segments() counted one for every segment the
+                // checkpoint binds. Nothing of the checkpoint is committed
+                // yet, so the image still holds the last one.
+                fprintf(stderr, "no back segment for segment %lu although the checkpoint reserved one\n",
+                        segment_id);
                 exit(EXIT_FAILURE);
             }
         }
         return back_seg_id;
     }
 
+    // Whether every segment the checkpoint binds can get a back segment,
+    // checked by the leader before the checkpoint writes anything
+    bool HybridInstEngine::reserve_back_segments() {
+        const size_t kNumBackSegments = image->get_nr_back_segments();
+        uint64_t needed = 0, available = 0;
+        AcquireLock(back_memory_lock);
+        segment_dirty[epoch].for_each([this, &needed](uint64_t seg_id) {
+            if (image->get_main_to_back(seg_id) == kNullSegmentIndex &&
+                (epoch || flush_mode != FMODE_WBINVD ||
+                 image->get_segment_state(seg_id) == CheckpointImage::SS_Main)) {
+                needed++;
+            }
+        });
+        for (uint64_t back_id = 0; back_id < kNumBackSegments && available < needed; ++back_id) {
+            uint64_t main_segment = image->get_back_to_main(back_id);
+            if (main_segment == kNullSegmentIndex || !segment_dirty[epoch].test(main_segment)) {
+                available++;
+            }
+        }
+        ReleaseLock(back_memory_lock);
+        return available >= needed;
+    }
+
     uint64_t HybridInstEngine::find_back_block(uint64_t block_id, bool &created) {
         uint64_t back_seg_id = find_back_segment(block_id / kBlocksPerSegment, created);
         return (back_seg_id * kBlocksPerSegment) + (block_id % kBlocksPerSegment);
@@ -720,26 +821,38 @@ namespace crpm {
     void HybridInstEngine::allocate_back_segment(uint64_t segment_id) {
         const size_t kNumBackSegments = image->get_nr_back_segments();
         AcquireLock(back_memory_lock);
-        uint64_t loop_count = 0;
-        while (loop_count < kNumBackSegments) {
-            uint64_t main_segment = image->get_back_to_main(next_back_segment);
-            if (main_segment == kNullSegmentIndex) {
-                image->bind_back_segment(segment_id, next_back_segment);
-                advance_next_back_segment();
-                ReleaseLock(back_memory_lock);
-                return;
-            }
-            if (segment_dirty[epoch].test(main_segment)) {
-                advance_next_back_segment();
-                loop_count++;
-                continue;
+        uint64_t back_id = replacement_policy->select(kNumBackSegments, [this](uint64_t back_id) {
+            uint64_t main_segment = image->get_back_to_main(back_id);
+            return main_segment == kNullSegmentIndex || !segment_dirty[epoch].test(main_segment);
+        });
+        if (back_id != kNullSegmentIndex) {
+            if (image->get_back_to_main(back_id) != kNullSegmentIndex) {
+                nr_evictions.fetch_add(1, std::memory_order_relaxed);
             }
+            image->bind_back_segment(segment_id, back_id);
+            replacement_policy->bind(back_id);
+        }
+        ReleaseLock(back_memory_lock);
+    }
 
-            image->bind_back_segment(segment_id, next_back_segment);
-            advance_next_back_segment();
-            ReleaseLock(back_memory_lock);
-            return;
+    // Feeds the segments dirtied in the epoch to the replacement policy,
+    // called once per checkpoint by its leader
+    void HybridInstEngine::record_back_segment_accesses(AtomicBitSet &dirty_segments) {
+        AcquireLock(back_memory_lock);
+        for (uint64_t seg_id = 0; seg_id < nr_segments; seg_id += AtomicBitSet::kBitWidth) {
+            uint64_t bitset = dirty_segments.test_all(seg_id);
+            while (bitset != 0) {
+                uint64_t t = bitset & -bitset;
+                int i = __builtin_ctzll(bitset); // i == first set index
+                bitset ^= t;
+                uint64_t back_id = image->get_main_to_back(seg_id + i);
+                if (back_id != kNullSegmentIndex) {
+                    replacement_policy->access(back_id);
+                }
+            }
         }
+        replacement_policy->tick();
+        ReleaseLock(back_memory_lock);
     }
 
     void HybridInstEngine::hook_routine(const void *addr, size_t len) {
@@ -755,9 +868,13 @@ namespace crpm {
             block_dirty[epoch].set(block_id, std::memory_order_release);
 
             thread_local unsigned int tid = tl_thread_info.get_thread_id();
+            auto bucket = flush_blocks[tid];
+            if (unlikely(!bucket)) {
+                bucket = flush_arena.attach(tid, flush_blocks);
+            }
             auto &bucket_size = flush_blocks_count[tid];
             if (likely(bucket_size != kMaxFlushBlocks)) {
-                flush_blocks[tid][bucket_size] = block_id;
+                bucket[bucket_size] = block_id;
                 ++bucket_size;
             }
 
@@ -781,9 +898,13 @@ namespace crpm {
         block_dirty[epoch].set(block_id, std::memory_order_release);
 
         thread_local unsigned int tid = tl_thread_info.get_thread_id();
+        auto bucket = flush_blocks[tid];
+        if (unlikely(!bucket)) {
+            bucket = flush_arena.attach(tid, flush_blocks);
+        }
         auto &bucket_size = flush_blocks_count[tid];
         if (likely(bucket_size != kMaxFlushBlocks)) {
-            flush_blocks[tid][bucket_size] = block_id;
+            bucket[bucket_size] = block_id;
             ++bucket_size;
         }
 
@@ -816,6 +937,11 @@ namespace crpm {
                     engine->write_back_state.store(WB_EXITING, std::memory_order_relaxed);
                     break;
                 case WB_EXITING:
+                    engine->stats_history.complete_background(
+                            engine->write_back_epoch,
+                            engine->checkpoint_traffic.load(std::memory_order_relaxed)
+                            - engine->write_back_start_traffic,
+                            0, 0, 0, CyclesToMilliseconds(ReadTSC() - engine->write_back_start_clock));
                     ReleaseLock(engine->write_back_thread_lock);
                     engine->write_back_state.store(WB_IDLE, std::memory_order_release);
                     break;
@@ -872,6 +998,13 @@ namespace crpm {
             }
         }
 
+        impl->replacement_policy = ReplacementPolicy::Create(option.replacement_policy,
+                                                             impl->image->get_nr_back_segments());
+        if (!impl->replacement_policy) {
+            delete impl;
+            return nullptr;
+        }
+
         impl->segment_dirty[0].allocate(impl->nr_segments);
         impl->segment_dirty[1].allocate(impl->nr_segments);
         impl->block_dirty[0].allocate(impl->nr_blocks);
@@ -900,7 +1033,7 @@ namespace crpm {
             if (min_epoch != my_epoch) {
                 impl->image->reset_committed_epoch(min_epoch);
             }
-            impl->image->recovery(CheckpointImage::SS_Main);
+            impl->image->recovery(CheckpointImage::SS_Main, option.recovery_threads);
             gettimeofday(&tv_mid, nullptr);
             impl->prepare_working_memory();
             impl->has_snapshot = impl->exist_snapshot();
@@ -940,6 +1073,14 @@ namespace crpm {
         if (is_leader) {
             std::atomic_thread_fence(std::memory_order_acquire);
             determine_flush_mode();
+            // Every rank skips the checkpoint if one of them cannot bind
+            int reserved = (flush_mode == FMODE_NO_ACTION || reserve_back_segments()) ? 1 : 0;
+            MPI_Allreduce(MPI_IN_PLACE, &reserved, 1, MPI_INT, MPI_MIN, comm);
+            skipped = !reserved;
+            if (skipped) {
+                fprintf(stderr, "checkpoint skipped: the working set of the epoch exceeds the back pool\n");
+                flush_mode = FMODE_NO_ACTION;
+            }
             if (flush_mode == FMODE_NO_ACTION) {
                 next_thread_id.store(0, std::memory_order_relaxed);
             } else {
@@ -976,7 +1117,8 @@ namespace crpm {
                 has_snapshot = true;
             }
             write_back_state.store(WB_STARTING, std::memory_order_relaxed);
-            for (uint64_t i = 0; i < kMaxThreads; ++i) {
+            for (uint64_t k = 0; k < flush_arena.get_nr_threads(); ++k) {
+                uint64_t i = flush_arena.get_thread(k);
                 flush_blocks_count[i] = 0;
             }
             checkpoint_in_progress.store(false, std::memory_order_relaxed);
@@ -1021,7 +1163,8 @@ namespace crpm {
             image->commit_segment_state_update_for_mpi(comm);
         } else {
             image->begin_segment_state_update();
-            for (size_t id = 0; id < kMaxThreads; ++id) {
+            for (uint64_t k = 0; k < flush_arena.get_nr_threads(); ++k) {
+                size_t id = flush_arena.get_thread(k);
                 auto &bucket = flush_blocks[id];
                 uint64_t bucket_size = flush_blocks_count[id];
                 for (uint64_t i = 0; i != bucket_size; ++i) {
@@ -1065,6 +1208,8 @@ struct AddressBuffer {
 static_assert(sizeof(AddressBuffer) == 4096, "wrong address buffer size");
 
 alignas(4096) AddressBuffer address_buffer[crpm::kMaxThreads];
+// One past the highest buffer a thread has stored to
+alignas(64) std::atomic<uint64_t> address_buffer_end(0);
 alignas(64) uint64_t stack_start_addr, stack_end_addr;
 
 #define INLINE_HOOK
@@ -1105,8 +1250,16 @@ void address_buffer_clear(AddressBuffer *buffer) {
     buffer->spinlock.clear(std::memory_order_release);
 }
 
+AddressBuffer *address_buffer_attach() {
+    uint64_t id = crpm::tl_thread_info.get_thread_id();
+    uint64_t end = address_buffer_end.load(std::memory_order_relaxed);
+    while (end <= id && !address_buffer_end.compare_exchange_weak(end, id + 1)) {}
+    return &address_buffer[id];
+}
+
 void address_buffer_clear_all() {
-    for (uint64_t i = 0; i < crpm::kMaxThreads; ++i) {
+    uint64_t end = address_buffer_end.load(std::memory_order_acquire);
+    for (uint64_t i = 0; i < end; ++i) {
         address_buffer_clear(&address_buffer[i]);
     }
 }
@@ -1147,8 +1300,7 @@ void __crpm_hook_rt_store(void *addr) {
     auto registry = crpm::HybridInstEngine::Registry::Get();
     registry->hook_routine(addr);
 #else
-    thread_local AddressBuffer *bucket =
-            &address_buffer[crpm::tl_thread_info.get_thread_id()];
+    thread_local AddressBuffer *bucket = address_buffer_attach();
     uint64_t length = bucket->length;
     bucket->ptr[length] = (uintptr_t) addr;
     length++;
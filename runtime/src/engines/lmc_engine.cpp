@@ -16,6 +16,7 @@ namespace crpm {
     void LmcEngine::Registry::do_register(LmcEngine *engine) {
         std::lock_guard<std::mutex> guard(mutex);
         engines.insert(engine);
+        table.insert(engine->address_range.first, engine->address_range.second, engine);
         if (!default_engine) {
             default_engine = engine;
         }
@@ -24,29 +25,14 @@ namespace crpm {
     void LmcEngine::Registry::do_unregister(LmcEngine *engine) {
         std::lock_guard<std::mutex> guard(mutex);
         engines.erase(engine);
+        table.erase(engine->address_range.first, engine->address_range.second, engine);
         if (engine == default_engine) {
             default_engine = nullptr;
         }
     }
 
     LmcEngine *LmcEngine::Registry::find(const void *addr) {
-        uintptr_t u_addr = (uintptr_t) addr;
-        if (likely(default_engine != nullptr)) {
-            auto &range = default_engine->address_range;
-            if (likely(u_addr >= range.first && u_addr < range.second)) {
-                return default_engine;
-            }
-        }
-        if (engines.size() == 1) {
-            return nullptr;
-        }
-        for (auto engine : engines) {
-            auto &range = engine->address_range;
-            if (u_addr >= range.first && u_addr < range.second) {
-                return engine;
-            }
-        }
-        return nullptr;
+        return table.find((uintptr_t) addr);
     }
 
     void LmcEngine::Registry::hook_routine(const void *addr) {
@@ -156,8 +142,7 @@ namespace crpm {
             write_back_latency(0),
             verbose(false) {
         for (uint64_t i = 0; i < kMaxThreads; ++i) {
-            flush_blocks[i] = (volatile uint64_t *)
-                    malloc(sizeof(uint64_t) * kMaxFlushBlocks);
+            flush_blocks[i] = nullptr;
             flush_blocks_count[i] = 0;
         }
     }
@@ -165,18 +150,15 @@ namespace crpm {
     LmcEngine::~LmcEngine() {
         if (has_init) {
             delete[]segment_locks;
-            for (uint64_t i = 0; i < kMaxThreads; ++i) {
-                free((void *) flush_blocks[i]);
-            }
             fs.close();
             Registry::Get()->do_unregister(this);
             if (verbose) {
                 printf("checkpoint_traffic: %.3lf MiB\n",
                        checkpoint_traffic / 1000000.0);
                 printf("flush_latency: %.3lf ms\n",
-                       flush_latency / 2400000.0);
+                       CyclesToMilliseconds(flush_latency));
                 printf("write_back_latency: %.3lf ms\n",
-                       write_back_latency / 2400000.0);
+                       CyclesToMilliseconds(write_back_latency));
             }
         }
     }
@@ -191,7 +173,8 @@ namespace crpm {
             start_clock = ReadTSC();
             std::atomic_thread_fence(std::memory_order_acquire);
             bool all_empty = true, has_full = false;
-            for (size_t i = 0; i < kMaxThreads; ++i) {
+            for (uint64_t k = 0; k < flush_arena.get_nr_threads(); ++k) {
+                size_t i = flush_arena.get_thread(k);
                 size_t size = flush_blocks_count[i];
                 if (size != 0) {
                     all_empty = false;
@@ -228,7 +211,8 @@ namespace crpm {
                 has_snapshot = true;
             }
             advance_current_epoch();
-            for (uint64_t i = 0; i < kMaxThreads; ++i) {
+            for (uint64_t k = 0; k < flush_arena.get_nr_threads(); ++k) {
+                uint64_t i = flush_arena.get_thread(k);
                 flush_blocks_count[i] = 0;
             }
             latch.latch_add(tid);
@@ -257,9 +241,10 @@ namespace crpm {
         } else {
             size_t id = tid;
             uint8_t *base_address = (uint8_t *) get_address(0);
-            while (id < kMaxThreads) {
-                auto &bucket = flush_blocks[id];
-                uint64_t bucket_size = flush_blocks_count[id];
+            while (id < flush_arena.get_nr_threads()) {
+                unsigned int thread_id = flush_arena.get_thread(id);
+                auto &bucket = flush_blocks[thread_id];
+                uint64_t bucket_size = flush_blocks_count[thread_id];
                 for (uint64_t i = 0; i != bucket_size; ++i) {
                     uint8_t *addr = base_address + (bucket[i] << kBlockShift);
                     FlushRegion(addr, kBlockSize);
@@ -328,7 +313,10 @@ namespace crpm {
         ReleaseLock(lock);
 
         thread_local unsigned int tid = tl_thread_info.get_thread_id();
-        auto &bucket = flush_blocks[tid];
+        auto bucket = flush_blocks[tid];
+        if (unlikely(!bucket)) {
+            bucket = flush_arena.attach(tid, flush_blocks);
+        }
         auto &bucket_size = flush_blocks_count[tid];
         if (likely(bucket_size != kMaxFlushBlocks)) {
             bucket[bucket_size] = block_id;
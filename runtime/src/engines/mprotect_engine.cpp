@@ -192,9 +192,9 @@ namespace crpm {
                 printf("checkpoint_traffic: %.3lf MiB\n",
                        checkpoint_traffic / 1000000.0);
                 printf("flush_latency: %.3lf ms\n",
-                       flush_latency / 2400000.0);
+                       CyclesToMilliseconds(flush_latency));
                 printf("write_back_latency: %.3lf ms\n",
-                       write_back_latency / 2400000.0);
+                       CyclesToMilliseconds(write_back_latency));
             }
         }
     }
@@ -9,6 +9,29 @@
 
 void address_buffer_clear_all();
 
+void store_filter_invalidate();
+
+void store_filter_get_stats(uint64_t &hooked_stores, uint64_t &filter_hits);
+
+// Finest tracking granularity of the registered engines, the generic hooks
+// filter and split stores at it
+std::atomic<uint64_t> hook_granularity_shift(crpm::kBlockShift);
+
+void store_hook_generic(void *addr);
+
+void range_store_hook_generic(void *addr, size_t length);
+
+template<size_t TrackingShift, size_t BlockShift, size_t SegmentShift>
+void store_hook(void *addr);
+
+template<size_t TrackingShift, size_t BlockShift, size_t SegmentShift>
+void range_store_hook(void *addr, size_t length);
+
+// Hooks taken by the instrumented stores, the ones of the registered pools
+// if they all share them and the generic ones otherwise
+std::atomic<void (*)(void *)> store_hook_routine(store_hook_generic);
+std::atomic<void (*)(void *, size_t)> range_store_hook_routine(range_store_hook_generic);
+
 // #define LEGACY_HOOK_FUNCTION
 
 namespace crpm {
@@ -19,6 +42,8 @@ namespace crpm {
     void NvmInstEngine::Registry::do_register(NvmInstEngine *engine) {
         std::lock_guard<std::mutex> guard(mutex);
         engines.insert(engine);
+        table.insert(engine->address_range.first, engine->address_range.second, engine);
+        update_hook_dispatch();
         if (!default_engine) {
             default_engine = engine;
         }
@@ -27,41 +52,33 @@ namespace crpm {
     void NvmInstEngine::Registry::do_unregister(NvmInstEngine *engine) {
         std::lock_guard<std::mutex> guard(mutex);
         engines.erase(engine);
+        table.erase(engine->address_range.first, engine->address_range.second, engine);
+        update_hook_dispatch();
         if (engine == default_engine) {
             default_engine = nullptr;
         }
     }
 
     NvmInstEngine *NvmInstEngine::Registry::find(const void *addr) {
-        uintptr_t u_addr = (uintptr_t) addr;
-        if (likely(default_engine != nullptr)) {
-            auto &range = default_engine->address_range;
-            if (likely(u_addr >= range.first && u_addr < range.second)) {
-                return default_engine;
-            }
-        }
-        if (engines.size() == 1) {
-            return nullptr;
-        }
-        for (auto engine : engines) {
-            auto &range = engine->address_range;
-            if (u_addr >= range.first && u_addr < range.second) {
-                return engine;
-            }
-        }
-        return nullptr;
+        return table.find((uintptr_t) addr);
     }
 
-    NvmInstEngine *NvmInstEngine::Registry::find_address_space(const void *addr) {
-        uintptr_t u_addr = (uintptr_t) addr;
+    // Called with mutex held
+    void NvmInstEngine::Registry::update_hook_dispatch() {
+        size_t shift = engines.empty() ? kBlockShift : SIZE_MAX;
+        StoreHooks hooks = {store_hook_generic, range_store_hook_generic};
         for (auto engine : engines) {
-            uintptr_t start = (uintptr_t) engine->image->get_start_address();
-            uintptr_t end = (uintptr_t) engine->image->get_end_address();
-            if (u_addr >= start && u_addr < end) {
-                return engine;
+            shift = std::min(shift, engine->tracking_shift);
+            if (engine == *engines.begin()) {
+                hooks = engine->store_hooks;
+            } else if (hooks.store != engine->store_hooks.store) {
+                hooks = {store_hook_generic, range_store_hook_generic};
             }
         }
-        return nullptr;
+        hook_granularity_shift.store(shift, std::memory_order_relaxed);
+        store_hook_routine.store(hooks.store, std::memory_order_relaxed);
+        range_store_hook_routine.store(hooks.range_store, std::memory_order_relaxed);
+        store_filter_invalidate();
     }
 
     void NvmInstEngine::Registry::hook_routine(const void *addr) {
@@ -100,35 +117,171 @@ namespace crpm {
         }
     }
 
-    bool NvmInstEngine::create_checkpoint_image(const char *path, size_t user_capacity,
-                                                void *hint_addr, int flags,
-                                                const MemoryPoolOption &option) {
+    void NvmInstEngine::Registry::enable_segfault_handler() {
+        std::call_once(segfault_handler_flag, [this] {
+            struct sigaction sa;
+            sa.sa_flags = SA_SIGINFO;
+            sigemptyset(&sa.sa_mask);
+            sa.sa_sigaction = &Registry::SegfaultHandlerProc;
+            if (sigaction(SIGSEGV, &sa, &prev_segfault_action) < 0) {
+                perror("sigaction");
+                exit(EXIT_FAILURE);
+            }
+        });
+    }
+
+    void NvmInstEngine::Registry::SegfaultHandlerProc(int sig, siginfo_t *info, void *ucontext) {
+        Registry *registry = Get();
+        if (info->si_code == SEGV_ACCERR) {
+            NvmInstEngine *engine = registry->find(info->si_addr);
+            if (engine && engine->restore_faulting_segment(info->si_addr)) {
+                return;
+            }
+        }
+        // Not a segment of a lazy recovery, the previous disposition applies
+        // when the faulting access is retried
+        struct sigaction &prev = registry->prev_segfault_action;
+        if (prev.sa_flags & SA_SIGINFO) {
+            prev.sa_sigaction(sig, info, ucontext);
+        } else if (prev.sa_handler != SIG_DFL && prev.sa_handler != SIG_IGN) {
+            prev.sa_handler(sig);
+        } else {
+            signal(SIGSEGV, SIG_DFL);
+        }
+    }
+
+    // An existing pool keeps the geometry it was created with, a new one
+    // takes that of the options
+    static bool ResolveGeometry(const char *path, const MemoryPoolOption &option,
+                                size_t &block_shift, size_t &segment_shift) {
+        if (!option.create || (!option.truncate && FileSystem::Exist(path))) {
+            uint8_t prefix[kCacheLineSize];
+            if (!FileSystem::ReadHeader(path, prefix, sizeof(prefix))) {
+                return false;
+            }
+            if (!CheckpointImage::GetGeometry(prefix, block_shift, segment_shift)) {
+                fprintf(stderr, "magic number mismatch\n");
+                return false;
+            }
+            return true;
+        }
+        size_t block_size = option.block_size ? option.block_size : kBlockSize;
+        size_t segment_size = option.segment_size ? option.segment_size : kSegmentSize;
+        if ((block_size & (block_size - 1)) || (segment_size & (segment_size - 1))) {
+            fprintf(stderr, "block and segment sizes must be powers of two\n");
+            return false;
+        }
+        block_shift = __builtin_ctzll(block_size);
+        segment_shift = __builtin_ctzll(segment_size);
+        return true;
+    }
+
+    NvmInstEngine *NvmInstEngine::Open(const char *path,
+                                       const MemoryPoolOption &option) {
+        size_t block_shift, segment_shift;
+        if (!ResolveGeometry(path, option, block_shift, segment_shift)) {
+            return nullptr;
+        }
+#define CRPM_OPEN_ENGINE(B, S) \
+        if (block_shift == B && segment_shift == S) { \
+            return NvmInstEngineImpl<B, S>::Open(path, option); \
+        }
+        CRPM_FOR_EACH_GEOMETRY(CRPM_OPEN_ENGINE)
+#undef CRPM_OPEN_ENGINE
+        fprintf(stderr, "unsupported geometry: %lu-byte blocks, %lu-byte segments\n",
+                1ul << block_shift, 1ul << segment_shift);
+        return nullptr;
+    }
+
+#ifdef USE_MPI_EXTENSION
+    NvmInstEngine *NvmInstEngine::OpenForMPI(const char *path,
+                                             const MemoryPoolOption &option,
+                                             MPI_Comm comm) {
+        size_t block_shift, segment_shift;
+        if (!ResolveGeometry(path, option, block_shift, segment_shift)) {
+            return nullptr;
+        }
+#define CRPM_OPEN_ENGINE(B, S) \
+        if (block_shift == B && segment_shift == S) { \
+            return NvmInstEngineImpl<B, S>::OpenForMPI(path, option, comm); \
+        }
+        CRPM_FOR_EACH_GEOMETRY(CRPM_OPEN_ENGINE)
+#undef CRPM_OPEN_ENGINE
+        fprintf(stderr, "unsupported geometry: %lu-byte blocks, %lu-byte segments\n",
+                1ul << block_shift, 1ul << segment_shift);
+        return nullptr;
+    }
+#endif // USE_MPI_EXTENSION
+
+    template<size_t BlockShift, size_t SegmentShift>
+    bool NvmInstEngineImpl<BlockShift, SegmentShift>::create_checkpoint_image(const char *path, size_t user_capacity,
+                                                                              void *hint_addr, int flags,
+                                                                              const MemoryPoolOption &option) {
         capacity = user_capacity;
         nr_segments = capacity >> kSegmentShift;
         nr_back_segments = nr_segments * option.shadow_capacity_factor;
         nr_blocks = capacity >> kBlockShift;
-        uint64_t fs_size = CheckpointImage::CalculateFileSize(nr_segments, nr_back_segments);
-        int ret = fs.create(path, fs_size, flags, hint_addr);
-        if (!ret) {
-            return false;
+        max_capacity = std::max(capacity.load(), RoundUp(option.max_capacity, kSegmentSize));
+        uint64_t max_segments = max_capacity >> kSegmentShift;
+        // The back pool of a growable image is elastic, so only images that
+        // have nothing to grow use the fixed layout
+        if (max_capacity == capacity && nr_back_segments >= max_segments) {
+            uint64_t fs_size = CheckpointImage::CalculateFileSize(nr_segments, nr_back_segments);
+            int ret = fs.create(path, fs_size, flags, hint_addr);
+            if (!ret) {
+                return false;
+            }
+
+            void *base_addr = fs.rel_to_abs(0);
+            image = CheckpointImage::Open(base_addr, nr_segments, nr_back_segments, true);
+            if (!image) {
+                fs.close();
+                return false;
+            }
+            return true;
         }
 
-        void *base_addr = fs.rel_to_abs(0);
-        image = CheckpointImage::Open(base_addr, nr_segments, nr_back_segments, true);
-        if (!image) {
+        // Only the initial extent is allocated in the file, the address
+        // space of the largest image is reserved at the base address. The
+        // back pool may grow up to one back segment per main segment.
+        uint64_t max_back_segments = std::max(max_segments, nr_back_segments.load());
+        size_t header_size = CheckpointImage::CalculateGrowableHeaderSize(max_segments, max_back_segments);
+        uint64_t fs_size = header_size + CheckpointImage::CalculateExtentSize(nr_segments, nr_back_segments);
+        size_t reserved_size = CheckpointImage::CalculateReservedSize(max_segments, max_back_segments);
+        if (!fs.create(path, fs_size, flags, hint_addr, reserved_size) || !fs.map_range(0, 0, header_size)) {
+            fs.close();
+            return false;
+        }
+        image = CheckpointImage::Open(fs.rel_to_abs(0), nr_segments, nr_back_segments, true,
+                                      max_segments, max_back_segments);
+        if (!image || !map_checkpoint_image()) {
+            delete image;
             fs.close();
             return false;
         }
         return true;
     }
 
-    bool NvmInstEngine::open_checkpoint_image(const char *path, void *hint_addr, int flags) {
-        if (!fs.open(path, flags, hint_addr)) {
+    template<size_t BlockShift, size_t SegmentShift>
+    bool NvmInstEngineImpl<BlockShift, SegmentShift>::open_checkpoint_image(
+            const char *path, void *hint_addr, int flags) {
+        uint8_t prefix[kCacheLineSize];
+        size_t header_size, reserved_size;
+        if (!FileSystem::ReadHeader(path, prefix, sizeof(prefix))) {
+            return false;
+        }
+        if (CheckpointImage::GetGrowableLayout(prefix, header_size, reserved_size)) {
+            if (!fs.open(path, flags, hint_addr, reserved_size) || !fs.map_range(0, 0, header_size)) {
+                fs.close();
+                return false;
+            }
+        } else if (!fs.open(path, flags, hint_addr)) {
             return false;
         }
         void *base_addr = fs.rel_to_abs(0);
         image = CheckpointImage::Open(base_addr, 0, 0, false);
-        if (!image) {
+        if (!image || !map_checkpoint_image()) {
+            delete image;
             fs.close();
             return false;
         }
@@ -136,12 +289,313 @@ namespace crpm {
         nr_back_segments = image->get_nr_back_segments();
         nr_blocks = nr_segments * kBlocksPerSegment;
         capacity = nr_segments * kSegmentSize;
+        max_capacity = image->get_max_main_segments() * kSegmentSize;
         return true;
     }
 
-    NvmInstEngine *NvmInstEngine::Open(const char *path,
-                                       const MemoryPoolOption &option) {
-        NvmInstEngine *impl = new NvmInstEngine();
+    template<size_t BlockShift, size_t SegmentShift>
+    bool NvmInstEngineImpl<BlockShift, SegmentShift>::map_checkpoint_image() {
+        return image->map_extents([this](size_t offset, size_t file_offset, size_t length) {
+            return fs.map_range(offset, file_offset, length);
+        });
+    }
+
+    // Finds the main segments to restore, the pool is usable before they are
+    template<size_t BlockShift, size_t SegmentShift>
+    bool NvmInstEngineImpl<BlockShift, SegmentShift>::prepare_lazy_recovery() {
+        uint64_t pending = 0;
+        bool has_inconsistent = false;
+        segment_unrestored.allocate(nr_segments);
+        for (uint64_t main_id = 0; main_id < nr_segments; ++main_id) {
+            if (image->is_recovery_needed(main_id)) {
+                segment_unrestored.set(main_id);
+                pending++;
+                has_inconsistent |= (image->get_segment_state(main_id) == CheckpointImage::SS_Back);
+            }
+        }
+        if (has_inconsistent) {
+            main_alias = (uint8_t *) fs.map_alias();
+            if (!main_alias) {
+                return false;
+            }
+        }
+        nr_lazy_segments = nr_segments;
+        nr_unrestored.store(pending, std::memory_order_release);
+        return true;
+    }
+
+    // Protects the inconsistent main segments and starts the restorer. It
+    // runs once the engine is registered, from then on a fault restores
+    // the segment it hits.
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::start_lazy_recovery() {
+        if (!nr_unrestored.load(std::memory_order_acquire)) {
+            return;
+        }
+        Registry::Get()->enable_segfault_handler();
+        uint64_t main_id = 0;
+        while (main_id < nr_lazy_segments) {
+            uint64_t run_length = 0;
+            while (main_id + run_length < nr_lazy_segments &&
+                   segment_unrestored.test(main_id + run_length) &&
+                   image->get_segment_state(main_id + run_length) == CheckpointImage::SS_Back) {
+                run_length++;
+            }
+            if (!run_length) {
+                main_id++;
+                continue;
+            }
+            if (mprotect(image->get_main_segment(main_id), run_length * kSegmentSize, PROT_NONE)) {
+                // E.g. too many mappings, these segments are restored now
+                for (uint64_t i = 0; i < run_length; ++i) {
+                    restore_segment(main_id + i);
+                }
+            }
+            main_id += run_length;
+        }
+        restorer_running = true;
+        restorer = std::thread(&RestoreThreadRoutine, this);
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::restore_segment(uint64_t segment_id) {
+        if (!is_unrestored(segment_id)) {
+            return;
+        }
+        auto &lock = segment_locks[segment_id & (kSegmentLocks - 1)];
+        AcquireLock(lock);
+        restore_segment_locked(segment_id);
+        ReleaseLock(lock);
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::restore_segment_locked(uint64_t segment_id) {
+        if (!segment_unrestored.test(segment_id, std::memory_order_acquire)) {
+            return;
+        }
+        uint8_t *main_segment = image->get_main_segment(segment_id);
+        bool inconsistent = (image->get_segment_state(segment_id) == CheckpointImage::SS_Back);
+        uint64_t traffic;
+        if (inconsistent) {
+            traffic = image->recover_main_segment(segment_id, main_alias + fs.abs_to_rel(main_segment));
+            if (mprotect(main_segment, kSegmentSize, PROT_READ | PROT_WRITE)) {
+                perror("mprotect");
+                exit(EXIT_FAILURE);
+            }
+            if (unlikely(g_track_persist_ranges)) {
+                // Persisted ranges are tracked by address, not through
+                // the alias
+                FlushRegion(main_segment, kSegmentSize);
+                StoreFence();
+            }
+            image->clear_segment_diverged(segment_id);
+        } else {
+            traffic = image->recover_main_segment(segment_id);
+            // The back segment holds no copy of the main segment any more
+            reset_missing_blocks(segment_id, true);
+        }
+        segment_unrestored.clear(segment_id);
+        recovery_traffic.fetch_add(traffic, std::memory_order_relaxed);
+        nr_unrestored.fetch_sub(1, std::memory_order_release);
+    }
+
+    // Returns false if the fault is not caused by a lazy recovery
+    template<size_t BlockShift, size_t SegmentShift>
+    bool NvmInstEngineImpl<BlockShift, SegmentShift>::restore_faulting_segment(const void *addr) {
+        uint64_t segment_id = ((uintptr_t) addr - address_range.first) >> kSegmentShift;
+        if (segment_id >= nr_lazy_segments) {
+            return false;
+        }
+        restore_segment(segment_id);
+        return true;
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::RestoreThreadRoutine(NvmInstEngineImpl *engine) {
+        BindSingleSocket(FindLocalSocket(engine->image->get_main_segment(0)));
+        uint64_t start_clock = ReadTSC();
+        for (uint64_t segment_id = 0;
+             segment_id < engine->nr_lazy_segments && engine->restorer_running;
+             ++segment_id) {
+            engine->restore_segment(segment_id);
+        }
+        if (engine->verbose && !engine->nr_unrestored.load(std::memory_order_acquire)) {
+            printf("lazy recovery: %lu bytes restored in %.3lf ms\n",
+                   engine->recovery_traffic.load(std::memory_order_relaxed),
+                   CyclesToMilliseconds(ReadTSC() - start_clock));
+        }
+    }
+
+    // An existing history is always kept up to date, a checkpoint without
+    // its snapshot would break the chain
+    template<size_t BlockShift, size_t SegmentShift>
+    bool NvmInstEngineImpl<BlockShift, SegmentShift>::open_snapshot_history(
+            const char *path, const MemoryPoolOption &option, bool create) {
+        std::string history_path = SnapshotHistory::GetPath(path);
+        if (!create && FileSystem::Exist(history_path.c_str())) {
+            history = SnapshotHistory::Open(history_path.c_str(), kBlockShift);
+            return history != nullptr;
+        }
+        if (!option.retained_snapshots) {
+            if (create) {
+                // Left behind by a truncated pool
+                FileSystem::Remove(history_path.c_str());
+            }
+            return true;
+        }
+        size_t history_capacity = option.history_capacity ? option.history_capacity : capacity / 4;
+        history = SnapshotHistory::Create(history_path.c_str(), option.retained_snapshots,
+                                          history_capacity, kBlockShift);
+        return history != nullptr;
+    }
+
+    // Reserves the pre-images of the running checkpoint, called by its leader
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::begin_snapshot(uint64_t max_blocks) {
+        if (!history->begin_snapshot(image->get_committed_epoch(), max_blocks) && verbose) {
+            printf("history: %lu dirty blocks do not fit, snapshots dropped\n", max_blocks);
+        }
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    uint64_t NvmInstEngineImpl<BlockShift, SegmentShift>::count_dirty_blocks() {
+        uint64_t count = 0;
+        segment_dirty.for_each([this, &count](uint64_t seg_id) {
+            const uint64_t start_block_id = seg_id * kBlocksPerSegment;
+            for (uint64_t block_id = start_block_id;
+                 block_id < start_block_id + kBlocksPerSegment;
+                 block_id += AtomicBitSet::kBitWidth) {
+                count += __builtin_popcountll(block_dirty.test_all(block_id));
+            }
+        });
+        return count;
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::record_dirty_segment(uint64_t segment_id) {
+        const uint64_t start_block_id = segment_id * kBlocksPerSegment;
+        for (uint64_t block_id = start_block_id;
+             block_id < start_block_id + kBlocksPerSegment;
+             block_id += AtomicBitSet::kBitWidth) {
+            uint64_t bitset = block_dirty.test_all(block_id);
+            while (bitset != 0) {
+                uint64_t t = bitset & -bitset;
+                int i = __builtin_ctzll(bitset); // i == first set index
+                bitset ^= t;
+                record_pre_image(block_id + i);
+            }
+        }
+    }
+
+    // The pre-images are written like the stores of the application and
+    // committed by an ordinary checkpoint, which is the commit point of the
+    // rollback. Called before the pool is handed out.
+    template<size_t BlockShift, size_t SegmentShift>
+    bool NvmInstEngineImpl<BlockShift, SegmentShift>::restore_snapshot(uint64_t epoch) {
+        if (!history || !history->has_snapshot(epoch)) {
+            fprintf(stderr, "no snapshot of epoch %lu is retained\n", epoch);
+            return false;
+        }
+        uint64_t restored_blocks = 0;
+        history->begin_rollback(epoch, image->get_committed_epoch() + 1);
+        history->for_each_pre_image(epoch, [this, &restored_blocks](uint64_t block_id,
+                                                                    const uint8_t *pre_image) {
+            if (block_id >= nr_blocks) {
+                return;
+            }
+            uint8_t *addr = image->get_main_block(block_id);
+            hook_copy_on_write_routine(addr);
+            if (pre_image) {
+                memcpy(addr, pre_image, kBlockSize);
+            } else {
+                memset(addr, 0, kBlockSize);
+            }
+            hook_routine(addr);
+            restored_blocks++;
+        });
+        restoring_snapshot = true;
+        checkpoint(1);
+        restoring_snapshot = false;
+        history->recover(image->get_committed_epoch());
+        if (verbose) {
+            printf("history: epoch %lu restored, %lu blocks rewritten\n", epoch, restored_blocks);
+        }
+        return true;
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::allocate_dirty_bits() {
+        uint64_t max_segments = max_capacity >> kSegmentShift;
+        segment_dirty.allocate(nr_segments, max_segments);
+        segment_in_flight.allocate(nr_segments, max_segments);
+        block_dirty.allocate(nr_blocks, max_segments * kBlocksPerSegment);
+        if (track_lines) {
+            line_dirty.allocate(nr_blocks << kLineShift, (max_segments * kBlocksPerSegment) << kLineShift);
+        }
+        block_missing.allocate(nr_blocks, max_segments * kBlocksPerSegment);
+        write_back_deferred.allocate(nr_segments, max_segments);
+        write_back_pending.allocate(nr_segments, max_segments);
+        segment_viewed.allocate(nr_segments, max_segments);
+        segment_pinned.allocate(nr_segments, max_segments);
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::load_missing_blocks() {
+        if (!image->is_block_granular()) {
+            return;
+        }
+        for (uint64_t back_id = 0; back_id < nr_back_segments; ++back_id) {
+            uint64_t main_id = image->get_back_to_main(back_id);
+            if (main_id == kNullSegmentIndex) {
+                continue;
+            }
+            for (uint64_t i = 0; i < CheckpointImage::kMissingWordsPerSegment; ++i) {
+                block_missing.store_all(main_id * kBlocksPerSegment + i * AtomicBitSet::kBitWidth,
+                                        image->get_missing_blocks(back_id, i));
+            }
+        }
+    }
+
+    // A main segment has every block missing once it is bound, and none
+    // once it is unbound
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::reset_missing_blocks(uint64_t main_id, bool missing) {
+        if (!image->is_block_granular()) {
+            return;
+        }
+        const uint64_t start_block_id = main_id * kBlocksPerSegment;
+        for (uint64_t block_id = start_block_id;
+             block_id < start_block_id + kBlocksPerSegment;
+             block_id += AtomicBitSet::kBitWidth) {
+            block_missing.store_all(block_id, missing ? UINT64_MAX : 0);
+        }
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    bool NvmInstEngineImpl<BlockShift, SegmentShift>::init_back_segment_pool(const MemoryPoolOption &option) {
+        replacement_policy = ReplacementPolicy::Create(option.replacement_policy,
+                                                       image->get_max_back_segments());
+        if (!replacement_policy) {
+            return false;
+        }
+        shadow_factor = std::max(option.shadow_capacity_factor, 0.0);
+        write_elimination = option.write_elimination;
+        back_released.allocate(nr_back_segments, image->get_max_back_segments());
+        // Unbound back segments of an existing image may have been released
+        // by a shrink, they are allocated again before being bound
+        for (uint64_t i = 0; i < nr_back_segments; ++i) {
+            if (image->get_back_to_main(i) == kNullSegmentIndex) {
+                back_released.set(i);
+                nr_released_back_segments++;
+            }
+        }
+        return true;
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    NvmInstEngineImpl<BlockShift, SegmentShift> *NvmInstEngineImpl<BlockShift, SegmentShift>::Open(
+            const char *path, const MemoryPoolOption &option) {
+        NvmInstEngineImpl *impl = new NvmInstEngineImpl();
         bool ret;
         int flags = 0;
         bool create = false;
@@ -175,434 +629,1680 @@ namespace crpm {
             }
         }
 
-        impl->segment_dirty.allocate(impl->nr_segments);
-        impl->block_dirty.allocate(impl->nr_blocks);
+        impl->track_lines = option.track_dirty_lines;
+        impl->init_dirty_tracking();
+        impl->allocate_dirty_bits();
+        if (!impl->init_back_segment_pool(option)) {
+            impl->close_checkpoint_image();
+            delete impl;
+            return nullptr;
+        }
         impl->segment_locks = new std::atomic_flag[kSegmentLocks];
         for (uint64_t i = 0; i < kSegmentLocks; ++i) {
             impl->segment_locks[i].clear(std::memory_order_relaxed);
         }
+        if (!impl->open_snapshot_history(path, option, create) ||
+            !impl->open_segment_stash(path, create)) {
+            impl->close_checkpoint_image();
+            delete impl;
+            return nullptr;
+        }
 
         if (!create) {
             uint64_t a = ReadTSC();
+            uint64_t recovered = impl->recover_stashed_segments();
+            if (impl->history) {
+                impl->history->recover(impl->image->get_committed_epoch());
+            }
+            // A rollback rewrites the pool right away
+            if (!option.lazy_recovery || option.restore_epoch || !impl->prepare_lazy_recovery()) {
 #ifdef USE_IDENTICAL_DATA
-            impl->image->recovery(CheckpointImage::SS_Identical);
+                recovered += impl->image->recovery(CheckpointImage::SS_Identical, option.recovery_threads);
 #else
-            impl->image->recovery(CheckpointImage::SS_Back);
+                recovered += impl->image->recovery(CheckpointImage::SS_Back, option.recovery_threads);
 #endif
+            }
+            impl->load_missing_blocks();
             impl->has_snapshot = impl->exist_snapshot();
             uint64_t b = ReadTSC();
-            printf("%.3lf ms\n", (b - a) / 2400000.0);
+            printf("%.3lf ms\n", CyclesToMilliseconds(b - a));
+            if (option.verbose_output) {
+                printf("recovery: %lu bytes restored, %lu segments deferred\n",
+                       recovered, impl->nr_unrestored.load(std::memory_order_relaxed));
+                if (impl->history) {
+                    printf("history: %lu snapshots retained\n", impl->history->get_nr_snapshots());
+                }
+            }
         }
 
         impl->address_range.first = (uintptr_t) impl->image->get_main_block(0);
-        impl->address_range.second = impl->address_range.first + impl->capacity;
+        impl->address_range.second = impl->address_range.first + impl->max_capacity;
+
+        if (option.checkpoint_threads &&
+            !impl->workers.start(option.checkpoint_threads, impl->image->get_main_segment(0))) {
+            impl->close_checkpoint_image();
+            delete impl;
+            return nullptr;
+        }
 
-        Registry::Get()->do_register(impl);
         impl->verbose = option.verbose_output;
+        impl->calibrate_flush_cost();
+        Registry::Get()->do_register(impl);
         impl->has_init = true;
+        impl->start_lazy_recovery();
         impl->cleaner = std::thread(&WriteBackThreadRoutine, impl);
+        impl->checkpoint_worker = std::thread(&CheckpointWorkerRoutine, impl);
+        if (!create && option.restore_epoch && !impl->restore_snapshot(option.restore_epoch)) {
+            delete impl;
+            return nullptr;
+        }
         return impl;
     }
 
-    NvmInstEngine::NvmInstEngine() :
+    template<size_t BlockShift, size_t SegmentShift>
+    NvmInstEngineImpl<BlockShift, SegmentShift>::NvmInstEngineImpl() :
             has_init(false),
             has_snapshot(false),
+            image(nullptr),
             next_thread_id(0),
             checkpoint_traffic(0),
+            flush_traffic(0),
             flush_latency(0),
             write_back_latency(0),
+            checkpoint_fences(0),
+            background_traffic(0),
+            nr_evictions(0),
+            nr_full_copies(0),
+            write_elimination(false),
+            nr_eliminated_lines(0),
+            cleaner_epoch(0),
+            cleaner_start_clock(0),
+            cleaner_start_traffic(0),
+            cleaner_start_evictions(0),
+            cleaner_start_full_copies(0),
+            cleaner_start_eliminated_lines(0),
+            idle_start_evictions(0),
+            idle_start_full_copies(0),
+            idle_start_eliminated_lines(0),
+            nr_flush_threads(0),
+            flush_cursor(0),
+            write_back_cursor(0),
+            checkpoint_worker_running(true),
+            async_pending(false),
+            async_in_flight(false),
+            async_issued(0),
+            async_durable(0),
+            async_start_clock(0),
+            async_ticket(0),
+            checkpoint_start_clock(0),
+            checkpoint_persist_clock(0),
+            checkpoint_start_fences(0),
+            last_hooked_stores(0),
+            last_store_filter_hits(0),
+            cleaner_busy(false),
+            segment_locks(nullptr),
             cleaner_running(true),
             checkpoint_in_progress(false),
             cleaner_state(WB_IDLE),
-            next_back_id(0),
+            replacement_policy(nullptr),
             skip_copy_on_write(false),
-            verbose(false) {
+            track_lines(false),
+            flush_arena(kMaxFlushBlocks),
+            flush_by_recopy(false),
+            flush_cost_model(kBlockShift),
+            last_flush_method(FlushCostModel::METHOD_FLUSH_BLOCKS),
+            shadow_factor(kShadowMemoryCapacityFactor),
+            nr_released_back_segments(0),
+            working_set(),
+            working_set_cursor(0),
+            nr_deferred_segments(0),
+            nr_unrestored(0),
+            nr_lazy_segments(0),
+            main_alias(nullptr),
+            restorer_running(false),
+            recovery_traffic(0),
+            history(nullptr),
+            restoring_snapshot(false),
+            history_cursor(0),
+            nr_views(0),
+            verbose(false),
+            stash(nullptr),
+            nr_stashed_segments(0) {
         for (uint64_t i = 0; i < kMaxThreads; ++i) {
-            flush_blocks[i] = (volatile uint64_t *)
-                    malloc(sizeof(uint64_t) * kMaxFlushBlocks);
+            flush_blocks[i] = nullptr;
             flush_blocks_count[i] = 0;
         }
         back_memory_lock.clear(std::memory_order_relaxed);
     }
 
-    NvmInstEngine::~NvmInstEngine() {
+    // The destructor only releases the image of an initialized engine
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::close_checkpoint_image() {
+        if (main_alias) {
+            fs.unmap_alias(main_alias);
+            main_alias = nullptr;
+        }
+        delete image;
+        image = nullptr;
+        delete[] segment_locks;
+        segment_locks = nullptr;
+        fs.close();
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    NvmInstEngineImpl<BlockShift, SegmentShift>::~NvmInstEngineImpl() {
         if (has_init) {
+            restorer_running = false;
+            if (restorer.joinable()) {
+                restorer.join();
+            }
+            wait_for_async_checkpoint();
+            {
+                std::lock_guard<std::mutex> guard(async_mutex);
+                checkpoint_worker_running = false;
+            }
+            async_condvar.notify_all();
+            checkpoint_worker.join();
             cleaner_running = false;
             cleaner_condvar.notify_all();
             cleaner.join();
-            for (uint64_t i = 0; i < kMaxThreads; ++i) {
-                free((void *) flush_blocks[i]);
+            for (auto view : views) {
+                fs.unmap_alias(view->alias);
+                delete view;
             }
+            views.clear();
             delete image;
             delete[]segment_locks;
+            if (main_alias) {
+                fs.unmap_alias(main_alias);
+            }
             fs.close();
             Registry::Get()->do_unregister(this);
             if (verbose) {
                 printf("checkpoint_traffic: %.3lf MiB\n",
                        checkpoint_traffic / 1000000.0);
+                printf("flush_traffic: %.3lf MiB\n",
+                       flush_traffic / 1000000.0);
+                uint64_t nr_checkpoints = stats_history.get_nr_records();
+                if (nr_checkpoints) {
+                    printf("per checkpoint (%ld): flushed %.1lf bytes copied %.1lf bytes\n", nr_checkpoints,
+                           (double) flush_traffic / nr_checkpoints,
+                           (double) checkpoint_traffic / nr_checkpoints);
+                }
                 printf("flush_latency: %.3lf ms\n",
-                       flush_latency / 2400000.0);
+                       CyclesToMilliseconds(flush_latency));
                 printf("write_back_latency: %.3lf ms\n",
-                       write_back_latency / 2400000.0);
-                printf("nr_blocks %ld nr_segments %ld\n", nr_blocks, nr_segments);
+                       CyclesToMilliseconds(write_back_latency));
+                printf("nr_blocks %ld nr_segments %ld\n", nr_blocks.load(), nr_segments.load());
+                printf("replacement policy %s: evictions %ld full segment copies %ld\n",
+                       replacement_policy->get_name(), nr_evictions.load(), nr_full_copies.load());
+                if (write_elimination) {
+                    printf("write elimination: %ld lines\n", nr_eliminated_lines.load());
+                }
+                if (nr_stashed_segments.load()) {
+                    printf("back pool full: %ld segments stashed\n", nr_stashed_segments.load());
+                }
+                if (g_persist_mode == PERSIST_EMULATED) {
+                    PersistCounters counters = GetPersistCounters();
+                    printf("emulated flush %ld fence %ld wbinvd %ld\n",
+                           counters.nr_flushes, counters.nr_fences, counters.nr_wbinvds);
+                }
             }
         }
+        delete replacement_policy;
+        delete history;
+        delete stash;
     }
 
-    void NvmInstEngine::determine_flush_mode() {
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::determine_flush_mode() {
         uint64_t total_blocks = 0;
-        bool all_empty = true, has_full = false;
-        for (size_t i = 0; i < kMaxThreads; ++i) {
+        bool has_full = false;
+        for (uint64_t k = 0; k < flush_arena.get_nr_threads(); ++k) {
+            size_t i = flush_arena.get_thread(k);
             size_t size = flush_blocks_count[i];
-            if (size != 0) {
-                all_empty = false;
-            }
-            // total_blocks += size;
-            total_blocks = size;
-            if (total_blocks >= kMaxFlushBlocks) {
+            total_blocks += size;
+            if (size >= kMaxFlushBlocks) {
                 has_full = true;
             }
         }
-        if (all_empty) {
+        flush_by_recopy = false;
+        if (total_blocks == 0) {
             flush_mode = FMODE_NO_ACTION;
             return;
-        } else if (has_full) {
+        }
+
+        uint64_t dirty_segments = segment_dirty.count();
+        FlushCostModel::Estimate estimate;
+        FlushCostModel::Method method = flush_cost_model.choose(total_blocks, dirty_segments, estimate);
+        if (has_full) {
+            // A full bucket has dropped blocks, only wbinvd covers them
+            method = FlushCostModel::METHOD_WBINVD;
+        }
+        if (method == FlushCostModel::METHOD_WBINVD) {
             flush_mode = FMODE_WBINVD;
         } else {
             flush_mode = FMODE_USE_FLUSH_BLOCKS;
+            flush_by_recopy = (method == FlushCostModel::METHOD_NT_RECOPY);
         }
-    }
 
-    void NvmInstEngine::checkpoint(uint64_t nr_threads) {
-        uint64_t start_clock, persist_clock;
-        int tid = next_thread_id.fetch_add(1, std::memory_order_relaxed);
-        bool is_leader = (tid == 0);
-        bool thread_busy = true;
+        if (verbose && method != last_flush_method) {
+            printf("flush mode %s -> %s: %lu blocks in %lu segments%s, estimated "
+                   "flush-blocks %.3lf ms, nt-recopy %.3lf ms, wbinvd %.3lf ms\n",
+                   FlushCostModel::GetMethodName(last_flush_method),
+                   FlushCostModel::GetMethodName(method),
+                   total_blocks, dirty_segments, has_full ? " (bucket full)" : "",
+                   estimate.flush_blocks_ms, estimate.nt_recopy_ms, estimate.wbinvd_ms);
+        }
+        last_flush_method = method;
+    }
 
-        barrier.barrier(nr_threads, tid);
-        if (is_leader) {
-            start_clock = ReadTSC();
-            address_buffer_clear_all();
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::calibrate_flush_cost() {
+        // Rewrites the head of the main area with its own content, so it has
+        // to run before the pool is shared with other threads
+        flush_cost_model.calibrate(image->get_main_segment(0), capacity);
+        if (verbose) {
+            flush_cost_model.print();
         }
+    }
 
-        std::atomic_thread_fence(std::memory_order_release);
-        barrier.barrier(nr_threads, tid);
-        if (is_leader) {
-            thread_busy = (cleaner_state.load(std::memory_order_acquire) != WB_IDLE);
-            determine_flush_mode();
-            if (flush_mode == FMODE_NO_ACTION) {
-                next_thread_id.store(0, std::memory_order_relaxed);
-            } else {
-                checkpoint_in_progress.store(true, std::memory_order_relaxed);
-                skip_copy_on_write = false;
-                if (flush_mode == FMODE_WBINVD || thread_busy) {
-                    cleaner_mutex.lock();
-                } else if (nr_segments == nr_back_segments) {
-                    skip_copy_on_write = true;
-                }
-            }
-            // printf("[DEBUG] checkpoint: flush_mode %d, skip_copy_on_write %d\n",
-            //        flush_mode, skip_copy_on_write);
-            latch.latch_add(tid);
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::begin_stats(CheckpointStats &stats) {
+        memset(&stats, 0, sizeof(stats));
+        stats.flush_mode = flush_by_recopy ? CRPM_FLUSH_MODE_NT_RECOPY : flush_mode;
+        for (uint64_t k = 0; k < flush_arena.get_nr_threads(); ++k) {
+            size_t i = flush_arena.get_thread(k);
+            stats.dirty_blocks += flush_blocks_count[i];
         }
-        latch.latch_wait(tid);
+        stats.dirty_segments = segment_dirty.count();
+        stats.bytes_copied = checkpoint_traffic.load(std::memory_order_relaxed);
+        stats.bytes_flushed = flush_traffic.load(std::memory_order_relaxed);
+        if (cleaner_state.load(std::memory_order_acquire) == WB_IDLE) {
+            stats.back_segment_evictions = idle_start_evictions.load(std::memory_order_relaxed);
+            stats.full_segment_copies = idle_start_full_copies.load(std::memory_order_relaxed);
+            stats.eliminated_lines = idle_start_eliminated_lines.load(std::memory_order_relaxed);
+        } else {
+            // Already accounted to the background write-back of the last epoch
+            stats.back_segment_evictions = nr_evictions.load(std::memory_order_relaxed);
+            stats.full_segment_copies = nr_full_copies.load(std::memory_order_relaxed);
+            stats.eliminated_lines = nr_eliminated_lines.load(std::memory_order_relaxed);
+        }
+        stats.back_segments = get_nr_usable_back_segments();
+        uint64_t hooked_stores, filter_hits;
+        store_filter_get_stats(hooked_stores, filter_hits);
+        stats.hooked_stores = hooked_stores - last_hooked_stores;
+        stats.store_filter_hits = filter_hits - last_store_filter_hits;
+        last_hooked_stores = hooked_stores;
+        last_store_filter_hits = filter_hits;
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::begin_checkpoint() {
+        wait_for_async_checkpoint();
+        checkpoint_start_clock = ReadTSC();
+        checkpoint_start_fences = tl_nr_fences;
+        address_buffer_clear_all();
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    bool NvmInstEngineImpl<BlockShift, SegmentShift>::prepare_checkpoint() {
+        cleaner_busy = (cleaner_state.load(std::memory_order_acquire) != WB_IDLE);
+        determine_flush_mode();
+        begin_stats(checkpoint_stats);
         if (flush_mode == FMODE_NO_ACTION) {
-            return;
+            checkpoint_stats.bytes_copied = 0;
+            checkpoint_stats.bytes_flushed = 0;
+            checkpoint_stats.back_segment_evictions = 0;
+            checkpoint_stats.full_segment_copies = 0;
+            checkpoint_stats.eliminated_lines = 0;
+            checkpoint_stats.fences = tl_nr_fences - checkpoint_start_fences;
+            checkpoint_stats.total_ms = CyclesToMilliseconds(ReadTSC() - checkpoint_start_clock);
+            checkpoint_stats.background_completed = true;
+            stats_history.append(checkpoint_stats);
+            return false;
+        }
+        partition_flush_blocks();
+        if (history && !restoring_snapshot) {
+            begin_snapshot(flush_mode == FMODE_WBINVD ? count_dirty_blocks()
+                                                      : flush_blocks_offset[nr_flush_threads]);
         }
+        checkpoint_in_progress.store(true, std::memory_order_relaxed);
+        skip_copy_on_write = false;
+        if (flush_mode == FMODE_WBINVD || cleaner_busy) {
+            cleaner_mutex.lock();
+        } else if (image->get_nr_bound_segments() == nr_segments) {
+            skip_copy_on_write = true;
+        }
+        // printf("[DEBUG] checkpoint: flush_mode %d, skip_copy_on_write %d\n",
+        //        flush_mode, skip_copy_on_write);
+        return true;
+    }
 
-        flush_parallel(tid, nr_threads);
-        barrier.barrier(nr_threads, tid);
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::commit_main_state() {
+        commit_layout_state(CheckpointImage::SS_Main);
+        CrashPoint("checkpoint.main_committed");
+        checkpoint_persist_clock = ReadTSC();
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::finish_checkpoint() {
+        CheckpointStats &stats = checkpoint_stats;
+        uint64_t start_clock = checkpoint_start_clock;
         if (flush_mode == FMODE_USE_FLUSH_BLOCKS) {
-            if (is_leader) {
-                commit_layout_state(CheckpointImage::SS_Main);
-                persist_clock = ReadTSC();
-                latch.latch_add(tid);
-            }
-            latch.latch_wait(tid);
-            uint64_t delta = write_back_parallel(tid, nr_threads);
-            checkpoint_traffic.fetch_add(delta, std::memory_order_relaxed);
-            barrier.barrier(nr_threads, tid);
-            if (is_leader) {
+            uint64_t persist_clock = checkpoint_persist_clock;
+            CrashPoint("checkpoint.written_back");
 #ifdef USE_IDENTICAL_DATA
-                commit_layout_state(CheckpointImage::SS_Identical);
+            commit_layout_state(CheckpointImage::SS_Identical);
 #else
-                commit_layout_state(CheckpointImage::SS_Back);
+            commit_layout_state(CheckpointImage::SS_Back);
 #endif //USE_IDENTICAL_DATA
-                uint64_t complete_clock = ReadTSC();
-                next_thread_id.store(0, std::memory_order_relaxed);
-                flush_latency.fetch_add(persist_clock - start_clock,
-                                        std::memory_order_relaxed);
-                write_back_latency.fetch_add(complete_clock - persist_clock,
-                                             std::memory_order_relaxed);
-                if (unlikely(!has_snapshot)) {
-                    image->set_attributes(kAttributeHasSnapshot);
-                    has_snapshot = true;
-                }
-                clear_dirty_bits();
-                for (uint64_t i = 0; i < kMaxThreads; ++i) {
-                    flush_blocks_count[i] = 0;
-                }
-                checkpoint_in_progress.store(false, std::memory_order_relaxed);
-                if (thread_busy) {
-                    cleaner_mutex.unlock();
-                    cleaner_condvar.notify_all();
-                }
-                latch.latch_add(tid);
+            uint64_t complete_clock = ReadTSC();
+            stats.deferred_segments = nr_deferred_segments;
+            if (unlikely(nr_deferred_segments)) {
+                write_back_deferred.clear_region(0, nr_segments);
+                nr_deferred_segments = 0;
             }
-            std::atomic_thread_fence(std::memory_order_release);
-            latch.latch_wait(tid);
-        } else {
-            if (is_leader) {
-                commit_layout_state(CheckpointImage::SS_Main);
-                segment_dirty.clear_region(0, nr_segments);
-                persist_clock = ReadTSC();
-                next_thread_id.store(0, std::memory_order_relaxed);
-                flush_latency.fetch_add(persist_clock - start_clock,
-                                        std::memory_order_relaxed);
-                if (unlikely(!has_snapshot)) {
-                    image->set_attributes(kAttributeHasSnapshot);
-                    has_snapshot = true;
-                }
-                cleaner_state.store(WB_STARTED, std::memory_order_relaxed);
-                for (uint64_t i = 0; i < kMaxThreads; ++i) {
-                    flush_blocks_count[i] = 0;
-                }
-                checkpoint_in_progress.store(false, std::memory_order_relaxed);
+            record_back_segment_accesses(segment_dirty);
+            resize_back_segments(stats.dirty_segments, !cleaner_busy);
+            stats.back_segments = get_nr_usable_back_segments();
+            flush_latency.fetch_add(persist_clock - start_clock,
+                                    std::memory_order_relaxed);
+            write_back_latency.fetch_add(complete_clock - persist_clock,
+                                         std::memory_order_relaxed);
+            stats.bytes_copied = checkpoint_traffic.load(std::memory_order_relaxed) - stats.bytes_copied;
+            stats.bytes_flushed = flush_traffic.load(std::memory_order_relaxed) - stats.bytes_flushed;
+            stats.back_segment_evictions = nr_evictions.load(std::memory_order_relaxed)
+                                           - stats.back_segment_evictions;
+            stats.full_segment_copies = nr_full_copies.load(std::memory_order_relaxed)
+                                        - stats.full_segment_copies;
+            stats.eliminated_lines = nr_eliminated_lines.load(std::memory_order_relaxed)
+                                     - stats.eliminated_lines;
+            mark_write_back_complete();
+            stats.fences = checkpoint_fences.exchange(0, std::memory_order_relaxed)
+                           + tl_nr_fences - checkpoint_start_fences;
+            stats.flush_ms = CyclesToMilliseconds(persist_clock - start_clock);
+            stats.write_back_ms = CyclesToMilliseconds(complete_clock - persist_clock);
+            stats.total_ms = CyclesToMilliseconds(complete_clock - start_clock);
+            stats.background_completed = true;
+            stats_history.append(stats);
+            if (unlikely(!has_snapshot)) {
+                image->set_attributes(kAttributeHasSnapshot);
+                has_snapshot = true;
+            }
+            clear_dirty_bits();
+            for (uint64_t k = 0; k < flush_arena.get_nr_threads(); ++k) {
+                uint64_t i = flush_arena.get_thread(k);
+                flush_blocks_count[i] = 0;
+            }
+            checkpoint_in_progress.store(false, std::memory_order_relaxed);
+            if (cleaner_busy) {
                 cleaner_mutex.unlock();
                 cleaner_condvar.notify_all();
+            }
+        } else {
+            commit_layout_state(CheckpointImage::SS_Main);
+            record_back_segment_accesses(segment_dirty);
+            mark_write_back_pending(segment_dirty);
+            segment_dirty.clear_region(0, nr_segments);
+            uint64_t persist_clock = ReadTSC();
+            flush_latency.fetch_add(persist_clock - start_clock,
+                                    std::memory_order_relaxed);
+            stats.bytes_copied = 0;
+            stats.bytes_flushed = flush_traffic.load(std::memory_order_relaxed) - stats.bytes_flushed;
+            stats.back_segment_evictions = nr_evictions.load(std::memory_order_relaxed)
+                                           - stats.back_segment_evictions;
+            stats.full_segment_copies = nr_full_copies.load(std::memory_order_relaxed)
+                                        - stats.full_segment_copies;
+            stats.eliminated_lines = nr_eliminated_lines.load(std::memory_order_relaxed)
+                                     - stats.eliminated_lines;
+            stats.fences = checkpoint_fences.exchange(0, std::memory_order_relaxed)
+                           + tl_nr_fences - checkpoint_start_fences;
+            stats.flush_ms = CyclesToMilliseconds(persist_clock - start_clock);
+            stats.total_ms = stats.flush_ms;
+            // The cleaner is about to bind a back segment to each of them
+            resize_back_segments(stats.dirty_segments, false);
+            stats.back_segments = get_nr_usable_back_segments();
+            restart_cleaner(stats_history.append(stats), persist_clock);
+            if (unlikely(!has_snapshot)) {
+                image->set_attributes(kAttributeHasSnapshot);
+                has_snapshot = true;
+            }
+            for (uint64_t k = 0; k < flush_arena.get_nr_threads(); ++k) {
+                uint64_t i = flush_arena.get_thread(k);
+                flush_blocks_count[i] = 0;
+            }
+            checkpoint_in_progress.store(false, std::memory_order_relaxed);
+            cleaner_mutex.unlock();
+            cleaner_condvar.notify_all();
+        }
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::checkpoint(uint64_t nr_threads) {
+        if (workers.get_nr_threads() != 0) {
+            checkpoint_by_workers();
+            return;
+        }
+
+        uint64_t start_fences = tl_nr_fences;
+        int tid = next_thread_id.fetch_add(1, std::memory_order_relaxed);
+        bool is_leader = (tid == 0);
+
+        barrier.barrier(nr_threads, tid);
+        if (is_leader) {
+            // Snapshot views are not opened while the epoch is committed
+            checkpoint_mutex.lock();
+            begin_checkpoint();
+        }
+
+        std::atomic_thread_fence(std::memory_order_release);
+        barrier.barrier(nr_threads, tid);
+        if (is_leader) {
+            if (!prepare_checkpoint()) {
+                next_thread_id.store(0, std::memory_order_relaxed);
+                checkpoint_mutex.unlock();
+            }
+            latch.latch_add(tid);
+        }
+        latch.latch_wait(tid);
+        if (flush_mode == FMODE_NO_ACTION) {
+            return;
+        }
+
+        flush_traffic.fetch_add(flush_parallel(tid, nr_threads), std::memory_order_relaxed);
+        if (!is_leader) {
+            checkpoint_fences.fetch_add(tl_nr_fences - start_fences, std::memory_order_relaxed);
+            start_fences = tl_nr_fences;
+        }
+        barrier.barrier(nr_threads, tid);
+        if (is_leader) {
+            CrashPoint("checkpoint.flushed");
+        }
+        if (flush_mode == FMODE_USE_FLUSH_BLOCKS) {
+            if (is_leader) {
+                commit_main_state();
                 latch.latch_add(tid);
             }
-            std::atomic_thread_fence(std::memory_order_release);
             latch.latch_wait(tid);
+            uint64_t delta = write_back_parallel(tid, nr_threads);
+            checkpoint_traffic.fetch_add(delta, std::memory_order_relaxed);
+            if (!is_leader) {
+                checkpoint_fences.fetch_add(tl_nr_fences - start_fences, std::memory_order_relaxed);
+            }
+            barrier.barrier(nr_threads, tid);
         }
+        if (is_leader) {
+            finish_checkpoint();
+            checkpoint_mutex.unlock();
+            next_thread_id.store(0, std::memory_order_relaxed);
+            latch.latch_add(tid);
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        latch.latch_wait(tid);
     }
 
-    void NvmInstEngine::commit_layout_state(uint8_t state) {
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::checkpoint_by_workers() {
+        std::lock_guard<std::mutex> guard(checkpoint_mutex);
+        begin_checkpoint();
+        if (!prepare_checkpoint()) {
+            return;
+        }
+
+        workers.run([this](int tid, int nr_threads) {
+            uint64_t start_fences = tl_nr_fences;
+            flush_traffic.fetch_add(flush_parallel(tid, nr_threads), std::memory_order_relaxed);
+            if (tid != 0) {
+                checkpoint_fences.fetch_add(tl_nr_fences - start_fences, std::memory_order_relaxed);
+            }
+        });
+        CrashPoint("checkpoint.flushed");
+        if (flush_mode == FMODE_USE_FLUSH_BLOCKS) {
+            commit_main_state();
+            workers.run([this](int tid, int nr_threads) {
+                uint64_t start_fences = tl_nr_fences;
+                uint64_t delta = write_back_parallel(tid, nr_threads);
+                checkpoint_traffic.fetch_add(delta, std::memory_order_relaxed);
+                if (tid != 0) {
+                    checkpoint_fences.fetch_add(tl_nr_fences - start_fences, std::memory_order_relaxed);
+                }
+            });
+        }
+        finish_checkpoint();
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    uint64_t NvmInstEngineImpl<BlockShift, SegmentShift>::checkpoint_async(uint64_t nr_threads) {
+        int tid = next_thread_id.fetch_add(1, std::memory_order_relaxed);
+        bool is_leader = (tid == 0);
+
+        barrier.barrier(nr_threads, tid);
+        if (is_leader) {
+            checkpoint_mutex.lock();
+            wait_for_async_checkpoint();
+            async_start_clock = ReadTSC();
+            address_buffer_clear_all();
+        }
+
+        std::atomic_thread_fence(std::memory_order_release);
+        barrier.barrier(nr_threads, tid);
+        if (is_leader) {
+            determine_flush_mode();
+            begin_stats(async_stats);
+            if (flush_mode == FMODE_NO_ACTION) {
+                async_stats.bytes_copied = 0;
+                async_stats.bytes_flushed = 0;
+                async_stats.back_segment_evictions = 0;
+                async_stats.full_segment_copies = 0;
+                async_stats.eliminated_lines = 0;
+                async_stats.total_ms = CyclesToMilliseconds(ReadTSC() - async_start_clock);
+                async_stats.background_completed = true;
+                stats_history.append(async_stats);
+                async_ticket = async_durable.load(std::memory_order_relaxed);
+            } else {
+                // Park the cleaner, it resumes once the epoch is durable
+                checkpoint_in_progress.store(true, std::memory_order_relaxed);
+                cleaner_mutex.lock();
+                cleaner_mutex.unlock();
+                skip_copy_on_write = false;
+
+                async_blocks.clear();
+                if (flush_mode == FMODE_USE_FLUSH_BLOCKS) {
+                    for (uint64_t k = 0; k < flush_arena.get_nr_threads(); ++k) {
+                        size_t i = flush_arena.get_thread(k);
+                        uint64_t bucket_size = flush_blocks_count[i];
+                        for (uint64_t j = 0; j != bucket_size; ++j) {
+                            uint64_t block_id = flush_blocks[i][j];
+                            async_blocks.push_back(block_id);
+                        }
+                    }
+                }
+                for (uint64_t k = 0; k < flush_arena.get_nr_threads(); ++k) {
+                    uint64_t i = flush_arena.get_thread(k);
+                    flush_blocks_count[i] = 0;
+                }
+                if (history) {
+                    // Recorded before the application resumes and the back
+                    // segments of the epoch may be rebound
+                    if (flush_mode == FMODE_USE_FLUSH_BLOCKS) {
+                        begin_snapshot(async_blocks.size());
+                        for (auto block_id : async_blocks) {
+                            record_pre_image(block_id);
+                        }
+                    } else {
+                        begin_snapshot(count_dirty_blocks());
+                        segment_dirty.for_each([this](uint64_t seg_id) {
+                            record_dirty_segment(seg_id);
+                        });
+                    }
+                    StoreFence();
+                }
+                segment_dirty.for_each_word([this](uint64_t seg_id, uint64_t bitset) {
+                    segment_in_flight.store_all(seg_id, bitset);
+                });
+                record_back_segment_accesses(segment_dirty);
+                segment_dirty.clear_region(0, nr_segments);
+
+                std::lock_guard<std::mutex> guard(async_mutex);
+                async_ticket = async_issued.fetch_add(1, std::memory_order_relaxed) + 1;
+                async_in_flight.store(true, std::memory_order_release);
+                async_pending = true;
+                async_condvar.notify_all();
+            }
+            checkpoint_mutex.unlock();
+            next_thread_id.store(0, std::memory_order_relaxed);
+            latch.latch_add(tid);
+        }
+        latch.latch_wait(tid);
+        return async_ticket;
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::persist_async_checkpoint() {
+        uint64_t start_fences = tl_nr_fences;
+        uint8_t *base_address = (uint8_t *) get_address(0);
         if (flush_mode == FMODE_WBINVD) {
-            image->begin_segment_state_update();
-            for (uint64_t seg_id = 0; seg_id < nr_segments; seg_id += AtomicBitSet::kBitWidth) {
-                uint64_t bitset = segment_dirty.test_all(seg_id);
-                while (bitset != 0) {
-                    uint64_t t = bitset & -bitset;
-                    int i = __builtin_ctzll(bitset); // i == first set index
-                    bitset ^= t;
-                    image->set_segment_state(seg_id + i, state);
+            WriteBackAndInvalidate();
+        } else if (workers.get_nr_threads() != 0) {
+            workers.run([this, base_address](int tid, int nr_threads) {
+                uint64_t bytes = 0;
+                for (size_t i = tid; i < async_blocks.size(); i += nr_threads) {
+                    bytes += persist_block(base_address, async_blocks[i]);
                 }
+                StoreFence();
+                flush_traffic.fetch_add(bytes, std::memory_order_relaxed);
+            });
+        } else {
+            uint64_t bytes = 0;
+            for (auto block_id : async_blocks) {
+                bytes += persist_block(base_address, block_id);
+            }
+            flush_traffic.fetch_add(bytes, std::memory_order_relaxed);
+        }
+        StoreFence();
+        CrashPoint("checkpoint.flushed");
+
+        if (history) {
+            history->commit_snapshot();
+        }
+        image->begin_segment_state_update();
+        if (flush_mode == FMODE_WBINVD) {
+            segment_in_flight.for_each([this](uint64_t seg_id) {
+                image->set_segment_state(seg_id, CheckpointImage::SS_Main);
+            });
+        } else {
+            for (auto block_id : async_blocks) {
+                uint64_t segment_id = block_id >> (kSegmentShift - kBlockShift);
+                image->set_segment_state(segment_id, CheckpointImage::SS_Main);
             }
+        }
+        image->commit_segment_state_update();
+        CrashPoint("checkpoint.main_committed");
+        PersistBarrier();
+        if (unlikely(!has_snapshot)) {
+            image->set_attributes(kAttributeHasSnapshot);
+            has_snapshot = true;
+        }
+
+        uint64_t persist_clock = ReadTSC();
+        flush_latency.fetch_add(persist_clock - async_start_clock, std::memory_order_relaxed);
+        async_stats.bytes_copied = 0;
+        async_stats.bytes_flushed = flush_traffic.load(std::memory_order_relaxed) - async_stats.bytes_flushed;
+        async_stats.back_segment_evictions = nr_evictions.load(std::memory_order_relaxed)
+                                             - async_stats.back_segment_evictions;
+        async_stats.full_segment_copies = nr_full_copies.load(std::memory_order_relaxed)
+                                          - async_stats.full_segment_copies;
+        async_stats.eliminated_lines = nr_eliminated_lines.load(std::memory_order_relaxed)
+                                       - async_stats.eliminated_lines;
+        async_stats.fences = tl_nr_fences - start_fences;
+        async_stats.flush_ms = CyclesToMilliseconds(persist_clock - async_start_clock);
+        async_stats.total_ms = async_stats.flush_ms;
+
+        // Hand the write-back of the epoch over to the cleaner
+        std::lock_guard<std::mutex> guard(cleaner_mutex);
+        mark_write_back_pending(segment_in_flight);
+        segment_in_flight.clear_region(0, nr_segments);
+        restart_cleaner(stats_history.append(async_stats), persist_clock);
+        checkpoint_in_progress.store(false, std::memory_order_relaxed);
+        cleaner_condvar.notify_all();
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::CheckpointWorkerRoutine(NvmInstEngineImpl *engine) {
+        BindSingleSocket();
+        std::unique_lock<std::mutex> lock(engine->async_mutex);
+        while (engine->checkpoint_worker_running) {
+            if (!engine->async_pending) {
+                engine->async_condvar.wait(lock);
+                continue;
+            }
+            uint64_t ticket = engine->async_issued.load(std::memory_order_relaxed);
+            lock.unlock();
+            engine->persist_async_checkpoint();
+            lock.lock();
+            engine->async_durable.store(ticket, std::memory_order_release);
+            engine->async_in_flight.store(false, std::memory_order_release);
+            engine->async_pending = false;
+            engine->async_condvar.notify_all();
+        }
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    bool NvmInstEngineImpl<BlockShift, SegmentShift>::is_durable(uint64_t ticket) {
+        return async_durable.load(std::memory_order_acquire) >= ticket;
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::wait_for_durable(uint64_t ticket) {
+        if (is_durable(ticket)) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(async_mutex);
+        async_condvar.wait(lock, [this, ticket] {
+            return async_durable.load(std::memory_order_acquire) >= ticket;
+        });
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::wait_for_async_checkpoint() {
+        if (!async_in_flight.load(std::memory_order_acquire)) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(async_mutex);
+        async_condvar.wait(lock, [this] { return !async_pending; });
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::wait_for_in_flight_segment(uint64_t segment_id) {
+        // Segments that still share their back segment with the last durable
+        // checkpoint can be written right away, the others are either part
+        // of the epoch being committed or need a state change.
+        uint8_t state = image->get_segment_state(segment_id);
+        if (segment_in_flight.test(segment_id, std::memory_order_relaxed)
+            || (state != CheckpointImage::SS_Back && state != CheckpointImage::SS_Initial)
+            || image->get_main_to_back(segment_id) == kNullSegmentIndex) {
+            wait_for_async_checkpoint();
+        }
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::commit_layout_state(uint8_t state) {
+        if (state == CheckpointImage::SS_Main && history) {
+            history->commit_snapshot();
+        }
+        if (flush_mode == FMODE_WBINVD) {
+            image->begin_segment_state_update();
+            segment_dirty.for_each([this, state](uint64_t seg_id) {
+                image->set_segment_state(seg_id, state);
+            });
             image->commit_segment_state_update();
         } else {
+            // Segments whose write-back was deferred stay in SS_Main
+            bool has_deferred = (nr_deferred_segments != 0);
             image->begin_segment_state_update();
-            for (size_t id = 0; id < kMaxThreads; ++id) {
+            for (uint64_t k = 0; k < flush_arena.get_nr_threads(); ++k) {
+                size_t id = flush_arena.get_thread(k);
                 auto &bucket = flush_blocks[id];
                 uint64_t bucket_size = flush_blocks_count[id];
                 for (uint64_t i = 0; i != bucket_size; ++i) {
                     uint64_t block_id = bucket[i];
                     uint64_t segment_id = block_id >> (kSegmentShift - kBlockShift);
+                    if (unlikely(has_deferred) && write_back_deferred.test(segment_id)) {
+                        continue;
+                    }
                     image->set_segment_state(segment_id, state);
                 }
             }
             image->commit_segment_state_update();
+            if (state == CheckpointImage::SS_Main) {
+                return;
+            }
+            // The written back segments are equal to their back segments
+            // until the next store, which marks them again
+            for (uint64_t k = 0; k < flush_arena.get_nr_threads(); ++k) {
+                size_t id = flush_arena.get_thread(k);
+                auto &bucket = flush_blocks[id];
+                uint64_t bucket_size = flush_blocks_count[id];
+                for (uint64_t i = 0; i != bucket_size; ++i) {
+                    uint64_t segment_id = bucket[i] >> (kSegmentShift - kBlockShift);
+                    if (unlikely(has_deferred) && write_back_deferred.test(segment_id)) {
+                        continue;
+                    }
+                    image->clear_segment_diverged(segment_id);
+                }
+            }
         }
     }
 
-    bool NvmInstEngine::exist_snapshot() {
+    template<size_t BlockShift, size_t SegmentShift>
+    bool NvmInstEngineImpl<BlockShift, SegmentShift>::exist_snapshot() {
         return image->get_attributes() & kAttributeHasSnapshot;
     }
 
-    void *NvmInstEngine::get_address(uint64_t offset) {
+    template<size_t BlockShift, size_t SegmentShift>
+    void *NvmInstEngineImpl<BlockShift, SegmentShift>::get_address(uint64_t offset) {
         return image->get_main_segment(0) + offset;
     }
 
-    size_t NvmInstEngine::get_capacity() {
+    template<size_t BlockShift, size_t SegmentShift>
+    size_t NvmInstEngineImpl<BlockShift, SegmentShift>::get_capacity() {
         return capacity;
     }
 
-    void NvmInstEngine::wait_for_background_task() {
+    template<size_t BlockShift, size_t SegmentShift>
+    size_t NvmInstEngineImpl<BlockShift, SegmentShift>::get_max_capacity() {
+        return max_capacity;
+    }
+
+    // Called by the allocator in the middle of an epoch. The new extent is
+    // mapped and committed before any store can reach it, its segments start
+    // in SS_Initial and follow the epoch commit like all the others.
+    template<size_t BlockShift, size_t SegmentShift>
+    bool NvmInstEngineImpl<BlockShift, SegmentShift>::grow(size_t min_capacity) {
+        std::lock_guard<std::mutex> guard(grow_mutex);
+        if (min_capacity <= capacity) {
+            return true;
+        }
+        if (min_capacity > max_capacity || image->get_nr_extents() == CheckpointImage::kMaxExtents) {
+            return false;
+        }
+
+        uint64_t new_capacity = std::max((uint64_t) min_capacity, capacity + capacity / 2);
+        new_capacity = std::min(RoundUp(new_capacity, kSegmentSize), max_capacity);
+        uint64_t new_segments = new_capacity >> kSegmentShift;
+        uint64_t extent_main = new_segments - nr_segments;
+        uint64_t extent_back = std::min((uint64_t) (extent_main * shadow_factor.load()),
+                                        image->get_max_back_segments() - nr_back_segments);
+        uint64_t new_back_segments = nr_back_segments + extent_back;
+
+        uint64_t file_offset = image->get_file_size();
+        size_t main_offset = image->get_main_segment(nr_segments) - image->get_start_address();
+        size_t back_offset = image->get_back_segment(nr_back_segments) - image->get_start_address();
+        if (!fs.extend(file_offset + CheckpointImage::CalculateExtentSize(extent_main, extent_back))
+            || !fs.map_range(main_offset, file_offset, extent_main * kSegmentSize)
+            || (extent_back && !fs.map_range(back_offset, file_offset + extent_main * kSegmentSize,
+                                             extent_back * kSegmentSize))) {
+            return false;
+        }
+
+        AcquireLock(back_memory_lock);
+        bool appended = image->append_extent(file_offset, extent_main, extent_back);
+        ReleaseLock(back_memory_lock);
+        if (!appended) {
+            return false;
+        }
+
+        segment_dirty.resize(new_segments);
+        segment_in_flight.resize(new_segments);
+        write_back_deferred.resize(new_segments);
+        write_back_pending.resize(new_segments);
+        segment_viewed.resize(new_segments);
+        segment_pinned.resize(new_segments);
+        block_dirty.resize(new_segments * kBlocksPerSegment);
+        if (track_lines) {
+            line_dirty.resize((new_segments * kBlocksPerSegment) << kLineShift);
+        }
+        block_missing.resize(new_segments * kBlocksPerSegment);
+        back_released.resize(new_back_segments);
+        // The bitsets are resized first, whoever acquires a new size finds
+        // them covering it
+        nr_blocks.store(new_segments * kBlocksPerSegment, std::memory_order_release);
+        nr_back_segments.store(new_back_segments, std::memory_order_release);
+        nr_segments.store(new_segments, std::memory_order_release);
+        capacity.store(new_capacity, std::memory_order_release);
+        if (verbose) {
+            printf("pool grown to %lu MiB (%lu extents, %lu back segments)\n",
+                   new_capacity >> 20, image->get_nr_extents(), new_back_segments);
+        }
+        return true;
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    bool NvmInstEngineImpl<BlockShift, SegmentShift>::set_shadow_capacity_factor(double factor) {
+        if (factor < 0) {
+            return false;
+        }
+        shadow_factor.store(factor);
+        return true;
+    }
+
+    // Called at the end of a checkpoint by its leader. The back pool is
+    // sized for the largest working set of the last kWorkingSetWindow
+    // epochs plus a quarter, but no less than the shadow capacity factor.
+    // It only shrinks once a whole window of epochs has been observed.
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::resize_back_segments(uint64_t dirty_segments, bool can_shrink) {
+        working_set[working_set_cursor++ % kWorkingSetWindow] = dirty_segments;
+        uint64_t peak = *std::max_element(working_set, working_set + kWorkingSetWindow);
+        uint64_t target = std::max((uint64_t) (nr_segments * shadow_factor.load()), peak + peak / 4);
+        target = std::min(target, image->get_max_back_segments());
+        uint64_t usable = get_nr_usable_back_segments();
+        if (usable < target) {
+            grow_back_segments(target);
+        } else if (can_shrink && usable > target * 2 && working_set_cursor >= kWorkingSetWindow) {
+            shrink_back_segments(target);
+        }
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    bool NvmInstEngineImpl<BlockShift, SegmentShift>::grow_back_segments(uint64_t min_usable) {
+        std::lock_guard<std::mutex> guard(grow_mutex);
+        // Released slots are within the file, they are reused first
+        for (uint64_t i = 0; i < nr_back_segments && nr_released_back_segments != 0; ++i) {
+            if (get_nr_usable_back_segments() >= min_usable) {
+                return true;
+            }
+            if (!back_released.test(i)) {
+                continue;
+            }
+            if (!fs.allocate(image->get_back_file_offset(i), kSegmentSize)) {
+                // Out of space for the punched out slots, an appended
+                // extent may still fit
+                break;
+            }
+            AcquireLock(back_memory_lock);
+            back_released.clear(i);
+            nr_released_back_segments--;
+            ReleaseLock(back_memory_lock);
+        }
+
+        uint64_t usable = get_nr_usable_back_segments();
+        if (usable >= min_usable) {
+            return true;
+        }
+        if (!image->is_growable() || image->get_nr_extents() == CheckpointImage::kMaxExtents) {
+            return false;
+        }
+
+        // Each growth takes an entry of the extent table, so the pool grows
+        // by half at least
+        uint64_t extent_back = std::max(min_usable - usable, nr_back_segments / 2);
+        extent_back = std::min(extent_back, image->get_max_back_segments() - nr_back_segments);
+        if (!extent_back) {
+            return false;
+        }
+        uint64_t file_offset = image->get_file_size();
+        size_t back_offset = image->get_back_segment(nr_back_segments) - image->get_start_address();
+        if (!fs.extend(file_offset + CheckpointImage::CalculateExtentSize(0, extent_back))
+            || !fs.map_range(back_offset, file_offset, extent_back * kSegmentSize)) {
+            return false;
+        }
+
+        AcquireLock(back_memory_lock);
+        bool appended = image->append_extent(file_offset, 0, extent_back);
+        if (appended) {
+            back_released.resize(nr_back_segments + extent_back);
+            nr_back_segments += extent_back;
+        }
+        ReleaseLock(back_memory_lock);
+        if (appended && verbose) {
+            printf("back pool grown to %lu segments (%lu extents)\n",
+                   get_nr_usable_back_segments(), image->get_nr_extents());
+        }
+        return appended && get_nr_usable_back_segments() >= min_usable;
+    }
+
+    // Releases the back segments at the end of the pool. It runs at the end
+    // of a checkpoint with the cleaner idle, when the main segments hold
+    // exactly the committed data and no copy-on-write can bind a segment.
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::shrink_back_segments(uint64_t max_usable) {
+        std::lock_guard<std::mutex> guard(grow_mutex);
+        uint64_t released = 0;
+        for (uint64_t i = nr_back_segments; i-- > 0 && get_nr_usable_back_segments() > max_usable;) {
+            if (back_released.test(i)) {
+                continue;
+            }
+            uint64_t main_id = image->get_back_to_main(i);
+            if (main_id != kNullSegmentIndex && (is_unrestored(main_id) || is_pinned(main_id))) {
+                // The lazy recovery of the main segment or a view still needs it
+                continue;
+            }
+            if (main_id != kNullSegmentIndex) {
+                if (image->get_segment_state(main_id) != CheckpointImage::SS_Initial) {
+                    image->set_segment_state_atomic(main_id, CheckpointImage::SS_Main);
+                }
+                image->unbind_back_segment(i);
+                reset_missing_blocks(main_id, false);
+            }
+            AcquireLock(back_memory_lock);
+            replacement_policy->release(i);
+            ReleaseLock(back_memory_lock);
+            fs.release(image->get_back_file_offset(i), kSegmentSize);
+            back_released.set(i);
+            nr_released_back_segments++;
+            released++;
+        }
+        if (released) {
+            // Unbound main segments need their copy-on-write again
+            skip_copy_on_write = false;
+            if (verbose) {
+                printf("back pool shrunk to %lu segments\n", get_nr_usable_back_segments());
+            }
+        }
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::wait_for_background_task() {
+        wait_for_async_checkpoint();
         std::atomic_thread_fence(std::memory_order_acquire);
         while (cleaner_state.load(std::memory_order_relaxed) != WB_IDLE) {
             _mm_pause();
         }
-        // printf("[DEBUG] wait_for_background_task\n");
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    size_t NvmInstEngineImpl<BlockShift, SegmentShift>::get_snapshots(uint64_t *epochs, size_t max_epochs) {
+        return history ? history->get_snapshots(epochs, max_epochs) : 0;
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    SnapshotView NvmInstEngineImpl<BlockShift, SegmentShift>::open_snapshot_view() {
+        std::lock_guard<std::mutex> guard(checkpoint_mutex);
+        wait_for_async_checkpoint();
+        View *view = new View();
+        view->alias = (uint8_t *) fs.map_alias(true);
+        if (!view->alias) {
+            delete view;
+            return SnapshotView();
+        }
+        view->address = view->alias + fs.abs_to_rel(image->get_main_segment(0));
+        view->nr_segments = nr_segments;
+        view->source.assign(nr_segments, VS_Pending);
+        {
+            std::lock_guard<std::mutex> view_guard(view_mutex);
+            views.push_back(view);
+            nr_views.fetch_add(1, std::memory_order_release);
+        }
+
+        // Application threads keep storing, each segment is mapped under
+        // its lock so that the first store of the epoch either precedes
+        // the mapping or switches it to the back segment
+        for (uint64_t segment_id = 0; segment_id < view->nr_segments; ++segment_id) {
+            restore_segment(segment_id);
+            auto &lock = segment_locks[segment_id & (kSegmentLocks - 1)];
+            AcquireLock(lock);
+            std::lock_guard<std::mutex> view_guard(view_mutex);
+            uint64_t back_id = image->get_main_to_back(segment_id);
+            if (image->get_segment_state(segment_id) == CheckpointImage::SS_Initial) {
+                // Nothing has been committed to it
+                map_view_segment(view, segment_id, VS_Zero);
+            } else if (!segment_dirty.test(segment_id)) {
+                view->source[segment_id] = VS_Main;
+                segment_viewed.set(segment_id, std::memory_order_release);
+            } else if (back_id != kNullSegmentIndex) {
+                fill_missing_blocks(segment_id, back_id);
+                map_view_segment(view, segment_id, VS_Back);
+                segment_pinned.set(segment_id, std::memory_order_release);
+            } else {
+                map_view_segment(view, segment_id, VS_Private);
+            }
+            ReleaseLock(lock);
+        }
+        if (verbose) {
+            printf("snapshot view of epoch %lu opened\n", image->get_committed_epoch());
+        }
+        return SnapshotView(this, view->address, get_address(0),
+                            view->nr_segments * kSegmentSize, image->get_committed_epoch());
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::close_snapshot_view(const void *address) {
+        std::lock_guard<std::mutex> view_guard(view_mutex);
+        auto iter = std::find_if(views.begin(), views.end(), [address](View *view) {
+            return view->address == address;
+        });
+        if (iter == views.end()) {
+            return;
+        }
+        View *view = *iter;
+        views.erase(iter);
+        for (uint64_t segment_id = 0; segment_id < view->nr_segments; ++segment_id) {
+            uint8_t source = view->source[segment_id];
+            if (source != VS_Main && source != VS_Back) {
+                continue;
+            }
+            bool shared = std::any_of(views.begin(), views.end(), [segment_id, source](View *other) {
+                return segment_id < other->nr_segments && other->source[segment_id] == source;
+            });
+            if (!shared) {
+                (source == VS_Main ? segment_viewed : segment_pinned).clear(segment_id);
+            }
+        }
+        fs.unmap_alias(view->alias);
+        delete view;
+        nr_views.fetch_sub(1, std::memory_order_release);
+    }
+
+    // Called with the segment lock and view_mutex held. A private copy
+    // is taken from the back segment if one is bound.
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::map_view_segment(
+            View *view, uint64_t segment_id, uint8_t source) {
+        uint8_t *target = view->address + segment_id * kSegmentSize;
+        uint64_t back_id = image->get_main_to_back(segment_id);
+        if (source == VS_Back) {
+            if (!fs.map_alias_range(view->alias, target - view->alias,
+                                    image->get_back_file_offset(back_id), kSegmentSize)) {
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            // Filled aside and moved in place, a reader never sees it partially
+            void *copy = mmap(nullptr, kSegmentSize, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (copy == MAP_FAILED) {
+                perror("mmap");
+                exit(EXIT_FAILURE);
+            }
+            if (source == VS_Private) {
+                memcpy(copy, back_id != kNullSegmentIndex ? image->get_back_segment(back_id)
+                                                          : image->get_main_segment(segment_id),
+                       kSegmentSize);
+            }
+            if (mprotect(copy, kSegmentSize, PROT_READ) ||
+                mremap(copy, kSegmentSize, kSegmentSize, MREMAP_MAYMOVE | MREMAP_FIXED, target) == MAP_FAILED) {
+                perror("mremap");
+                exit(EXIT_FAILURE);
+            }
+        }
+        view->source[segment_id] = source;
+    }
+
+    // Called with the segment lock held, so that a view reads the whole
+    // segment from the back segment
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::fill_missing_blocks(uint64_t segment_id, uint64_t back_id) {
+        if (!image->is_block_granular()) {
+            return;
+        }
+        const uint64_t start_block_id = segment_id * kBlocksPerSegment;
+        uint64_t nr_copied = 0;
+        for (uint64_t i = 0; i < kBlocksPerSegment; ++i) {
+            if (block_missing.test(start_block_id + i)) {
+                copy_block(image->get_back_block(back_id * kBlocksPerSegment + i),
+                           image->get_main_block(start_block_id + i));
+                nr_copied++;
+            }
+        }
+        if (!nr_copied) {
+            return;
+        }
+        StoreFence();
+        for (uint64_t i = 0; i < kBlocksPerSegment; ++i) {
+            mark_block_present(start_block_id + i, back_id);
+        }
+        StoreFence();
+        checkpoint_traffic.fetch_add(nr_copied * kBlockSize, std::memory_order_relaxed);
+    }
+
+    // Called with the segment lock held before the first store of the
+    // epoch to the segment, once its back segment holds the committed data
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::pin_viewed_segment(uint64_t segment_id) {
+        if (likely(nr_views.load(std::memory_order_acquire) == 0) ||
+            !segment_viewed.test(segment_id, std::memory_order_acquire)) {
+            return;
+        }
+        std::lock_guard<std::mutex> view_guard(view_mutex);
+        if (!segment_viewed.test(segment_id)) {
+            return;
+        }
+        uint64_t back_id = image->get_main_to_back(segment_id);
+        uint8_t source = VS_Private;
+        if (back_id != kNullSegmentIndex) {
+            fill_missing_blocks(segment_id, back_id);
+            source = VS_Back;
+        }
+        for (auto view : views) {
+            if (segment_id < view->nr_segments && view->source[segment_id] == VS_Main) {
+                map_view_segment(view, segment_id, source);
+            }
+        }
+        segment_viewed.clear(segment_id);
+        if (source == VS_Back) {
+            segment_pinned.set(segment_id, std::memory_order_release);
+        }
+    }
+
+    // Called before the back segment is written back, the views that read
+    // it take a private copy of the committed data
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::unpin_segment(uint64_t segment_id) {
+        std::lock_guard<std::mutex> view_guard(view_mutex);
+        if (!segment_pinned.test(segment_id)) {
+            return;
+        }
+        for (auto view : views) {
+            if (segment_id < view->nr_segments && view->source[segment_id] == VS_Back) {
+                map_view_segment(view, segment_id, VS_Private);
+            }
+        }
+        segment_pinned.clear(segment_id);
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    size_t NvmInstEngineImpl<BlockShift, SegmentShift>::get_stats(CheckpointStats *records, size_t max_records) {
+        return stats_history.get(records, max_records);
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::reset_stats() {
         checkpoint_traffic = 0;
+        flush_traffic = 0;
         flush_latency = 0;
         write_back_latency = 0;
+        stats_history.reset();
     }
 
-    bool NvmInstEngine::has_background_task() {
+    template<size_t BlockShift, size_t SegmentShift>
+    bool NvmInstEngineImpl<BlockShift, SegmentShift>::has_background_task() {
         return cleaner_state.load(std::memory_order_acquire) != WB_IDLE;
     }
 
-    uint64_t NvmInstEngine::flush_parallel(int tid, int nr_threads) {
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::partition_flush_blocks() {
+        uint64_t offset = 0;
+        nr_flush_threads = flush_arena.get_nr_threads();
+        for (uint64_t k = 0; k < nr_flush_threads; ++k) {
+            flush_blocks_offset[k] = offset;
+            offset += flush_blocks_count[flush_arena.get_thread(k)];
+        }
+        flush_blocks_offset[nr_flush_threads] = offset;
+        flush_cursor.store(0, std::memory_order_relaxed);
+        write_back_cursor.store(0, std::memory_order_relaxed);
+        history_cursor.store(0, std::memory_order_relaxed);
+    }
+
+    // Threads claim kFlushChunkBlocks entries of the concatenated flush_blocks
+    // lists at a time until all of them are taken, a chunk may span buckets
+    template<size_t BlockShift, size_t SegmentShift>
+    template<typename Visitor>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::for_each_flush_chunk(
+            std::atomic<uint64_t> &cursor, Visitor visit) {
+        const uint64_t total_blocks = flush_blocks_offset[nr_flush_threads];
+        while (true) {
+            uint64_t start = cursor.fetch_add(kFlushChunkBlocks, std::memory_order_relaxed);
+            if (start >= total_blocks) {
+                break;
+            }
+            uint64_t stop = std::min(start + kFlushChunkBlocks, total_blocks);
+            size_t id = std::upper_bound(flush_blocks_offset,
+                                         flush_blocks_offset + nr_flush_threads + 1,
+                                         start) - flush_blocks_offset - 1;
+            while (start < stop) {
+                auto &bucket = flush_blocks[flush_arena.get_thread(id)];
+                uint64_t bucket_stop = std::min(stop, flush_blocks_offset[id + 1]);
+                for (uint64_t i = start - flush_blocks_offset[id]; start < bucket_stop; ++i, ++start) {
+                    visit(bucket[i]);
+                }
+                id++;
+            }
+        }
+    }
+
+    // Threads claim kWriteBackChunkSegments segments at a time, starting from
+    // the first dirty one at the cursor, until no dirty segment is left
+    template<size_t BlockShift, size_t SegmentShift>
+    uint64_t NvmInstEngineImpl<BlockShift, SegmentShift>::claim_dirty_segments(std::atomic<uint64_t> &cursor) {
+        uint64_t start = cursor.load(std::memory_order_relaxed);
+        while (true) {
+            uint64_t next = segment_dirty.find_next(start, nr_segments);
+            if (next >= nr_segments) {
+                return nr_segments;
+            }
+            if (cursor.compare_exchange_weak(start, next + kWriteBackChunkSegments,
+                                             std::memory_order_relaxed)) {
+                return next;
+            }
+        }
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    uint64_t NvmInstEngineImpl<BlockShift, SegmentShift>::flush_parallel(int tid, int nr_threads) {
+        uint64_t bytes = 0;
+        // The pre-images of the snapshot are fenced with the flush
+        bool recording = history && history->is_recording();
         if (flush_mode == FMODE_WBINVD) {
+            while (recording) {
+                uint64_t start = claim_dirty_segments(history_cursor);
+                if (start >= nr_segments) {
+                    break;
+                }
+                uint64_t stop = std::min(start + kWriteBackChunkSegments, nr_segments.load(std::memory_order_acquire));
+                for (uint64_t segment_id = start; segment_id < stop; ++segment_id) {
+                    if (segment_dirty.test(segment_id)) {
+                        record_dirty_segment(segment_id);
+                    }
+                }
+            }
             if (tid == 0) {
                 WriteBackAndInvalidate();
             }
         } else {
-            size_t id = tid;
             uint8_t *base_address = (uint8_t *) get_address(0);
-            while (id < kMaxThreads) {
-                auto &bucket = flush_blocks[id];
-                uint64_t bucket_size = flush_blocks_count[id];
-                for (uint64_t i = 0; i != bucket_size; ++i) {
-                    uint64_t block_id = bucket[i];
-                    uint8_t *addr = base_address + (block_id << kBlockShift);
-                    FlushRegion(addr, kBlockSize);
+            for_each_flush_chunk(flush_cursor, [this, base_address, recording, &bytes](uint64_t block_id) {
+                if (recording) {
+                    record_pre_image(block_id);
                 }
-                id += nr_threads;
-            }
+                bytes += persist_block(base_address, block_id);
+            });
+        }
+        StoreFence();
+        return bytes;
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::init_dirty_tracking() {
+        if (track_lines) {
+            tracking_shift = kCacheLineShift;
+            store_hooks = {store_hook<kCacheLineShift, BlockShift, SegmentShift>,
+                           range_store_hook<kCacheLineShift, BlockShift, SegmentShift>};
+        } else {
+            tracking_shift = kBlockShift;
+            store_hooks = {store_hook<BlockShift, BlockShift, SegmentShift>,
+                           range_store_hook<BlockShift, BlockShift, SegmentShift>};
         }
-        StoreFence();
-        return 0;
     }
 
-    uint64_t NvmInstEngine::write_back_parallel(int tid, int nr_threads) {
+    // The dirty segments are claimed in address order in every flush mode,
+    // so that the copies to back form sequential streams
+    template<size_t BlockShift, size_t SegmentShift>
+    uint64_t NvmInstEngineImpl<BlockShift, SegmentShift>::write_back_parallel(int tid, int nr_threads) {
         uint64_t flush_count = 0;
-        if (flush_mode == FMODE_WBINVD) {
-            uint64_t main_id = tid;
-            while (main_id < nr_segments) {
-                if (!segment_dirty.test(main_id)) {
-                    main_id += nr_threads;
-                    continue;
+        uint64_t eliminated_lines = 0;
+        uint64_t main_id = nr_segments, chunk_stop = nr_segments;
+        while (true) {
+            if (main_id == chunk_stop) {
+                main_id = claim_dirty_segments(write_back_cursor);
+                if (main_id >= nr_segments) {
+                    break;
                 }
+                chunk_stop = std::min(main_id + kWriteBackChunkSegments, nr_segments.load(std::memory_order_acquire));
+            }
+            if (!segment_dirty.test(main_id)) {
+                main_id++;
+                continue;
+            }
+            if (is_pinned(main_id)) {
+                unpin_segment(main_id);
+            }
 
-                bool created;
-                uint64_t back_id = find_back_segment(main_id, created);
-                const uint64_t start_block_id = main_id * kBlocksPerSegment;
-                const uint64_t stop_block_id =
-                        std::min(nr_blocks, start_block_id + kBlocksPerSegment);
-                assert(start_block_id % AtomicBitSet::kBitWidth == 0);
-
-                uint8_t *main_base = image->get_main_segment(main_id);
-                uint8_t *back_base = image->get_back_segment(back_id);
-                if (created && image->get_segment_state(main_id) != CheckpointImage::SS_Initial) {
-                    NonTemporalCopy256(back_base, main_base, kSegmentSize);
-                    flush_count += kSegmentSize;
-                } else {
-                    for (uint64_t block_id = start_block_id;
-                         block_id < stop_block_id;
-                         block_id += AtomicBitSet::kBitWidth) {
-                        uint64_t bitset = block_dirty.test_all(block_id);
-                        while (bitset != 0) {
-                            uint64_t t = bitset & -bitset;
-                            int i = __builtin_ctzll(bitset); // i == first set index
-                            bitset ^= t;
-                            // assert(block_dirty.test(block_id + i));
-                            uint8_t *main_addr = main_base + (i << kBlockShift);
-                            uint8_t *back_addr = back_base + (i << kBlockShift);
-                            NonTemporalCopy256(back_addr, main_addr, kBlockSize);
-                            flush_count += kBlockSize;
-                        }
-                        main_base += AtomicBitSet::kBitWidth * kBlockSize;
-                        back_base += AtomicBitSet::kBitWidth * kBlockSize;
-                    }
-                }
-                main_id += nr_threads;
+            bool created;
+            uint64_t back_id = find_back_segment(main_id, created);
+            if (unlikely(back_id == kNullSegmentIndex)) {
+                defer_write_back(main_id);
+                main_id++;
+                continue;
             }
-        } else {
-            size_t id = tid;
-            while (id < kMaxThreads) {
-                auto &bucket = flush_blocks[id];
-                uint64_t bucket_size = flush_blocks_count[id];
-                for (uint64_t i = 0; i != bucket_size; ++i) {
-                    uint64_t main_block_id = bucket[i];
-                    bool created;
-                    uint64_t back_block_id = find_back_block(main_block_id, created);
-                    if (created) {
-                        uint8_t *main_addr = image->get_main_segment(
-                                main_block_id / kBlocksPerSegment);
-                        uint8_t *back_addr = image->get_back_segment(
-                                back_block_id / kBlocksPerSegment);
-                        NonTemporalCopy256(back_addr, main_addr, kSegmentSize);
-                        flush_count += kSegmentSize;
-                    } else {
-                        uint8_t *main_addr = image->get_main_block(main_block_id);
-                        uint8_t *back_addr = image->get_back_block(back_block_id);
-                        NonTemporalCopy256(back_addr, main_addr, kBlockSize);
-                        flush_count += kBlockSize;
-                    }
-                }
-                id += nr_threads;
+            if (created && !image->is_block_granular() &&
+                image->get_segment_state(main_id) != CheckpointImage::SS_Initial) {
+                eliminated_lines += write_back_copy(image->get_back_segment(back_id),
+                                                    image->get_main_segment(main_id), kSegmentSize);
+                nr_full_copies.fetch_add(1, std::memory_order_relaxed);
+                flush_count += kSegmentSize;
+            } else {
+                // The other blocks of a newly bound back segment stay
+                // missing, the main segment holds their committed data
+                flush_count += write_back_segment(main_id, back_id, eliminated_lines);
             }
+            main_id++;
         }
         StoreFence();
+        if (eliminated_lines) {
+            nr_eliminated_lines.fetch_add(eliminated_lines, std::memory_order_relaxed);
+        }
         return flush_count;
     }
 
-    uint64_t NvmInstEngine::find_back_segment(uint64_t segment_id, bool &created) {
+    // Runs of dirty blocks that are copied as a whole take one copy each,
+    // the start of the next run is prefetched while a run is copied
+    template<size_t BlockShift, size_t SegmentShift>
+    uint64_t NvmInstEngineImpl<BlockShift, SegmentShift>::write_back_segment(uint64_t main_id, uint64_t back_id,
+                                                                             uint64_t &eliminated_lines) {
+        const uint64_t start_block_id = main_id * kBlocksPerSegment;
+        const uint64_t stop_block_id = std::min(nr_blocks.load(std::memory_order_acquire),
+                                                 start_block_id + kBlocksPerSegment);
+        uint8_t *main_base = image->get_main_segment(main_id);
+        uint8_t *back_base = image->get_back_segment(back_id);
+        uint64_t bytes = 0;
+        uint64_t lines, next_lines = kAllLines;
+        uint64_t run_start = block_dirty.find_next(start_block_id, stop_block_id);
+        uint64_t run_stop = find_run_stop(run_start, stop_block_id, next_lines);
+        while (run_start < stop_block_id) {
+            lines = next_lines;
+            uint64_t next_start = block_dirty.find_next(run_stop, stop_block_id);
+            uint64_t next_stop = find_run_stop(next_start, stop_block_id, next_lines);
+            if (next_start < stop_block_id) {
+                uint64_t prefetch_len = (next_stop - next_start) << kBlockShift;
+                PrefetchT0(main_base + ((next_start - start_block_id) << kBlockShift),
+                           prefetch_len < kWriteBackPrefetchBytes ? prefetch_len : kWriteBackPrefetchBytes);
+            }
+            uint64_t offset = (run_start - start_block_id) << kBlockShift;
+            if (lines == kAllLines) {
+                uint64_t len = (run_stop - run_start) << kBlockShift;
+                eliminated_lines += write_back_copy(back_base + offset, main_base + offset, len);
+                bytes += len;
+            } else {
+                bytes += write_back_lines(back_base + offset, main_base + offset, lines, eliminated_lines);
+            }
+            for (uint64_t block_id = run_start; block_id < run_stop; ++block_id) {
+                mark_block_present(block_id, back_id);
+            }
+            CrashPoint("write_back.run_copied");
+            run_start = next_start;
+            run_stop = next_stop;
+        }
+        return bytes;
+    }
+
+    // Returns kNullSegmentIndex if every usable back segment is held by a
+    // dirty segment and the back pool cannot grow
+    template<size_t BlockShift, size_t SegmentShift>
+    uint64_t NvmInstEngineImpl<BlockShift, SegmentShift>::find_back_segment(uint64_t segment_id, bool &created) {
         uint64_t back_seg_id = image->get_main_to_back(segment_id);
-        created = (back_seg_id == kNullSegmentIndex);
-        if (created) {
-            allocate_back_segment(segment_id);
+        created = false;
+        while (back_seg_id == kNullSegmentIndex) {
+            uint64_t usable = get_nr_usable_back_segments();
+            created = allocate_back_segment(segment_id);
             back_seg_id = image->get_main_to_back(segment_id);
             if (back_seg_id == kNullSegmentIndex) {
-                fprintf(stderr, "no free back segments\n");
-                exit(EXIT_FAILURE);
+                grow_back_segments(usable + std::max(usable / 4, (uint64_t) 1));
+                if (get_nr_usable_back_segments() == usable) {
+                    break;
+                }
             }
         }
         return back_seg_id;
     }
 
-    uint64_t NvmInstEngine::find_back_block(uint64_t block_id, bool &created) {
-        uint64_t back_seg_id = find_back_segment(block_id / kBlocksPerSegment, created);
-        return (back_seg_id * kBlocksPerSegment) + (block_id % kBlocksPerSegment);
+    // The segment is committed in SS_Main already, it keeps that state until
+    // a copy-on-write binds a back segment to it in a later epoch
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::defer_write_back(uint64_t segment_id) {
+        AcquireLock(back_memory_lock);
+        if (!write_back_deferred.test(segment_id)) {
+            write_back_deferred.set(segment_id);
+            nr_deferred_segments++;
+        }
+        ReleaseLock(back_memory_lock);
+    }
+
+    // Makes a back segment bindable when the clean segments that hold them
+    // are only kept by a lazy recovery or a snapshot view: the segment is
+    // restored, the views take a private copy. Returns false if every back
+    // segment is held by a segment dirty in the epoch.
+    template<size_t BlockShift, size_t SegmentShift>
+    bool NvmInstEngineImpl<BlockShift, SegmentShift>::reclaim_back_segment() {
+        for (uint64_t back_id = 0; back_id < nr_back_segments; ++back_id) {
+            uint64_t main_id = image->get_back_to_main(back_id);
+            if (main_id == kNullSegmentIndex) {
+                if (!back_released.test(back_id)) {
+                    return true;
+                }
+                continue;
+            }
+            if (segment_dirty.test(main_id, std::memory_order_acquire)) {
+                continue;
+            }
+            if (is_unrestored(main_id)) {
+                restore_segment(main_id);
+            }
+            if (is_pinned(main_id)) {
+                unpin_segment(main_id);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // Called without the segment lock when a copy-on-write finds no back
+    // segment and the back pool cannot grow. Returns true if the
+    // copy-on-write is worth retrying. Only a checkpoint frees the back
+    // segments of the segments dirty in the epoch, and the storing thread
+    // may take part in it, so the copy-on-write stashes the segment rather
+    // than wait for it.
+    template<size_t BlockShift, size_t SegmentShift>
+    bool NvmInstEngineImpl<BlockShift, SegmentShift>::make_room_for_back_segment() {
+        if (reclaim_back_segment()) {
+            return true;
+        }
+        if (async_in_flight.load(std::memory_order_acquire)) {
+            // Run by checkpoint_worker, the back segments of its epoch are
+            // released by the cleaner once it is durable
+            wait_for_async_checkpoint();
+            return true;
+        }
+        return false;
+    }
+
+    // Called with the segment lock held before the first store of the
+    // epoch to a segment in SS_Main that no back segment can be bound to.
+    // The committed data is persisted in the stash and the segment is
+    // written in place, the checkpoint commits it in SS_Main.
+    template<size_t BlockShift, size_t SegmentShift>
+    bool NvmInstEngineImpl<BlockShift, SegmentShift>::stash_segment(uint64_t segment_id) {
+        std::lock_guard<std::mutex> guard(stash_mutex);
+        if (!stash) {
+            stash = SegmentStash::Create(stash_path.c_str(), max_capacity >> kSegmentShift, kSegmentShift);
+            if (!stash) {
+                return false;
+            }
+        }
+        if (!stash->stash(image->get_committed_epoch(), segment_id, image->get_main_segment(segment_id))) {
+            return false;
+        }
+        nr_stashed_segments.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // A stash is only created once a copy-on-write needs it, one left by a
+    // truncated pool is removed
+    template<size_t BlockShift, size_t SegmentShift>
+    bool NvmInstEngineImpl<BlockShift, SegmentShift>::open_segment_stash(const char *path, bool create) {
+        stash_path = SegmentStash::GetPath(path);
+        if (create || !FileSystem::Exist(stash_path.c_str())) {
+            if (create) {
+                FileSystem::Remove(stash_path.c_str());
+            }
+            return true;
+        }
+        stash = SegmentStash::Open(stash_path.c_str(), kSegmentShift);
+        return stash != nullptr;
+    }
+
+    // Called before the recovery of the image, which leaves the stashed
+    // segments alone as they are in SS_Main
+    template<size_t BlockShift, size_t SegmentShift>
+    uint64_t NvmInstEngineImpl<BlockShift, SegmentShift>::recover_stashed_segments() {
+        uint64_t restored = 0;
+        if (!stash) {
+            return 0;
+        }
+        stash->recover(image->get_committed_epoch(), [this, &restored](uint64_t segment_id, const uint8_t *data) {
+            if (segment_id < nr_segments) {
+                NonTemporalCopy64(image->get_main_segment(segment_id), (void *) data, kSegmentSize);
+                restored += kSegmentSize;
+            }
+        });
+        return restored;
     }
 
-    void NvmInstEngine::clear_dirty_bits() {
-        for (size_t id = 0; id < kMaxThreads; ++id) {
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::clear_dirty_bits() {
+        for (uint64_t k = 0; k < flush_arena.get_nr_threads(); ++k) {
+            size_t id = flush_arena.get_thread(k);
             auto &bucket = flush_blocks[id];
             uint64_t bucket_size = flush_blocks_count[id];
             for (uint64_t i = 0; i != bucket_size; ++i) {
                 uint64_t block_id = bucket[i];
-                uint64_t page_id = block_id >> (kSegmentShift - kBlockShift);
                 block_dirty.clear_all(block_id);
-                segment_dirty.clear_all(page_id);
             }
         }
+        if (track_lines) {
+            line_dirty.clear_region(0, nr_blocks << kLineShift);
+        }
+        segment_dirty.clear_region(0, nr_segments);
     }
 
-    bool NvmInstEngine::lazy_write_back(uint64_t segment_id, bool on_demand) {
+    template<size_t BlockShift, size_t SegmentShift>
+    bool NvmInstEngineImpl<BlockShift, SegmentShift>::lazy_write_back(uint64_t segment_id, bool on_demand) {
         uint64_t start_clock, write_back_clock;
         uint8_t *address_list[kAddressListCapacity];
+        uint64_t line_list[kAddressListCapacity];
         uint64_t address_list_size = 0;
-        uint64_t address_count = 0;
+        uint64_t copied_bytes = 0;
+        uint64_t eliminated_lines = 0;
         auto &lock = segment_locks[segment_id & (kSegmentLocks - 1)];
-        AcquireLock(lock);
-
-        auto attribute = image->get_segment_state(segment_id);
-        uint64_t back_segment_id = image->get_main_to_back(segment_id);
+        uint64_t back_segment_id;
         bool created = false;
+        bool room_made = true, stash_failed = false;
+        while (true) {
+            AcquireLock(lock);
+            if (is_unrestored(segment_id)) {
+                restore_segment_locked(segment_id);
+            }
 
-        if (attribute != CheckpointImage::SS_Main && back_segment_id != kNullSegmentIndex) {
+            auto attribute = image->get_segment_state(segment_id);
+            back_segment_id = image->get_main_to_back(segment_id);
+            if (attribute != CheckpointImage::SS_Main && back_segment_id != kNullSegmentIndex) {
 #ifdef USE_IDENTICAL_DATA
-            if (on_demand && attribute == CheckpointImage::SS_Identical) {
-                image->set_segment_state_atomic(segment_id, CheckpointImage::SS_Back);
-            }
+                if (on_demand && attribute == CheckpointImage::SS_Identical) {
+                    image->set_segment_state_atomic(segment_id, CheckpointImage::SS_Back);
+                }
 #endif
-            if (on_demand) {
+                if (on_demand) {
+                    pin_viewed_segment(segment_id);
+                    image->set_segment_diverged(segment_id);
+                    segment_dirty.set(segment_id, std::memory_order_relaxed);
+                }
+                ReleaseLock(lock);
+                return false;
+            }
+            if (back_segment_id != kNullSegmentIndex) {
+                break;
+            }
+            if (!on_demand) {
+                ReleaseLock(lock);
+                return false;
+            }
+            if (attribute == CheckpointImage::SS_Initial) {
+                // Nothing has been committed to the segment. The write-back
+                // of the checkpoint binds its back segment and copies it
+                // as a whole, a recycled back segment holds stale blocks.
+                image->set_segment_diverged(segment_id);
                 segment_dirty.set(segment_id, std::memory_order_relaxed);
+                ReleaseLock(lock);
+                return false;
+            }
+            back_segment_id = find_back_segment(segment_id, created);
+            if (likely(back_segment_id != kNullSegmentIndex)) {
+                break;
+            }
+            if (!room_made) {
+                if (stash_segment(segment_id)) {
+                    pin_viewed_segment(segment_id);
+                    image->set_segment_diverged(segment_id);
+                    segment_dirty.set(segment_id, std::memory_order_relaxed);
+                    ReleaseLock(lock);
+                    return false;
+                }
+                // The stash cannot grow either, the store waits for a
+                // checkpoint of another thread or for free space
+                if (!stash_failed) {
+                    fprintf(stderr, "copy-on-write of segment %lu: the back pool is full and the segment "
+                                    "cannot be stashed, waiting for a checkpoint\n", segment_id);
+                    stash_failed = true;
+                }
+                ReleaseLock(lock);
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                room_made = make_room_for_back_segment();
+                continue;
             }
             ReleaseLock(lock);
-            return false;
+            room_made = make_room_for_back_segment();
         }
 
         start_clock = ReadTSC();
         const uint64_t start_block_id = segment_id * kBlocksPerSegment;
-        const uint64_t stop_block_id = std::min(nr_blocks, start_block_id + kBlocksPerSegment);
+        const uint64_t stop_block_id = std::min(nr_blocks.load(std::memory_order_acquire),
+                                                 start_block_id + kBlocksPerSegment);
         assert(start_block_id % AtomicBitSet::kBitWidth == 0);
 
-        if (back_segment_id == kNullSegmentIndex) {
-            if (!on_demand) {
-                ReleaseLock(lock);
-                return false;
-            }
-            back_segment_id = find_back_segment(segment_id, created);
+        if (is_pinned(segment_id)) {
+            unpin_segment(segment_id);
         }
-
-        uint64_t delta = capacity + back_segment_id * kSegmentSize - segment_id * kSegmentSize;
+        CrashPoint("lazy_write_back.bound");
+        uint64_t delta = image->get_back_segment(back_segment_id) - image->get_main_segment(segment_id);
         if (created) {
-            if (attribute != CheckpointImage::SS_Initial) {
+            // A block granular back segment starts empty, the blocks are
+            // copied by the first store to each of them
+            if (!image->is_block_granular()) {
                 uint8_t *addr = (uint8_t *) get_address(start_block_id << kBlockShift);
-                NonTemporalCopy256(addr + delta, addr, kSegmentSize);
+                eliminated_lines += write_back_copy(addr + delta, addr, kSegmentSize);
+                nr_full_copies.fetch_add(1, std::memory_order_relaxed);
+                copied_bytes = kSegmentSize;
             }
         } else {
             for (uint64_t block_id = start_block_id;
@@ -614,12 +2314,14 @@ namespace crpm {
                     uint64_t t = bitset & -bitset;
                     int i = __builtin_ctzll(bitset); // i == first set index
                     bitset ^= t;
+                    line_list[address_list_size] = get_lines_to_persist(block_id + i,
+                                                                        block_missing.test(block_id + i));
+                    mark_block_present(block_id + i, back_segment_id);
                     address_list[address_list_size++] = base_address + (i << kBlockShift);
-                    address_count++;
                     if (address_list_size == kAddressListCapacity) {
                         for (int j = 0; j < address_list_size; ++j) {
                             uint8_t *addr = address_list[j];
-                            NonTemporalCopy256(addr + delta, addr, kBlockSize);
+                            copied_bytes += write_back_lines(addr + delta, addr, line_list[j], eliminated_lines);
                         }
                         address_list_size = 0;
                     }
@@ -627,10 +2329,11 @@ namespace crpm {
             }
             for (int i = 0; i < address_list_size; ++i) {
                 uint8_t *addr = address_list[i];
-                NonTemporalCopy256(addr + delta, addr, kBlockSize);
+                copied_bytes += write_back_lines(addr + delta, addr, line_list[i], eliminated_lines);
             }
         }
         StoreFence();
+        CrashPoint("lazy_write_back.copied");
 
 #ifdef USE_IDENTICAL_DATA
         uint8_t state = on_demand ? CheckpointImage::SS_Back : CheckpointImage::SS_Identical;
@@ -639,81 +2342,163 @@ namespace crpm {
         image->set_segment_state_atomic(segment_id, CheckpointImage::SS_Back);
 #endif
         block_dirty.clear_region(start_block_id, stop_block_id);
+        if (track_lines) {
+            line_dirty.clear_region(start_block_id << kLineShift, stop_block_id << kLineShift);
+        }
         write_back_clock = ReadTSC();
         write_back_latency.fetch_add(write_back_clock - start_clock,
                                      std::memory_order_relaxed);
-        checkpoint_traffic.fetch_add(address_count * kBlockSize,
-                                     std::memory_order_relaxed);
+        checkpoint_traffic.fetch_add(copied_bytes, std::memory_order_relaxed);
+        background_traffic.fetch_add(copied_bytes, std::memory_order_relaxed);
+        if (eliminated_lines) {
+            nr_eliminated_lines.fetch_add(eliminated_lines, std::memory_order_relaxed);
+        }
         if (on_demand) {
+            pin_viewed_segment(segment_id);
+            image->set_segment_diverged(segment_id);
             segment_dirty.set(segment_id, std::memory_order_relaxed);
+        } else {
+            image->clear_segment_diverged(segment_id);
         }
         ReleaseLock(lock);
         return true;
     }
 
-    void NvmInstEngine::allocate_back_segment(uint64_t main_id) {
+    template<size_t BlockShift, size_t SegmentShift>
+    bool NvmInstEngineImpl<BlockShift, SegmentShift>::allocate_back_segment(uint64_t main_id) {
         const size_t kNumBackSegments = image->get_nr_back_segments();
         AcquireLock(back_memory_lock);
-        uint64_t loop_count = 0;
-        while (loop_count < kNumBackSegments) {
-            uint64_t old_main_id = image->get_back_to_main(next_back_id);
+        // Blocks of a segment may be written back by several checkpoint
+        // threads, only the first one binds the back segment
+        if (image->get_main_to_back(main_id) != kNullSegmentIndex) {
+            ReleaseLock(back_memory_lock);
+            return false;
+        }
+        auto evictable = [this](uint64_t back_id) {
+            uint64_t old_main_id = image->get_back_to_main(back_id);
             if (old_main_id == kNullSegmentIndex) {
-                image->bind_back_segment(main_id, next_back_id);
-                advance_next_back_segment();
-                ReleaseLock(back_memory_lock);
-                return;
+                return !back_released.test(back_id);
             }
-            if (checkpoint_in_progress.load(std::memory_order_relaxed)) {
-                if (segment_dirty.test(old_main_id)) {
-                    advance_next_back_segment();
-                    loop_count++;
-                    continue;
+            return !segment_dirty.test(old_main_id) && !is_unrestored(old_main_id) &&
+                   !is_pinned(old_main_id);
+        };
+        bool in_checkpoint = checkpoint_in_progress.load(std::memory_order_relaxed);
+        for (uint64_t loop_count = 0; loop_count < kNumBackSegments; ++loop_count) {
+            uint64_t back_id = replacement_policy->select(kNumBackSegments, evictable);
+            if (back_id == kNullSegmentIndex) {
+                break;
+            }
+            uint64_t old_main_id = image->get_back_to_main(back_id);
+            if (old_main_id == kNullSegmentIndex || in_checkpoint) {
+                if (old_main_id != kNullSegmentIndex) {
+                    nr_evictions.fetch_add(1, std::memory_order_relaxed);
                 }
-
-                image->bind_back_segment(main_id, next_back_id);
-                advance_next_back_segment();
+                bind_back_segment(main_id, back_id, old_main_id);
                 ReleaseLock(back_memory_lock);
-                return;
-            } else {
-                auto &lock = segment_locks[old_main_id & (kSegmentLocks - 1)];
-                if (!TryAcquireLock(lock)) {
-                    advance_next_back_segment();
-                    loop_count++;
-                    continue;
-                }
-                if (segment_dirty.test(old_main_id)) {
+                return true;
+            }
+
+            // A copy-on-write of the old main segment may be running. The
+            // one of main_id holds its lock, which may also be the lock of
+            // the old main segment.
+            auto &lock = segment_locks[old_main_id & (kSegmentLocks - 1)];
+            bool own_lock = (&lock == &segment_locks[main_id & (kSegmentLocks - 1)]);
+            if (!own_lock && !TryAcquireLock(lock)) {
+                continue;
+            }
+            if (segment_dirty.test(old_main_id) || is_unrestored(old_main_id) ||
+                is_pinned(old_main_id)) {
+                if (!own_lock) {
                     ReleaseLock(lock);
-                    advance_next_back_segment();
-                    loop_count++;
-                    continue;
                 }
+                continue;
+            }
 
-                image->bind_back_segment(main_id, next_back_id);
-                advance_next_back_segment();
+            nr_evictions.fetch_add(1, std::memory_order_relaxed);
+            bind_back_segment(main_id, back_id, old_main_id);
+            if (!own_lock) {
                 ReleaseLock(lock);
-                ReleaseLock(back_memory_lock);
-                return;
             }
+            ReleaseLock(back_memory_lock);
+            return true;
+        }
+        ReleaseLock(back_memory_lock);
+        return false;
+    }
+
+    // Called with back_memory_lock held. The missing blocks are set before
+    // the binding is visible to the other checkpoint threads.
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::bind_back_segment(uint64_t main_id, uint64_t back_id,
+                                                                        uint64_t old_main_id) {
+        if (old_main_id != kNullSegmentIndex) {
+            reset_missing_blocks(old_main_id, false);
         }
+        reset_missing_blocks(main_id, true);
+        image->bind_back_segment(main_id, back_id);
+        replacement_policy->bind(back_id);
+    }
+
+    // Feeds the segments dirtied in the epoch to the replacement policy,
+    // called once per checkpoint by its leader
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::record_back_segment_accesses(AtomicBitSet &dirty_segments) {
+        AcquireLock(back_memory_lock);
+        dirty_segments.for_each([this](uint64_t seg_id) {
+            uint64_t back_id = image->get_main_to_back(seg_id);
+            if (back_id != kNullSegmentIndex) {
+                replacement_policy->access(back_id);
+            }
+        });
+        replacement_policy->tick();
+        ReleaseLock(back_memory_lock);
     }
 
-    void NvmInstEngine::hook_routine(const void *addr, size_t len) {
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::hook_routine(const void *addr, size_t len) {
         uint64_t delta = (uint64_t) addr - address_range.first;
-        for (uintptr_t ptr = delta & ~kBlockMask; ptr < delta + len; ptr += kBlockSize) {
+        uint64_t step = track_lines ? kCacheLineSize : kBlockSize;
+        for (uintptr_t ptr = delta & ~(step - 1); ptr < delta + len; ptr += step) {
             hook_routine((void *) (address_range.first + ptr));
         }
     }
 
-    void NvmInstEngine::hook_routine(const void *addr) {
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::hook_routine_batch(const volatile uint64_t *addrs,
+                                                                         uint64_t count) {
+        uint64_t size = address_range.second - address_range.first;
+        for (uint64_t i = 0; i != count; ++i) {
+            uintptr_t addr = addrs[i];
+            if (addr - address_range.first < size) {
+                NvmInstEngineImpl::hook_routine((const void *) addr);
+            }
+        }
+    }
+
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::hook_routine(const void *addr) {
         uint64_t delta = (uint64_t) addr - address_range.first;
         uint64_t block_id = delta >> kBlockShift;
+        if (track_lines) {
+            // A scalar store of up to 8 bytes may cross into the next line
+            uint64_t line_id = delta >> kCacheLineShift;
+            uint64_t last_line_id = std::min(delta + sizeof(uint64_t) - 1, delta | kBlockMask) >> kCacheLineShift;
+            for (; line_id <= last_line_id; ++line_id) {
+                if (!line_dirty.test(line_id)) {
+                    line_dirty.set(line_id);
+                }
+            }
+        }
         if (block_dirty.test(block_id, std::memory_order_acquire)) {
             return;
         }
 
         block_dirty.set(block_id, std::memory_order_release);
         thread_local unsigned int tid = tl_thread_info.get_thread_id();
-        auto &bucket = flush_blocks[tid];
+        auto bucket = flush_blocks[tid];
+        if (unlikely(!bucket)) {
+            bucket = flush_arena.attach(tid, flush_blocks);
+        }
         auto &bucket_size = flush_blocks_count[tid];
         if (likely(bucket_size != kMaxFlushBlocks)) {
             bucket[bucket_size] = block_id;
@@ -721,33 +2506,122 @@ namespace crpm {
         }
     }
 
-    void NvmInstEngine::hook_copy_on_write_routine(const void *addr, size_t len) {
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::hook_copy_on_write_routine(const void *addr, size_t len) {
         uint64_t delta = (uint64_t) addr - address_range.first;
         uint64_t start_segment_id = delta >> kSegmentShift;
         uint64_t end_segment_id = (delta + len + kSegmentMask) >> kSegmentShift;
         for (uintptr_t segment_id = start_segment_id; segment_id < end_segment_id; ++segment_id) {
             if (!segment_dirty.test(segment_id, std::memory_order_acquire)) {
+                if (is_unrestored(segment_id)) {
+                    restore_segment(segment_id);
+                }
+                if (unlikely(async_in_flight.load(std::memory_order_acquire))) {
+                    wait_for_in_flight_segment(segment_id);
+                }
                 if (skip_copy_on_write) {
-                    segment_dirty.set(segment_id, std::memory_order_release);
+                    mark_segment_dirty(segment_id);
                 } else {
                     lazy_write_back(segment_id, true);
                 }
             }
         }
+        for (uintptr_t ptr = delta & ~kBlockMask; ptr < delta + len; ptr += kBlockSize) {
+            if (unlikely(block_missing.test(ptr >> kBlockShift, std::memory_order_acquire))) {
+                copy_missing_block(ptr >> kBlockShift);
+            }
+        }
     }
 
-    void NvmInstEngine::hook_copy_on_write_routine(const void *addr) {
-        uint64_t segment_id = ((uint64_t) addr - address_range.first) >> kSegmentShift;
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::hook_copy_on_write_routine(const void *addr) {
+        uint64_t delta = (uint64_t) addr - address_range.first;
+        uint64_t segment_id = delta >> kSegmentShift;
         if (!segment_dirty.test(segment_id, std::memory_order_acquire)) {
+            if (is_unrestored(segment_id)) {
+                restore_segment(segment_id);
+            }
+            if (unlikely(async_in_flight.load(std::memory_order_acquire))) {
+                wait_for_in_flight_segment(segment_id);
+            }
             if (skip_copy_on_write) {
-                segment_dirty.set(segment_id, std::memory_order_release);
+                mark_segment_dirty(segment_id);
             } else {
                 lazy_write_back(segment_id, true);
             }
         }
+        if (unlikely(block_missing.test(delta >> kBlockShift, std::memory_order_acquire))) {
+            copy_missing_block(delta >> kBlockShift);
+        }
+    }
+
+    // The back segment holds the committed data already, the lock orders
+    // the store after a snapshot view has switched to the back segment
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::mark_segment_dirty(uint64_t segment_id) {
+        auto &lock = segment_locks[segment_id & (kSegmentLocks - 1)];
+        AcquireLock(lock);
+        pin_viewed_segment(segment_id);
+        image->set_segment_diverged(segment_id);
+        segment_dirty.set(segment_id, std::memory_order_release);
+        ReleaseLock(lock);
+    }
+
+    // The committed data of the block is only in the main segment, it is
+    // copied to the back segment before the first store of the epoch
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::copy_missing_block(uint64_t block_id) {
+        uint64_t segment_id = block_id / kBlocksPerSegment;
+        auto &lock = segment_locks[segment_id & (kSegmentLocks - 1)];
+        AcquireLock(lock);
+        if (block_missing.test(block_id)) {
+            uint64_t back_id = image->get_main_to_back(segment_id);
+            uint8_t *main_addr = image->get_main_block(block_id);
+            uint8_t *back_addr = image->get_back_segment(back_id) +
+                                 ((block_id % kBlocksPerSegment) << kBlockShift);
+            copy_block(back_addr, main_addr);
+            StoreFence();
+            CrashPoint("copy_on_write.block_copied");
+            mark_block_present(block_id, back_id);
+            StoreFence();
+            checkpoint_traffic.fetch_add(kBlockSize, std::memory_order_relaxed);
+        }
+        ReleaseLock(lock);
+    }
+
+    // Called with cleaner_mutex held. The background traffic of the pass
+    // so far is added to the record of its epoch.
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::complete_cleaner_epoch() {
+        stats_history.complete_background(
+                cleaner_epoch,
+                background_traffic.load(std::memory_order_relaxed) - cleaner_start_traffic,
+                nr_evictions.load(std::memory_order_relaxed) - cleaner_start_evictions,
+                nr_full_copies.load(std::memory_order_relaxed) - cleaner_start_full_copies,
+                nr_eliminated_lines.load(std::memory_order_relaxed) - cleaner_start_eliminated_lines,
+                CyclesToMilliseconds(ReadTSC() - cleaner_start_clock));
+    }
+
+    // Called with cleaner_mutex held, once the segments of epoch are marked
+    // pending. A pass of an earlier epoch may not have finished: its record
+    // is completed here, the segments it has left are written back with
+    // those of epoch and accounted to it.
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::restart_cleaner(uint64_t epoch, uint64_t start_clock) {
+        if (cleaner_state.load(std::memory_order_relaxed) != WB_IDLE) {
+            complete_cleaner_epoch();
+        }
+        cleaner_epoch = epoch;
+        cleaner_start_clock = start_clock;
+        cleaner_start_traffic = background_traffic.load(std::memory_order_relaxed);
+        cleaner_start_evictions = nr_evictions.load(std::memory_order_relaxed);
+        cleaner_start_full_copies = nr_full_copies.load(std::memory_order_relaxed);
+        cleaner_start_eliminated_lines = nr_eliminated_lines.load(std::memory_order_relaxed);
+        cleaner_state.store(WB_STARTED, std::memory_order_relaxed);
     }
 
-    void NvmInstEngine::WriteBackThreadRoutine(NvmInstEngine *engine) {
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::WriteBackThreadRoutine(NvmInstEngineImpl *engine) {
         BindSingleSocket();
         assert(engine);
         uint64_t segment_id;
@@ -765,11 +2639,15 @@ namespace crpm {
                         engine->cleaner_condvar.wait(lock);
                         continue;
                     }
-                    // printf("[DEBUG] cleaner: write_back %ld\n", segment_id);
-                    // Should be removed for Masstree
-                    engine->lazy_write_back(segment_id);
-                    segment_id++;
-                    if (segment_id == engine->nr_segments) {
+                    segment_id = engine->write_back_pending.find_next(segment_id, engine->nr_segments);
+                    if (segment_id < engine->nr_segments) {
+                        engine->lazy_write_back(segment_id);
+                        engine->write_back_pending.clear(segment_id);
+                        segment_id++;
+                    } else {
+                        engine->write_back_pending.clear_region(0, engine->nr_segments);
+                        engine->complete_cleaner_epoch();
+                        engine->mark_write_back_complete();
                         engine->cleaner_state.store(WB_IDLE, std::memory_order_release);
                     }
                     break;
@@ -783,10 +2661,10 @@ namespace crpm {
     }
 
 #ifdef USE_MPI_EXTENSION
-    NvmInstEngine * NvmInstEngine::OpenForMPI(const char *path,
-                                              const MemoryPoolOption &option,
-                                              MPI_Comm comm) {
-        NvmInstEngine *impl = new NvmInstEngine();
+    template<size_t BlockShift, size_t SegmentShift>
+    NvmInstEngineImpl<BlockShift, SegmentShift> *NvmInstEngineImpl<BlockShift, SegmentShift>::OpenForMPI(
+            const char *path, const MemoryPoolOption &option, MPI_Comm comm) {
+        NvmInstEngineImpl *impl = new NvmInstEngineImpl();
         bool ret;
         int flags = 0;
         int create = 0, all_create, comm_size;
@@ -827,12 +2705,30 @@ namespace crpm {
             }
         }
 
-        impl->segment_dirty.allocate(impl->nr_segments);
-        impl->block_dirty.allocate(impl->nr_blocks);
+        impl->track_lines = option.track_dirty_lines;
+        impl->init_dirty_tracking();
+        impl->allocate_dirty_bits();
+        if (!impl->init_back_segment_pool(option)) {
+            impl->close_checkpoint_image();
+            delete impl;
+            return nullptr;
+        }
         impl->segment_locks = new std::atomic_flag[kSegmentLocks];
         for (uint64_t i = 0; i < kSegmentLocks; ++i) {
             impl->segment_locks[i].clear(std::memory_order_relaxed);
         }
+        if (option.restore_epoch) {
+            fprintf(stderr, "snapshots cannot be restored with MPI\n");
+            impl->close_checkpoint_image();
+            delete impl;
+            return nullptr;
+        }
+        if (!impl->open_snapshot_history(path, option, create) ||
+            !impl->open_segment_stash(path, create)) {
+            impl->close_checkpoint_image();
+            delete impl;
+            return nullptr;
+        }
 
         if (!create) {
             uint64_t a = ReadTSC();
@@ -846,27 +2742,42 @@ namespace crpm {
             if (min_epoch != my_epoch) {
                 impl->image->reset_committed_epoch(min_epoch);
             }
+            uint64_t recovered = impl->recover_stashed_segments();
+            if (impl->history) {
+                impl->history->recover(min_epoch);
+            }
+            if (!option.lazy_recovery || !impl->prepare_lazy_recovery()) {
 #ifdef USE_IDENTICAL_DATA
-            impl->image->recovery(CheckpointImage::SS_Identical);
+                recovered += impl->image->recovery(CheckpointImage::SS_Identical, option.recovery_threads);
 #else
-            impl->image->recovery(CheckpointImage::SS_Back);
+                recovered += impl->image->recovery(CheckpointImage::SS_Back, option.recovery_threads);
 #endif
+            }
+            impl->load_missing_blocks();
             impl->has_snapshot = impl->exist_snapshot();
             uint64_t b = ReadTSC();
-            printf("%.3lf ms\n", (b - a) / 2400000.0);
+            printf("%.3lf ms\n", CyclesToMilliseconds(b - a));
+            if (option.verbose_output) {
+                printf("recovery: %lu bytes restored, %lu segments deferred\n",
+                       recovered, impl->nr_unrestored.load(std::memory_order_relaxed));
+            }
         }
 
         impl->address_range.first = (uintptr_t) impl->image->get_main_block(0);
-        impl->address_range.second = impl->address_range.first + impl->capacity;
+        impl->address_range.second = impl->address_range.first + impl->max_capacity;
 
-        Registry::Get()->do_register(impl);
         impl->verbose = option.verbose_output;
+        impl->calibrate_flush_cost();
+        Registry::Get()->do_register(impl);
         impl->has_init = true;
+        impl->start_lazy_recovery();
         impl->cleaner = std::thread(&WriteBackThreadRoutine, impl);
+        impl->checkpoint_worker = std::thread(&CheckpointWorkerRoutine, impl);
         return impl;
     }
 
-    void NvmInstEngine::checkpoint_for_mpi(uint64_t nr_threads, MPI_Comm comm) {
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::checkpoint_for_mpi(uint64_t nr_threads, MPI_Comm comm) {
         uint64_t start_clock, persist_clock;
         int tid = next_thread_id.fetch_add(1, std::memory_order_relaxed);
         bool is_leader = (tid == 0);
@@ -888,17 +2799,24 @@ namespace crpm {
                 checkpoint_in_progress.store(true, std::memory_order_relaxed);
                 cleaner_mutex.lock();
             }
+            partition_flush_blocks();
+            if (history) {
+                begin_snapshot(flush_mode == FMODE_WBINVD ? count_dirty_blocks()
+                                                          : flush_blocks_offset[nr_flush_threads]);
+            }
             latch.latch_add(tid);
         }
         latch.latch_wait(tid);
-        flush_parallel(tid, nr_threads);
+        flush_traffic.fetch_add(flush_parallel(tid, nr_threads), std::memory_order_relaxed);
         barrier.barrier(nr_threads, tid);
 
         if (is_leader) {
             commit_layout_state_for_mpi(CheckpointImage::SS_Main, comm);
+            mark_write_back_pending(segment_dirty);
             segment_dirty.clear_region(0, nr_segments);
             persist_clock = ReadTSC();
-            for (uint64_t id = 0; id < kMaxThreads; ++id) {
+            for (uint64_t k = 0; k < flush_arena.get_nr_threads(); ++k) {
+                uint64_t id = flush_arena.get_thread(k);
                 flush_blocks_count[id] = 0;
             }
             next_thread_id.store(0, std::memory_order_relaxed);
@@ -908,8 +2826,10 @@ namespace crpm {
                 image->set_attributes(kAttributeHasSnapshot);
                 has_snapshot = true;
             }
-            cleaner_state.store(WB_STARTED, std::memory_order_relaxed);
-            for (uint64_t i = 0; i < kMaxThreads; ++i) {
+            // The checkpoints under MPI keep no record, epoch 0 has none
+            restart_cleaner(0, persist_clock);
+            for (uint64_t k = 0; k < flush_arena.get_nr_threads(); ++k) {
+                uint64_t i = flush_arena.get_thread(k);
                 flush_blocks_count[i] = 0;
             }
             checkpoint_in_progress.store(false, std::memory_order_relaxed);
@@ -921,22 +2841,21 @@ namespace crpm {
         latch.latch_wait(tid);
     }
 
-    void NvmInstEngine::commit_layout_state_for_mpi(uint8_t state, MPI_Comm comm) {
+    template<size_t BlockShift, size_t SegmentShift>
+    void NvmInstEngineImpl<BlockShift, SegmentShift>::commit_layout_state_for_mpi(uint8_t state, MPI_Comm comm) {
+        if (state == CheckpointImage::SS_Main && history) {
+            history->commit_snapshot();
+        }
         if (flush_mode == FMODE_WBINVD) {
             image->begin_segment_state_update();
-            for (uint64_t seg_id = 0; seg_id < nr_segments; seg_id += AtomicBitSet::kBitWidth) {
-                uint64_t bitset = segment_dirty.test_all(seg_id);
-                while (bitset != 0) {
-                    uint64_t t = bitset & -bitset;
-                    int i = __builtin_ctzll(bitset); // i == first set index
-                    bitset ^= t;
-                    image->set_segment_state(seg_id + i, state);
-                }
-            }
+            segment_dirty.for_each([this, state](uint64_t seg_id) {
+                image->set_segment_state(seg_id, state);
+            });
             image->commit_segment_state_update_for_mpi(comm);
         } else {
             image->begin_segment_state_update();
-            for (size_t id = 0; id < kMaxThreads; ++id) {
+            for (uint64_t k = 0; k < flush_arena.get_nr_threads(); ++k) {
+                size_t id = flush_arena.get_thread(k);
                 auto &bucket = flush_blocks[id];
                 uint64_t bucket_size = flush_blocks_count[id];
                 for (uint64_t i = 0; i != bucket_size; ++i) {
@@ -950,6 +2869,11 @@ namespace crpm {
     }
 
 #endif // USE_MPI_EXTENSION
+
+#define CRPM_INSTANTIATE_ENGINE(block_shift, segment_shift) \
+    template class NvmInstEngineImpl<block_shift, segment_shift>;
+
+    CRPM_FOR_EACH_GEOMETRY(CRPM_INSTANTIATE_ENGINE)
 }
 
 #ifdef USE_NVM_INST_ENGINE
@@ -966,19 +2890,72 @@ void __crpm_hook_rt_range_store(void *addr, size_t length);
 
 #ifdef LEGACY_HOOK_FUNCTION
 void address_buffer_clear_all() { }
+void store_filter_invalidate() { }
+void store_filter_get_stats(uint64_t &hooked_stores, uint64_t &filter_hits) {
+    hooked_stores = filter_hits = 0;
+}
 alignas(64) uint64_t stack_start_addr, stack_end_addr;
+
+void store_hook_generic(void *addr) {
+    auto registry = crpm::NvmInstEngine::Registry::Get();
+    registry->hook_copy_on_write_routine(addr);
+    registry->hook_routine(addr);
+}
+
+template<size_t TrackingShift, size_t BlockShift, size_t SegmentShift>
+void store_hook(void *addr) {
+    store_hook_generic(addr);
+}
+
+template<size_t TrackingShift, size_t BlockShift, size_t SegmentShift>
+void range_store_hook(void *addr, size_t length) {
+    range_store_hook_generic(addr, length);
+}
 #else
 const static size_t kNumBufferedAddresses = 120;
+struct AddressBuffer;
+
+// The last blocks stored to by a thread, a store to one of them needs
+// no copy-on-write and its address is buffered already. The filter is
+// dropped when the epoch changes, which happens before the dirty bits
+// are cleared and when a pool is opened or closed. The counters are
+// only written by the owner thread, a hit touches nothing else.
+const static size_t kStoreFilterBlocks = 4;
+struct StoreFilter {
+    uint64_t epoch;
+    uint64_t next;
+    AddressBuffer *bucket;
+    uintptr_t blocks[kStoreFilterBlocks];
+    std::atomic<uint64_t> filter_hits;
+    std::atomic<uint64_t> filter_misses;
+};
+
 struct AddressBuffer {
     volatile uint64_t length;
     std::atomic_flag spinlock;
-    uint64_t padding[6];
+    // Guarded by spinlock: the filter of the thread that owns the buffer,
+    // and the counters of the threads that owned it before
+    StoreFilter *filter;
+    uint64_t hooked_stores;
+    uint64_t filter_hits;
+    uint64_t padding[3];
     volatile uint64_t ptr[kNumBufferedAddresses];
 };
 
+// Folds the counters of an exiting thread into its buffer
+struct StoreFilterOwner {
+    ~StoreFilterOwner();
+};
+
+alignas(64) std::atomic<uint64_t> store_filter_epoch(1);
+thread_local StoreFilter store_filter;
+thread_local StoreFilterOwner store_filter_owner;
+
 static_assert(sizeof(AddressBuffer) == 1024, "wrong address buffer size");
 
 alignas(1024) AddressBuffer address_buffer[crpm::kMaxThreads];
+// One past the highest buffer a thread has stored to
+alignas(64) std::atomic<uint64_t> address_buffer_end(0);
 alignas(64) uint64_t stack_start_addr, stack_end_addr;
 
 #define INLINE_HOOK
@@ -992,14 +2969,7 @@ void address_buffer_clear(AddressBuffer *buffer) {
 #ifdef INLINE_HOOK
     auto engine = registry->get_unique_engine();
     if (engine) {
-        uintptr_t start_addr = (uintptr_t) engine->get_address(0);
-        uintptr_t end_addr = start_addr + engine->get_capacity();
-        for (uint64_t i = 0; i != length; ++i) {
-            uintptr_t addr = buffer->ptr[i];
-            if (addr >= start_addr && addr < end_addr) {
-                engine->hook_routine((const void *) addr);
-            }
-        }
+        engine->hook_routine_batch(buffer->ptr, length);
     } else {
         for (uint64_t i = 0; i != length; ++i) {
             uintptr_t addr = buffer->ptr[i];
@@ -1017,10 +2987,140 @@ void address_buffer_clear(AddressBuffer *buffer) {
     buffer->spinlock.clear(std::memory_order_release);
 }
 
+AddressBuffer *address_buffer_attach() {
+    uint64_t id = crpm::tl_thread_info.get_thread_id();
+    AddressBuffer *buffer = &address_buffer[id];
+    // Constructed after tl_thread_info, so it is destroyed before the id
+    // is handed to another thread
+    (void) &store_filter_owner;
+    crpm::AcquireLock(buffer->spinlock);
+    buffer->filter = &store_filter;
+    crpm::ReleaseLock(buffer->spinlock);
+    store_filter.bucket = buffer;
+    uint64_t end = address_buffer_end.load(std::memory_order_relaxed);
+    while (end <= id && !address_buffer_end.compare_exchange_weak(end, id + 1)) {}
+    return buffer;
+}
+
+StoreFilterOwner::~StoreFilterOwner() {
+    AddressBuffer *buffer = store_filter.bucket;
+    if (!buffer) {
+        return;
+    }
+    uint64_t hits = store_filter.filter_hits.load(std::memory_order_relaxed);
+    crpm::AcquireLock(buffer->spinlock);
+    buffer->hooked_stores += hits + store_filter.filter_misses.load(std::memory_order_relaxed);
+    buffer->filter_hits += hits;
+    buffer->filter = nullptr;
+    crpm::ReleaseLock(buffer->spinlock);
+}
+
 void address_buffer_clear_all() {
-    for (uint64_t i = 0; i < crpm::kMaxThreads; ++i) {
+    uint64_t end = address_buffer_end.load(std::memory_order_acquire);
+    for (uint64_t i = 0; i < end; ++i) {
         address_buffer_clear(&address_buffer[i]);
     }
+    store_filter_invalidate();
+}
+
+void store_filter_invalidate() {
+    store_filter_epoch.fetch_add(1, std::memory_order_release);
+}
+
+void store_filter_get_stats(uint64_t &hooked_stores, uint64_t &filter_hits) {
+    hooked_stores = filter_hits = 0;
+    uint64_t end = address_buffer_end.load(std::memory_order_acquire);
+    for (uint64_t i = 0; i < end; ++i) {
+        AddressBuffer *buffer = &address_buffer[i];
+        crpm::AcquireLock(buffer->spinlock);
+        hooked_stores += buffer->hooked_stores;
+        filter_hits += buffer->filter_hits;
+        if (buffer->filter) {
+            uint64_t hits = buffer->filter->filter_hits.load(std::memory_order_relaxed);
+            hooked_stores += hits + buffer->filter->filter_misses.load(std::memory_order_relaxed);
+            filter_hits += hits;
+        }
+        crpm::ReleaseLock(buffer->spinlock);
+    }
+}
+
+
+// Returns whether the block is in the filter of the thread, the filter is
+// dropped first if the epoch has changed
+static inline bool store_filter_lookup(uintptr_t block) {
+    uint64_t epoch = store_filter_epoch.load(std::memory_order_acquire);
+    if (likely(store_filter.epoch == epoch)) {
+        for (auto cached : store_filter.blocks) {
+            if (cached == block) {
+                uint64_t hits = store_filter.filter_hits.load(std::memory_order_relaxed);
+                store_filter.filter_hits.store(hits + 1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+    } else {
+        for (auto &cached : store_filter.blocks) {
+            cached = UINTPTR_MAX;
+        }
+        store_filter.epoch = epoch;
+    }
+    return false;
+}
+
+// Buffers the address for the dirty tracking and adds its block to the filter
+static inline void store_filter_insert(void *addr, uintptr_t block) {
+    thread_local AddressBuffer *bucket = address_buffer_attach();
+    uint64_t length = bucket->length;
+    bucket->ptr[length] = (uintptr_t) addr;
+    length++;
+    bucket->length = length;
+    if (length == kNumBufferedAddresses) {
+        address_buffer_clear(bucket);
+    }
+    uint64_t misses = store_filter.filter_misses.load(std::memory_order_relaxed);
+    store_filter.filter_misses.store(misses + 1, std::memory_order_relaxed);
+    store_filter.blocks[store_filter.next++ % kStoreFilterBlocks] = block;
+}
+
+// Pools of different geometries or tracking shifts, or none at all
+void store_hook_generic(void *addr) {
+    uintptr_t block = (uintptr_t) addr >> hook_granularity_shift.load(std::memory_order_relaxed);
+    if (store_filter_lookup(block)) {
+        return;
+    }
+    crpm::NvmInstEngine::Registry::Get()->hook_copy_on_write_routine(addr);
+    store_filter_insert(addr, block);
+}
+
+template<size_t TrackingShift, size_t BlockShift, size_t SegmentShift>
+void store_hook(void *addr) {
+    typedef crpm::NvmInstEngineImpl<BlockShift, SegmentShift> EngineImpl;
+    void (*const hook)(void *) = store_hook<TrackingShift, BlockShift, SegmentShift>;
+    uintptr_t block = (uintptr_t) addr >> TrackingShift;
+    if (store_filter_lookup(block)) {
+        return;
+    }
+    auto engine = crpm::NvmInstEngine::Registry::Get()->find(addr);
+    if (likely(engine != nullptr)) {
+        // The dispatch may have changed since the hook was taken
+        if (likely(engine->get_store_hooks().store == hook)) {
+            static_cast<EngineImpl *>(engine)->EngineImpl::hook_copy_on_write_routine(addr);
+        } else {
+            engine->hook_copy_on_write_routine(addr);
+        }
+    }
+    store_filter_insert(addr, block);
+}
+
+template<size_t TrackingShift, size_t BlockShift, size_t SegmentShift>
+void range_store_hook(void *addr, size_t length) {
+    const static uint64_t kSize = 1ull << TrackingShift;
+    if ((((uint64_t) addr & (kSize - 1)) + length) <= kSize) {
+        store_hook<TrackingShift, BlockShift, SegmentShift>(addr);
+    } else {
+        auto registry = crpm::NvmInstEngine::Registry::Get();
+        registry->hook_copy_on_write_routine(addr, length);
+        registry->hook_routine(addr, length);
+    }
 }
 
 #endif
@@ -1032,6 +3132,9 @@ void __crpm_hook_rt_init() {
     for (uint64_t i = 0; i < crpm::kMaxThreads; ++i) {
         address_buffer[i].length = 0;
         address_buffer[i].spinlock.clear(std::memory_order_relaxed);
+        address_buffer[i].filter = nullptr;
+        address_buffer[i].hooked_stores = 0;
+        address_buffer[i].filter_hits = 0;
     }
 #endif
     crpm::process_instrumented = true;
@@ -1043,29 +3146,18 @@ void __crpm_hook_rt_fini() {
 
 void __crpm_hook_rt_store(void *addr) {
     // store_counter++;
-#ifdef LEGACY_HOOK_FUNCTION
-    auto registry = crpm::NvmInstEngine::Registry::Get();
-    registry->hook_copy_on_write_routine(addr);
-    registry->hook_routine(addr);
-#else
-    auto registry = crpm::NvmInstEngine::Registry::Get();
-    registry->hook_copy_on_write_routine(addr);
-    thread_local AddressBuffer *bucket =
-            &address_buffer[crpm::tl_thread_info.get_thread_id()];
-    uint64_t length = bucket->length;
-    bucket->ptr[length] = (uintptr_t) addr;
-    length++;
-    bucket->length = length;
-    if (length == kNumBufferedAddresses) {
-        address_buffer_clear(bucket);
-    }
-#endif
+    store_hook_routine.load(std::memory_order_relaxed)(addr);
 }
 
 void __crpm_hook_rt_range_store(void *addr, size_t length) {
     // store_counter++;
-    if ((((uint64_t) addr & crpm::kBlockMask) + length) <= crpm::kBlockSize) {
-        __crpm_hook_rt_store(addr);
+    range_store_hook_routine.load(std::memory_order_relaxed)(addr, length);
+}
+
+void range_store_hook_generic(void *addr, size_t length) {
+    uint64_t size = 1ull << hook_granularity_shift.load(std::memory_order_relaxed);
+    if ((((uint64_t) addr & (size - 1)) + length) <= size) {
+        store_hook_generic(addr);
     } else {
         auto registry = crpm::NvmInstEngine::Registry::Get();
         registry->hook_copy_on_write_routine(addr, length);
@@ -16,6 +16,7 @@ namespace crpm {
     void UndoLogEngine::Registry::do_register(UndoLogEngine *engine) {
         std::lock_guard<std::mutex> guard(mutex);
         engines.insert(engine);
+        table.insert(engine->address_range.first, engine->address_range.second, engine);
         if (!default_engine) {
             default_engine = engine;
         }
@@ -24,29 +25,14 @@ namespace crpm {
     void UndoLogEngine::Registry::do_unregister(UndoLogEngine *engine) {
         std::lock_guard<std::mutex> guard(mutex);
         engines.erase(engine);
+        table.erase(engine->address_range.first, engine->address_range.second, engine);
         if (engine == default_engine) {
             default_engine = nullptr;
         }
     }
 
     UndoLogEngine *UndoLogEngine::Registry::find(const void *addr) {
-        uintptr_t u_addr = (uintptr_t) addr;
-        if (likely(default_engine != nullptr)) {
-            auto &range = default_engine->address_range;
-            if (likely(u_addr >= range.first && u_addr < range.second)) {
-                return default_engine;
-            }
-        }
-        if (engines.size() == 1) {
-            return nullptr;
-        }
-        for (auto engine : engines) {
-            auto &range = engine->address_range;
-            if (u_addr >= range.first && u_addr < range.second) {
-                return engine;
-            }
-        }
-        return nullptr;
+        return table.find((uintptr_t) addr);
     }
 
     void UndoLogEngine::Registry::hook_routine(const void *addr) {
@@ -154,26 +140,22 @@ namespace crpm {
             log_head(0),
             verbose(false) {
         for (uint64_t i = 0; i < kMaxThreads; ++i) {
-            flush_blocks[i] = (volatile uint64_t *)
-                    malloc(sizeof(uint64_t) * kMaxFlushBlocks);
+            flush_blocks[i] = nullptr;
             flush_blocks_count[i] = 0;
         }
     }
 
     UndoLogEngine::~UndoLogEngine() {
         if (has_init) {
-            for (uint64_t i = 0; i < kMaxThreads; ++i) {
-                free((void *) flush_blocks[i]);
-            }
             fs.close();
             Registry::Get()->do_unregister(this);
             if (verbose) {
                 printf("checkpoint_traffic: %.3lf MiB\n",
                        checkpoint_traffic / 1000000.0);
                 printf("flush_latency: %.3lf ms\n",
-                       flush_latency / 2400000.0);
+                       CyclesToMilliseconds(flush_latency));
                 printf("write_back_latency: %.3lf ms\n",
-                       write_back_latency / 2400000.0);
+                       CyclesToMilliseconds(write_back_latency));
             }
         }
     }
@@ -194,7 +176,8 @@ namespace crpm {
         if (is_leader) {
             std::atomic_thread_fence(std::memory_order_acquire);
             bool all_empty = true, has_full = false;
-            for (size_t i = 0; i < kMaxThreads; ++i) {
+            for (uint64_t k = 0; k < flush_arena.get_nr_threads(); ++k) {
+                size_t i = flush_arena.get_thread(k);
                 size_t size = flush_blocks_count[i];
                 if (size != 0) {
                     all_empty = false;
@@ -261,9 +244,10 @@ namespace crpm {
         } else {
             size_t id = tid;
             uint8_t *base_address = (uint8_t *) get_address(0);
-            while (id < kMaxThreads) {
-                auto &bucket = flush_blocks[id];
-                uint64_t bucket_size = flush_blocks_count[id];
+            while (id < flush_arena.get_nr_threads()) {
+                unsigned int thread_id = flush_arena.get_thread(id);
+                auto &bucket = flush_blocks[thread_id];
+                uint64_t bucket_size = flush_blocks_count[thread_id];
                 for (uint64_t i = 0; i != bucket_size; ++i) {
                     uint8_t *addr = base_address + (bucket[i] << kBlockShift);
                     FlushRegion(addr, kBlockSize);
@@ -283,15 +267,17 @@ namespace crpm {
                 id += nr_threads * AtomicBitSet::kBitWidth;
             }
             id = tid;
-            while (id < kMaxThreads) {
-                flush_blocks_count[id] = 0;
+            while (id < flush_arena.get_nr_threads()) {
+                unsigned int thread_id = flush_arena.get_thread(id);
+                flush_blocks_count[thread_id] = 0;
                 id += nr_threads;
             }
         } else {
             size_t id = tid;
-            while (id < kMaxThreads) {
-                auto &bucket = flush_blocks[id];
-                uint64_t bucket_size = flush_blocks_count[id];
+            while (id < flush_arena.get_nr_threads()) {
+                unsigned int thread_id = flush_arena.get_thread(id);
+                auto &bucket = flush_blocks[thread_id];
+                uint64_t bucket_size = flush_blocks_count[thread_id];
                 for (uint64_t i = 0; i != bucket_size; ++i) {
                     uint64_t block_id = bucket[i];
                     block_dirty.clear_all(block_id);
@@ -374,7 +360,10 @@ namespace crpm {
         ReleaseLock(lock);
 
         thread_local unsigned int tid = tl_thread_info.get_thread_id();
-        auto &bucket = flush_blocks[tid];
+        auto bucket = flush_blocks[tid];
+        if (unlikely(!bucket)) {
+            bucket = flush_arena.attach(tid, flush_blocks);
+        }
         auto &bucket_size = flush_blocks_count[tid];
         if (likely(bucket_size != kMaxFlushBlocks)) {
             bucket[bucket_size] = block_id;
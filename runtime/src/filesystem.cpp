@@ -10,11 +10,166 @@
 #include <cassert>
 #include <cstdlib>
 #include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <mutex>
 
 #include "internal/filesystem.h"
 #include "internal/common.h"
 
 namespace crpm {
+    struct MappedFile {
+        FileSystem *fs;
+        uintptr_t start, end;
+        size_t file_offset;
+        uint8_t *media; // crash simulation only
+    };
+
+    static std::mutex g_mapping_mutex;
+    static std::vector<MappedFile> g_mappings;
+
+    bool g_crash_simulation = false;
+    bool g_track_persist_ranges = false;
+    static std::string g_crash_point;
+    static uint64_t g_crash_countdown;
+    thread_local std::vector<std::pair<uintptr_t, size_t>> tl_pending_ranges;
+
+    void SyncMappedFiles() {
+        std::lock_guard<std::mutex> guard(g_mapping_mutex);
+        std::vector<FileSystem *> synced;
+        for (auto &entry : g_mappings) {
+            if (std::find(synced.begin(), synced.end(), entry.fs) == synced.end()) {
+                entry.fs->sync();
+                synced.push_back(entry.fs);
+            }
+        }
+    }
+
+    bool EnableCrashSimulation(const char *crash_point, uint64_t countdown) {
+        std::lock_guard<std::mutex> guard(g_mapping_mutex);
+        if (!g_mappings.empty()) {
+            fprintf(stderr, "crash simulation must be enabled before opening pools\n");
+            return false;
+        }
+        g_crash_point = crash_point;
+        g_crash_countdown = countdown;
+        g_crash_simulation = true;
+        g_track_persist_ranges = true;
+        return true;
+    }
+
+    static MappedFile *FindMappedFile(uintptr_t addr) {
+        for (auto &entry : g_mappings) {
+            if (addr >= entry.start && addr < entry.end) {
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+
+    void TrackPersistRange(const void *addr, size_t len) {
+        tl_pending_ranges.emplace_back((uintptr_t) addr, len);
+    }
+
+    // Pages of the pending ranges are msync()ed, merged where they touch
+    static void SyncPendingRanges() {
+        std::vector<std::pair<uintptr_t, uintptr_t>> pages;
+        {
+            std::lock_guard<std::mutex> guard(g_mapping_mutex);
+            for (auto &range : tl_pending_ranges) {
+                MappedFile *entry = FindMappedFile(range.first);
+                if (entry) {
+                    uintptr_t end = std::min(range.first + range.second, entry->end);
+                    pages.emplace_back(range.first & ~kPageMask, RoundUp(end, kPageSize));
+                }
+            }
+        }
+        tl_pending_ranges.clear();
+        std::sort(pages.begin(), pages.end());
+        for (size_t i = 0; i < pages.size();) {
+            uintptr_t start = pages[i].first, end = pages[i].second;
+            for (++i; i < pages.size() && pages[i].first <= end; ++i) {
+                end = std::max(end, pages[i].second);
+            }
+            if (msync((void *) start, end - start, MS_SYNC)) {
+                perror("msync");
+            }
+        }
+    }
+
+    void TrackPersistFence() {
+        if (tl_pending_ranges.empty()) {
+            return;
+        }
+        if (!g_crash_simulation) {
+            SyncPendingRanges();
+            return;
+        }
+        std::lock_guard<std::mutex> guard(g_mapping_mutex);
+        for (auto &range : tl_pending_ranges) {
+            MappedFile *entry = FindMappedFile(range.first);
+            if (entry) {
+                size_t len = std::min(range.second, entry->end - range.first);
+                memcpy(entry->media + (range.first - entry->start), (void *) range.first, len);
+            }
+        }
+        tl_pending_ranges.clear();
+    }
+
+    void TrackWriteBackAndInvalidate() {
+        std::lock_guard<std::mutex> guard(g_mapping_mutex);
+        for (auto &entry : g_mappings) {
+            memcpy(entry.media, (void *) entry.start, entry.end - entry.start);
+        }
+    }
+
+    void TriggerCrashPoint(const char *name) {
+        std::lock_guard<std::mutex> guard(g_mapping_mutex);
+        if (g_crash_point != name || g_crash_countdown-- != 0) {
+            return;
+        }
+        // A file may be mapped in several ranges, each is dumped at its offset
+        std::vector<std::pair<FileSystem *, int>> crash_files;
+        for (auto &entry : g_mappings) {
+            int fd = -1;
+            for (auto &crash_file : crash_files) {
+                if (crash_file.first == entry.fs) {
+                    fd = crash_file.second;
+                }
+            }
+            if (fd < 0) {
+                std::string crash_path = entry.fs->get_file_path() + ".crash";
+                fd = ::open(crash_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+                if (fd < 0) {
+                    perror("open");
+                    _exit(EXIT_FAILURE);
+                }
+                if (ftruncate(fd, entry.fs->get_size())) {
+                    perror("ftruncate");
+                    _exit(EXIT_FAILURE);
+                }
+                crash_files.emplace_back(entry.fs, fd);
+            }
+            size_t length = entry.end - entry.start, offset = 0;
+            while (offset < length) {
+                ssize_t bytes_written = pwrite(fd, entry.media + offset, length - offset,
+                                               entry.file_offset + offset);
+                if (bytes_written <= 0) {
+                    perror("pwrite");
+                    _exit(EXIT_FAILURE);
+                }
+                offset += bytes_written;
+            }
+        }
+        for (auto &crash_file : crash_files) {
+            fsync(crash_file.second);
+            ::close(crash_file.second);
+        }
+        fprintf(stderr, "crash point %s triggered\n", name);
+        _exit(kCrashExitCode);
+    }
+
     bool FileSystem::Exist(const char *path) {
         int rc = access(path, R_OK | W_OK);
         return (rc == 0);
@@ -25,10 +180,25 @@ namespace crpm {
         return (rc == 0);
     }
 
-    bool FileSystem::create(const char *path, size_t size_, int flags, void *hint_addr) {
+    bool FileSystem::ReadHeader(const char *path, void *buf, size_t len) {
+        int tmp_fd = ::open(path, O_RDONLY);
+        if (tmp_fd < 0) {
+            perror("open");
+            return false;
+        }
+        ssize_t bytes_read = pread(tmp_fd, buf, len, 0);
+        ::close(tmp_fd);
+        if (bytes_read != (ssize_t) len) {
+            fprintf(stderr, "%s: truncated file\n", path);
+            return false;
+        }
+        return true;
+    }
+
+    bool FileSystem::create(const char *path, size_t size_, int flags, void *hint_addr,
+                            size_t reserve_size) {
         size = size_;
         int tmp_fd, rc;
-        void *map_addr;
 
         if (has_init)
             return false;
@@ -60,33 +230,16 @@ namespace crpm {
             return false;
         }
 
-        map_addr = mmap(hint_addr, size, PROT_READ | PROT_WRITE,
-                        MAP_SHARED_VALIDATE | MAP_SYNC | flags,
-                        tmp_fd, 0);
-
-        if (map_addr == MAP_FAILED) {
-            perror("mmap");
-            ::close(tmp_fd);
-            return false;
-        }
-
-        if ((flags & MAP_FIXED) && (map_addr != hint_addr)) {
-            perror("mmap");
+        if (!map_file(tmp_fd, reserve_size, flags, hint_addr)) {
             ::close(tmp_fd);
             return false;
         }
-
-        fd = tmp_fd;
-        addr = map_addr;
         file_path = path;
-        has_init = true;
         return true;
     }
 
-    bool FileSystem::open(const char *path, int flags, void *hint_addr) {
-        int tmp_fd, rc;
-        size_t tmp_size;
-        void *map_addr;
+    bool FileSystem::open(const char *path, int flags, void *hint_addr, size_t reserve_size) {
+        int tmp_fd;
 
         if (has_init)
             return false;
@@ -104,41 +257,211 @@ namespace crpm {
             return false;
         }
 
-        tmp_size = off_tail;
-        map_addr = mmap(hint_addr, tmp_size, PROT_READ | PROT_WRITE,
-                        MAP_SHARED_VALIDATE | MAP_SYNC | flags,
-                        tmp_fd, 0);
+        size = off_tail;
+        if (!map_file(tmp_fd, reserve_size, flags, hint_addr)) {
+            ::close(tmp_fd);
+            return false;
+        }
+        file_path = path;
+        return true;
+    }
+
+    bool FileSystem::map_file(int tmp_fd, size_t reserve_size, int flags, void *hint_addr) {
+        void *map_addr;
+        if (reserve_size) {
+            map_addr = mmap(hint_addr, reserve_size, PROT_NONE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | (flags & MAP_FIXED), -1, 0);
+        } else {
+            map_addr = mmap(hint_addr, size, PROT_READ | PROT_WRITE,
+                            get_map_flags() | flags, tmp_fd, 0);
+        }
 
         if (map_addr == MAP_FAILED) {
             perror("mmap");
-            ::close(tmp_fd);
             return false;
         }
 
         if ((flags & MAP_FIXED) && (map_addr != hint_addr)) {
             perror("mmap");
-            ::close(tmp_fd);
+            munmap(map_addr, reserve_size ? reserve_size : size);
             return false;
         }
 
         fd = tmp_fd;
         addr = map_addr;
-        size = tmp_size;
-        file_path = path;
+        reserved_size = reserve_size;
         has_init = true;
+        if (!reserve_size) {
+            ranges.push_back({0, 0, size});
+            register_mapping(ranges.back());
+        }
+        return true;
+    }
+
+    bool FileSystem::map_range(size_t offset, size_t file_offset, size_t length) {
+        if (!has_init || offset + length > reserved_size || file_offset + length > size) {
+            fprintf(stderr, "map_range: [%lx, %lx) is out of the reserved space\n",
+                    offset, offset + length);
+            return false;
+        }
+        void *target = rel_to_abs(offset);
+        void *map_addr = mmap(target, length, PROT_READ | PROT_WRITE,
+                              get_map_flags() | MAP_FIXED, fd, file_offset);
+        if (map_addr == MAP_FAILED) {
+            perror("mmap");
+            return false;
+        }
+        ranges.push_back({offset, file_offset, length});
+        register_mapping(ranges.back());
+        return true;
+    }
+
+    void *FileSystem::map_alias(bool read_only) {
+        if (!has_init) {
+            return nullptr;
+        }
+        size_t length = reserved_size ? reserved_size : size;
+        void *alias = mmap(nullptr, length, PROT_NONE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (alias == MAP_FAILED) {
+            perror("mmap");
+            return nullptr;
+        }
+        int prot = read_only ? PROT_READ : PROT_READ | PROT_WRITE;
+        for (auto &range : ranges) {
+            void *target = (char *) alias + range.offset;
+            if (mmap(target, range.length, prot,
+                     get_map_flags() | MAP_FIXED, fd, range.file_offset) == MAP_FAILED) {
+                perror("mmap");
+                munmap(alias, length);
+                return nullptr;
+            }
+        }
+        return alias;
+    }
+
+    bool FileSystem::map_alias_range(void *alias, size_t offset, size_t file_offset, size_t length) {
+        if (!has_init || file_offset + length > size) {
+            fprintf(stderr, "map_alias_range: [%lx, %lx) is out of the file\n",
+                    file_offset, file_offset + length);
+            return false;
+        }
+        void *target = (char *) alias + offset;
+        if (mmap(target, length, PROT_READ, get_map_flags() | MAP_FIXED, fd, file_offset) == MAP_FAILED) {
+            perror("mmap");
+            return false;
+        }
+        return true;
+    }
+
+    void FileSystem::unmap_alias(void *alias) {
+        munmap(alias, reserved_size ? reserved_size : size);
+    }
+
+    bool FileSystem::extend(size_t new_size) {
+        if (!has_init || new_size <= size) {
+            return has_init;
+        }
+        int rc = posix_fallocate(fd, size, new_size - size);
+        if (rc) {
+            fprintf(stderr, "fallocate: %s\n", strerror(rc));
+            return false;
+        }
+        if (fsync(fd)) {
+            perror("fsync");
+            return false;
+        }
+        size = new_size;
         return true;
     }
 
     void FileSystem::close() {
         if (has_init) {
-            munmap(addr, size);
+            unregister_mapping();
+            if (g_persist_mode == PERSIST_MSYNC) {
+                sync();
+            }
+            munmap(addr, reserved_size ? reserved_size : size);
             ::close(fd);
+            ranges.clear();
+            reserved_size = 0;
             has_init = false;
         }
     }
 
+    void FileSystem::release(size_t offset, size_t length) {
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length)) {
+            perror("fallocate");
+        }
+    }
+
+    bool FileSystem::allocate(size_t offset, size_t length) {
+        int rc = posix_fallocate(fd, offset, length);
+        if (rc) {
+            fprintf(stderr, "fallocate: %s\n", strerror(rc));
+            return false;
+        }
+        return true;
+    }
+
     void FileSystem::clear_poison(size_t offset, size_t length) {
         fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length);
         fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, length);
     }
-}
\ No newline at end of file
+
+    void FileSystem::sync() {
+        if (!has_init) {
+            return;
+        }
+        for (auto &range : ranges) {
+            if (msync(rel_to_abs(range.offset), range.length, MS_SYNC)) {
+                perror("msync");
+            }
+        }
+    }
+
+    int FileSystem::get_map_flags() const {
+        if (g_persist_mode == PERSIST_DAX) {
+            return MAP_SHARED_VALIDATE | MAP_SYNC;
+        } else {
+            return MAP_SHARED;
+        }
+    }
+
+    bool HasMappedFiles() {
+        std::lock_guard<std::mutex> guard(g_mapping_mutex);
+        return !g_mappings.empty();
+    }
+
+    void FileSystem::register_mapping(const MappedRange &range) {
+        std::lock_guard<std::mutex> guard(g_mapping_mutex);
+        MappedFile entry;
+        entry.fs = this;
+        entry.start = (uintptr_t) rel_to_abs(range.offset);
+        entry.end = entry.start + range.length;
+        entry.file_offset = range.file_offset;
+        entry.media = nullptr;
+        if (g_crash_simulation) {
+            // Everything in the file when it is mapped is durable by definition
+            entry.media = (uint8_t *) malloc(range.length);
+            if (!entry.media) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+            }
+            memcpy(entry.media, (void *) entry.start, range.length);
+        }
+        g_mappings.push_back(entry);
+    }
+
+    void FileSystem::unregister_mapping() {
+        std::lock_guard<std::mutex> guard(g_mapping_mutex);
+        for (auto iter = g_mappings.begin(); iter != g_mappings.end();) {
+            if (iter->fs == this) {
+                free(iter->media);
+                iter = g_mappings.erase(iter);
+            } else {
+                ++iter;
+            }
+        }
+    }
+}
@@ -0,0 +1,38 @@
+//
+// Per-thread lists of the blocks dirtied in an epoch.
+//
+
+#include "internal/flush_blocks.h"
+
+namespace crpm {
+    FlushBlockArena::FlushBlockArena(uint64_t list_capacity) :
+            list_capacity(list_capacity), nr_threads(0), chunk_used(kListsPerChunk) {}
+
+    FlushBlockArena::~FlushBlockArena() {
+        for (auto chunk : chunks) {
+            free(chunk);
+        }
+    }
+
+    volatile uint64_t *FlushBlockArena::attach(unsigned int tid, volatile uint64_t **lists) {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (lists[tid]) {
+            return lists[tid];
+        }
+        if (chunk_used == kListsPerChunk) {
+            // Pages of a chunk are only touched as its lists fill up
+            uint64_t *chunk = (uint64_t *) malloc(sizeof(uint64_t) * list_capacity * kListsPerChunk);
+            if (!chunk) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+            }
+            chunks.push_back(chunk);
+            chunk_used = 0;
+        }
+        uint64_t index = nr_threads.load(std::memory_order_relaxed);
+        threads[index] = tid;
+        lists[tid] = chunks.back() + list_capacity * chunk_used++;
+        nr_threads.store(index + 1, std::memory_order_release);
+        return lists[tid];
+    }
+}
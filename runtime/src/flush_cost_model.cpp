@@ -0,0 +1,137 @@
+//
+// Cost model that picks how the dirty blocks of a checkpoint are persisted.
+//
+
+#include <unistd.h>
+#include <algorithm>
+
+#include "internal/common.h"
+#include "internal/flush_cost_model.h"
+
+namespace crpm {
+    const static size_t kCalibrationBytes = 1ull << 20;
+    const static int kCalibrationRounds = 3;
+
+    // The emulated domain has no flush cost to measure. Its nominal costs put
+    // the break-even point of wbinvd at kMaxFlushBlocks dirty blocks in total.
+    FlushCostModel::FlushCostModel(size_t block_shift) :
+            line_cycles(1.0),
+            block_cycles(1ull << (block_shift - kCacheLineShift)),
+            wbinvd_cycles(kMaxFlushBytes >> kCacheLineShift),
+            segment_cycles(0.0),
+            block_size(1ull << block_shift),
+            lines_per_block(1ull << (block_shift - kCacheLineShift)),
+            calibrated(false),
+            has_wbinvd(true) {}
+
+    static void TouchRegion(uint8_t *addr, size_t len) {
+        for (size_t offset = 0; offset < len; offset += kCacheLineSize) {
+            volatile uint64_t *word = (volatile uint64_t *) (addr + offset);
+            *word = *word;
+        }
+    }
+
+    void FlushCostModel::calibrate(void *sample, size_t len) {
+        if (g_persist_mode == PERSIST_EMULATED) {
+            return;
+        }
+#if !defined(USE_ENHANCED_ADR)
+        if (g_persist_mode == PERSIST_DAX) {
+            has_wbinvd = (access("/dev/global_flush", W_OK) == 0);
+        }
+#endif
+        uint8_t *base = (uint8_t *) sample;
+        len = std::min(len, kCalibrationBytes) & ~(block_size - 1);
+        const size_t nr_blocks = len / block_size;
+        if (!nr_blocks) {
+            return;
+        }
+
+        uint64_t best_flush = UINT64_MAX, best_recopy = UINT64_MAX;
+        uint64_t best_wbinvd = UINT64_MAX, best_segment = UINT64_MAX;
+        for (int round = 0; round < kCalibrationRounds; ++round) {
+            TouchRegion(base, len);
+            uint64_t start_clock = ReadTSC();
+            FlushRegion(base, len);
+            StoreFence();
+            best_flush = std::min(best_flush, ReadTSC() - start_clock);
+
+            TouchRegion(base, len);
+            start_clock = ReadTSC();
+            for (size_t offset = 0; offset < len; offset += block_size) {
+                if (block_size & 255) {
+                    NonTemporalCopy64(base + offset, base + offset, block_size);
+                } else {
+                    NonTemporalCopy256(base + offset, base + offset, block_size);
+                }
+            }
+            StoreFence();
+            best_recopy = std::min(best_recopy, ReadTSC() - start_clock);
+
+            // One line flushed and fenced at a time, like a segment state update
+            TouchRegion(base, len);
+            start_clock = ReadTSC();
+            for (size_t offset = 0; offset < len; offset += block_size) {
+                Flush(base + offset);
+                StoreFence();
+            }
+            best_segment = std::min(best_segment, ReadTSC() - start_clock);
+
+            if (has_wbinvd) {
+                TouchRegion(base, len);
+                start_clock = ReadTSC();
+                WriteBackAndInvalidate();
+                best_wbinvd = std::min(best_wbinvd, ReadTSC() - start_clock);
+            }
+        }
+
+        line_cycles = (double) best_flush / (nr_blocks * lines_per_block);
+        block_cycles = (double) best_recopy / nr_blocks;
+        segment_cycles = (double) best_segment / nr_blocks;
+        wbinvd_cycles = has_wbinvd ? (double) best_wbinvd : 0.0;
+        calibrated = true;
+    }
+
+    FlushCostModel::Method FlushCostModel::choose(uint64_t dirty_blocks, uint64_t dirty_segments,
+                                                  Estimate &estimate) const {
+        double frequency = GetTSCFrequency();
+        estimate.flush_blocks_ms = dirty_blocks * lines_per_block * line_cycles / frequency;
+        estimate.nt_recopy_ms = dirty_blocks * block_cycles / frequency;
+        estimate.wbinvd_ms = (wbinvd_cycles + dirty_segments * segment_cycles) / frequency;
+
+        Method method = METHOD_FLUSH_BLOCKS;
+        double best_ms = estimate.flush_blocks_ms;
+        if (estimate.nt_recopy_ms < best_ms) {
+            method = METHOD_NT_RECOPY;
+            best_ms = estimate.nt_recopy_ms;
+        }
+        if (has_wbinvd && estimate.wbinvd_ms < best_ms) {
+            method = METHOD_WBINVD;
+        }
+        return method;
+    }
+
+    void FlushCostModel::print() const {
+        double frequency = GetTSCFrequency() / 1000000.0; // cycles per ns
+        printf("flush cost model (%s): line %.1lf ns, block re-copy %.1lf ns, "
+               "wbinvd %.3lf ms%s, segment %.1lf ns\n",
+               calibrated ? "calibrated" : "nominal",
+               line_cycles / frequency, block_cycles / frequency,
+               wbinvd_cycles / frequency / 1000000.0,
+               has_wbinvd ? "" : " (unavailable)",
+               segment_cycles / frequency);
+    }
+
+    const char *FlushCostModel::GetMethodName(Method method) {
+        switch (method) {
+            case METHOD_FLUSH_BLOCKS:
+                return "flush-blocks";
+            case METHOD_NT_RECOPY:
+                return "nt-recopy";
+            case METHOD_WBINVD:
+                return "wbinvd";
+            default:
+                return "unknown";
+        }
+    }
+}
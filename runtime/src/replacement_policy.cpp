@@ -0,0 +1,140 @@
+//
+// Policies that pick the back segment to bind when the back pool is full.
+//
+
+#include <cstdio>
+
+#include "internal/common.h"
+#include "internal/replacement_policy.h"
+
+namespace crpm {
+    ReplacementPolicy *ReplacementPolicy::Create(const std::string &name, uint64_t max_back_segments) {
+        if (name == "default" || name == "round-robin") {
+            return new RoundRobinPolicy();
+        } else if (name == "clock") {
+            return new ClockPolicy(max_back_segments);
+        } else if (name == "lru-k") {
+            return new LruKPolicy(max_back_segments);
+        } else if (name == "frequency") {
+            return new FrequencyPolicy(max_back_segments);
+        }
+        fprintf(stderr, "unsupported replacement policy %s\n", name.c_str());
+        return nullptr;
+    }
+
+    uint64_t ReplacementPolicy::select_sampled(uint64_t nr_back_segments, const Filter &evictable,
+                                               const std::function<uint64_t(uint64_t)> &score) {
+        uint64_t victim = kNullSegmentIndex, victim_score = UINT64_MAX;
+        uint64_t nr_samples = 0;
+        cursor %= nr_back_segments;
+        for (uint64_t i = 0; i < nr_back_segments && nr_samples < kSampleSize; ++i) {
+            uint64_t back_id = cursor;
+            cursor = (cursor + 1) % nr_back_segments;
+            if (!evictable(back_id)) {
+                continue;
+            }
+            uint64_t value = score(back_id);
+            if (victim == kNullSegmentIndex || value < victim_score) {
+                victim = back_id;
+                victim_score = value;
+            }
+            nr_samples++;
+        }
+        return victim;
+    }
+
+    uint64_t RoundRobinPolicy::select(uint64_t nr_back_segments, const Filter &evictable) {
+        cursor %= nr_back_segments;
+        for (uint64_t i = 0; i < nr_back_segments; ++i) {
+            uint64_t back_id = cursor;
+            cursor = (cursor + 1) % nr_back_segments;
+            if (evictable(back_id)) {
+                return back_id;
+            }
+        }
+        return kNullSegmentIndex;
+    }
+
+    ClockPolicy::ClockPolicy(uint64_t max_back_segments) : referenced(max_back_segments, false) {}
+
+    uint64_t ClockPolicy::select(uint64_t nr_back_segments, const Filter &evictable) {
+        cursor %= nr_back_segments;
+        // The first round clears the reference bits the second one relies on
+        for (uint64_t i = 0; i < 2 * nr_back_segments; ++i) {
+            uint64_t back_id = cursor;
+            cursor = (cursor + 1) % nr_back_segments;
+            if (!evictable(back_id)) {
+                continue;
+            }
+            if (referenced[back_id]) {
+                referenced[back_id] = false;
+                continue;
+            }
+            return back_id;
+        }
+        return kNullSegmentIndex;
+    }
+
+    LruKPolicy::LruKPolicy(uint64_t max_back_segments) :
+            last_access(max_back_segments, 0),
+            prev_access(max_back_segments, 0) {}
+
+    void LruKPolicy::access(uint64_t back_id) {
+        if (last_access[back_id] != clock) {
+            prev_access[back_id] = last_access[back_id];
+            last_access[back_id] = clock;
+        }
+    }
+
+    void LruKPolicy::bind(uint64_t back_id) {
+        prev_access[back_id] = 0;
+        last_access[back_id] = clock;
+    }
+
+    void LruKPolicy::release(uint64_t back_id) {
+        prev_access[back_id] = 0;
+        last_access[back_id] = 0;
+    }
+
+    uint64_t LruKPolicy::select(uint64_t nr_back_segments, const Filter &evictable) {
+        // Segments accessed once rank first, by their only access, then the
+        // others by their second most recent access
+        const uint64_t now = clock;
+        return select_sampled(nr_back_segments, evictable, [this, now](uint64_t back_id) {
+            uint64_t prev = prev_access[back_id];
+            return prev ? prev + now : last_access[back_id];
+        });
+    }
+
+    FrequencyPolicy::FrequencyPolicy(uint64_t max_back_segments) :
+            count(max_back_segments, 0),
+            last_access(max_back_segments, 0) {}
+
+    uint64_t FrequencyPolicy::decayed_count(uint64_t back_id) const {
+        uint64_t half_lives = (clock - last_access[back_id]) / kHalfLife;
+        return half_lives >= 64 ? 0 : count[back_id] >> half_lives;
+    }
+
+    void FrequencyPolicy::access(uint64_t back_id) {
+        if (last_access[back_id] != clock) {
+            count[back_id] = decayed_count(back_id) + 1;
+            last_access[back_id] = clock;
+        }
+    }
+
+    void FrequencyPolicy::bind(uint64_t back_id) {
+        count[back_id] = 1;
+        last_access[back_id] = clock;
+    }
+
+    void FrequencyPolicy::release(uint64_t back_id) {
+        count[back_id] = 0;
+        last_access[back_id] = 0;
+    }
+
+    uint64_t FrequencyPolicy::select(uint64_t nr_back_segments, const Filter &evictable) {
+        return select_sampled(nr_back_segments, evictable, [this](uint64_t back_id) {
+            return decayed_count(back_id);
+        });
+    }
+}
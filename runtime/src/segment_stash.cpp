@@ -0,0 +1,134 @@
+//
+// Copies of committed segments that are written in place.
+//
+
+#include "internal/segment_stash.h"
+
+namespace crpm {
+    size_t SegmentStash::CalculateDataOffset(size_t nr_slots) {
+        return RoundUp(sizeof(Header), kPageSize) + RoundUp(sizeof(uint64_t) * nr_slots, kPageSize);
+    }
+
+    void SegmentStash::setup_layout() {
+        uint8_t *base = (uint8_t *) header;
+        segment_ids = (uint64_t *) (base + RoundUp(sizeof(Header), kPageSize));
+        segments = base + CalculateDataOffset(header->nr_slots);
+    }
+
+    SegmentStash *SegmentStash::Create(const char *path, size_t max_segments, size_t segment_shift) {
+        SegmentStash *obj = new SegmentStash();
+        obj->segment_size = 1ull << segment_shift;
+        size_t data_offset = CalculateDataOffset(max_segments);
+        if (!obj->fs.create(path, data_offset, 0, nullptr, data_offset + max_segments * obj->segment_size) ||
+            !obj->fs.map_range(0, 0, data_offset)) {
+            delete obj;
+            return nullptr;
+        }
+        Header *header = (Header *) obj->fs.rel_to_abs(0);
+        memset(header, 0, sizeof(Header));
+        header->magic = kSegmentStashMagic;
+        header->segment_shift = segment_shift;
+        header->nr_slots = max_segments;
+        FlushRegion(header, sizeof(Header));
+        StoreFence();
+        obj->header = header;
+        obj->setup_layout();
+        return obj;
+    }
+
+    SegmentStash *SegmentStash::Open(const char *path, size_t segment_shift) {
+        Header stored;
+        if (!FileSystem::ReadHeader(path, &stored, sizeof(Header)) || stored.magic != kSegmentStashMagic ||
+            stored.segment_shift != segment_shift) {
+            fprintf(stderr, "%s: segment stash corrupted\n", path);
+            return nullptr;
+        }
+        SegmentStash *obj = new SegmentStash();
+        obj->segment_size = 1ull << segment_shift;
+        size_t data_offset = CalculateDataOffset(stored.nr_slots);
+        if (!obj->fs.open(path, 0, nullptr, data_offset + stored.nr_slots * obj->segment_size)) {
+            delete obj;
+            return nullptr;
+        }
+        obj->nr_mapped = obj->fs.get_size() < data_offset ? 0 : (obj->fs.get_size() - data_offset) / obj->segment_size;
+        if (obj->fs.get_size() < data_offset || stored.nr_entries > obj->nr_mapped ||
+            !obj->fs.map_range(0, 0, data_offset + obj->nr_mapped * obj->segment_size)) {
+            fprintf(stderr, "%s: segment stash corrupted\n", path);
+            delete obj;
+            return nullptr;
+        }
+        obj->header = (Header *) obj->fs.rel_to_abs(0);
+        obj->setup_layout();
+        return obj;
+    }
+
+    void SegmentStash::recover(uint64_t committed_epoch,
+                               const std::function<void(uint64_t, const uint8_t *)> &restore) {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (header->epoch == committed_epoch) {
+            for (uint64_t slot = 0; slot < header->nr_entries; ++slot) {
+                restore(segment_ids[slot], segments + slot * segment_size);
+            }
+            // The restored segments are persisted before the stash is dropped
+            StoreFence();
+        }
+        if (header->nr_entries) {
+            NTStore(&header->nr_entries, 0);
+            StoreFence();
+        }
+        slots.clear();
+    }
+
+    bool SegmentStash::map_slot(uint64_t slot) {
+        if (slot < nr_mapped) {
+            return true;
+        }
+        size_t offset = CalculateDataOffset(header->nr_slots) + slot * segment_size;
+        if (!fs.extend(offset + segment_size) || !fs.map_range(offset, offset, segment_size)) {
+            return false;
+        }
+        nr_mapped = slot + 1;
+        return true;
+    }
+
+    // The stash of an older epoch is emptied before it is retagged, the
+    // count of a stash is only raised once its segment is persisted
+    bool SegmentStash::stash(uint64_t epoch, uint64_t segment_id, const void *data) {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (header->epoch != epoch) {
+            if (header->nr_entries) {
+                NTStore(&header->nr_entries, 0);
+                StoreFence();
+            }
+            NTStore(&header->epoch, epoch);
+            StoreFence();
+            slots.clear();
+        }
+        if (slots.count(segment_id)) {
+            // Still the committed data, the segment is not overwritten so
+            // that a crash never tears it
+            return true;
+        }
+        uint64_t slot = header->nr_entries;
+        if (slot == header->nr_slots || !map_slot(slot)) {
+            return false;
+        }
+        NonTemporalCopy64(segments + slot * segment_size, (void *) data, segment_size);
+        NTStore(&segment_ids[slot], segment_id);
+        StoreFence();
+        CrashPoint("stash.copied");
+        NTStore(&header->nr_entries, slot + 1);
+        StoreFence();
+        slots[segment_id] = slot;
+        return true;
+    }
+
+    const uint8_t *SegmentStash::find(uint64_t epoch, uint64_t segment_id) {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (header->epoch != epoch) {
+            return nullptr;
+        }
+        auto iter = slots.find(segment_id);
+        return iter != slots.end() ? segments + iter->second * segment_size : nullptr;
+    }
+}
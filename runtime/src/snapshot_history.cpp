@@ -0,0 +1,214 @@
+//
+// Pre-images of the blocks changed by the recent checkpoints.
+//
+
+#include <algorithm>
+
+#include "internal/snapshot_history.h"
+
+namespace crpm {
+    size_t SnapshotHistory::CalculateFileSize(size_t nr_entries, size_t block_size) {
+        return RoundUp(sizeof(Header), kPageSize) +
+               RoundUp(sizeof(uint64_t) * nr_entries, kPageSize) +
+               nr_entries * block_size;
+    }
+
+    void SnapshotHistory::setup_layout() {
+        uint8_t *base = (uint8_t *) header;
+        block_ids = (uint64_t *) (base + RoundUp(sizeof(Header), kPageSize));
+        blocks = (uint8_t *) block_ids + RoundUp(sizeof(uint64_t) * header->nr_entries, kPageSize);
+    }
+
+    SnapshotHistory *SnapshotHistory::Create(const char *path, size_t nr_snapshots, size_t capacity,
+                                             size_t block_shift) {
+        nr_snapshots = std::min(std::max(nr_snapshots, (size_t) 1), kMaxSnapshots);
+        size_t nr_entries = std::max(capacity >> block_shift, (size_t) 1);
+        SnapshotHistory *obj = new SnapshotHistory();
+        obj->block_size = 1ull << block_shift;
+        if (!obj->fs.create(path, CalculateFileSize(nr_entries, obj->block_size))) {
+            delete obj;
+            return nullptr;
+        }
+        Header *header = (Header *) obj->fs.rel_to_abs(0);
+        memset(header, 0, sizeof(Header));
+        header->magic = kSnapshotHistoryMagic;
+        header->block_shift = block_shift;
+        header->nr_slots = nr_snapshots;
+        header->nr_entries = nr_entries;
+        FlushRegion(header, sizeof(Header));
+        StoreFence();
+        obj->header = header;
+        obj->setup_layout();
+        return obj;
+    }
+
+    SnapshotHistory *SnapshotHistory::Open(const char *path, size_t block_shift) {
+        SnapshotHistory *obj = new SnapshotHistory();
+        obj->block_size = 1ull << block_shift;
+        if (!obj->fs.open(path)) {
+            delete obj;
+            return nullptr;
+        }
+        Header *header = (Header *) obj->fs.rel_to_abs(0);
+        if (obj->fs.get_size() < sizeof(Header) || header->magic != kSnapshotHistoryMagic ||
+            header->nr_slots == 0 || header->nr_slots > kMaxSnapshots ||
+            obj->fs.get_size() < CalculateFileSize(header->nr_entries, obj->block_size) ||
+            get_count(header->window) > header->nr_slots) {
+            fprintf(stderr, "%s: snapshot history corrupted\n", path);
+            delete obj;
+            return nullptr;
+        }
+        if ((header->block_shift ? header->block_shift : kBlockShift) != block_shift) {
+            fprintf(stderr, "%s: block size mismatch\n", path);
+            delete obj;
+            return nullptr;
+        }
+        obj->header = header;
+        obj->setup_layout();
+        return obj;
+    }
+
+    void SnapshotHistory::set_window(uint64_t window) {
+        NTStore(&header->window, window);
+        StoreFence();
+    }
+
+    void SnapshotHistory::recover(uint64_t committed_epoch) {
+        uint64_t window = header->window;
+        uint64_t count = get_count(window);
+        if (count && get_slot(window, count - 1).commit_epoch > committed_epoch) {
+            count--;
+        }
+        if (header->rollback_commit_epoch && committed_epoch >= header->rollback_commit_epoch) {
+            while (count && get_slot(window, count - 1).epoch >= header->rollback_epoch) {
+                count--;
+            }
+        }
+        if (count != get_count(window)) {
+            set_window(make_window(get_first(window), count));
+        }
+        if (header->rollback_commit_epoch) {
+            NTStore(&header->rollback_commit_epoch, 0);
+            StoreFence();
+        }
+        recording = false;
+    }
+
+    bool SnapshotHistory::begin_snapshot(uint64_t epoch, uint64_t max_blocks) {
+        const uint64_t window = header->window;
+        uint64_t first = get_first(window), count = get_count(window);
+        recording = false;
+        if (max_blocks > header->nr_entries) {
+            if (count) {
+                set_window(make_window(first, 0));
+            }
+            return false;
+        }
+
+        uint64_t used_blocks = 0;
+        for (uint64_t i = 0; i < count; ++i) {
+            used_blocks += get_slot(window, i).nr_blocks;
+        }
+        while (count && (count == header->nr_slots || used_blocks + max_blocks > header->nr_entries)) {
+            used_blocks -= header->slots[first].nr_blocks;
+            first = (first + 1) % header->nr_slots;
+            count--;
+        }
+        if (count != get_count(window)) {
+            set_window(make_window(first, count));
+        }
+
+        pending_start = 0;
+        if (count) {
+            Snapshot &newest = header->slots[(first + count - 1) % header->nr_slots];
+            pending_start = (newest.start + newest.nr_blocks) % header->nr_entries;
+        }
+        pending_epoch = epoch;
+        reserved_blocks = max_blocks;
+        recorded_blocks.store(0, std::memory_order_relaxed);
+        recording = true;
+        return true;
+    }
+
+    void SnapshotHistory::record(uint64_t block_id, void *pre_image) {
+        uint64_t index = recorded_blocks.fetch_add(1, std::memory_order_relaxed);
+        if (unlikely(index >= reserved_blocks)) {
+            return; // the reservation covers every block of the checkpoint
+        }
+        uint64_t entry = (pending_start + index) % header->nr_entries;
+        if (!pre_image) {
+            NTStore(&block_ids[entry], block_id | kZeroPreImage);
+            return;
+        }
+        NTStore(&block_ids[entry], block_id);
+        if (block_size & 255) {
+            NonTemporalCopy64(blocks + entry * block_size, pre_image, block_size);
+        } else {
+            NonTemporalCopy256(blocks + entry * block_size, pre_image, block_size);
+        }
+    }
+
+    void SnapshotHistory::commit_snapshot() {
+        if (!recording) {
+            return;
+        }
+        recording = false;
+        uint64_t window = header->window;
+        uint64_t count = get_count(window);
+        Snapshot &slot = get_slot(window, count);
+        slot.epoch = pending_epoch;
+        slot.commit_epoch = pending_epoch + 1;
+        slot.start = pending_start;
+        slot.nr_blocks = std::min(recorded_blocks.load(std::memory_order_relaxed), reserved_blocks);
+        FlushRegion(&slot, sizeof(Snapshot));
+        StoreFence();
+        CrashPoint("history.recorded");
+        set_window(make_window(get_first(window), count + 1));
+    }
+
+    size_t SnapshotHistory::get_snapshots(uint64_t *epochs, size_t max_epochs) {
+        uint64_t window = header->window;
+        uint64_t count = std::min(get_count(window), (uint64_t) max_epochs);
+        for (uint64_t i = 0; i < count; ++i) {
+            epochs[i] = get_slot(window, get_count(window) - 1 - i).epoch;
+        }
+        return count;
+    }
+
+    bool SnapshotHistory::has_snapshot(uint64_t epoch) {
+        uint64_t window = header->window;
+        for (uint64_t i = 0; i < get_count(window); ++i) {
+            if (get_slot(window, i).epoch == epoch) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void SnapshotHistory::for_each_pre_image(uint64_t epoch,
+                                             const std::function<void(uint64_t, const uint8_t *)> &restore) {
+        uint64_t window = header->window;
+        for (uint64_t i = get_count(window); i > 0; --i) {
+            Snapshot &slot = get_slot(window, i - 1);
+            for (uint64_t j = 0; j < slot.nr_blocks; ++j) {
+                uint64_t entry = (slot.start + j) % header->nr_entries;
+                uint64_t block_id = block_ids[entry];
+                if (block_id & kZeroPreImage) {
+                    restore(block_id & ~kZeroPreImage, nullptr);
+                } else {
+                    restore(block_id, blocks + entry * block_size);
+                }
+            }
+            if (slot.epoch == epoch) {
+                break;
+            }
+        }
+    }
+
+    void SnapshotHistory::begin_rollback(uint64_t epoch, uint64_t commit_epoch) {
+        NTStore(&header->rollback_epoch, epoch);
+        StoreFence();
+        NTStore(&header->rollback_commit_epoch, commit_epoch);
+        StoreFence();
+    }
+}
@@ -0,0 +1,76 @@
+//
+// Runtime-owned threads for the parallel phases of a checkpoint.
+//
+
+#include "internal/common.h"
+#include "internal/worker_pool.h"
+
+namespace crpm {
+    WorkerPool::WorkerPool() :
+            nr_threads(0),
+            current_task(nullptr),
+            generation(0),
+            nr_running(0),
+            running(true) {}
+
+    WorkerPool::~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            running = false;
+        }
+        start_condvar.notify_all();
+        for (auto &worker : workers) {
+            worker.join();
+        }
+    }
+
+    bool WorkerPool::start(int nr_threads_, const void *local_addr) {
+        if (nr_threads_ <= 0 || nr_threads_ > (int) kMaxThreads) {
+            fprintf(stderr, "invalid number of checkpoint threads %d\n", nr_threads_);
+            return false;
+        }
+        nr_threads = nr_threads_;
+        int socket = FindLocalSocket(local_addr);
+        for (int tid = 1; tid < nr_threads; ++tid) {
+            workers.emplace_back(&WorkerRoutine, this, tid, socket);
+        }
+        return true;
+    }
+
+    void WorkerPool::run(const Task &task) {
+        std::lock_guard<std::mutex> run_guard(run_mutex);
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            current_task = &task;
+            nr_running = nr_threads - 1;
+            generation++;
+        }
+        start_condvar.notify_all();
+        task(0, nr_threads);
+        std::unique_lock<std::mutex> lock(mutex);
+        done_condvar.wait(lock, [this] { return nr_running == 0; });
+        current_task = nullptr;
+    }
+
+    void WorkerPool::WorkerRoutine(WorkerPool *pool, int tid, int socket) {
+        BindSingleSocket(socket);
+        uint64_t last_generation = 0;
+        std::unique_lock<std::mutex> lock(pool->mutex);
+        while (true) {
+            pool->start_condvar.wait(lock, [pool, last_generation] {
+                return !pool->running || pool->generation != last_generation;
+            });
+            if (!pool->running) {
+                return;
+            }
+            last_generation = pool->generation;
+            const Task *task = pool->current_task;
+            lock.unlock();
+            (*task)(tid, pool->nr_threads);
+            lock.lock();
+            if (--pool->nr_running == 0) {
+                pool->done_condvar.notify_one();
+            }
+        }
+    }
+}
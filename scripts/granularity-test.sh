@@ -0,0 +1,27 @@
+#!/bin/bash
+# Bytes flushed and copied per checkpoint at 64 B, 256 B and 4 KiB dirty
+# tracking
+NR_RECORDS=24000000
+NR_OPS=24000000
+BENCH_APP=../build/tests/benchmark
+ENGINE=default
+ALLOCATOR=default
+PERSIST_MODE=emulated
+
+function granularity_test() {
+  APP=$1
+  LABEL=$2
+  shift 2
+  DATA_STRUCTURE=stl-unordered-map
+  INTERVAL=128
+  for DATASET_TYPE in a b; do
+    DATASET=$DATASET_TYPE-$NR_RECORDS-$NR_OPS
+    echo "$LABEL $DATASET_TYPE"
+    $APP -d $DATASET -t 1 -p $NR_RECORDS -i $INTERVAL -b $DATA_STRUCTURE -e $ENGINE -a $ALLOCATOR \
+      -P $PERSIST_MODE -v "$@" | grep -E "per checkpoint|flush_traffic|checkpoint_traffic"
+  done
+}
+
+granularity_test $BENCH_APP 64B -L
+granularity_test $BENCH_APP 256B
+granularity_test $BENCH_APP 4KiB -B 4096
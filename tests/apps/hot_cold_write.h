@@ -0,0 +1,103 @@
+//
+// Back segment reuse under a hot set that is dirtied every epoch and a
+// cold region that is swept a few segments at a time. The cold sweep comes
+// first in each epoch, so a replacement policy that ignores the access
+// history keeps stealing the back segments of the hot set.
+//
+
+#ifndef LIBCRPM_HOT_COLD_WRITE_H
+#define LIBCRPM_HOT_COLD_WRITE_H
+
+#include <random>
+
+#include "../bench.h"
+
+namespace crpm {
+    class HotColdWriteBenchmark : public Benchmark {
+        const static uint64_t kBlockBytes = 256;
+        const static uint64_t kSegmentBytes = 2ull << 20;
+        const static uint64_t kHotSegments = 32;
+        const static uint64_t kColdSegments = 256;
+        const static uint64_t kColdSegmentsPerEpoch = 8;
+        const static uint64_t kBlocksPerSegment = 64;
+        const static uint64_t kWarmupEpochs = 32;
+        const static uint64_t kDefaultEpochs = 200;
+
+        uint8_t *target;
+        uint64_t region_bytes;
+        uint64_t epochs;
+        uint64_t evictions, full_segment_copies;
+        double total_ms;
+
+    public:
+        HotColdWriteBenchmark(const BenchmarkOption &option) : Benchmark(option) {
+            region_bytes = (kHotSegments + kColdSegments) * kSegmentBytes;
+            target = (uint8_t *) pool->pmalloc(region_bytes * option.threads);
+            pool->set_root(0, target);
+            epochs = option.interval ? option.interval : kDefaultEpochs;
+            evictions = full_segment_copies = 0;
+            total_ms = 0;
+            // Size the back pool by the working set alone
+            pool->set_shadow_capacity_factor(0);
+        }
+
+        virtual ~HotColdWriteBenchmark() {
+            uint64_t measured = epochs > kWarmupEpochs ? epochs - kWarmupEpochs : 0;
+            printf("hot-cold-write: %lu epochs, %.3lf ms per checkpoint, "
+                   "%lu back segment evictions, %lu full segment copies\n",
+                   measured, measured ? total_ms / measured : 0.0,
+                   evictions, full_segment_copies);
+            pool->pfree(target);
+        }
+
+    protected:
+        virtual void setup(unsigned int id) {
+            uint8_t *region = target + id * region_bytes;
+            for (uint64_t offset = 0; offset < region_bytes; offset += kBlockBytes) {
+                region[offset] = 0;
+            }
+            pool->checkpoint(option.threads);
+        }
+
+        virtual void teardown(unsigned int id) {}
+
+        void write_segment(uint8_t *segment, std::mt19937_64 &generator, uint8_t value) {
+            std::uniform_int_distribution<uint64_t> block_distribution(0, kSegmentBytes / kBlockBytes - 1);
+            for (uint64_t i = 0; i < kBlocksPerSegment; ++i) {
+                segment[block_distribution(generator) * kBlockBytes] = value;
+            }
+        }
+
+        virtual uint64_t worker(unsigned int id) {
+            uint8_t *hot_region = target + id * region_bytes;
+            uint8_t *cold_region = hot_region + kHotSegments * kSegmentBytes;
+            std::mt19937_64 generator(id);
+            uint64_t cold_cursor = 0;
+
+            for (uint64_t epoch = 0; epoch < epochs; ++epoch) {
+                for (uint64_t i = 0; i < kColdSegmentsPerEpoch; ++i) {
+                    write_segment(cold_region + cold_cursor * kSegmentBytes, generator, (uint8_t) epoch);
+                    cold_cursor = (cold_cursor + 1) % kColdSegments;
+                }
+                for (uint64_t i = 0; i < kHotSegments; ++i) {
+                    write_segment(hot_region + i * kSegmentBytes, generator, (uint8_t) epoch);
+                }
+                pool->checkpoint(option.threads);
+                if (id == 0 && epoch >= kWarmupEpochs) {
+                    // Copies of the background write-back are accounted on completion
+                    pool->wait_for_background_task();
+                    CheckpointStats stats;
+                    if (pool->get_stats(&stats, 1) == 1) {
+                        total_ms += stats.total_ms;
+                        evictions += stats.back_segment_evictions;
+                        full_segment_copies += stats.full_segment_copies;
+                    }
+                }
+                pthread_barrier_wait(&barrier);
+            }
+            return epochs * (kColdSegmentsPerEpoch + kHotSegments) * kBlocksPerSegment;
+        }
+    };
+}
+
+#endif //LIBCRPM_HOT_COLD_WRITE_H
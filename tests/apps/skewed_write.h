@@ -0,0 +1,90 @@
+//
+// Checkpoint latency under a skewed per-thread write distribution: thread
+// i dirties a share of the blocks proportional to 1 / (i + 1)^2, so the
+// first thread produces most of the flush and write-back work.
+//
+
+#ifndef LIBCRPM_SKEWED_WRITE_H
+#define LIBCRPM_SKEWED_WRITE_H
+
+#include <cmath>
+#include <cstring>
+#include <random>
+
+#include "../bench.h"
+
+namespace crpm {
+    class SkewedWriteBenchmark : public Benchmark {
+        const static uint64_t kBlockBytes = 256;
+        const static uint64_t kRegionBytes = 512ull << 20;
+        const static uint64_t kBlocksPerEpoch = 64 * 1024;
+        const static uint64_t kDefaultEpochs = 200;
+
+        uint8_t *target;
+        uint64_t region_bytes;
+        uint64_t writes[kMaxThreads];
+        uint64_t epochs;
+        double total_ms, flush_ms, write_back_ms;
+
+    public:
+        SkewedWriteBenchmark(const BenchmarkOption &option) : Benchmark(option) {
+            region_bytes = kRegionBytes / option.threads / kBlockBytes * kBlockBytes;
+            target = (uint8_t *) pool->pmalloc(region_bytes * option.threads);
+            pool->set_root(0, target);
+            epochs = option.interval ? option.interval : kDefaultEpochs;
+
+            double sum = 0;
+            for (unsigned int i = 0; i < option.threads; ++i) {
+                sum += 1.0 / ((i + 1.0) * (i + 1.0));
+            }
+            for (unsigned int i = 0; i < option.threads; ++i) {
+                double share = 1.0 / ((i + 1.0) * (i + 1.0)) / sum;
+                writes[i] = std::min((uint64_t) (kBlocksPerEpoch * share), region_bytes / kBlockBytes);
+            }
+            total_ms = flush_ms = write_back_ms = 0;
+        }
+
+        virtual ~SkewedWriteBenchmark() {
+            printf("skewed-write: %lu epochs, %.3lf ms per checkpoint "
+                   "(flush %.3lf ms, write-back %.3lf ms)\n",
+                   epochs, total_ms / epochs, flush_ms / epochs, write_back_ms / epochs);
+            pool->pfree(target);
+        }
+
+    protected:
+        virtual void setup(unsigned int id) {
+            uint8_t *region = target + id * region_bytes;
+            for (uint64_t offset = 0; offset < region_bytes; offset += kBlockBytes) {
+                region[offset] = 0;
+            }
+            pool->checkpoint(option.threads);
+        }
+
+        virtual void teardown(unsigned int id) {}
+
+        virtual uint64_t worker(unsigned int id) {
+            uint8_t *region = target + id * region_bytes;
+            std::mt19937_64 generator(id);
+            std::uniform_int_distribution<uint64_t> block_distribution(0, region_bytes / kBlockBytes - 1);
+
+            for (uint64_t epoch = 0; epoch < epochs; ++epoch) {
+                for (uint64_t i = 0; i < writes[id]; ++i) {
+                    region[block_distribution(generator) * kBlockBytes] = (uint8_t) epoch;
+                }
+                pool->checkpoint(option.threads);
+                if (id == 0) {
+                    CheckpointStats stats;
+                    if (pool->get_stats(&stats, 1) == 1) {
+                        total_ms += stats.total_ms;
+                        flush_ms += stats.flush_ms;
+                        write_back_ms += stats.write_back_ms;
+                    }
+                }
+                pthread_barrier_wait(&barrier);
+            }
+            return epochs * writes[id];
+        }
+    };
+}
+
+#endif //LIBCRPM_SKEWED_WRITE_H
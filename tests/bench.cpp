@@ -119,6 +119,7 @@ namespace crpm {
         self->setup(id);
         if (id == 0) {
             self->pool->wait_for_background_task();
+            self->pool->reset_stats();
 #ifdef SFENCE_STAT
             sfence_cnt = 0;
 #endif
@@ -0,0 +1,216 @@
+//
+// Throughput of the non-temporal copy kernels supported by the CPU, after
+// checking that they copy the same bytes as a plain memcpy
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <getopt.h>
+
+#include "internal/common.h"
+
+using namespace crpm;
+
+struct CopyBenchOption {
+    size_t size = 256ull << 20;
+    int repeats = 5;
+};
+
+void parseCmdline(int argc, char **argv, CopyBenchOption &conf) {
+    static struct option long_options[] = {
+            {"size",    required_argument, 0, 's'},
+            {"repeats", required_argument, 0, 'r'},
+            {"help",    no_argument,       0, 'h'},
+            {0, 0, 0, 0}
+    };
+
+    while (true) {
+        int option_index = 0;
+        int c = getopt_long(argc, argv, "s:r:h", long_options, &option_index);
+        if (c == -1)
+            break;
+        switch (c) {
+            case 's':
+                conf.size = (1ULL << 20ULL) * strtol(optarg, NULL, 10);
+                break;
+            case 'r':
+                conf.repeats = strtol(optarg, NULL, 10);
+                break;
+            case 'h':
+            case '?':
+                fprintf(stderr, "Usage: %s [arguments]\n", argv[0]);
+                fprintf(stderr, "  --size -s: Bytes copied per pass in MiB\n");
+                fprintf(stderr, "  --repeats -r: Passes per kernel, the best one is reported\n");
+                fprintf(stderr, "  --help -h: This help message\n");
+                exit(EXIT_SUCCESS);
+            default:
+                fprintf(stderr, "Unknown arguments %s\n", optarg);
+                exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// GB/s of the best pass, dst is zeroed before each pass if clear_dst is set
+template<typename CopyFunction>
+double measure(CopyFunction copy, void *dst, void *src, const CopyBenchOption &conf,
+               bool clear_dst = false) {
+    double best_ms = 0;
+    for (int i = 0; i < conf.repeats; ++i) {
+        if (clear_dst) {
+            memset(dst, 0, conf.size);
+        }
+        uint64_t start = ReadTSC();
+        copy(dst, src, conf.size);
+        StoreFence();
+        double ms = CyclesToMilliseconds(ReadTSC() - start);
+        if (i == 0 || ms < best_ms) {
+            best_ms = ms;
+        }
+    }
+    return conf.size / best_ms / 1e6;
+}
+
+// The kernels take cache line aligned ranges, the checked ranges start and
+// end at lines that are not aligned to a 256-byte block or a page
+static const size_t kCheckOffsets[] = {0, 64, 192, 4032};
+static const size_t kCheckLengths[] = {64, 128, 192, 256, 320, 768, 4096 - 64, 4096 + 192, 3 * 4096};
+static const size_t kCheckGuardSize = 4096;
+
+static void FillPattern(uint8_t *buf, size_t len, uint8_t seed) {
+    for (size_t i = 0; i < len; ++i) {
+        buf[i] = (uint8_t) (i * 31 + seed);
+    }
+}
+
+// Lines that dst holds already, the others differ in their first or last
+// byte only so that a kernel comparing part of a line is caught
+static void MakePartlyEqual(uint8_t *dst, const uint8_t *src, size_t len) {
+    for (size_t line = 0; line < len / kCacheLineSize; ++line) {
+        uint8_t *dst_line = dst + line * kCacheLineSize;
+        memcpy(dst_line, src + line * kCacheLineSize, kCacheLineSize);
+        switch (line % 3) {
+            case 0:
+                dst_line[0] ^= 1;
+                break;
+            case 1:
+                dst_line[kCacheLineSize - 1] ^= 0x80;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// Runs every kernel on the same ranges and compares the whole buffer,
+// including the bytes around the range, and the skipped line count with
+// the result of memcpy and memcmp. Returns the number of mismatches.
+static int CheckKernels(const CopyKernels **kernels, size_t nr_kernels) {
+    const size_t kBufferSize = kCheckGuardSize + 4096 + 3 * 4096 + kCheckGuardSize;
+    uint8_t *src = (uint8_t *) aligned_alloc(kPageSize, kBufferSize);
+    uint8_t *dst = (uint8_t *) aligned_alloc(kPageSize, kBufferSize);
+    uint8_t *expected = (uint8_t *) aligned_alloc(kPageSize, kBufferSize);
+    if (!src || !dst || !expected) {
+        perror("aligned_alloc");
+        exit(EXIT_FAILURE);
+    }
+    FillPattern(src, kBufferSize, 0x5a);
+    int failures = 0;
+    for (size_t k = 0; k < nr_kernels; ++k) {
+        const CopyKernels *kernel = kernels[k];
+        for (size_t offset : kCheckOffsets) {
+            for (size_t len : kCheckLengths) {
+                size_t start = kCheckGuardSize + offset;
+                for (int mode = 0; mode < 3; ++mode) {
+                    if (mode == 1 && len % 256) {
+                        continue;
+                    }
+                    FillPattern(dst, kBufferSize, 0xa5);
+                    size_t expected_skipped = 0;
+                    if (mode == 2) {
+                        MakePartlyEqual(dst + start, src + start, len);
+                        for (size_t i = 0; i < len; i += kCacheLineSize) {
+                            expected_skipped += !memcmp(dst + start + i, src + start + i, kCacheLineSize);
+                        }
+                    }
+                    memcpy(expected, dst, kBufferSize);
+                    memcpy(expected + start, src + start, len);
+
+                    size_t skipped = 0;
+                    const char *kernel_name;
+                    if (mode == 0) {
+                        kernel_name = "copy64";
+                        kernel->copy64(dst + start, src + start, len);
+                    } else if (mode == 1) {
+                        kernel_name = "copy256";
+                        kernel->copy256(dst + start, src + start, len);
+                    } else {
+                        kernel_name = "copy_with_write_elimination";
+                        skipped = kernel->copy_with_write_elimination(dst + start, src + start, len);
+                    }
+                    StoreFence();
+                    if (memcmp(dst, expected, kBufferSize)) {
+                        fprintf(stderr, "%s: %s of %zu bytes at offset %zu copied data mismatch\n",
+                                kernel->name, kernel_name, len, offset);
+                        failures++;
+                    }
+                    if (skipped != expected_skipped) {
+                        fprintf(stderr, "%s: %s of %zu bytes at offset %zu skipped %zu lines, expected %zu\n",
+                                kernel->name, kernel_name, len, offset, skipped, expected_skipped);
+                        failures++;
+                    }
+                }
+            }
+        }
+    }
+    free(src);
+    free(dst);
+    free(expected);
+    return failures;
+}
+
+int main(int argc, char **argv) {
+    CopyBenchOption conf;
+    parseCmdline(argc, argv, conf);
+    conf.size = RoundUp(conf.size, 256);
+    uint8_t *src = (uint8_t *) aligned_alloc(kPageSize, conf.size);
+    uint8_t *dst = (uint8_t *) aligned_alloc(kPageSize, conf.size);
+    if (!src || !dst) {
+        perror("aligned_alloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < conf.size; ++i) {
+        src[i] = (uint8_t) i;
+        dst[i] = (uint8_t) ~i;
+    }
+
+    const size_t kMaxKernels = 8;
+    const CopyKernels *kernels[kMaxKernels];
+    size_t nr_kernels = GetSupportedCopyKernels(kernels, kMaxKernels);
+    int failures = CheckKernels(kernels, nr_kernels);
+    if (failures) {
+        fprintf(stderr, "%d kernel checks failed\n", failures);
+        exit(EXIT_FAILURE);
+    }
+    printf("size %.1f MiB, selected kernels %s\n", conf.size / 1048576.0, g_copy_kernels->name);
+    printf("%-8s %10s %10s %14s %14s\n", "kernels", "copy64", "copy256", "elim(differ)", "elim(same)");
+    for (size_t k = 0; k < nr_kernels; ++k) {
+        const CopyKernels *kernel = kernels[k];
+        double copy64 = measure(kernel->copy64, dst, src, conf);
+        double copy256 = measure(kernel->copy256, dst, src, conf);
+        if (memcmp(dst, src, conf.size)) {
+            fprintf(stderr, "%s: copied data mismatch\n", kernel->name);
+            exit(EXIT_FAILURE);
+        }
+        // dst holds src now, every line is skipped
+        double elim_same = measure(kernel->copy_with_write_elimination, dst, src, conf);
+        double elim_differ = measure(kernel->copy_with_write_elimination, dst, src, conf, true);
+        if (memcmp(dst, src, conf.size)) {
+            fprintf(stderr, "%s: copied data mismatch\n", kernel->name);
+            exit(EXIT_FAILURE);
+        }
+        printf("%-8s %10.2f %10.2f %14.2f %14.2f\n", kernel->name, copy64, copy256, elim_differ, elim_same);
+    }
+    free(src);
+    free(dst);
+    return 0;
+}
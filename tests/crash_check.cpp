@@ -0,0 +1,543 @@
+//
+// Crash-point injection and recovery verification for the checkpoint engines.
+//
+// For every crash point and every countdown, a child process runs a random
+// write workload on a pool in the emulated persistence domain, with crash
+// simulation armed. When the crash point fires, only the flushed and fenced
+// stores are left in the dumped image. The parent reopens that image and
+// compares the recovered data byte for byte with the last committed epoch.
+// With --grow, the pool starts small and is grown by the allocator during
+// the run, so that crashes also hit an extension of the image. With
+// --write-elimination, the write-backs skip the lines that back holds
+// already, and a crash has to find the skipped lines intact. With
+// --track-lines, only the dirty cache lines of a block are persisted and
+// written back, and some stores straddle two lines. --block-size and
+// --segment-size pick the geometry of the pool, --extreme-geometries runs
+// the crash points at the smallest and at the largest one. With --runs,
+// the writes are runs of whole blocks mixed with parts of blocks, which
+// the write-back copies as runs and crashes in between. Finally, a
+// pool is rolled back to a retained snapshot taken before half of its
+// segments were first stored to, and a snapshot view is checked to keep
+// its bytes while the pool is stored to and checkpointed.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "crpm.h"
+#include "internal/common.h"
+#include "internal/filesystem.h"
+#include "internal/snapshot_history.h"
+
+using namespace crpm;
+
+const static char *kCrashPoints[] = {
+        "checkpoint.flushed",
+        "checkpoint.main_committed",
+        "checkpoint.written_back",
+        "commit.state_flushed",
+        "commit.epoch_committed",
+        "lazy_write_back.bound",
+        "lazy_write_back.copied",
+        "copy_on_write.block_copied",
+        "write_back.run_copied",
+        "grow.extent_written",
+        "grow.extent_committed",
+};
+
+const static uint64_t kRegionBytes = 64ull << 20;
+const static uint64_t kGrowBytes = 4ull << 20;
+
+struct CrashCheckOption {
+    std::string memory_pool_path;
+    uint64_t checkpoints;
+    uint64_t writes_per_checkpoint;
+    uint64_t max_countdown;
+    uint64_t seed;
+    double shadow_factor;
+    bool async;
+    bool grow;
+    bool lazy_recovery;
+    bool write_elimination;
+    bool track_lines;
+    uint64_t block_size;    // 0 for the build default
+    uint64_t segment_size;
+    bool extreme_geometries;
+    bool runs;
+};
+
+// Shared with the child process, written before and after each checkpoint
+struct SharedState {
+    volatile int committed;
+    volatile int in_checkpoint;
+    volatile uint64_t nr_checkpoints;
+    uint8_t *expected[2];
+};
+
+static inline uint64_t GetCurrentNanoseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static MemoryPoolOption GetPoolOption(const CrashCheckOption &conf, bool create) {
+    MemoryPoolOption option;
+    option.create = create;
+    option.truncate = create;
+    option.capacity = conf.grow ? kMinContainerSize : 4 * kRegionBytes;
+    option.max_capacity = conf.grow ? 4 * kRegionBytes : 0;
+    option.shadow_capacity_factor = conf.shadow_factor;
+    option.persist_mode = "emulated";
+    option.lazy_recovery = conf.lazy_recovery && !create;
+    option.write_elimination = conf.write_elimination;
+    option.track_dirty_lines = conf.track_lines;
+    option.block_size = conf.block_size;
+    option.segment_size = conf.segment_size;
+    return option;
+}
+
+// Smallest and largest geometry the default engine is built for
+static std::vector<std::pair<uint64_t, uint64_t>> GetExtremeGeometries() {
+    uint64_t min_block_shift = 64, max_block_shift = 0;
+    uint64_t min_segment_shift = 64, max_segment_shift = 0;
+#define CRPM_VISIT_GEOMETRY(B, S) \
+    min_block_shift = std::min(min_block_shift, (uint64_t) (B)); \
+    max_block_shift = std::max(max_block_shift, (uint64_t) (B)); \
+    min_segment_shift = std::min(min_segment_shift, (uint64_t) (S)); \
+    max_segment_shift = std::max(max_segment_shift, (uint64_t) (S));
+    CRPM_FOR_EACH_LISTED_GEOMETRY(CRPM_VISIT_GEOMETRY)
+#undef CRPM_VISIT_GEOMETRY
+    return {{1ull << min_block_shift, 1ull << min_segment_shift},
+            {1ull << max_block_shift, 1ull << max_segment_shift}};
+}
+
+static void RunWorkload(const CrashCheckOption &conf, SharedState *state) {
+    MemoryPool *pool = MemoryPool::Open(conf.memory_pool_path.c_str(), GetPoolOption(conf, true));
+    if (!pool) {
+        fprintf(stderr, "unable to open a memory pool\n");
+        _exit(EXIT_FAILURE);
+    }
+
+    uint8_t *region = (uint8_t *) pool->pmalloc(kRegionBytes);
+    pool->set_root(0, region);
+    memset(region, 0, kRegionBytes);
+    const uint64_t block_size = conf.block_size ? conf.block_size : kBlockSize;
+
+    std::mt19937_64 generator(conf.seed);
+    auto random_writes = [&](uint64_t writes) {
+        for (uint64_t i = 0; i < writes; ++i) {
+            uint64_t offset = generator() % kRegionBytes;
+            if (conf.runs) {
+                uint64_t value = generator();
+                uint64_t length;
+                if (i % 4 == 0) {
+                    // A run of up to 16 whole blocks
+                    offset &= ~(block_size - 1);
+                    length = (1 + value % 16) * block_size;
+                } else {
+                    // Part of a block, which may end in the next one
+                    length = 1 + value % (block_size - 1);
+                }
+                memset(region + offset, (int) (value >> 32), std::min(length, kRegionBytes - offset));
+            } else {
+                region[offset] = (uint8_t) generator();
+            }
+            if (conf.track_lines && i % 16 == 0) {
+                // One store that straddles two cache lines
+                uint64_t value = generator();
+                offset = (generator() % (kRegionBytes / kCacheLineSize - 1) + 1) * kCacheLineSize - 4;
+                memcpy(region + offset, &value, sizeof(value));
+            }
+        }
+    };
+    for (uint64_t step = 0; step <= conf.checkpoints; ++step) {
+        if (step != 0) {
+            // Every 8th epoch dirties more than kMaxFlushBytes and takes
+            // the wbinvd path, the others are sparse updates
+            random_writes((step % 8 == 0) ? (kRegionBytes / block_size) : conf.writes_per_checkpoint);
+            if (conf.grow) {
+                // Never freed, so that the pool keeps growing
+                uint8_t *chunk = (uint8_t *) pool->pmalloc(kGrowBytes);
+                if (!chunk) {
+                    fprintf(stderr, "unable to grow the memory pool\n");
+                    _exit(EXIT_FAILURE);
+                }
+                memset(chunk, (int) step, kGrowBytes);
+            }
+        }
+        int next = 1 - state->committed;
+        memcpy(state->expected[next], region, kRegionBytes);
+        state->in_checkpoint = 1;
+        if (conf.async) {
+            // Writes of the next epoch overlap with the flush
+            CheckpointHandle handle = pool->checkpoint_async(1);
+            random_writes(conf.writes_per_checkpoint);
+            handle.wait();
+        } else {
+            pool->checkpoint(1);
+        }
+        state->committed = next;
+        state->nr_checkpoints++;
+        state->in_checkpoint = 0;
+    }
+
+    pool->wait_for_background_task();
+    delete pool;
+}
+
+static bool VerifyImage(const CrashCheckOption &conf, SharedState *state, double &open_ms) {
+    std::string crash_path = conf.memory_pool_path + ".crash";
+    uint64_t start_clock = GetCurrentNanoseconds();
+    MemoryPool *pool = MemoryPool::Open(crash_path.c_str(), GetPoolOption(conf, false));
+    open_ms = (GetCurrentNanoseconds() - start_clock) / 1000000.0;
+    if (!pool) {
+        fprintf(stderr, "unable to reopen the crash image\n");
+        return false;
+    }
+
+    // Nothing is recoverable before the first checkpoint completes
+    bool passed = (state->nr_checkpoints == 0);
+    uint8_t *region = pool->get_root<uint8_t>(0);
+    if (region) {
+        int committed = state->committed;
+        passed = memcmp(region, state->expected[committed], kRegionBytes) == 0;
+        // The crash may hit either side of the commit point of the checkpoint
+        if (!passed && state->in_checkpoint) {
+            passed = memcmp(region, state->expected[1 - committed], kRegionBytes) == 0;
+        }
+    }
+    delete pool;
+    FileSystem::Remove(crash_path.c_str());
+    return passed;
+}
+
+// The second half of the region is first stored to after the snapshot
+// epoch, its segments are committed for the first time by the next
+// checkpoint and have to be restored to zero
+static bool CheckSnapshotRestore(const CrashCheckOption &conf) {
+    std::string path = conf.memory_pool_path + ".history-check";
+    MemoryPoolOption option;
+    option.create = true;
+    option.truncate = true;
+    option.capacity = 4 * kRegionBytes;
+    option.shadow_capacity_factor = conf.shadow_factor;
+    option.persist_mode = "emulated";
+    option.retained_snapshots = 4;
+    option.block_size = conf.block_size;
+    option.segment_size = conf.segment_size;
+    MemoryPool *pool = MemoryPool::Open(path.c_str(), option);
+    if (!pool) {
+        fprintf(stderr, "unable to open a memory pool\n");
+        return false;
+    }
+
+    uint8_t *region = (uint8_t *) pool->pmalloc(kRegionBytes);
+    pool->set_root(0, region);
+    std::mt19937_64 generator(conf.seed);
+    auto random_writes = [&](uint64_t start, uint64_t length, uint64_t writes) {
+        for (uint64_t i = 0; i < writes; ++i) {
+            region[start + generator() % length] = (uint8_t) generator();
+        }
+    };
+    random_writes(0, kRegionBytes / 2, conf.writes_per_checkpoint);
+    pool->checkpoint(1);
+    uint8_t *expected = (uint8_t *) malloc(kRegionBytes);
+    memcpy(expected, region, kRegionBytes);
+    random_writes(0, kRegionBytes, conf.writes_per_checkpoint);
+    pool->checkpoint(1);
+    random_writes(0, kRegionBytes, conf.writes_per_checkpoint);
+    pool->checkpoint(1);
+    uint64_t epochs[3];
+    size_t nr_epochs = pool->get_snapshots(epochs, 3);
+    pool->wait_for_background_task();
+    delete pool;
+
+    bool passed = false;
+    if (nr_epochs >= 2) {
+        // Newest first, the second one precedes the second half
+        option.create = false;
+        option.truncate = false;
+        option.restore_epoch = epochs[1];
+        pool = MemoryPool::Open(path.c_str(), option);
+        if (pool) {
+            region = pool->get_root<uint8_t>(0);
+            passed = region && memcmp(region, expected, kRegionBytes) == 0;
+            delete pool;
+        }
+    }
+    printf("history.restore,%lu,%s\n", nr_epochs, passed ? "passed" : "FAILED");
+    free(expected);
+    FileSystem::Remove(path.c_str());
+    FileSystem::Remove(SnapshotHistory::GetPath(path.c_str()).c_str());
+    return passed;
+}
+
+// A view opened while some segments are dirty, with part of their blocks
+// copied to the back segment, and others are clean, keeps the committed
+// bytes while every segment is stored to and checkpointed. The pool is
+// growable so that its back segments are filled block by block.
+static bool CheckSnapshotView(const CrashCheckOption &conf) {
+    std::string path = conf.memory_pool_path + ".view-check";
+    MemoryPoolOption option;
+    option.create = true;
+    option.truncate = true;
+    option.capacity = 4 * kRegionBytes;
+    option.max_capacity = 8 * kRegionBytes;
+    option.shadow_capacity_factor = conf.shadow_factor;
+    option.persist_mode = "emulated";
+    option.block_size = conf.block_size;
+    option.segment_size = conf.segment_size;
+    MemoryPool *pool = MemoryPool::Open(path.c_str(), option);
+    if (!pool) {
+        fprintf(stderr, "unable to open a memory pool\n");
+        return false;
+    }
+
+    uint8_t *region = (uint8_t *) pool->pmalloc(kRegionBytes);
+    pool->set_root(0, region);
+    std::mt19937_64 generator(conf.seed);
+    auto random_writes = [&](uint64_t start, uint64_t length, uint64_t writes) {
+        for (uint64_t i = 0; i < writes; ++i) {
+            region[start + generator() % length] = (uint8_t) generator();
+        }
+    };
+    random_writes(0, kRegionBytes, conf.writes_per_checkpoint);
+    pool->checkpoint(1);
+    uint8_t *expected = (uint8_t *) malloc(kRegionBytes);
+    memcpy(expected, region, kRegionBytes);
+    // The first half is dirty when the view opens, the second half is
+    // clean and switched to its back segment by the first store
+    random_writes(0, kRegionBytes / 2, conf.writes_per_checkpoint);
+
+    bool passed = false;
+    SnapshotView view = pool->open_snapshot_view();
+    if (view.is_open()) {
+        const uint8_t *snapshot = view.translate(region);
+        passed = memcmp(snapshot, expected, kRegionBytes) == 0;
+        for (int i = 0; i < 3 && passed; ++i) {
+            random_writes(0, kRegionBytes, conf.writes_per_checkpoint);
+            passed = memcmp(snapshot, expected, kRegionBytes) == 0;
+            pool->checkpoint(1);
+            passed = passed && memcmp(snapshot, expected, kRegionBytes) == 0;
+        }
+        view.close();
+    }
+    printf("snapshot.view,%lu,%s\n", view.get_epoch(), passed ? "passed" : "FAILED");
+    pool->wait_for_background_task();
+    delete pool;
+    free(expected);
+    FileSystem::Remove(path.c_str());
+    return passed;
+}
+
+static void ParseCmdline(int argc, char **argv, CrashCheckOption &conf) {
+    static struct option long_options[] = {
+            {"memory-pool-path", required_argument, 0, 'm'},
+            {"checkpoints",     required_argument, 0, 'n'},
+            {"writes",          required_argument, 0, 'w'},
+            {"max-countdown",   required_argument, 0, 'k'},
+            {"seed",            required_argument, 0, 's'},
+            {"shadow-factor",   required_argument, 0, 'f'},
+            {"async",           no_argument,       0, 'a'},
+            {"grow",            no_argument,       0, 'g'},
+            {"lazy-recovery",   no_argument,       0, 'l'},
+            {"write-elimination", no_argument,     0, 'e'},
+            {"track-lines",     no_argument,       0, 't'},
+            {"block-size",      required_argument, 0, 'b'},
+            {"segment-size",    required_argument, 0, 'z'},
+            {"extreme-geometries", no_argument,    0, 'x'},
+            {"runs",            no_argument,       0, 'r'},
+            {"help",            no_argument,       0, 'h'},
+            {0, 0, 0, 0}
+    };
+
+    while (true) {
+        int option_index = 0;
+        int c = getopt_long(argc, argv, "m:n:w:k:s:f:agletb:z:xrh", long_options, &option_index);
+        if (c == -1)
+            break;
+        switch (c) {
+            case 'm':
+                conf.memory_pool_path = optarg;
+                break;
+            case 'n':
+                conf.checkpoints = strtoull(optarg, NULL, 10);
+                break;
+            case 'w':
+                conf.writes_per_checkpoint = strtoull(optarg, NULL, 10);
+                break;
+            case 'k':
+                conf.max_countdown = strtoull(optarg, NULL, 10);
+                break;
+            case 's':
+                conf.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'f':
+                conf.shadow_factor = strtod(optarg, NULL);
+                break;
+            case 'a':
+                conf.async = true;
+                break;
+            case 'g':
+                conf.grow = true;
+                break;
+            case 'l':
+                conf.lazy_recovery = true;
+                break;
+            case 'e':
+                conf.write_elimination = true;
+                break;
+            case 't':
+                conf.track_lines = true;
+                break;
+            case 'b':
+                conf.block_size = strtoull(optarg, NULL, 10);
+                break;
+            case 'z':
+                conf.segment_size = strtoull(optarg, NULL, 10);
+                break;
+            case 'x':
+                conf.extreme_geometries = true;
+                break;
+            case 'r':
+                conf.runs = true;
+                break;
+            case 'h':
+            case '?':
+                fprintf(stderr, "Usage: %s [arguments]\n", argv[0]);
+                fprintf(stderr, "  --memory-pool-path -m: Path of the memory pool file (tmpfs recommended)\n");
+                fprintf(stderr, "  --checkpoints -n: Checkpoints per run\n");
+                fprintf(stderr, "  --writes -w: Random writes between two checkpoints\n");
+                fprintf(stderr, "  --max-countdown -k: Largest countdown for each crash point\n");
+                fprintf(stderr, "  --seed -s: Seed of the workload\n");
+                fprintf(stderr, "  --shadow-factor -f: Back segments per main segment, lower values rebind more\n");
+                fprintf(stderr, "  --async -a: Use checkpoint_async() and overlap writes with the flush\n");
+                fprintf(stderr, "  --grow -g: Start with a small pool that grows during the run\n");
+                fprintf(stderr, "  --lazy-recovery -l: Reopen the crash images with lazy recovery\n");
+                fprintf(stderr, "  --write-elimination -e: Skip the lines that back holds already in write-backs\n");
+                fprintf(stderr, "  --track-lines -t: Track dirty cache lines and persist only those\n");
+                fprintf(stderr, "  --block-size -b: Block size of the pool in bytes, default %zu\n", kBlockSize);
+                fprintf(stderr, "  --segment-size -z: Segment size of the pool in bytes, default %zu\n", kSegmentSize);
+                fprintf(stderr, "  --extreme-geometries -x: Run at the smallest and at the largest geometry\n");
+                fprintf(stderr, "  --runs -r: Write runs of whole blocks mixed with parts of blocks\n");
+                fprintf(stderr, "  --help -h: This help message\n");
+                exit(EXIT_SUCCESS);
+            default:
+                fprintf(stderr, "Unknown arguments %s\n", optarg);
+                exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Returns the number of crash images that were not recovered
+static uint64_t RunCrashPoints(const CrashCheckOption &conf, SharedState *state) {
+    uint64_t failures = 0;
+    for (auto crash_point : kCrashPoints) {
+        uint64_t countdown = 0;
+        while (countdown <= conf.max_countdown) {
+            state->committed = 0;
+            state->in_checkpoint = 0;
+            state->nr_checkpoints = 0;
+            memset(state->expected[0], 0, kRegionBytes);
+
+            pid_t pid = fork();
+            if (pid < 0) {
+                perror("fork");
+                exit(EXIT_FAILURE);
+            } else if (pid == 0) {
+                if (!EnableCrashSimulation(crash_point, countdown)) {
+                    _exit(EXIT_FAILURE);
+                }
+                RunWorkload(conf, state);
+                _exit(EXIT_SUCCESS);
+            }
+
+            int status;
+            waitpid(pid, &status, 0);
+            if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+                break; // the crash point is reached fewer than countdown times
+            }
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != kCrashExitCode) {
+                printf("%s,%lu,aborted\n", crash_point, countdown);
+                failures++;
+                break;
+            }
+
+            double open_ms;
+            bool passed = VerifyImage(conf, state, open_ms);
+            printf("%s,%lu,%s,%.3lf\n", crash_point, countdown, passed ? "passed" : "FAILED", open_ms);
+            if (!passed) {
+                failures++;
+            }
+            countdown = countdown ? countdown * 2 : 1;
+        }
+    }
+    return failures;
+}
+
+int main(int argc, char **argv) {
+    CrashCheckOption conf;
+    conf.memory_pool_path = "/dev/shm/crpm-crash-check";
+    conf.checkpoints = 24;
+    conf.writes_per_checkpoint = 1000;
+    conf.max_countdown = 64;
+    conf.seed = 0;
+    conf.shadow_factor = 0.5;
+    conf.async = false;
+    conf.grow = false;
+    conf.lazy_recovery = false;
+    conf.write_elimination = false;
+    conf.track_lines = false;
+    conf.block_size = 0;
+    conf.segment_size = 0;
+    conf.extreme_geometries = false;
+    conf.runs = false;
+    ParseCmdline(argc, argv, conf);
+
+    SharedState *state = (SharedState *) mmap(nullptr, sizeof(SharedState) + 2 * kRegionBytes,
+                                              PROT_READ | PROT_WRITE,
+                                              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (state == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    state->expected[0] = (uint8_t *) (state + 1);
+    state->expected[1] = state->expected[0] + kRegionBytes;
+
+    uint64_t failures = 0;
+    if (conf.extreme_geometries) {
+        for (auto &geometry : GetExtremeGeometries()) {
+            conf.block_size = geometry.first;
+            conf.segment_size = geometry.second;
+            printf("geometry,%lu,%lu\n", conf.block_size, conf.segment_size);
+            failures += RunCrashPoints(conf, state);
+        }
+    } else {
+        failures += RunCrashPoints(conf, state);
+    }
+
+    if (!CheckSnapshotRestore(conf)) {
+        failures++;
+    }
+    if (!CheckSnapshotView(conf)) {
+        failures++;
+    }
+
+    FileSystem::Remove(conf.memory_pool_path.c_str());
+    munmap(state, sizeof(SharedState) + 2 * kRegionBytes);
+    if (failures) {
+        printf("Crash check failed: %lu crash images were not recovered\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("Crash check passed\n");
+    return EXIT_SUCCESS;
+}
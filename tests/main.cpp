@@ -5,6 +5,8 @@
 #include "apps/stl_map.h"
 #include "apps/stl_unordered_map.h"
 #include "apps/consistency_check.h"
+#include "apps/skewed_write.h"
+#include "apps/hot_cold_write.h"
 
 using namespace crpm;
 
@@ -22,12 +24,19 @@ void parseCmdline(int argc, char **argv, BenchmarkOption &conf) {
             {"capacity",        required_argument, 0, 'c'},
             {"allocator",       required_argument, 0, 'a'},
             {"engine",          required_argument, 0, 'e'},
+            {"persist-mode",    required_argument, 0, 'P'},
+            {"checkpoint-threads", required_argument, 0, 'W'},
+            {"replacement-policy", required_argument, 0, 'R'},
+            {"write-elimination", no_argument,    0, 'E'},
+            {"track-dirty-lines", no_argument,    0, 'L'},
+            {"block-size",      required_argument, 0, 'B'},
+            {"segment-size",    required_argument, 0, 'S'},
             {0, 0, 0, 0}
     };
 
     while (true) {
         int option_index = 0;
-        int c = getopt_long(argc, argv, "d:t:p:Hi:b:hvm:c:a:e:",
+        int c = getopt_long(argc, argv, "d:t:p:Hi:b:hvm:c:a:e:P:W:R:ELB:S:",
                             long_options, &option_index);
         if (c == -1)
             break;
@@ -66,6 +75,28 @@ void parseCmdline(int argc, char **argv, BenchmarkOption &conf) {
             case 'e':
                 conf.memory_pool_option.engine_name = optarg;
                 break;
+            case 'P':
+                conf.memory_pool_option.persist_mode = optarg;
+                break;
+            case 'W':
+                conf.memory_pool_option.checkpoint_threads = strtoul(optarg, NULL, 10);
+                break;
+            case 'R':
+                conf.memory_pool_option.replacement_policy = optarg;
+                break;
+            case 'E':
+                conf.memory_pool_option.write_elimination = true;
+                break;
+            case 'L':
+                conf.memory_pool_option.track_dirty_lines = true;
+                break;
+            case 'B':
+                conf.memory_pool_option.block_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'S':
+                conf.memory_pool_option.segment_size =
+                        (1ULL << 20ULL) * strtoul(optarg, NULL, 10);
+                break;
             case 'h':
             case '?':
                 fprintf(stderr, "Usage: %s [arguments]\n", argv[0]);
@@ -80,6 +111,13 @@ void parseCmdline(int argc, char **argv, BenchmarkOption &conf) {
                 fprintf(stderr, "  --capacity -c: Capacity of the memory pool in MiB\n");
                 fprintf(stderr, "  --allocator -a: Name of used allocator\n");
                 fprintf(stderr, "  --engine -e: Name of used engine\n");
+                fprintf(stderr, "  --persist-mode -P: Persistence domain (dax, msync, emulated)\n");
+                fprintf(stderr, "  --checkpoint-threads -W: Runtime-owned checkpoint threads (single-threaded workloads)\n");
+                fprintf(stderr, "  --replacement-policy -R: Back segment replacement (default, clock, lru-k, frequency)\n");
+                fprintf(stderr, "  --write-elimination -E: Only write back the cache lines that changed\n");
+                fprintf(stderr, "  --track-dirty-lines -L: Flush and write back the dirty 64-byte lines of blocks\n");
+                fprintf(stderr, "  --block-size -B: Block size of a new pool of the default engine in bytes\n");
+                fprintf(stderr, "  --segment-size -S: Segment size of a new pool of the default engine in MiB\n");
                 fprintf(stderr, "  --help -h: This help message\n");
                 exit(EXIT_SUCCESS);
             default:
@@ -140,6 +178,10 @@ int main(int argc, char **argv) {
         bench = new STLUnorderedMapBenchmark<ValueType>(conf);
     } else if (conf.benchmark == "consistency-check") {
         bench = new ConsistencyChecker(conf);
+    } else if (conf.benchmark == "skewed-write") {
+        bench = new SkewedWriteBenchmark(conf);
+    } else if (conf.benchmark == "hot-cold-write") {
+        bench = new HotColdWriteBenchmark(conf);
     } else {
         assert(0 && "--benchmark: unknown benchmark");
         exit(EXIT_FAILURE);